@@ -0,0 +1,216 @@
+#include "stdafx.h"
+#include "KernelTuner.h"
+#include <limits>
+#include <sstream>
+
+namespace
+{
+    const int warmup_runs = 1;
+    const int timed_runs = 3;
+
+    unsigned int FloorLog2(unsigned int value)
+    {
+        unsigned int result = 0;
+        while (value > 1)
+        {
+            value >>= 1;
+            result++;
+        }
+        return result;
+    }
+
+    template<typename fp_t>
+    double TimeVariant(
+        const mandelbrot_kernel_config& config, 
+        Concurrency::array<unsigned int, 2>& target, 
+        unsigned int max_iter, 
+        fp_t real_min, 
+        fp_t imag_min, 
+        fp_t real_max, 
+        fp_t imag_max)
+    {
+        using namespace Concurrency;
+
+        array_view<unsigned int, 2> view(target);
+
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+
+        double best = std::numeric_limits<double>::max();
+
+        for (int run = 0; run < warmup_runs + timed_runs; run++)
+        {
+            LARGE_INTEGER before, after;
+            QueryPerformanceCounter(&before);
+
+            generate_mandelbrot_variant<fp_t>(config, view, max_iter, real_min, imag_min, real_max, imag_max);
+            target.accelerator_view.wait();
+
+            QueryPerformanceCounter(&after);
+
+            //the first runs include shader compilation
+            if (run >= warmup_runs)
+            {
+                best = std::min(best, (after.QuadPart - before.QuadPart) * 1000.0 / frequency.QuadPart);
+            }
+        }
+
+        return best;
+    }
+}
+
+KernelTuner::KernelTuner(void)
+{
+    Concurrency::accelerator default_acc;
+
+    m_device = default_acc.device_path;
+    std::replace(m_device.begin(), m_device.end(), L' ', L'_');
+}
+
+
+KernelTuner::~KernelTuner(void)
+{
+}
+
+HRESULT KernelTuner::GetCachePath(std::wstring* path) const
+{
+    PWSTR folder = nullptr;
+    HRESULT hr = ::SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &folder);
+
+    if (SUCCEEDED(hr))
+    {
+        std::wstring directory(folder);
+        directory += L"\\MandelbrotViewer";
+
+        if (!::CreateDirectory(directory.c_str(), nullptr) && ::GetLastError() != ERROR_ALREADY_EXISTS)
+        {
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        *path = directory + L"\\kernels.cache";
+    }
+
+    ::CoTaskMemFree(folder);
+
+    return hr;
+}
+
+std::wstring KernelTuner::GetViewportClass(bool useDouble, unsigned int width, unsigned int height, unsigned int max_iter) const
+{
+    std::wstringstream key;
+    key << m_device;
+    key << (useDouble ? L"|double|" : L"|float|");
+    key << FloorLog2(width * height);
+    key << L"|";
+    key << FloorLog2(max_iter);
+
+    return key.str();
+}
+
+HRESULT KernelTuner::Load()
+{
+    std::wstring path;
+    HRESULT hr = GetCachePath(&path);
+
+    if (SUCCEEDED(hr))
+    {
+        std::wifstream file(path);
+
+        //a missing cache only means nothing was tuned yet
+        std::wstring key;
+        mandelbrot_kernel_config config;
+        while (file >> key >> config.unroll >> config.tile_shape)
+        {
+            m_configs[key] = config;
+        }
+    }
+
+    return hr;
+}
+
+HRESULT KernelTuner::Save()
+{
+    std::wstring path;
+    HRESULT hr = GetCachePath(&path);
+
+    if (SUCCEEDED(hr))
+    {
+        Concurrency::critical_section::scoped_lock lock(m_lock);
+        std::wofstream file(path, std::ios::trunc);
+
+        for (auto it = m_configs.begin(); it != m_configs.end(); ++it)
+        {
+            file << it->first << L" " << it->second.unroll << L" " << it->second.tile_shape << std::endl;
+        }
+
+        if (!file)
+        {
+            hr = E_FAIL;
+        }
+    }
+
+    return hr;
+}
+
+bool KernelTuner::Lookup(bool useDouble, unsigned int width, unsigned int height, unsigned int max_iter, mandelbrot_kernel_config* config) const
+{
+    Concurrency::critical_section::scoped_lock lock(m_lock);
+    auto it = m_configs.find(GetViewportClass(useDouble, width, height, max_iter));
+
+    if (it == m_configs.end())
+    {
+        config->unroll = 1;
+        config->tile_shape = mandelbrot_tile_none;
+        return false;
+    }
+
+    *config = it->second;
+    return true;
+}
+
+HRESULT KernelTuner::Tune(
+    bool useDouble, 
+    unsigned int width, 
+    unsigned int height, 
+    unsigned int max_iter, 
+    double real_min, 
+    double imag_min, 
+    double real_max, 
+    double imag_max, 
+    mandelbrot_kernel_config* config)
+{
+    Concurrency::array<unsigned int, 2> target(height, width);
+
+    double best_time = std::numeric_limits<double>::max();
+    mandelbrot_kernel_config best = { 1, mandelbrot_tile_none };
+
+    for (int u = 0; u < _countof(mandelbrot_unroll_factors); u++)
+    {
+        for (int shape = mandelbrot_tile_none; shape < mandelbrot_tile_shape_count; shape++)
+        {
+            mandelbrot_kernel_config candidate = { mandelbrot_unroll_factors[u], shape };
+
+            double time = useDouble ?
+                TimeVariant<double>(candidate, target, max_iter, real_min, imag_min, real_max, imag_max) :
+                TimeVariant<float>(candidate, target, max_iter, 
+                    static_cast<float>(real_min), 
+                    static_cast<float>(imag_min), 
+                    static_cast<float>(real_max), 
+                    static_cast<float>(imag_max));
+
+            if (time < best_time)
+            {
+                best_time = time;
+                best = candidate;
+            }
+        }
+    }
+
+    {
+        Concurrency::critical_section::scoped_lock lock(m_lock);
+        m_configs[GetViewportClass(useDouble, width, height, max_iter)] = best;
+    }
+    *config = best;
+
+    return Save();
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "mandelbrot.h"
+#include <concrt.h>
+
+// Benchmarks the generate_mandelbrot kernel variants (escape check interval and thread
+// group shape) on the default accelerator and keeps the fastest one per viewport class
+// in a small cache file under the user's local application data, so that later runs
+// start already tuned. Lookup may run while Tune benchmarks on a background task.
+class KernelTuner
+{
+public:
+    KernelTuner(void);
+    ~KernelTuner(void);
+
+    HRESULT Load();
+    HRESULT Save();
+
+    // Returns false and the reference variant if the viewport class was never tuned.
+    bool Lookup(bool useDouble, unsigned int width, unsigned int height, unsigned int max_iter, mandelbrot_kernel_config* config) const;
+
+    HRESULT Tune(
+        bool useDouble, 
+        unsigned int width, 
+        unsigned int height, 
+        unsigned int max_iter, 
+        double real_min, 
+        double imag_min, 
+        double real_max, 
+        double imag_max, 
+        mandelbrot_kernel_config* config);
+
+private:
+    std::wstring GetViewportClass(bool useDouble, unsigned int width, unsigned int height, unsigned int max_iter) const;
+    HRESULT GetCachePath(std::wstring* path) const;
+
+    std::wstring m_device;
+    std::map<std::wstring, mandelbrot_kernel_config> m_configs;
+    mutable Concurrency::critical_section m_lock;
+};
@@ -0,0 +1,416 @@
+#include "stdafx.h"
+#include "PosterRenderer.h"
+#include <deque>
+#include <ppltasks.h>
+
+namespace
+{
+    const unsigned int journal_magic = 0x5453504d; // "MPST"
+    const unsigned int journal_version = 2;
+
+    unsigned int GetBandCount(const PosterRenderer::Settings& settings)
+    {
+        return (settings.height + settings.bandHeight - 1) / settings.bandHeight;
+    }
+
+    unsigned int GetBandRows(const PosterRenderer::Settings& settings, unsigned int band)
+    {
+        return std::min(settings.bandHeight, settings.height - band * settings.bandHeight);
+    }
+}
+
+PosterRenderer::PosterRenderer(void) : m_journal(INVALID_HANDLE_VALUE), m_cancelled(false)
+{
+}
+
+
+PosterRenderer::~PosterRenderer(void)
+{
+    if (m_journal != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_journal);
+    }
+}
+
+void PosterRenderer::Cancel()
+{
+    m_cancelled = true;
+}
+
+void PosterRenderer::Reset()
+{
+    m_cancelled = false;
+}
+
+PosterRenderer::JournalHeader PosterRenderer::MakeJournalHeader(const Settings& settings)
+{
+    JournalHeader header = {};
+    header.magic = journal_magic;
+    header.version = journal_version;
+    header.width = settings.width;
+    header.height = settings.height;
+    header.bandHeight = settings.bandHeight;
+    header.maxIter = settings.maxIter;
+    header.useDouble = settings.useDouble ? 1 : 0;
+    header.realMin = settings.realMin;
+    header.imagMin = settings.imagMin;
+    header.realMax = settings.realMax;
+    header.imagMax = settings.imagMax;
+
+    return header;
+}
+
+HRESULT PosterRenderer::LoadJournalSettings(const std::wstring& path, Settings* settings)
+{
+    std::wstring journalPath(path + L".journal");
+    HANDLE journal = ::CreateFile(journalPath.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (journal == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+
+    JournalHeader header = {};
+    DWORD bytesRead = 0;
+    if (!::ReadFile(journal, &header, sizeof(header), &bytesRead, nullptr))
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+    }
+    else if (bytesRead != sizeof(header) || header.magic != journal_magic || header.version != journal_version)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_INVALID_DATA);
+    }
+
+    ::CloseHandle(journal);
+
+    if (SUCCEEDED(hr))
+    {
+        settings->width = header.width;
+        settings->height = header.height;
+        settings->bandHeight = header.bandHeight;
+        settings->maxIter = header.maxIter;
+        settings->useDouble = header.useDouble != 0;
+        settings->realMin = header.realMin;
+        settings->imagMin = header.imagMin;
+        settings->realMax = header.realMax;
+        settings->imagMax = header.imagMax;
+    }
+
+    return hr;
+}
+
+PosterRenderer::Band PosterRenderer::RenderBand(const Settings& settings, unsigned int band)
+{
+    using namespace Concurrency;
+
+    const unsigned int top = band * settings.bandHeight;
+    const unsigned int rows = GetBandRows(settings, band);
+
+    //the kernel counts rows up from imag_min, so the band's window is measured from the bottom edge
+    double scale_imag = (settings.imagMax - settings.imagMin) / settings.height;
+    double band_imag_min = settings.imagMin + (settings.height - top - rows) * scale_imag;
+    double band_imag_max = band_imag_min + rows * scale_imag;
+
+    Band data = std::make_shared<std::vector<unsigned int>>(settings.width * rows);
+    array_view<unsigned int, 2> view(rows, settings.width, *data);
+    view.discard_data();
+
+    if (settings.useDouble)
+    {
+        generate_mandelbrot_variant<double>(
+            settings.kernel, 
+            view, 
+            settings.maxIter, 
+            settings.realMin, 
+            band_imag_min, 
+            settings.realMax, 
+            band_imag_max);
+    }
+    else
+    {
+        generate_mandelbrot_variant<float>(
+            settings.kernel, 
+            view, 
+            settings.maxIter, 
+            static_cast<float>(settings.realMin), 
+            static_cast<float>(band_imag_min), 
+            static_cast<float>(settings.realMax), 
+            static_cast<float>(band_imag_max));
+    }
+
+    view.synchronize();
+
+    return data;
+}
+
+HRESULT PosterRenderer::OpenJournal(const Settings& settings, const std::wstring& path, unsigned int* completedBands)
+{
+    *completedBands = 0;
+
+    std::wstring journalPath(path + L".journal");
+    m_journal = ::CreateFile(journalPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (m_journal == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+
+    JournalHeader expected = MakeJournalHeader(settings);
+    JournalHeader existing = {};
+    DWORD bytesRead = 0;
+
+    LARGE_INTEGER end;
+    end.QuadPart = 0;
+
+    unsigned int count = 0;
+    if (SUCCEEDED(hr) && 
+        ::ReadFile(m_journal, &existing, sizeof(existing), &bytesRead, nullptr) && 
+        bytesRead == sizeof(existing) && 
+        memcmp(&existing, &expected, sizeof(expected)) == 0 &&
+        ::ReadFile(m_journal, &count, sizeof(count), &bytesRead, nullptr) && 
+        bytesRead == sizeof(count))
+    {
+        //the header matches, keep it and the band count
+        end.QuadPart = sizeof(JournalHeader) + sizeof(count);
+        *completedBands = std::min(count, GetBandCount(settings));
+    }
+
+    if (SUCCEEDED(hr) && (!::SetFilePointerEx(m_journal, end, nullptr, FILE_BEGIN) || !::SetEndOfFile(m_journal)))
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    if (SUCCEEDED(hr) && end.QuadPart == 0)
+    {
+        DWORD bytesWritten = 0;
+        if (!::WriteFile(m_journal, &expected, sizeof(expected), &bytesWritten, nullptr))
+        {
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = WriteJournalCount(0);
+        }
+    }
+
+    return hr;
+}
+
+HRESULT PosterRenderer::WriteJournalCount(unsigned int completedBands)
+{
+    LARGE_INTEGER offset;
+    offset.QuadPart = sizeof(JournalHeader);
+
+    DWORD bytesWritten = 0;
+    if (!::SetFilePointerEx(m_journal, offset, nullptr, FILE_BEGIN) || 
+        !::WriteFile(m_journal, &completedBands, sizeof(completedBands), &bytesWritten, nullptr))
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    return S_OK;
+}
+
+HRESULT PosterRenderer::CreateEncoder(const Settings& settings, const std::wstring& path)
+{
+    using namespace Hilo::Direct2DHelpers;
+
+    // File extension to determine which container format to use for the output file
+    size_t dot = path.find_last_of('.');
+    if (dot == std::wstring::npos)
+    {
+        return E_INVALIDARG;
+    }
+
+    ComPtr<IWICImagingFactory> factory;
+    HRESULT hr = Direct2DUtility::GetWICFactory(&factory);
+
+    std::wstring fileExtension(path.substr(dot));
+    std::transform(fileExtension.begin(), fileExtension.end(), fileExtension.begin(), tolower);
+
+    GUID containerFormat = GUID_ContainerFormatPng;
+    if (fileExtension.compare(L".tif") == 0 || fileExtension.compare(L".tiff") == 0)
+    {
+        containerFormat = GUID_ContainerFormatTiff;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = factory->CreateEncoder(containerFormat, nullptr, &m_encoder);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = factory->CreateStream(&m_stream);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_stream->InitializeFromFilename(path.c_str(), GENERIC_WRITE);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_encoder->Initialize(m_stream, WICBitmapEncoderNoCache);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_encoder->CreateNewFrame(&m_frame, nullptr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_frame->Initialize(nullptr);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_frame->SetSize(settings.width, settings.height);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        // The kernel writes 0xAARRGGBB, which is BGRA in memory
+        WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat32bppBGRA;
+        hr = m_frame->SetPixelFormat(&pixelFormat);
+
+        if (SUCCEEDED(hr) && !IsEqualGUID(pixelFormat, GUID_WICPixelFormat32bppBGRA))
+        {
+            hr = WINCODEC_ERR_UNSUPPORTEDPIXELFORMAT;
+        }
+    }
+
+    return hr;
+}
+
+HRESULT PosterRenderer::WriteBand(const Settings& settings, const Band& band)
+{
+    const unsigned int bytes = static_cast<unsigned int>(band->size() * sizeof(unsigned int));
+    const unsigned int stride = settings.width * sizeof(unsigned int);
+
+    return m_frame->WritePixels(bytes / stride, stride, bytes, reinterpret_cast<BYTE*>(band->data()));
+}
+
+HRESULT PosterRenderer::Render(const Settings& settings, const std::wstring& path, const ProgressCallback& progress)
+{
+    const unsigned int bandCount = GetBandCount(settings);
+    unsigned int journaled = 0;
+    unsigned int completed = 0;
+
+    HRESULT hr = OpenJournal(settings, path, &journaled);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CreateEncoder(settings, path);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        progress(completed, bandCount);
+    }
+
+    // Render ahead by up to maxBandsInFlight bands, write them back in order. The bands
+    // of an interrupted render are rendered again into the new encoder
+    std::deque<Concurrency::task<Band>> inFlight;
+    unsigned int next = 0;
+
+    while (SUCCEEDED(hr) && completed < bandCount)
+    {
+        while (!m_cancelled && next < bandCount && inFlight.size() < std::max(1u, settings.maxBandsInFlight))
+        {
+            unsigned int band = next++;
+            inFlight.push_back(Concurrency::create_task([settings, band]
+            {
+                return RenderBand(settings, band);
+            }));
+        }
+
+        if (inFlight.empty())
+        {
+            break;
+        }
+
+        Band data;
+        try
+        {
+            data = inFlight.front().get();
+        }
+        catch (const Concurrency::runtime_exception& e)
+        {
+            hr = e.get_error_code();
+        }
+        catch (const std::bad_alloc&)
+        {
+            hr = E_OUTOFMEMORY;
+        }
+        inFlight.pop_front();
+
+        if (SUCCEEDED(hr))
+        {
+            hr = WriteBand(settings, data);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            completed++;
+
+            if (completed > journaled)
+            {
+                journaled = completed;
+                hr = WriteJournalCount(journaled);
+            }
+
+            progress(completed, bandCount);
+        }
+    }
+
+    // Bands still in flight after a failure are discarded, errors included
+    for (auto it = inFlight.begin(); it != inFlight.end(); ++it)
+    {
+        try
+        {
+            it->wait();
+        }
+        catch (...)
+        {
+        }
+    }
+
+    if (SUCCEEDED(hr) && completed < bandCount)
+    {
+        hr = HRESULT_FROM_WIN32(ERROR_CANCELLED);
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_frame->Commit();
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = m_encoder->Commit();
+    }
+
+    m_frame = nullptr;
+    m_encoder = nullptr;
+    m_stream = nullptr;
+
+    if (m_journal != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_journal);
+        m_journal = INVALID_HANDLE_VALUE;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        ::DeleteFile((path + L".journal").c_str());
+    }
+
+    return hr;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "mandelbrot.h"
+#include <atomic>
+#include <functional>
+
+// Renders a Mandelbrot view that is far larger than fits in memory (32k x 32k and up).
+// The image is split into horizontal bands, up to maxBandsInFlight bands are rendered
+// concurrently, and completed bands are streamed in order into a WIC PNG or TIFF
+// encoder, so memory stays bounded by the bands in flight. A small journal file next to
+// the output keeps the settings and the number of bands written. The encoders cannot
+// append to a partial file, so an interrupted render started again with the same
+// settings renders the written bands again and keeps the journal count until it passes
+// them. The journal is deleted once the image is committed.
+class PosterRenderer
+{
+public:
+    struct Settings
+    {
+        unsigned int width;
+        unsigned int height;
+        unsigned int bandHeight;
+        unsigned int maxBandsInFlight;
+        unsigned int maxIter;
+        bool useDouble;
+        mandelbrot_kernel_config kernel;
+        double realMin;
+        double imagMin;
+        double realMax;
+        double imagMax;
+    };
+
+    // Called from the render thread after each band was written.
+    typedef std::function<void(unsigned int completedBands, unsigned int totalBands)> ProgressCallback;
+
+    PosterRenderer(void);
+    ~PosterRenderer(void);
+
+    HRESULT Render(const Settings& settings, const std::wstring& path, const ProgressCallback& progress);
+
+    // Reads the settings of an interrupted render of path, fails if there is nothing to resume.
+    static HRESULT LoadJournalSettings(const std::wstring& path, Settings* settings);
+
+    // Stops a running Render after the bands in flight; the journal is kept for resuming.
+    // A cancel made before Render starts stops it as well.
+    void Cancel();
+
+    // Clears a cancel, call it before queueing the next Render.
+    void Reset();
+
+private:
+    struct JournalHeader
+    {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int width;
+        unsigned int height;
+        unsigned int bandHeight;
+        unsigned int maxIter;
+        unsigned int useDouble;
+        unsigned int reserved;
+        double realMin;
+        double imagMin;
+        double realMax;
+        double imagMax;
+    };
+
+    typedef std::shared_ptr<std::vector<unsigned int>> Band;
+
+    static JournalHeader MakeJournalHeader(const Settings& settings);
+    static Band RenderBand(const Settings& settings, unsigned int band);
+
+    HRESULT OpenJournal(const Settings& settings, const std::wstring& path, unsigned int* completedBands);
+    HRESULT CreateEncoder(const Settings& settings, const std::wstring& path);
+    HRESULT WriteBand(const Settings& settings, const Band& band);
+    HRESULT WriteJournalCount(unsigned int completedBands);
+
+    HANDLE m_journal;
+    ComPtr<IWICStream> m_stream;
+    ComPtr<IWICBitmapEncoder> m_encoder;
+    ComPtr<IWICBitmapFrameEncode> m_frame;
+    std::atomic<bool> m_cancelled;
+};
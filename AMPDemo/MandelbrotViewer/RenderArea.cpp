@@ -3,6 +3,7 @@
 #include "mandelbrot.h"
 #include "d3d11.h"
 #include "dxgi.h"
+#include <sstream>
 
 RenderAreaMessageHandler::RenderAreaMessageHandler(void) 
     : 
@@ -21,7 +22,22 @@ RenderAreaMessageHandler::RenderAreaMessageHandler(void)
     m_right_stretched(false),
     m_lastscale(0.5),
     m_resizing(false),
-    m_useDouble(false)
+    m_useDouble(false),
+    m_antialias(false),
+    m_tunedOnStartup(false),
+    m_tuneRequested(false),
+    m_tuning(false),
+    m_forceMorton(false),
+    m_posterRunning(false),
+    m_posterBands(0),
+    m_posterTotalBands(0),
+    m_posterResult(S_OK),
+    m_posterWidth(32768),
+    m_posterBandsInFlight(4),
+    m_useTileStore(false),
+    m_renderedCenterx(0.0),
+    m_renderedCentery(0.0),
+    m_renderedScale(0.5)
 {
 }
 
@@ -78,6 +94,20 @@ HRESULT RenderAreaMessageHandler::OnCreate()
         m_useDouble = true;
     }
 
+    //a missing or unreadable cache just means the kernels get tuned again
+    m_tuner.Load();
+
+    //without a tile store the tile mode falls back to rendering every frame
+    PWSTR folder = nullptr;
+    if (SUCCEEDED(::SHGetKnownFolderPath(FOLDERID_LocalAppData, 0, nullptr, &folder)))
+    {
+        std::wstring directory(std::wstring(folder) + L"\\MandelbrotViewer");
+        ::CreateDirectory(directory.c_str(), nullptr);
+
+        m_tileStore.Open(directory + L"\\tiles.store", 256);
+    }
+    ::CoTaskMemFree(folder);
+
     return hr;
 }
 
@@ -85,8 +115,13 @@ HRESULT RenderAreaMessageHandler::OnDestroy()
 {
     SetEvent(m_hEvNuiProcessStop);
 
+    //an interrupted poster keeps its journal and resumes on the next P
+    m_poster.Cancel();
+
     tasks.wait();
 
+    m_tileStore.Close();
+
 #ifdef KINECT_CTRL
     if (m_pNuiSensor != nullptr)
     {
@@ -127,40 +162,229 @@ HRESULT RenderAreaMessageHandler::OnRender()
         double dx = d * width / 640;
         double dy = d * height / 640;
 
-        std::vector<unsigned int> data(width * height);
+        if (m_useTileStore)
+        {
+            bool rendered = false;
+            unsigned int tiles = 0;
+            unsigned int storedTiles = 0;
+
+            LARGE_INTEGER frequency, before, after;
+            QueryPerformanceFrequency(&frequency);
+            QueryPerformanceCounter(&before);
+
+            hr = RenderStoredTiles(width, height, dx, dy, &rendered, &tiles, &storedTiles);
+
+            QueryPerformanceCounter(&after);
+
+            if (rendered)
+            {
+                double millisecond = (after.QuadPart - before.QuadPart) * 1000.0 / frequency.QuadPart; 
+
+                std::wstringstream msg;
+                msg << L"Mandelbrot Set Viewer: last frame render time ";
+                msg << millisecond;
+                msg << L" ms, ";
+                msg << storedTiles;
+                msg << L" of ";
+                msg << tiles;
+                msg << L" tiles from the tile store";
+
+                HWND hParent;
+                if (SUCCEEDED(window->GetParentWindowHandle(&hParent)))
+                {
+                    SetWindowText(hParent, msg.str().c_str());
+                }
+
+                return hr;
+            }
+        }
+
+        //the view moved since the last frame, render at the scale of the frame time controller.
+        //the internal image covers the same region of the plane as the window
+        const bool moving = m_centerx != m_renderedCenterx || m_centery != m_renderedCentery || m_scale != m_renderedScale;
+        const float resolutionScale = m_dynamicResolution.next_scale(moving);
 
-        array_view<unsigned int, 2> arrayview(height, width, data);
+        m_renderedCenterx = m_centerx;
+        m_renderedCentery = m_centery;
+        m_renderedScale = m_scale;
+
+        const unsigned int renderWidth = dynamic_resolution::scaled_size(width, resolutionScale);
+        const unsigned int renderHeight = dynamic_resolution::scaled_size(height, resolutionScale);
+
+        std::vector<unsigned int> data(renderWidth * renderHeight);
+
+        array_view<unsigned int, 2> arrayview(renderHeight, renderWidth, data);
 
         static const unsigned int max_iter = 4096;
 
+        unsigned int iterations = std::min(static_cast<unsigned int>(64 * log(1 + m_scale) * 4), max_iter);
+        float refined = 0.0f;
+
+        mandelbrot_kernel_config config;
+        bool tuned = m_tuner.Lookup(m_useDouble, renderWidth, renderHeight, iterations, &config);
+
+        if (!m_antialias && !m_tuning && (m_tuneRequested || (!tuned && !m_tunedOnStartup)))
+        {
+            //tune the startup viewport class once, later runs pick it up from the cache.
+            //the sweep runs on a background task and frames keep the reference variant
+            //until it is done. a cache that cannot be written only costs another tuning
+            //run next time.
+            m_tunedOnStartup = true;
+            m_tuneRequested = false;
+            m_tuning = true;
+
+            const bool useDouble = m_useDouble;
+            const double realMin = m_centerx - dx;
+            const double imagMin = m_centery - dy;
+            const double realMax = m_centerx + dx;
+            const double imagMax = m_centery + dy;
+
+            tasks.run([this, window, useDouble, renderWidth, renderHeight, iterations, realMin, imagMin, realMax, imagMax]
+            {
+                mandelbrot_kernel_config tunedConfig;
+                m_tuner.Tune(useDouble, renderWidth, renderHeight, iterations, realMin, imagMin, realMax, imagMax, &tunedConfig);
+
+                m_tuning = false;
+                window->RedrawWindow();
+            });
+        }
+
+        if (m_forceMorton)
+        {
+            config.tile_shape = mandelbrot_tile_morton;
+        }
+
+        LARGE_INTEGER frequency, before, after;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&before);
+
         if (m_useDouble)
         {
-            generate_mandelbrot<double>(
-                arrayview, 
-                std::min(static_cast<unsigned int>(64 * log(1 + m_scale) * 4), max_iter), 
-                static_cast<double>(m_centerx - dx), 
-                static_cast<double>(m_centery - dy), 
-                static_cast<double>(m_centerx + dx), 
-                static_cast<double>(m_centery + dy));
+            if (m_antialias)
+            {
+                refined = generate_mandelbrot_adaptive<double>(
+                    arrayview, 
+                    iterations, 
+                    static_cast<double>(m_centerx - dx), 
+                    static_cast<double>(m_centery - dy), 
+                    static_cast<double>(m_centerx + dx), 
+                    static_cast<double>(m_centery + dy));
+            }
+            else
+            {
+                generate_mandelbrot_variant<double>(
+                    config,
+                    arrayview, 
+                    iterations, 
+                    static_cast<double>(m_centerx - dx), 
+                    static_cast<double>(m_centery - dy), 
+                    static_cast<double>(m_centerx + dx), 
+                    static_cast<double>(m_centery + dy));
+            }
         }
         else
         {
-            generate_mandelbrot<float>(
-                arrayview, 
-                std::min(static_cast<unsigned int>(64 * log(1 + m_scale) * 4), max_iter), 
-                static_cast<float>(m_centerx - dx), 
-                static_cast<float>(m_centery - dy), 
-                static_cast<float>(m_centerx + dx), 
-                static_cast<float>(m_centery + dy));
+            if (m_antialias)
+            {
+                refined = generate_mandelbrot_adaptive<float>(
+                    arrayview, 
+                    iterations, 
+                    static_cast<float>(m_centerx - dx), 
+                    static_cast<float>(m_centery - dy), 
+                    static_cast<float>(m_centerx + dx), 
+                    static_cast<float>(m_centery + dy));
+            }
+            else
+            {
+                generate_mandelbrot_variant<float>(
+                    config,
+                    arrayview, 
+                    iterations, 
+                    static_cast<float>(m_centerx - dx), 
+                    static_cast<float>(m_centery - dy), 
+                    static_cast<float>(m_centerx + dx), 
+                    static_cast<float>(m_centery + dy));
+            }
         }
 
         arrayview.synchronize();
 
+        QueryPerformanceCounter(&after);
+
+        double millisecond = (after.QuadPart - before.QuadPart) * 1000.0 / frequency.QuadPart; 
+
+        m_dynamicResolution.frame_rendered(millisecond, resolutionScale);
+
+        std::wstringstream msg;
+        msg << L"Mandelbrot Set Viewer: last frame render time ";
+        msg << millisecond;
+        msg << L" ms";
+
+        if (resolutionScale < 1.0f)
+        {
+            msg << L", dynamic resolution ";
+            msg << renderWidth;
+            msg << L"x";
+            msg << renderHeight;
+        }
+        else if (!m_dynamicResolution.get_enabled())
+        {
+            msg << L", dynamic resolution off";
+        }
+
+        if (m_antialias)
+        {
+            msg << L", antialiased ";
+            msg << refined * 100.0f;
+            msg << L"% of pixels";
+        }
+        else
+        {
+            msg << L", kernel unroll ";
+            msg << config.unroll;
+            msg << L" tile shape ";
+            msg << config.tile_shape;
+
+            if (m_tuning)
+            {
+                msg << L", tuning kernels";
+            }
+        }
+
+        if (m_posterRunning)
+        {
+            msg << L", poster band ";
+            msg << m_posterBands;
+            msg << L" of ";
+            msg << m_posterTotalBands;
+        }
+        else
+        {
+            if (m_posterTotalBands > 0)
+            {
+                msg << (SUCCEEDED(m_posterResult) ? L", poster saved" : L", poster stopped");
+            }
+
+            msg << L", poster width ";
+            msg << m_posterWidth;
+            msg << L" with ";
+            msg << m_posterBandsInFlight;
+            msg << L" bands in flight";
+        }
+
+        HWND hParent;
+        hr = window->GetParentWindowHandle(&hParent);
+
+        if (SUCCEEDED(hr))
+        {
+            SetWindowText(hParent, msg.str().c_str());
+        }
+
         ComPtr<ID2D1Bitmap> bitmap;
         hr = m_renderTarget->CreateBitmap(
-            D2D1::SizeU(width, height),
+            D2D1::SizeU(renderWidth, renderHeight),
             static_cast<void*>(data.data()),
-            width * 4,
+            renderWidth * 4,
             D2D1::BitmapProperties(
             D2D1::PixelFormat(
             DXGI_FORMAT_B8G8R8A8_UNORM,
@@ -173,11 +397,20 @@ HRESULT RenderAreaMessageHandler::OnRender()
             m_renderTarget->BeginDraw();
             m_renderTarget->Clear();
 
+            //frames of reduced resolution are stretched to the window with bilinear filtering
             m_renderTarget->DrawBitmap(bitmap, 
-                D2D1::RectF(0.0, 0.0, static_cast<float>(width), static_cast<float>(height)));
+                D2D1::RectF(0.0, 0.0, static_cast<float>(width), static_cast<float>(height)),
+                1.0f,
+                D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
 
             m_renderTarget->EndDraw();
         }
+
+        //a frame of reduced resolution is followed by a full one once the view stops
+        if (SUCCEEDED(hr) && resolutionScale < 1.0f)
+        {
+            hr = window->RedrawWindow();
+        }
     }
     return hr;
 }
@@ -283,7 +516,312 @@ HRESULT RenderAreaMessageHandler::OnMouseWheel(D2D1_POINT_2F mousePosition, shor
 
 HRESULT RenderAreaMessageHandler::OnKeyDown(unsigned int vKey)
 {
-    return S_OK;
+    HRESULT hr = S_OK;
+
+    if (vKey == 'A')
+    {
+        //toggle edge-adaptive antialiasing
+        m_antialias = !m_antialias;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'S')
+    {
+        //toggle rendering through the persistent tile store
+        m_useTileStore = !m_useTileStore;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'Z')
+    {
+        //compare Morton order pixel traversal against the tuned kernel
+        m_forceMorton = !m_forceMorton;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'P')
+    {
+        //start, resume or stop rendering a poster of the current view
+        hr = StartPoster();
+    }
+    else if (vKey == 'W' || vKey == 'B')
+    {
+        //cycle the width of the next poster from 4096 to 65536 pixels, or the number of
+        //bands it renders concurrently from 1 to 8. a resumed poster keeps its width
+        if (vKey == 'W')
+        {
+            m_posterWidth = m_posterWidth >= 65536 ? 4096 : m_posterWidth * 2;
+        }
+        else
+        {
+            m_posterBandsInFlight = m_posterBandsInFlight >= 8 ? 1 : m_posterBandsInFlight * 2;
+        }
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'D')
+    {
+        //switch dynamic resolution while the view moves on or off
+        m_dynamicResolution.set_enabled(!m_dynamicResolution.get_enabled());
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'T')
+    {
+        //retune the kernel variants for the current viewport
+        m_tuneRequested = true;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+
+    return hr;
+}
+
+HRESULT RenderAreaMessageHandler::StartPoster()
+{
+    static const unsigned int poster_band_height = 256;
+    static const unsigned int max_iter = 4096;
+
+    if (m_posterRunning)
+    {
+        m_poster.Cancel();
+        return S_OK;
+    }
+
+    ComPtr<IWindow> window;
+    HRESULT hr = GetWindow(&window);
+
+    RECT rect;
+    if (SUCCEEDED(hr))
+    {
+        hr = window->GetClientRect(&rect);
+    }
+
+    std::wstring path;
+    if (SUCCEEDED(hr))
+    {
+        PWSTR folder = nullptr;
+        hr = ::SHGetKnownFolderPath(FOLDERID_Pictures, 0, nullptr, &folder);
+
+        if (SUCCEEDED(hr))
+        {
+            path = std::wstring(folder) + L"\\Mandelbrot Poster.png";
+        }
+
+        ::CoTaskMemFree(folder);
+    }
+
+    PosterRenderer::Settings settings;
+    if (SUCCEEDED(hr) && FAILED(PosterRenderer::LoadJournalSettings(path, &settings)))
+    {
+        //nothing to resume, render the current view at poster resolution; a minimized
+        //window has no view to render
+        if (rect.right == 0 || rect.bottom == 0)
+        {
+            return S_OK;
+        }
+
+        double d = 1 / m_scale;
+        double dx = d * rect.right / 640;
+        double dy = d * rect.bottom / 640;
+
+        settings.width = m_posterWidth;
+        settings.height = static_cast<unsigned int>(static_cast<double>(m_posterWidth) * rect.bottom / rect.right);
+        settings.maxIter = std::min(static_cast<unsigned int>(64 * log(1 + m_scale) * 4), max_iter);
+        settings.useDouble = m_useDouble;
+        settings.realMin = m_centerx - dx;
+        settings.imagMin = m_centery - dy;
+        settings.realMax = m_centerx + dx;
+        settings.imagMax = m_centery + dy;
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        settings.bandHeight = poster_band_height;
+        settings.maxBandsInFlight = m_posterBandsInFlight;
+        m_tuner.Lookup(settings.useDouble, settings.width, settings.bandHeight, settings.maxIter, &settings.kernel);
+
+        m_posterRunning = true;
+        m_posterBands = 0;
+        m_posterTotalBands = 0;
+        m_poster.Reset();
+
+        tasks.run([this, settings, path, window]
+        {
+            m_posterResult = m_poster.Render(settings, path, [this, window](unsigned int completedBands, unsigned int totalBands)
+            {
+                m_posterBands = completedBands;
+                m_posterTotalBands = totalBands;
+                window->RedrawWindow();
+            });
+
+            m_posterRunning = false;
+            window->RedrawWindow();
+        });
+    }
+
+    return hr;
+}
+
+//
+// Draws the view from fixed 256x256 tiles of raw iteration counts. Tiles at level n
+// cover 4 / 2^n in the complex plane, and the level is chosen so that a tile pixel is
+// no larger than a screen pixel. Missing tiles are rendered and added to the store,
+// stored ones are decoded straight from the mapped file. Sets rendered to false if the
+// view is too deep for tile indices or the store is not available.
+//
+HRESULT RenderAreaMessageHandler::RenderStoredTiles(unsigned int width, unsigned int height, double dx, double dy, bool* rendered, unsigned int* tiles, unsigned int* storedTiles)
+{
+    using namespace Concurrency;
+
+    static const unsigned int max_iter = 4096;
+    static const int max_level = 28;
+
+    *rendered = false;
+
+    if (!m_tileStore.IsOpen())
+    {
+        return S_OK;
+    }
+
+    const unsigned int tile_size = m_tileStore.GetTileSize();
+
+    double pixel = 2 * dx / width;
+    int level = std::max(0, static_cast<int>(ceil(log(4.0 / (tile_size * pixel)) / log(2.0))));
+
+    if (level > max_level)
+    {
+        return S_OK;
+    }
+
+    double span = ldexp(4.0, -level);
+
+    //iterations as if the view were zoomed to exactly the tile resolution
+    double scale = 2.0 / (640 * span / tile_size);
+    unsigned int iterations = std::min(static_cast<unsigned int>(64 * log(1 + scale) * 4), max_iter);
+    unsigned long long params = (static_cast<unsigned long long>(iterations) << 1) | (m_useDouble ? 1 : 0);
+
+    int x0 = static_cast<int>(floor((m_centerx - dx) / span));
+    int x1 = static_cast<int>(floor((m_centerx + dx) / span));
+    int y0 = static_cast<int>(floor((m_centery - dy) / span));
+    int y1 = static_cast<int>(floor((m_centery + dy) / span));
+
+    std::vector<unsigned int> counts(tile_size * tile_size);
+    std::vector<unsigned int> colors(tile_size * tile_size);
+
+    HRESULT hr = S_OK;
+
+    m_renderTarget->BeginDraw();
+    m_renderTarget->Clear();
+
+    for (int ty = y0; ty <= y1 && SUCCEEDED(hr); ty++)
+    {
+        for (int tx = x0; tx <= x1 && SUCCEEDED(hr); tx++)
+        {
+            bool stored = m_tileStore.Get(level, tx, ty, params, counts.data());
+
+            array_view<unsigned int, 2> countView(tile_size, tile_size, counts);
+
+            if (stored)
+            {
+                (*storedTiles)++;
+            }
+            else
+            {
+                if (m_useDouble)
+                {
+                    generate_mandelbrot_counts<double>(countView, iterations, tx * span, ty * span, (tx + 1) * span, (ty + 1) * span);
+                }
+                else
+                {
+                    generate_mandelbrot_counts<float>(
+                        countView, 
+                        iterations, 
+                        static_cast<float>(tx * span), 
+                        static_cast<float>(ty * span), 
+                        static_cast<float>((tx + 1) * span), 
+                        static_cast<float>((ty + 1) * span));
+                }
+                countView.synchronize();
+
+                //a full store just stops caching
+                m_tileStore.Put(level, tx, ty, params, counts.data());
+            }
+            (*tiles)++;
+
+            array_view<unsigned int, 2> colorView(tile_size, tile_size, colors);
+            colorize_mandelbrot(countView, colorView, iterations);
+            colorView.synchronize();
+
+            ComPtr<ID2D1Bitmap> bitmap;
+            hr = m_renderTarget->CreateBitmap(
+                D2D1::SizeU(tile_size, tile_size),
+                static_cast<void*>(colors.data()),
+                tile_size * 4,
+                D2D1::BitmapProperties(
+                D2D1::PixelFormat(
+                DXGI_FORMAT_B8G8R8A8_UNORM,
+                D2D1_ALPHA_MODE_IGNORE
+                )),
+                &bitmap);
+
+            if (SUCCEEDED(hr))
+            {
+                double left = (tx * span - (m_centerx - dx)) / (2 * dx) * width;
+                double top = ((m_centery + dy) - (ty + 1) * span) / (2 * dy) * height;
+                double size = span / (2 * dx) * width;
+
+                m_renderTarget->DrawBitmap(bitmap, 
+                    D2D1::RectF(
+                    static_cast<float>(left), 
+                    static_cast<float>(top), 
+                    static_cast<float>(left + size), 
+                    static_cast<float>(top + size)));
+            }
+        }
+    }
+
+    HRESULT hrEnd = m_renderTarget->EndDraw();
+
+    *rendered = true;
+
+    return SUCCEEDED(hr) ? hrEnd : hr;
 }
 
 HRESULT RenderAreaMessageHandler::Initialize()
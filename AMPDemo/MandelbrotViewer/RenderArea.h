@@ -9,6 +9,10 @@
 #pragma comment(lib, "Kinect10.lib")
 #endif
 #include <ppl.h>
+#include "KernelTuner.h"
+#include "PosterRenderer.h"
+#include "TileStore.h"
+#include "dynamic_resolution.h"
 
 class RenderAreaMessageHandler : 
     public IInitializable,
@@ -56,6 +60,33 @@ private:
     Concurrency::task_group tasks;
 
     bool m_useDouble;
+    bool m_antialias;
+
+    //kernel variant autotuning
+    KernelTuner m_tuner;
+    bool m_tunedOnStartup;
+    bool m_tuneRequested;
+    std::atomic<bool> m_tuning;
+    bool m_forceMorton;
+
+    //out-of-core poster rendering
+    PosterRenderer m_poster;
+    std::atomic<bool> m_posterRunning;
+    std::atomic<unsigned int> m_posterBands;
+    std::atomic<unsigned int> m_posterTotalBands;
+    std::atomic<HRESULT> m_posterResult;
+    unsigned int m_posterWidth;
+    unsigned int m_posterBandsInFlight;
+
+    //persistent iteration tile store
+    TileStore m_tileStore;
+    bool m_useTileStore;
+
+    //reduced internal resolution while the view moves
+    dynamic_resolution m_dynamicResolution;
+    double m_renderedCenterx;
+    double m_renderedCentery;
+    double m_renderedScale;
 
     //mouse control
     double m_centerx;
@@ -78,6 +109,9 @@ private:
     bool m_resizing;
     double m_lastscale;
 
+    HRESULT StartPoster();
+    HRESULT RenderStoredTiles(unsigned int width, unsigned int height, double dx, double dy, bool* rendered, unsigned int* tiles, unsigned int* storedTiles);
+
 #ifdef KINECT_CTRL
     HRESULT Nui_Init();
     void Nui_GotSkeletonAlert();
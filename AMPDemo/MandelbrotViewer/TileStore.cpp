@@ -0,0 +1,278 @@
+#include "stdafx.h"
+#include "TileStore.h"
+#include "tilecodec.h"
+
+namespace
+{
+    const unsigned int tile_store_magic = 0x5354424d; // "MBTS"
+    const unsigned int tile_store_version = 1;
+    const unsigned int tile_store_index_capacity = 1 << 16;
+
+    // Growth stops here, the whole file has to fit in a 32-bit address space
+    const unsigned long long tile_store_initial_data = 16ull << 20;
+    const unsigned long long tile_store_max_size = 1ull << 30;
+
+    unsigned int HashKey(int level, int x, int y, unsigned long long params)
+    {
+        unsigned long long h = params ^ 0x9e3779b97f4a7c15ull;
+        h = (h ^ static_cast<unsigned int>(level)) * 0xff51afd7ed558ccdull;
+        h = (h ^ static_cast<unsigned int>(x)) * 0xc4ceb9fe1a85ec53ull;
+        h = (h ^ static_cast<unsigned int>(y)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+
+        return static_cast<unsigned int>(h);
+    }
+}
+
+TileStore::TileStore(void) : 
+    m_file(INVALID_HANDLE_VALUE), 
+    m_mapping(nullptr), 
+    m_view(nullptr), 
+    m_mappedSize(0), 
+    m_tileSize(0)
+{
+}
+
+
+TileStore::~TileStore(void)
+{
+    Close();
+}
+
+HRESULT TileStore::Map(unsigned long long size)
+{
+    // Mapping more than the file size extends the file
+    m_mapping = ::CreateFileMapping(m_file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+
+    if (m_mapping == nullptr)
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    m_view = static_cast<unsigned char*>(::MapViewOfFile(m_mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0));
+
+    if (m_view == nullptr)
+    {
+        HRESULT hr = HRESULT_FROM_WIN32(::GetLastError());
+        Unmap();
+        return hr;
+    }
+
+    m_mappedSize = size;
+
+    return S_OK;
+}
+
+void TileStore::Unmap()
+{
+    if (m_view != nullptr)
+    {
+        ::UnmapViewOfFile(m_view);
+        m_view = nullptr;
+    }
+
+    if (m_mapping != nullptr)
+    {
+        ::CloseHandle(m_mapping);
+        m_mapping = nullptr;
+    }
+
+    m_mappedSize = 0;
+}
+
+HRESULT TileStore::Open(const std::wstring& path, unsigned int tileSize)
+{
+    Close();
+
+    m_tileSize = tileSize;
+    m_file = ::CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+
+    if (m_file == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(m_file, &size))
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    const unsigned long long dataStart = sizeof(TileStoreHeader) + tile_store_index_capacity * sizeof(TileStoreEntry);
+
+    bool valid = false;
+    if (SUCCEEDED(hr) && static_cast<unsigned long long>(size.QuadPart) >= dataStart)
+    {
+        hr = Map(size.QuadPart);
+
+        if (SUCCEEDED(hr))
+        {
+            const TileStoreHeader* header = GetHeader();
+            valid = 
+                header->magic == tile_store_magic && 
+                header->version == tile_store_version &&
+                header->tileSize == tileSize &&
+                header->indexCapacity == tile_store_index_capacity &&
+                header->dataEnd >= dataStart &&
+                header->dataEnd <= m_mappedSize;
+
+            if (!valid)
+            {
+                Unmap();
+            }
+        }
+    }
+
+    if (SUCCEEDED(hr) && !valid)
+    {
+        // New file, or one written with other settings: start over
+        LARGE_INTEGER zero;
+        zero.QuadPart = 0;
+        if (!::SetFilePointerEx(m_file, zero, nullptr, FILE_BEGIN) || !::SetEndOfFile(m_file))
+        {
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = Map(dataStart + tile_store_initial_data);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            // The extended file reads as zeros, so every index slot starts unused
+            TileStoreHeader* header = GetHeader();
+            header->magic = tile_store_magic;
+            header->version = tile_store_version;
+            header->tileSize = tileSize;
+            header->indexCapacity = tile_store_index_capacity;
+            header->entryCount = 0;
+            header->reserved = 0;
+            header->dataEnd = dataStart;
+        }
+    }
+
+    if (FAILED(hr))
+    {
+        Close();
+    }
+
+    return hr;
+}
+
+void TileStore::Close()
+{
+    if (m_view != nullptr)
+    {
+        ::FlushViewOfFile(m_view, 0);
+    }
+
+    Unmap();
+
+    if (m_file != INVALID_HANDLE_VALUE)
+    {
+        ::CloseHandle(m_file);
+        m_file = INVALID_HANDLE_VALUE;
+    }
+}
+
+TileStore::TileStoreEntry* TileStore::FindSlot(int level, int x, int y, unsigned long long params) const
+{
+    TileStoreEntry* index = GetIndex();
+    const unsigned int mask = tile_store_index_capacity - 1;
+
+    // The index is never filled beyond three quarters, so probing always ends
+    for (unsigned int slot = HashKey(level, x, y, params) & mask; ; slot = (slot + 1) & mask)
+    {
+        TileStoreEntry* entry = index + slot;
+
+        if (!entry->used || 
+            (entry->level == level && entry->x == x && entry->y == y && entry->params == params))
+        {
+            return entry;
+        }
+    }
+}
+
+bool TileStore::Get(int level, int x, int y, unsigned long long params, unsigned int* counts) const
+{
+    if (!IsOpen())
+    {
+        return false;
+    }
+
+    const TileStoreEntry* entry = FindSlot(level, x, y, params);
+
+    if (!entry->used || entry->offset + entry->size > GetHeader()->dataEnd)
+    {
+        return false;
+    }
+
+    return tile_codec_decode(m_view + entry->offset, entry->size, m_tileSize, counts);
+}
+
+HRESULT TileStore::Put(int level, int x, int y, unsigned long long params, const unsigned int* counts)
+{
+    if (!IsOpen())
+    {
+        return E_UNEXPECTED;
+    }
+
+    if (FindSlot(level, x, y, params)->used)
+    {
+        // Tiles never change once stored
+        return S_OK;
+    }
+
+    if (GetHeader()->entryCount + 1 > tile_store_index_capacity / 4 * 3)
+    {
+        return HRESULT_FROM_WIN32(ERROR_DATABASE_FULL);
+    }
+
+    std::vector<unsigned char> payload;
+    tile_codec_encode(counts, m_tileSize, &payload);
+
+    HRESULT hr = S_OK;
+
+    unsigned long long required = GetHeader()->dataEnd + payload.size();
+    if (required > m_mappedSize)
+    {
+        unsigned long long size = std::max(required, m_mappedSize * 2);
+        if (size > tile_store_max_size)
+        {
+            return HRESULT_FROM_WIN32(ERROR_DATABASE_FULL);
+        }
+
+        Unmap();
+        hr = Map(size);
+
+        if (FAILED(hr))
+        {
+            Close();
+            return hr;
+        }
+    }
+
+    // Payload first, then the index entry, then the header, so that a crash in between
+    // at worst leaks payload space
+    TileStoreHeader* header = GetHeader();
+    unsigned long long offset = header->dataEnd;
+    memcpy(m_view + offset, payload.data(), payload.size());
+
+    TileStoreEntry* entry = FindSlot(level, x, y, params);
+    entry->level = level;
+    entry->x = x;
+    entry->y = y;
+    entry->params = params;
+    entry->offset = offset;
+    entry->size = static_cast<unsigned int>(payload.size());
+    entry->reserved = 0;
+    entry->used = 1;
+
+    header->dataEnd = offset + payload.size();
+    header->entryCount++;
+
+    return hr;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+// Persistent store of raw Mandelbrot iteration tiles, memory-mapped so that revisiting
+// a stored tile costs a page fault and a decode instead of a render.
+//
+// File layout:
+//   Header        fixed size, see TileStoreHeader
+//   Index         indexCapacity TileStoreEntry slots, open addressing on
+//                 (level, x, y, params) with linear probing
+//   Payloads      tilecodec.h compressed tiles, appended at dataEnd
+//
+// The file grows in place while tiles are added and is remapped when it does. Lookups
+// and inserts are meant to be made from one thread.
+class TileStore
+{
+public:
+    TileStore(void);
+    ~TileStore(void);
+
+    HRESULT Open(const std::wstring& path, unsigned int tileSize);
+    void Close();
+
+    bool IsOpen() const { return m_view != nullptr; }
+    unsigned int GetTileSize() const { return m_tileSize; }
+
+    // Fills counts (tileSize * tileSize values) and returns true if the tile is stored.
+    bool Get(int level, int x, int y, unsigned long long params, unsigned int* counts) const;
+
+    HRESULT Put(int level, int x, int y, unsigned long long params, const unsigned int* counts);
+
+private:
+    struct TileStoreHeader
+    {
+        unsigned int magic;
+        unsigned int version;
+        unsigned int tileSize;
+        unsigned int indexCapacity;
+        unsigned int entryCount;
+        unsigned int reserved;
+        unsigned long long dataEnd;
+    };
+
+    struct TileStoreEntry
+    {
+        int level;
+        int x;
+        int y;
+        unsigned int used;
+        unsigned long long params;
+        unsigned long long offset;
+        unsigned int size;
+        unsigned int reserved;
+    };
+
+    HRESULT Map(unsigned long long size);
+    void Unmap();
+
+    TileStoreHeader* GetHeader() const { return reinterpret_cast<TileStoreHeader*>(m_view); }
+    TileStoreEntry* GetIndex() const { return reinterpret_cast<TileStoreEntry*>(m_view + sizeof(TileStoreHeader)); }
+
+    // Returns the slot holding the key, or the empty slot where it would be inserted.
+    TileStoreEntry* FindSlot(int level, int x, int y, unsigned long long params) const;
+
+    HANDLE m_file;
+    HANDLE m_mapping;
+    unsigned char* m_view;
+    unsigned long long m_mappedSize;
+    unsigned int m_tileSize;
+};
@@ -1,5 +1,8 @@
+#pragma once
+
 #include "amp.h"
 #include "amp_math.h"
+#include "morton.h"
 
 inline unsigned int set_hsb (float hue, float saturate, float bright) restrict (amp)
 {   
@@ -40,6 +43,61 @@ inline unsigned int set_hsb (float hue, float saturate, float bright) restrict (
     return 0xff000000 | (ired << 16) | (igreen << 8) | iblue;  
 }
 
+inline unsigned int mandelbrot_hash(unsigned int x) restrict(amp)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+
+    return x;
+}
+
+template<typename fp_t>
+inline unsigned int mandelbrot_iterate(fp_t cx, fp_t cy, unsigned int max_iter) restrict(amp)
+{
+    const fp_t zero = static_cast<fp_t>(0.0f);
+    const fp_t max_c = static_cast<fp_t>(4.0f);
+
+    fp_t zx = zero;
+    fp_t zy = zero;
+
+    fp_t temp;
+    fp_t length_sqr;
+
+    unsigned int count = 0;
+    do
+    {
+        count++;
+
+        temp = zx * zx - zy * zy + cx;
+        zy = 2 * zx * zy + cy;
+        zx = temp;
+
+        length_sqr = zx * zx + zy * zy;
+    }
+    while((length_sqr < max_c) && (count < max_iter));
+
+    return count;
+}
+
+inline unsigned int mandelbrot_color(unsigned int count, unsigned int max_iter) restrict(amp)
+{
+    using namespace Concurrency;
+    using namespace fast_math;
+
+    //faster using multiplication than division
+    float n = count * 0.0078125f; // n = count / 128.0f; 
+
+    float h = 1.0f - 2.0f * fabs(0.5f - n + floor(n));
+
+    //turn points at maximum iteration to black
+    float bfactor = direct3d::clamp((float)(max_iter - count), 0.0f, 1.0f);
+
+    return set_hsb(h, 0.7f, (1.0f - h * h * 0.83f) * bfactor);
+}
+
 template<typename fp_t>
 void generate_mandelbrot(
     Concurrency::array_view<unsigned int, 2> result,
@@ -50,7 +108,6 @@ void generate_mandelbrot(
     fp_t imag_max )
 {
     using namespace Concurrency;
-    using namespace fast_math;
 
     int width = result.extent[1];
     int height = result.extent[0];
@@ -58,44 +115,386 @@ void generate_mandelbrot(
     fp_t scale_real = (real_max - real_min) / width;
     fp_t scale_imag = (imag_max - imag_min) / height;
 
-    const fp_t zero = static_cast<fp_t>(0.0f);
-    const fp_t max_c = static_cast<fp_t>(4.0f);
-
     parallel_for_each(result.extent, [=](index<2> i) restrict(amp)
     {
         int gx = i[1];
         int gy = i[0];
 
-        fp_t cx = real_min + static_cast<float>(gx) * scale_real;
-        fp_t cy = imag_min + static_cast<float>(height - gy) * scale_imag;
+        fp_t cx = real_min + static_cast<fp_t>(gx) * scale_real;
+        fp_t cy = imag_min + static_cast<fp_t>(height - gy) * scale_imag;
+
+        result[i] = mandelbrot_color(mandelbrot_iterate(cx, cy, max_iter), max_iter);
+    });
+}
+
+// Raw iteration counts instead of colors, for the tile store.
+template<typename fp_t>
+void generate_mandelbrot_counts(
+    Concurrency::array_view<unsigned int, 2> counts,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t real_max,
+    fp_t imag_max )
+{
+    using namespace Concurrency;
+
+    int width = counts.extent[1];
+    int height = counts.extent[0];
 
-        fp_t zx = zero;
-        fp_t zy = zero;
+    fp_t scale_real = (real_max - real_min) / width;
+    fp_t scale_imag = (imag_max - imag_min) / height;
 
-        fp_t temp;
-        fp_t length_sqr;
+    counts.discard_data();
 
-        unsigned int count = 0;
-        do
-        {
-            count++;
+    parallel_for_each(counts.extent, [=](index<2> i) restrict(amp)
+    {
+        fp_t cx = real_min + static_cast<fp_t>(i[1]) * scale_real;
+        fp_t cy = imag_min + static_cast<fp_t>(height - i[0]) * scale_imag;
 
+        counts[i] = mandelbrot_iterate(cx, cy, max_iter);
+    });
+}
+
+inline void colorize_mandelbrot(
+    Concurrency::array_view<const unsigned int, 2> counts,
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter)
+{
+    using namespace Concurrency;
+
+    result.discard_data();
+
+    parallel_for_each(result.extent, [=](index<2> i) restrict(amp)
+    {
+        result[i] = mandelbrot_color(counts[i], max_iter);
+    });
+}
+
+// Escape-time loop that tests for escape only every unroll iterations. A block that
+// escaped is rolled back and replayed one iteration at a time, so the returned count is
+// identical to mandelbrot_iterate. The test is written as !(length_sqr < max_c) so that
+// points which overflowed to infinity or NaN inside a block still count as escaped.
+template<typename fp_t, int unroll>
+inline unsigned int mandelbrot_iterate_unrolled(fp_t cx, fp_t cy, unsigned int max_iter) restrict(amp)
+{
+    const fp_t zero = static_cast<fp_t>(0.0f);
+    const fp_t max_c = static_cast<fp_t>(4.0f);
+
+    fp_t zx = zero;
+    fp_t zy = zero;
+
+    fp_t temp;
+
+    // mandelbrot_iterate always runs one iteration, even for max_iter 0
+    if (max_iter == 0)
+    {
+        return 1;
+    }
+
+    unsigned int count = 0;
+    while (count + unroll <= max_iter)
+    {
+        fp_t block_zx = zx;
+        fp_t block_zy = zy;
+
+        for (int k = 0; k < unroll; k++)
+        {
             temp = zx * zx - zy * zy + cx;
             zy = 2 * zx * zy + cy;
             zx = temp;
+        }
 
-            length_sqr = zx * zx + zy * zy;
+        if (!(zx * zx + zy * zy < max_c))
+        {
+            zx = block_zx;
+            zy = block_zy;
+            break;
+        }
+
+        count += unroll;
+    }
+
+    while (count < max_iter)
+    {
+        count++;
+
+        temp = zx * zx - zy * zy + cx;
+        zy = 2 * zx * zy + cy;
+        zx = temp;
+
+        if (!(zx * zx + zy * zy < max_c))
+        {
+            break;
         }
-        while((length_sqr < max_c) && (count < max_iter));
+    }
+
+    return count;
+}
+
+// Thread group shapes the kernel variants can be dispatched with.
+enum mandelbrot_tile_shape
+{
+    mandelbrot_tile_none,
+    mandelbrot_tile_16x16,
+    mandelbrot_tile_8x32,
+    mandelbrot_tile_32x8,
+    mandelbrot_tile_morton,
+    mandelbrot_tile_shape_count
+};
 
-        //faster using multiplication than division
-        float n = count * 0.0078125f; // n = count / 128.0f; 
+// One point in the kernel variant space benchmarked by the autotuner.
+struct mandelbrot_kernel_config
+{
+    int unroll;
+    int tile_shape;
+};
+
+static const int mandelbrot_unroll_factors[] = { 1, 4, 8 };
+
+template<typename fp_t, int unroll>
+inline unsigned int mandelbrot_pixel(int gx, int gy, int height, unsigned int max_iter, fp_t real_min, fp_t imag_min, fp_t scale_real, fp_t scale_imag) restrict(amp)
+{
+    fp_t cx = real_min + static_cast<fp_t>(gx) * scale_real;
+    fp_t cy = imag_min + static_cast<fp_t>(height - gy) * scale_imag;
+
+    return mandelbrot_color(mandelbrot_iterate_unrolled<fp_t, unroll>(cx, cy, max_iter), max_iter);
+}
 
-        float h = 1.0f - 2.0f * fabs(0.5f - n + floor(n));
+template<typename fp_t, int unroll>
+void generate_mandelbrot_untiled(
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t scale_real,
+    fp_t scale_imag)
+{
+    using namespace Concurrency;
 
-        //turn points at maximum iteration to black
-        float bfactor = direct3d::clamp((float)(max_iter - count), 0.0f, 1.0f);
+    const int height = result.extent[0];
 
-        result[i] = set_hsb(h, 0.7f, (1.0f - h * h * 0.83f) * bfactor);
+    parallel_for_each(result.extent, [=](index<2> i) restrict(amp)
+    {
+        result[i] = mandelbrot_pixel<fp_t, unroll>(i[1], i[0], height, max_iter, real_min, imag_min, scale_real, scale_imag);
+    });
+}
+
+template<typename fp_t, int unroll, int tile_y, int tile_x>
+void generate_mandelbrot_tiled(
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t scale_real,
+    fp_t scale_imag)
+{
+    using namespace Concurrency;
+
+    const int width = result.extent[1];
+    const int height = result.extent[0];
+
+    parallel_for_each(result.extent.tile<tile_y, tile_x>().pad(), [=](tiled_index<tile_y, tile_x> t) restrict(amp)
+    {
+        const int gx = t.global[1];
+        const int gy = t.global[0];
+
+        if (gx < width && gy < height)
+        {
+            result(gy, gx) = mandelbrot_pixel<fp_t, unroll>(gx, gy, height, max_iter, real_min, imag_min, scale_real, scale_imag);
+        }
+    });
+}
+
+// Untiled launch that walks the pixels in Morton order, see morton.h.
+template<typename fp_t, int unroll>
+void generate_mandelbrot_morton(
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t scale_real,
+    fp_t scale_imag)
+{
+    const int height = result.extent[0];
+
+    parallel_for_each_pixel(result.extent, pixel_order_morton, [=](int gx, int gy) restrict(amp)
+    {
+        result(gy, gx) = mandelbrot_pixel<fp_t, unroll>(gx, gy, height, max_iter, real_min, imag_min, scale_real, scale_imag);
+    });
+}
+
+template<typename fp_t, int unroll>
+void generate_mandelbrot_shaped(
+    int tile_shape,
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t scale_real,
+    fp_t scale_imag)
+{
+    switch (tile_shape)
+    {
+    case mandelbrot_tile_16x16:
+        generate_mandelbrot_tiled<fp_t, unroll, 16, 16>(result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    case mandelbrot_tile_8x32:
+        generate_mandelbrot_tiled<fp_t, unroll, 8, 32>(result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    case mandelbrot_tile_32x8:
+        generate_mandelbrot_tiled<fp_t, unroll, 32, 8>(result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    case mandelbrot_tile_morton:
+        generate_mandelbrot_morton<fp_t, unroll>(result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    default:
+        generate_mandelbrot_untiled<fp_t, unroll>(result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    }
+}
+
+// Same image as generate_mandelbrot, rendered with the kernel variant selected by config.
+template<typename fp_t>
+void generate_mandelbrot_variant(
+    const mandelbrot_kernel_config& config,
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t real_max,
+    fp_t imag_max )
+{
+    int width = result.extent[1];
+    int height = result.extent[0];
+
+    fp_t scale_real = (real_max - real_min) / width;
+    fp_t scale_imag = (imag_max - imag_min) / height;
+
+    switch (config.unroll)
+    {
+    case 8:
+        generate_mandelbrot_shaped<fp_t, 8>(config.tile_shape, result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    case 4:
+        generate_mandelbrot_shaped<fp_t, 4>(config.tile_shape, result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    default:
+        generate_mandelbrot_shaped<fp_t, 1>(config.tile_shape, result, max_iter, real_min, imag_min, scale_real, scale_imag);
+        break;
+    }
+}
+
+// Edge-adaptive antialiasing. A base pass renders one sample per pixel and keeps the
+// iteration counts, a detection pass collects the pixels whose count differs from one
+// of their neighbours by more than edge_threshold (or that border the set itself), and
+// only those pixels are re-rendered with aa_grid x aa_grid stratified subsamples.
+// Returns the fraction of pixels that were refined.
+template<typename fp_t>
+float generate_mandelbrot_adaptive(
+    Concurrency::array_view<unsigned int, 2> result,
+    unsigned int max_iter,
+    fp_t real_min,
+    fp_t imag_min,
+    fp_t real_max,
+    fp_t imag_max,
+    unsigned int edge_threshold = 4,
+    int aa_grid = 4)
+{
+    using namespace Concurrency;
+
+    const int width = result.extent[1];
+    const int height = result.extent[0];
+
+    fp_t scale_real = (real_max - real_min) / width;
+    fp_t scale_imag = (imag_max - imag_min) / height;
+
+    array<unsigned int, 2> counts(result.extent);
+
+    parallel_for_each(result.extent, [=, &counts](index<2> i) restrict(amp)
+    {
+        fp_t cx = real_min + static_cast<fp_t>(i[1]) * scale_real;
+        fp_t cy = imag_min + static_cast<fp_t>(height - i[0]) * scale_imag;
+
+        unsigned int count = mandelbrot_iterate(cx, cy, max_iter);
+
+        counts[i] = count;
+        result[i] = mandelbrot_color(count, max_iter);
     });
+
+    int refine_total = 0;
+    array_view<int, 1> refine_count(1, &refine_total);
+    array<int, 1> refine_list(width * height);
+
+    parallel_for_each(result.extent, [=, &counts, &refine_list](index<2> i) restrict(amp)
+    {
+        unsigned int count = counts[i];
+        bool inside = count >= max_iter;
+        bool edge = false;
+
+        for (int dy = -1; dy <= 1; dy++)
+        {
+            for (int dx = -1; dx <= 1; dx++)
+            {
+                int ny = direct3d::clamp(i[0] + dy, 0, height - 1);
+                int nx = direct3d::clamp(i[1] + dx, 0, width - 1);
+
+                unsigned int neighbour = counts(ny, nx);
+                unsigned int diff = count > neighbour ? count - neighbour : neighbour - count;
+
+                if (diff > edge_threshold || inside != (neighbour >= max_iter))
+                {
+                    edge = true;
+                }
+            }
+        }
+
+        if (edge)
+        {
+            int slot = atomic_fetch_inc(&refine_count[0]);
+            refine_list[slot] = i[0] * width + i[1];
+        }
+    });
+
+    refine_count.synchronize();
+
+    if (refine_total > 0)
+    {
+        const unsigned int samples = aa_grid * aa_grid;
+
+        parallel_for_each(extent<1>(refine_total), [=, &refine_list](index<1> k) restrict(amp)
+        {
+            int pixel = refine_list[k];
+            int gx = pixel % width;
+            int gy = pixel / width;
+
+            unsigned int r = 0;
+            unsigned int g = 0;
+            unsigned int b = 0;
+
+            for (int sy = 0; sy < aa_grid; sy++)
+            {
+                for (int sx = 0; sx < aa_grid; sx++)
+                {
+                    //one jittered sample per stratum, centered on the base sample
+                    unsigned int h = mandelbrot_hash(pixel * samples + sy * aa_grid + sx);
+                    float jx = (sx + (h & 0xffff) * (1.0f / 65536.0f)) / aa_grid - 0.5f;
+                    float jy = (sy + (h >> 16) * (1.0f / 65536.0f)) / aa_grid - 0.5f;
+
+                    fp_t cx = real_min + (static_cast<fp_t>(gx) + jx) * scale_real;
+                    fp_t cy = imag_min + (static_cast<fp_t>(height - gy) - jy) * scale_imag;
+
+                    unsigned int color = mandelbrot_color(mandelbrot_iterate(cx, cy, max_iter), max_iter);
+
+                    r += (color >> 16) & 0xff;
+                    g += (color >> 8) & 0xff;
+                    b += color & 0xff;
+                }
+            }
+
+            result(gy, gx) = 0xff000000 | ((r / samples) << 16) | ((g / samples) << 8) | (b / samples);
+        });
+    }
+
+    return static_cast<float>(refine_total) / (width * height);
 }
\ No newline at end of file
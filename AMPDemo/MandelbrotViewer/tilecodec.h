@@ -0,0 +1,229 @@
+#pragma once
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Compression of square tiles of raw iteration counts for the tile store.
+//
+// Counts are predicted from the left neighbour (the upper one at the start of a row),
+// the zigzag-coded residuals are written as LEB128 varints, and the resulting byte
+// stream is entropy coded with an order-0 byte-wise rANS coder. Smooth regions away
+// from the set boundary turn into long runs of tiny residuals that code to a fraction
+// of a bit per pixel.
+//
+// Payload layout:
+//   unsigned int   varint stream length
+//   unsigned short symbol frequencies[256], summing to 1 << tile_codec_scale_bits
+//   unsigned char  rANS stream (initial decoder state first)
+
+static const unsigned int tile_codec_scale_bits = 12;
+static const unsigned int tile_codec_rans_low = 1u << 23;
+
+inline void tile_codec_normalize(const unsigned int* histogram, unsigned int total, unsigned short* freq)
+{
+    const unsigned int scale = 1u << tile_codec_scale_bits;
+
+    unsigned int sum = 0;
+    int largest = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        freq[s] = 0;
+        if (histogram[s] > 0)
+        {
+            //every symbol that occurs needs a non-zero slot
+            freq[s] = static_cast<unsigned short>(std::max(1ull, static_cast<unsigned long long>(histogram[s]) * scale / total));
+            sum += freq[s];
+
+            if (histogram[s] > histogram[largest])
+            {
+                largest = s;
+            }
+        }
+    }
+
+    //give the rounding error to the most frequent symbols
+    while (sum > scale)
+    {
+        for (int s = 0; s < 256 && sum > scale; s++)
+        {
+            if (freq[s] > 1 && (s == largest || freq[s] > freq[largest] / 2))
+            {
+                freq[s]--;
+                sum--;
+            }
+        }
+    }
+    freq[largest] = static_cast<unsigned short>(freq[largest] + (scale - sum));
+}
+
+inline void tile_codec_encode(const unsigned int* counts, unsigned int tile_size, std::vector<unsigned char>* payload)
+{
+    //prediction residuals as zigzag varints
+    std::vector<unsigned char> symbols;
+    symbols.reserve(tile_size * tile_size);
+
+    for (unsigned int y = 0; y < tile_size; y++)
+    {
+        for (unsigned int x = 0; x < tile_size; x++)
+        {
+            unsigned int value = counts[y * tile_size + x];
+            unsigned int prediction = x > 0 ? counts[y * tile_size + x - 1] : (y > 0 ? counts[(y - 1) * tile_size] : 0);
+
+            int residual = static_cast<int>(value - prediction);
+            unsigned int zigzag = (static_cast<unsigned int>(residual) << 1) ^ static_cast<unsigned int>(residual >> 31);
+
+            while (zigzag >= 0x80)
+            {
+                symbols.push_back(static_cast<unsigned char>(zigzag | 0x80));
+                zigzag >>= 7;
+            }
+            symbols.push_back(static_cast<unsigned char>(zigzag));
+        }
+    }
+
+    unsigned int histogram[256] = {};
+    for (size_t i = 0; i < symbols.size(); i++)
+    {
+        histogram[symbols[i]]++;
+    }
+
+    unsigned short freq[256];
+    tile_codec_normalize(histogram, static_cast<unsigned int>(symbols.size()), freq);
+
+    unsigned int cumulative[256];
+    unsigned int running = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        cumulative[s] = running;
+        running += freq[s];
+    }
+
+    //rANS encodes back to front; the bytes are collected reversed and flipped at the end
+    std::vector<unsigned char> stream;
+    unsigned int state = tile_codec_rans_low;
+
+    for (size_t i = symbols.size(); i-- > 0; )
+    {
+        unsigned int f = freq[symbols[i]];
+        unsigned int limit = ((tile_codec_rans_low >> tile_codec_scale_bits) << 8) * f;
+
+        while (state >= limit)
+        {
+            stream.push_back(static_cast<unsigned char>(state & 0xff));
+            state >>= 8;
+        }
+
+        state = ((state / f) << tile_codec_scale_bits) + (state % f) + cumulative[symbols[i]];
+    }
+
+    for (int shift = 24; shift >= 0; shift -= 8)
+    {
+        stream.push_back(static_cast<unsigned char>(state >> shift));
+    }
+
+    payload->clear();
+    payload->reserve(sizeof(unsigned int) + sizeof(freq) + stream.size());
+
+    unsigned int length = static_cast<unsigned int>(symbols.size());
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(&length);
+    payload->insert(payload->end(), header, header + sizeof(length));
+
+    const unsigned char* table = reinterpret_cast<const unsigned char*>(freq);
+    payload->insert(payload->end(), table, table + sizeof(freq));
+
+    payload->insert(payload->end(), stream.rbegin(), stream.rend());
+}
+
+// Returns false if the payload is truncated or inconsistent.
+inline bool tile_codec_decode(const unsigned char* payload, size_t size, unsigned int tile_size, unsigned int* counts)
+{
+    unsigned int length;
+    unsigned short freq[256];
+
+    if (size < sizeof(length) + sizeof(freq) + 4)
+    {
+        return false;
+    }
+
+    memcpy(&length, payload, sizeof(length));
+    memcpy(freq, payload + sizeof(length), sizeof(freq));
+
+    const unsigned char* stream = payload + sizeof(length) + sizeof(freq);
+    const unsigned char* end = payload + size;
+
+    const unsigned int scale = 1u << tile_codec_scale_bits;
+
+    unsigned int cumulative[257];
+    unsigned char lookup[1u << tile_codec_scale_bits];
+    cumulative[0] = 0;
+    for (int s = 0; s < 256; s++)
+    {
+        cumulative[s + 1] = cumulative[s] + freq[s];
+        if (cumulative[s + 1] > scale)
+        {
+            return false;
+        }
+        for (unsigned int slot = cumulative[s]; slot < cumulative[s + 1]; slot++)
+        {
+            lookup[slot] = static_cast<unsigned char>(s);
+        }
+    }
+
+    if (cumulative[256] != scale)
+    {
+        return false;
+    }
+
+    unsigned int state = stream[0] | (stream[1] << 8) | (stream[2] << 16) | (static_cast<unsigned int>(stream[3]) << 24);
+    stream += 4;
+
+    unsigned int pixel = 0;
+    unsigned int zigzag = 0;
+    int shift = 0;
+    const unsigned int pixels = tile_size * tile_size;
+
+    for (unsigned int i = 0; i < length; i++)
+    {
+        unsigned int slot = state & (scale - 1);
+        unsigned char symbol = lookup[slot];
+
+        state = freq[symbol] * (state >> tile_codec_scale_bits) + slot - cumulative[symbol];
+        while (state < tile_codec_rans_low)
+        {
+            if (stream == end)
+            {
+                return false;
+            }
+            state = (state << 8) | *stream++;
+        }
+
+        // a 32 bit varint has at most 5 bytes, a longer run of continuation bytes is corrupt
+        if (shift > 28)
+        {
+            return false;
+        }
+        zigzag |= static_cast<unsigned int>(symbol & 0x7f) << shift;
+        shift += 7;
+
+        if ((symbol & 0x80) == 0)
+        {
+            if (pixel == pixels)
+            {
+                return false;
+            }
+
+            unsigned int x = pixel % tile_size;
+            unsigned int y = pixel / tile_size;
+            unsigned int prediction = x > 0 ? counts[pixel - 1] : (y > 0 ? counts[pixel - tile_size] : 0);
+
+            int residual = static_cast<int>(zigzag >> 1) ^ -static_cast<int>(zigzag & 1);
+            counts[pixel++] = prediction + static_cast<unsigned int>(residual);
+
+            zigzag = 0;
+            shift = 0;
+        }
+    }
+
+    return pixel == pixels;
+}
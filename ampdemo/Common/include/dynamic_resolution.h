@@ -0,0 +1,99 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+
+// Dynamic resolution for interactive viewers.
+//
+// While the view moves, frames are rendered at a reduced internal resolution and
+// stretched to the window, so that dragging stays responsive however large the window
+// is. The scale factor comes from a PID loop on the measured frame times against a
+// target frame time. Once the view rests the viewer renders one full resolution frame.
+//
+// Frame time grows with the pixel count, the square of the scale, so the loop works on
+// log2 of the scale: the error of a frame is the change of log2 scale that would have
+// hit the target, half of log2(target / time), and the plant has unit gain. The loop is
+// in velocity form, each frame adds the PID correction to the current log2 scale, which
+// keeps the integral term from winding up while the scale sits at one of its limits.
+
+class dynamic_resolution
+{
+public:
+    explicit dynamic_resolution(double target_ms = 16.0, float min_scale = 0.25f)
+        : target_ms(target_ms), min_log_scale(std::log2(min_scale)), enabled(true)
+    {
+        reset();
+    }
+
+    // Forgets the measured frame times, the next moving frame starts at full resolution.
+    void reset()
+    {
+        log_scale = 0.0;
+        last_error = 0.0;
+        previous_error = 0.0;
+    }
+
+    void set_enabled(bool enable)
+    {
+        enabled = enable;
+        reset();
+    }
+
+    bool get_enabled() const
+    {
+        return enabled;
+    }
+
+    double get_target_ms() const
+    {
+        return target_ms;
+    }
+
+    // Scale of the internal resolution for the next frame, 1 while the view rests.
+    float next_scale(bool moving) const
+    {
+        return enabled && moving ? static_cast<float>(std::exp2(log_scale)) : 1.0f;
+    }
+
+    // Feeds back the render time of a frame drawn at frame_scale. Full resolution frames
+    // count as well, they tell how far below 1 the first moving frame has to start.
+    void frame_rendered(double frame_ms, float frame_scale)
+    {
+        if (!enabled || frame_ms <= 0.0)
+        {
+            return;
+        }
+
+        // an integral gain of 1 would correct the whole error of a frame at once, less of
+        // it rides out the noise of single frames while the proportional and derivative
+        // terms damp the response to sudden changes of scene cost
+        const double proportional_gain = 0.3;
+        const double integral_gain = 0.5;
+        const double derivative_gain = 0.05;
+
+        // measured against the current scale, frame_scale differs from it at rest
+        const double error = 0.5 * std::log2(target_ms / frame_ms) + std::log2(frame_scale) - log_scale;
+
+        log_scale += proportional_gain * (error - last_error) + integral_gain * error + derivative_gain * (error - 2.0 * last_error + previous_error);
+        log_scale = std::min(std::max(log_scale, min_log_scale), 0.0);
+
+        previous_error = last_error;
+        last_error = error;
+    }
+
+    // Internal size of a window dimension at scale, at least one pixel.
+    static unsigned int scaled_size(unsigned int size, float scale)
+    {
+        return std::max(static_cast<unsigned int>(size * scale + 0.5f), 1u);
+    }
+
+private:
+    double target_ms;
+    double min_log_scale;
+    bool enabled;
+
+    double log_scale;
+    double last_error;
+    double previous_error;
+};
+
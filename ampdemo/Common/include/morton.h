@@ -0,0 +1,150 @@
+#pragma once
+
+#include <amp.h>
+
+// Z-order (Morton) pixel traversal for per-pixel C++ AMP kernels.
+//
+// A row-major dispatch hands consecutive thread indices to consecutive pixels of one
+// row. In Morton order the image is cut into square tiles visited row by row, and the
+// pixels inside a tile follow a Z curve, so each run of consecutive threads (a GPU
+// warp, or a SIMD batch of the WARP CPU accelerator) covers a compact 2D block whose
+// pixels have correlated cost and touch neighbouring cache lines. Results are always
+// written back to the usual linear row-major image.
+
+enum pixel_order
+{
+    pixel_order_row_major,
+    pixel_order_morton
+};
+
+inline unsigned int morton_part_1by1(unsigned int x) restrict(cpu, amp)
+{
+    x &= 0x0000ffff;
+    x = (x ^ (x << 8)) & 0x00ff00ff;
+    x = (x ^ (x << 4)) & 0x0f0f0f0f;
+    x = (x ^ (x << 2)) & 0x33333333;
+    x = (x ^ (x << 1)) & 0x55555555;
+    return x;
+}
+
+inline unsigned int morton_compact_1by1(unsigned int x) restrict(cpu, amp)
+{
+    x &= 0x55555555;
+    x = (x ^ (x >> 1)) & 0x33333333;
+    x = (x ^ (x >> 2)) & 0x0f0f0f0f;
+    x = (x ^ (x >> 4)) & 0x00ff00ff;
+    x = (x ^ (x >> 8)) & 0x0000ffff;
+    return x;
+}
+
+inline unsigned int morton_encode2(unsigned int x, unsigned int y) restrict(cpu, amp)
+{
+    return morton_part_1by1(x) | (morton_part_1by1(y) << 1);
+}
+
+inline void morton_decode2(unsigned int code, unsigned int& x, unsigned int& y) restrict(cpu, amp)
+{
+    x = morton_compact_1by1(code);
+    y = morton_compact_1by1(code >> 1);
+}
+
+inline unsigned int morton_part_1by2(unsigned int x) restrict(cpu, amp)
+{
+    x &= 0x000003ff;
+    x = (x ^ (x << 16)) & 0xff0000ff;
+    x = (x ^ (x << 8)) & 0x0300f00f;
+    x = (x ^ (x << 4)) & 0x030c30c3;
+    x = (x ^ (x << 2)) & 0x09249249;
+    return x;
+}
+
+// 30-bit code of a point quantized to 10 bits per axis
+inline unsigned int morton_encode3(unsigned int x, unsigned int y, unsigned int z) restrict(cpu, amp)
+{
+    return morton_part_1by2(x) | (morton_part_1by2(y) << 1) | (morton_part_1by2(z) << 2);
+}
+
+// 63-bit variants with 21 bits per axis, CPU only since amp code has no 64-bit integers
+inline unsigned long long morton_part_1by2_64(unsigned long long x) restrict(cpu)
+{
+    x &= 0x1fffff;
+    x = (x ^ (x << 32)) & 0x1f00000000ffffull;
+    x = (x ^ (x << 16)) & 0x1f0000ff0000ffull;
+    x = (x ^ (x << 8)) & 0x100f00f00f00f00full;
+    x = (x ^ (x << 4)) & 0x10c30c30c30c30c3ull;
+    x = (x ^ (x << 2)) & 0x1249249249249249ull;
+    return x;
+}
+
+inline unsigned long long morton_encode3_64(unsigned int x, unsigned int y, unsigned int z) restrict(cpu)
+{
+    return morton_part_1by2_64(x) | (morton_part_1by2_64(y) << 1) | (morton_part_1by2_64(z) << 2);
+}
+
+// Maps linear launch indices to pixels, in tiles of 2^tile_shift x 2^tile_shift.
+class morton_traversal
+{
+public:
+    explicit morton_traversal(int width, int height, int tile_shift = 4) restrict(cpu, amp)
+        : width(width), height(height), tile_shift(tile_shift)
+    {
+        tiles_x = (width + (1 << tile_shift) - 1) >> tile_shift;
+        tiles_y = (height + (1 << tile_shift) - 1) >> tile_shift;
+    }
+
+    // Launch size, including the padding of partial tiles at the right and bottom edges.
+    int size() const restrict(cpu, amp)
+    {
+        return (tiles_x * tiles_y) << (2 * tile_shift);
+    }
+
+    // Returns false for padding indices that fall outside the image.
+    bool pixel(int linear, int& x, int& y) const restrict(cpu, amp)
+    {
+        int tile = linear >> (2 * tile_shift);
+        unsigned int code = static_cast<unsigned int>(linear) & ((1u << (2 * tile_shift)) - 1);
+
+        unsigned int tx, ty;
+        morton_decode2(code, tx, ty);
+
+        x = ((tile % tiles_x) << tile_shift) + static_cast<int>(tx);
+        y = ((tile / tiles_x) << tile_shift) + static_cast<int>(ty);
+
+        return x < width && y < height;
+    }
+
+private:
+    int width;
+    int height;
+    int tile_shift;
+    int tiles_x;
+    int tiles_y;
+};
+
+// Runs kernel(x, y) restrict(amp) once for every pixel of image in the given order.
+template<typename kernel_t>
+void parallel_for_each_pixel(const Concurrency::extent<2>& image, int order, const kernel_t& kernel)
+{
+    using namespace Concurrency;
+
+    if (order == pixel_order_morton)
+    {
+        morton_traversal traversal(image[1], image[0]);
+
+        parallel_for_each(extent<1>(traversal.size()), [=](index<1> idx) restrict(amp)
+        {
+            int x, y;
+            if (traversal.pixel(idx[0], x, y))
+            {
+                kernel(x, y);
+            }
+        });
+    }
+    else
+    {
+        parallel_for_each(image, [=](index<2> idx) restrict(amp)
+        {
+            kernel(idx[1], idx[0]);
+        });
+    }
+}
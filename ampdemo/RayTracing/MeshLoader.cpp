@@ -0,0 +1,719 @@
+#include "stdafx.h"
+#include "MeshLoader.h"
+#include <ppl.h>
+#include <sstream>
+
+namespace
+{
+    // OBJ chunks are at least this large so that small files stay on one thread
+    const size_t ObjChunkSize = 4 * 1024 * 1024;
+
+    bool IsSpace(char c)
+    {
+        return c == ' ' || c == '\t';
+    }
+
+    const char* SkipSpaces(const char* p, const char* end)
+    {
+        while (p < end && IsSpace(*p))
+        {
+            p++;
+        }
+        return p;
+    }
+
+    const char* SkipLine(const char* p, const char* end)
+    {
+        while (p < end && *p != '\n')
+        {
+            p++;
+        }
+        return p < end ? p + 1 : end;
+    }
+
+    // Locale independent float parser, accurate enough for vertex positions.
+    const char* ParseFloat(const char* p, const char* end, float* value)
+    {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative = *p == '-';
+            p++;
+        }
+
+        double result = 0.0;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            result = result * 10.0 + (*p - '0');
+            p++;
+        }
+
+        if (p < end && *p == '.')
+        {
+            p++;
+
+            double scale = 0.1;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                result += (*p - '0') * scale;
+                scale *= 0.1;
+                p++;
+            }
+        }
+
+        if (p < end && (*p == 'e' || *p == 'E'))
+        {
+            p++;
+
+            bool negativeExponent = false;
+            if (p < end && (*p == '-' || *p == '+'))
+            {
+                negativeExponent = *p == '-';
+                p++;
+            }
+
+            int exponent = 0;
+            while (p < end && *p >= '0' && *p <= '9')
+            {
+                exponent = exponent * 10 + (*p - '0');
+                p++;
+            }
+
+            result *= pow(10.0, negativeExponent ? -exponent : exponent);
+        }
+
+        *value = static_cast<float>(negative ? -result : result);
+        return p;
+    }
+
+    const char* ParseInt(const char* p, const char* end, int* value)
+    {
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+'))
+        {
+            negative = *p == '-';
+            p++;
+        }
+
+        int result = 0;
+        while (p < end && *p >= '0' && *p <= '9')
+        {
+            result = result * 10 + (*p - '0');
+            p++;
+        }
+
+        *value = negative ? -result : result;
+        return p;
+    }
+
+    // Vertices and triangles of one OBJ chunk. Indices are zero based and global, except
+    // the ones listed in relative, which count from the chunk's first vertex until
+    // that is known.
+    struct ObjChunk
+    {
+        std::vector<float> x, y, z;
+        std::vector<int> indices;
+        std::vector<size_t> relative;
+        bool failed;
+
+        ObjChunk() : failed(false) {}
+    };
+
+    void ParseObjChunk(const char* p, const char* end, ObjChunk* chunk)
+    {
+        std::vector<int> polygon;
+        std::vector<bool> polygonRelative;
+
+        while (p < end)
+        {
+            p = SkipSpaces(p, end);
+
+            if (end - p >= 2 && p[0] == 'v' && IsSpace(p[1]))
+            {
+                float x, y, z;
+                p = ParseFloat(SkipSpaces(p + 2, end), end, &x);
+                p = ParseFloat(SkipSpaces(p, end), end, &y);
+                p = ParseFloat(SkipSpaces(p, end), end, &z);
+
+                chunk->x.push_back(x);
+                chunk->y.push_back(y);
+                chunk->z.push_back(z);
+            }
+            else if (end - p >= 2 && p[0] == 'f' && IsSpace(p[1]))
+            {
+                polygon.clear();
+                polygonRelative.clear();
+                p += 2;
+
+                for (;;)
+                {
+                    p = SkipSpaces(p, end);
+                    if (p >= end || *p == '\r' || *p == '\n' || *p == '#')
+                    {
+                        break;
+                    }
+
+                    int index = 0;
+                    const char* next = ParseInt(p, end, &index);
+                    if (next == p || index == 0)
+                    {
+                        chunk->failed = true;
+                        return;
+                    }
+
+                    // OBJ indices start at 1, negative ones count back from the last vertex
+                    polygon.push_back(index > 0 ? index - 1 : static_cast<int>(chunk->x.size()) + index);
+                    polygonRelative.push_back(index < 0);
+
+                    // skip texture and normal indices
+                    p = next;
+                    while (p < end && !IsSpace(*p) && *p != '\r' && *p != '\n')
+                    {
+                        p++;
+                    }
+                }
+
+                for (size_t i = 2; i < polygon.size(); i++)
+                {
+                    const size_t corners[3] = { 0, i - 1, i };
+
+                    for (int k = 0; k < 3; k++)
+                    {
+                        if (polygonRelative[corners[k]])
+                        {
+                            chunk->relative.push_back(chunk->indices.size());
+                        }
+                        chunk->indices.push_back(polygon[corners[k]]);
+                    }
+                }
+            }
+
+            p = SkipLine(p, end);
+        }
+    }
+
+    enum PlyType
+    {
+        PlyInvalid,
+        PlyInt8,
+        PlyUInt8,
+        PlyInt16,
+        PlyUInt16,
+        PlyInt32,
+        PlyUInt32,
+        PlyFloat32,
+        PlyFloat64
+    };
+
+    struct PlyProperty
+    {
+        std::string name;
+        PlyType type;
+        bool isList;
+        PlyType countType;
+    };
+
+    struct PlyElement
+    {
+        std::string name;
+        int count;
+        std::vector<PlyProperty> properties;
+    };
+
+    PlyType ParsePlyType(const std::string& name)
+    {
+        if (name == "char" || name == "int8") return PlyInt8;
+        if (name == "uchar" || name == "uint8") return PlyUInt8;
+        if (name == "short" || name == "int16") return PlyInt16;
+        if (name == "ushort" || name == "uint16") return PlyUInt16;
+        if (name == "int" || name == "int32") return PlyInt32;
+        if (name == "uint" || name == "uint32") return PlyUInt32;
+        if (name == "float" || name == "float32") return PlyFloat32;
+        if (name == "double" || name == "float64") return PlyFloat64;
+        return PlyInvalid;
+    }
+
+    int PlyTypeSize(PlyType type)
+    {
+        switch (type)
+        {
+        case PlyInt8:
+        case PlyUInt8:
+            return 1;
+        case PlyInt16:
+        case PlyUInt16:
+            return 2;
+        case PlyInt32:
+        case PlyUInt32:
+        case PlyFloat32:
+            return 4;
+        case PlyFloat64:
+            return 8;
+        default:
+            return 0;
+        }
+    }
+
+    template <typename T>
+    double ReadAs(const unsigned char* bytes)
+    {
+        T value;
+        memcpy(&value, bytes, sizeof(T));
+        return static_cast<double>(value);
+    }
+
+    double ReadPlyValue(const char* p, PlyType type, bool swapBytes)
+    {
+        unsigned char bytes[8];
+        const int size = PlyTypeSize(type);
+
+        for (int i = 0; i < size; i++)
+        {
+            bytes[i] = static_cast<unsigned char>(p[swapBytes ? size - 1 - i : i]);
+        }
+
+        switch (type)
+        {
+        case PlyInt8: return ReadAs<signed char>(bytes);
+        case PlyUInt8: return ReadAs<unsigned char>(bytes);
+        case PlyInt16: return ReadAs<short>(bytes);
+        case PlyUInt16: return ReadAs<unsigned short>(bytes);
+        case PlyInt32: return ReadAs<int>(bytes);
+        case PlyUInt32: return ReadAs<unsigned int>(bytes);
+        case PlyFloat32: return ReadAs<float>(bytes);
+        case PlyFloat64: return ReadAs<double>(bytes);
+        default: return 0.0;
+        }
+    }
+
+    // Walks one record of the element and returns its end, or nullptr past the data.
+    const char* SkipPlyRecord(const char* p, const char* end, const PlyElement& element, bool swapBytes)
+    {
+        for (size_t i = 0; i < element.properties.size(); i++)
+        {
+            const PlyProperty& property = element.properties[i];
+
+            size_t size = PlyTypeSize(property.type);
+            if (property.isList)
+            {
+                if (end - p < PlyTypeSize(property.countType))
+                {
+                    return nullptr;
+                }
+
+                // a negative count or one past the data is corrupt, check before the cast
+                const double count = ReadPlyValue(p, property.countType, swapBytes);
+                p += PlyTypeSize(property.countType);
+                if (!(count >= 0.0) || count > static_cast<double>(end - p) / size)
+                {
+                    return nullptr;
+                }
+                size *= static_cast<size_t>(count);
+            }
+
+            if (static_cast<size_t>(end - p) < size)
+            {
+                return nullptr;
+            }
+            p += size;
+        }
+
+        return p;
+    }
+
+    // Bytes of the shortest possible record, its scalar properties and list counts.
+    size_t PlyMinRecordSize(const PlyElement& element)
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < element.properties.size(); i++)
+        {
+            const PlyProperty& property = element.properties[i];
+            size += PlyTypeSize(property.isList ? property.countType : property.type);
+        }
+        return size;
+    }
+}
+
+HRESULT MeshLoader::Load(const std::wstring& path, triangle_mesh* mesh)
+{
+    size_t dot = path.find_last_of(L'.');
+    std::wstring extension = dot == std::wstring::npos ? L"" : path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::towlower);
+
+    if (extension != L"obj" && extension != L"ply")
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+    }
+
+    HANDLE file = ::CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(::GetLastError());
+    }
+
+    HRESULT hr = S_OK;
+
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(file, &size))
+    {
+        hr = HRESULT_FROM_WIN32(::GetLastError());
+    }
+    else if (size.QuadPart == 0 || static_cast<unsigned long long>(size.QuadPart) > static_cast<size_t>(-1))
+    {
+        hr = E_INVALIDARG;
+    }
+
+    HANDLE mapping = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        mapping = ::CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+        }
+    }
+
+    const char* view = nullptr;
+    if (SUCCEEDED(hr))
+    {
+        view = static_cast<const char*>(::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (view == nullptr)
+        {
+            hr = HRESULT_FROM_WIN32(::GetLastError());
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        const char* end = view + static_cast<size_t>(size.QuadPart);
+        hr = extension == L"obj" ? LoadObj(view, end, mesh) : LoadPly(view, end, mesh);
+    }
+
+    if (view != nullptr)
+    {
+        ::UnmapViewOfFile(view);
+    }
+
+    if (mapping != nullptr)
+    {
+        ::CloseHandle(mapping);
+    }
+
+    ::CloseHandle(file);
+
+    return hr;
+}
+
+HRESULT MeshLoader::LoadObj(const char* begin, const char* end, triangle_mesh* mesh)
+{
+    const size_t size = end - begin;
+    const int chunkCount = static_cast<int>(std::max<size_t>(1, size / ObjChunkSize));
+
+    // chunk boundaries are moved forward to the next line start
+    std::vector<const char*> bounds(chunkCount + 1);
+    bounds[0] = begin;
+    bounds[chunkCount] = end;
+
+    for (int i = 1; i < chunkCount; i++)
+    {
+        const char* p = std::max(begin + size / chunkCount * i, bounds[i - 1]);
+        while (p < end && p[-1] != '\n')
+        {
+            p++;
+        }
+        bounds[i] = p;
+    }
+
+    std::vector<ObjChunk> chunks(chunkCount);
+
+    Concurrency::parallel_for(0, chunkCount, [&](int i)
+    {
+        ParseObjChunk(bounds[i], bounds[i + 1], &chunks[i]);
+    });
+
+    std::vector<int> firstVertex(chunkCount + 1, 0);
+    std::vector<size_t> firstIndex(chunkCount + 1, 0);
+
+    for (int i = 0; i < chunkCount; i++)
+    {
+        if (chunks[i].failed)
+        {
+            return E_FAIL;
+        }
+
+        firstVertex[i + 1] = firstVertex[i] + static_cast<int>(chunks[i].x.size());
+        firstIndex[i + 1] = firstIndex[i] + chunks[i].indices.size();
+    }
+
+    const int vertexCount = firstVertex[chunkCount];
+
+    mesh->x.resize(vertexCount);
+    mesh->y.resize(vertexCount);
+    mesh->z.resize(vertexCount);
+    mesh->indices.resize(firstIndex[chunkCount]);
+
+    Concurrency::parallel_for(0, chunkCount, [&](int i)
+    {
+        ObjChunk& chunk = chunks[i];
+
+        std::copy(chunk.x.begin(), chunk.x.end(), mesh->x.begin() + firstVertex[i]);
+        std::copy(chunk.y.begin(), chunk.y.end(), mesh->y.begin() + firstVertex[i]);
+        std::copy(chunk.z.begin(), chunk.z.end(), mesh->z.begin() + firstVertex[i]);
+
+        for (size_t k = 0; k < chunk.relative.size(); k++)
+        {
+            chunk.indices[chunk.relative[k]] += firstVertex[i];
+        }
+
+        for (size_t k = 0; k < chunk.indices.size(); k++)
+        {
+            int index = chunk.indices[k];
+            if (index < 0 || index >= vertexCount)
+            {
+                chunk.failed = true;
+                index = 0;
+            }
+
+            mesh->indices[firstIndex[i] + k] = index;
+        }
+    });
+
+    for (int i = 0; i < chunkCount; i++)
+    {
+        if (chunks[i].failed)
+        {
+            return E_FAIL;
+        }
+    }
+
+    return S_OK;
+}
+
+HRESULT MeshLoader::LoadPly(const char* begin, const char* end, triangle_mesh* mesh)
+{
+    const char* p = begin;
+    std::vector<PlyElement> elements;
+    bool binary = false;
+    bool swapBytes = false;
+    bool headerEnded = false;
+    int vertexCount = -1;
+
+    if (end - p < 3 || strncmp(p, "ply", 3) != 0)
+    {
+        return E_FAIL;
+    }
+    p = SkipLine(p, end);
+
+    while (p < end && !headerEnded)
+    {
+        const char* lineEnd = SkipLine(p, end);
+
+        std::istringstream line(std::string(p, lineEnd));
+        std::string keyword;
+        line >> keyword;
+
+        if (keyword == "format")
+        {
+            std::string format;
+            line >> format;
+
+            binary = format == "binary_little_endian" || format == "binary_big_endian";
+            swapBytes = format == "binary_big_endian";
+        }
+        else if (keyword == "element")
+        {
+            PlyElement element;
+            if (!(line >> element.name >> element.count) || element.count < 0)
+            {
+                return E_FAIL;
+            }
+
+            // faces are checked against the vertex count before any is added
+            if (element.name == "vertex")
+            {
+                if (vertexCount >= 0)
+                {
+                    return E_FAIL;
+                }
+                vertexCount = element.count;
+            }
+            elements.push_back(element);
+        }
+        else if (keyword == "property" && !elements.empty())
+        {
+            PlyProperty property;
+            std::string type;
+            line >> type;
+
+            property.isList = type == "list";
+            property.countType = PlyInvalid;
+
+            if (property.isList)
+            {
+                std::string countType;
+                line >> countType >> type;
+                property.countType = ParsePlyType(countType);
+            }
+
+            property.type = ParsePlyType(type);
+            line >> property.name;
+
+            if (property.type == PlyInvalid || (property.isList && property.countType == PlyInvalid))
+            {
+                return E_FAIL;
+            }
+
+            elements.back().properties.push_back(property);
+        }
+        else if (keyword == "end_header")
+        {
+            headerEnded = true;
+        }
+
+        p = lineEnd;
+    }
+
+    // ASCII PLY is not supported, only the binary encodings
+    if (!binary)
+    {
+        return HRESULT_FROM_WIN32(ERROR_NOT_SUPPORTED);
+    }
+
+    if (!headerEnded)
+    {
+        return E_FAIL;
+    }
+
+    for (size_t e = 0; e < elements.size(); e++)
+    {
+        const PlyElement& element = elements[e];
+
+        // every record takes at least one byte, so no count can exceed the bytes left.
+        // checked before the count sizes anything
+        const size_t minRecordSize = std::max<size_t>(PlyMinRecordSize(element), 1);
+        if (static_cast<size_t>(end - p) / minRecordSize < static_cast<size_t>(element.count))
+        {
+            return E_FAIL;
+        }
+
+        if (element.name == "vertex")
+        {
+            // vertex records have a fixed stride, locate x, y and z inside them
+            int stride = 0;
+            int offsets[3] = { -1, -1, -1 };
+            PlyType types[3] = { PlyInvalid, PlyInvalid, PlyInvalid };
+
+            for (size_t i = 0; i < element.properties.size(); i++)
+            {
+                const PlyProperty& property = element.properties[i];
+                if (property.isList)
+                {
+                    return E_FAIL;
+                }
+
+                int axis = property.name == "x" ? 0 : property.name == "y" ? 1 : property.name == "z" ? 2 : -1;
+                if (axis >= 0)
+                {
+                    offsets[axis] = stride;
+                    types[axis] = property.type;
+                }
+
+                stride += PlyTypeSize(property.type);
+            }
+
+            if (offsets[0] < 0 || offsets[1] < 0 || offsets[2] < 0)
+            {
+                return E_FAIL;
+            }
+
+            mesh->x.resize(element.count);
+            mesh->y.resize(element.count);
+            mesh->z.resize(element.count);
+
+            const char* data = p;
+            const int blockSize = 65536;
+            const int blockCount = (element.count + blockSize - 1) / blockSize;
+
+            Concurrency::parallel_for(0, blockCount, [&](int block)
+            {
+                const int last = std::min(element.count, (block + 1) * blockSize);
+                for (int i = block * blockSize; i < last; i++)
+                {
+                    const char* record = data + static_cast<size_t>(i) * stride;
+                    mesh->x[i] = static_cast<float>(ReadPlyValue(record + offsets[0], types[0], swapBytes));
+                    mesh->y[i] = static_cast<float>(ReadPlyValue(record + offsets[1], types[1], swapBytes));
+                    mesh->z[i] = static_cast<float>(ReadPlyValue(record + offsets[2], types[2], swapBytes));
+                }
+            });
+
+            p += static_cast<size_t>(element.count) * stride;
+        }
+        else if (element.name == "face")
+        {
+            mesh->indices.reserve(static_cast<size_t>(element.count) * 3);
+
+            std::vector<int> polygon;
+            for (int f = 0; f < element.count; f++)
+            {
+                const char* record = p;
+                p = SkipPlyRecord(p, end, element, swapBytes);
+                if (p == nullptr)
+                {
+                    return E_FAIL;
+                }
+
+                for (size_t i = 0; i < element.properties.size(); i++)
+                {
+                    const PlyProperty& property = element.properties[i];
+
+                    if (!property.isList)
+                    {
+                        record += PlyTypeSize(property.type);
+                        continue;
+                    }
+
+                    // SkipPlyRecord has checked that the count is not negative and fits the data
+                    const size_t count = static_cast<size_t>(ReadPlyValue(record, property.countType, swapBytes));
+                    record += PlyTypeSize(property.countType);
+
+                    if (property.name == "vertex_indices" || property.name == "vertex_index")
+                    {
+                        polygon.resize(count);
+                        for (size_t k = 0; k < count; k++)
+                        {
+                            const double index = ReadPlyValue(record + k * PlyTypeSize(property.type), property.type, swapBytes);
+                            if (!(index >= 0.0 && index < vertexCount))
+                            {
+                                return E_FAIL;
+                            }
+                            polygon[k] = static_cast<int>(index);
+                        }
+
+                        for (size_t k = 2; k < count; k++)
+                        {
+                            mesh->indices.push_back(polygon[0]);
+                            mesh->indices.push_back(polygon[k - 1]);
+                            mesh->indices.push_back(polygon[k]);
+                        }
+                    }
+
+                    record += count * PlyTypeSize(property.type);
+                }
+            }
+        }
+        else
+        {
+            for (int i = 0; i < element.count && p != nullptr; i++)
+            {
+                p = SkipPlyRecord(p, end, element, swapBytes);
+            }
+
+            if (p == nullptr)
+            {
+                return E_FAIL;
+            }
+        }
+    }
+
+    return S_OK;
+}
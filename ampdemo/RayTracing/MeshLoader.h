@@ -0,0 +1,20 @@
+#pragma once
+
+#include "geometry.h"
+
+// Streaming loader for triangle meshes in Wavefront OBJ and binary PLY format.
+//
+// The file is memory-mapped and parsed in place. OBJ text is cut into chunks at line
+// boundaries that are parsed in parallel, then the per-chunk vertex and face lists are
+// concatenated and relative (negative) indices are resolved. Binary PLY vertices are
+// converted in parallel, faces are walked in one pass since their records may differ
+// in length. Polygons are triangulated as fans.
+class MeshLoader
+{
+public:
+    // Picks the format from the file extension.
+    static HRESULT Load(const std::wstring& path, triangle_mesh* mesh);
+
+    static HRESULT LoadObj(const char* begin, const char* end, triangle_mesh* mesh);
+    static HRESULT LoadPly(const char* begin, const char* end, triangle_mesh* mesh);
+};
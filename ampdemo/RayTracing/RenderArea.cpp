@@ -1,6 +1,7 @@
 #include "stdafx.h"
 #include "RenderArea.h"
 #include "render.h"
+#include "MeshLoader.h"
 #include <sstream>
 
 RenderAreaMessageHandler::RenderAreaMessageHandler(void) 
@@ -16,7 +17,21 @@ RenderAreaMessageHandler::RenderAreaMessageHandler(void)
     m_lasttheta(0.0f), 
     m_eyedist(60.0f), 
     m_mousepressed(false),
-    m_useDouble(false)
+    m_useDouble(false),
+    m_pixelOrder(pixel_order_row_major),
+    m_bvhMethod(bvh_build_sah),
+    m_cpuPacketSize(0),
+    m_useWavefront(false),
+    m_samplingMode(sampling_single),
+    m_useReprojection(false),
+    m_gbufferView(0),
+    m_useDenoiser(false),
+    m_meshLoadTime(0.0),
+    m_renderedPhi(-270.0f),
+    m_renderedTheta(-85.0f),
+    m_renderedEyedist(60.0f),
+    m_recordingPath(false),
+    m_cameraPathSaved(false)
 {
 }
 
@@ -98,11 +113,24 @@ HRESULT RenderAreaMessageHandler::OnRender()
 
     if (SUCCEEDED(hr))
     {
-        const unsigned int width = rect.right;
-        const unsigned int height = rect.bottom;
+        //the camera moved since the last frame, render at the scale of the frame time controller
+        const bool moving = m_phi != m_renderedPhi || m_theta != m_renderedTheta || m_eyedist != m_renderedEyedist;
+        const float scale = m_dynamicResolution.next_scale(moving);
+
+        m_renderedPhi = m_phi;
+        m_renderedTheta = m_theta;
+        m_renderedEyedist = m_eyedist;
+
+        const unsigned int clientWidth = rect.right;
+        const unsigned int clientHeight = rect.bottom;
+        const unsigned int width = dynamic_resolution::scaled_size(clientWidth, scale);
+        const unsigned int height = dynamic_resolution::scaled_size(clientHeight, scale);
 
         int aa_factor = 1;
 
+        //pixels per pixel of the renderers' 640 pixel frame, so the view stays the same
+        const float resolution = aa_factor * scale;
+
         std::vector<unsigned int> data(width * height * aa_factor * aa_factor);
 
         array_view<unsigned int, 2> arrayview(height * aa_factor, width * aa_factor, data);
@@ -112,18 +140,153 @@ HRESULT RenderAreaMessageHandler::OnRender()
         QueryPerformanceFrequency(&frequency);
         QueryPerformanceCounter(&before);
 
-        render_reflection<float>(arrayview, m_phi, m_theta, m_eyedist, aa_factor);
+        cpu_render_stats cpu_stats = {};
+
+        if (m_gbufferView != 0)
+        {
+            RenderGbufferView(arrayview, resolution);
+
+            arrayview.synchronize();
+        }
+        else if (m_useDenoiser)
+        {
+            m_gbuffer.render<atrous_denoiser<float>::inputs>(width * aa_factor, height * aa_factor, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+            m_denoiser.denoise(m_gbuffer, arrayview, m_pixelOrder);
+
+            arrayview.synchronize();
+        }
+        else if (m_samplingMode == sampling_progressive)
+        {
+            m_progressive.render(arrayview, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+
+            arrayview.synchronize();
+        }
+        else if (m_samplingMode == sampling_adaptive)
+        {
+            m_adaptive.render(arrayview, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution);
 
-        arrayview.synchronize();
+            arrayview.synchronize();
+        }
+        else if (m_useReprojection)
+        {
+            m_reprojection.render(arrayview, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution);
+
+            arrayview.synchronize();
+        }
+        else if (m_cpuPacketSize > 0)
+        {
+            cpu_stats = render_reflection_cpu<float>(data, width * aa_factor, height * aa_factor, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_cpuPacketSize);
+        }
+        else if (m_useWavefront)
+        {
+            m_wavefront.render(arrayview, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution);
+
+            arrayview.synchronize();
+        }
+        else
+        {
+            render_reflection<float>(arrayview, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+
+            arrayview.synchronize();
+        }
 
         QueryPerformanceCounter(&after);
 
         double millisecond = (after.QuadPart - before.QuadPart) * 1000.0 / frequency.QuadPart; 
 
+        m_dynamicResolution.frame_rendered(millisecond, scale);
+
         std::wstringstream msg;
         msg << L"Ray Tracing Viewer: last frame render time ";
         msg << millisecond;
         msg << " ms";
+        if (scale < 1.0f)
+        {
+            msg << L", dynamic resolution " << width << L"x" << height;
+        }
+        else if (!m_dynamicResolution.get_enabled())
+        {
+            msg << L", dynamic resolution off";
+        }
+        if (m_gbufferView != 0)
+        {
+            static const wchar_t* const gbuffer_names[] = { L"depth", L"normal", L"material", L"albedo", L"color", L"motion" };
+            for (int i = 0; i < 6; i++)
+            {
+                if (m_gbufferView == 1 << i)
+                {
+                    msg << L", G-buffer " << gbuffer_names[i];
+                }
+            }
+        }
+        else if (m_useDenoiser)
+        {
+            msg << L", denoised " << m_gbuffer.get_color_samples() << L" spp, filter " << m_denoiser.last_denoise_ms() << L" ms";
+        }
+        else if (m_samplingMode == sampling_progressive)
+        {
+            msg << L", progressive " << m_progressive.samples() << L" samples";
+        }
+        else if (m_samplingMode == sampling_adaptive)
+        {
+            msg << L", adaptive " << m_adaptive.last_frame_samples() << L" of " << m_adaptive.get_sample_budget() << L" samples";
+            msg << L", " << m_adaptive.noisy_tiles() << L" noisy tiles";
+        }
+        else if (m_useReprojection)
+        {
+            const reprojection_stats& stats = m_reprojection.last_frame_stats();
+            msg << L", reprojection traced " << stats.traced << L" of " << stats.pixels << L" pixels (";
+            msg << stats.disoccluded << L" disoccluded, " << stats.failed << L" failed, " << stats.refreshed << L" refreshed)";
+        }
+        else if (m_cpuPacketSize > 0)
+        {
+            msg << L", CPU ";
+            if (m_cpuPacketSize > 1)
+            {
+                msg << m_cpuPacketSize << L"-ray packets";
+            }
+            else
+            {
+                msg << L"single rays";
+            }
+            msg << L", primary rays " << cpu_stats.rays_per_second() / 1e6 << L" Mrays/s";
+        }
+        else if (m_useWavefront)
+        {
+            // rays and hits per checker and phong material of every bounce
+            msg << L", wavefront queues";
+            const std::vector<wavefront_bounce_stats>& bounces = m_wavefront.bounce_stats();
+            for (size_t i = 0; i < bounces.size(); i++)
+            {
+                msg << (i == 0 ? L" " : L" | ") << bounces[i].rays << L" rays " << bounces[i].material_hits[0] << L"/" << bounces[i].material_hits[1] << L" hits";
+            }
+        }
+        else
+        {
+            msg << (m_pixelOrder == pixel_order_morton ? L", Morton order" : L", row-major order");
+        }
+
+        static const wchar_t* const builder_names[] = { L"median", L"SAH", L"LBVH" };
+
+        const bvh_build_stats& stats = m_scene.build_stats();
+        msg << L", " << builder_names[m_bvhMethod] << L" BVH " << stats.node_count << L" nodes, SAH cost " << stats.sah_cost;
+        msg << L", built in " << stats.build_ms << L" ms";
+
+        msg << L", " << m_lights.light_count() << (m_lights.light_count() == 1 ? L" light" : L" lights");
+
+        if (m_recordingPath)
+        {
+            msg << L", recording camera path " << m_cameraPath.size() << L" views";
+        }
+        else if (m_cameraPathSaved)
+        {
+            msg << L", camera path of " << m_cameraPath.size() << L" views saved to camera_path.rtcp";
+        }
+
+        if (m_scene.triangle_primitive_count() > 0)
+        {
+            msg << L", " << m_scene.triangle_primitive_count() << L" triangles loaded in " << m_meshLoadTime << L" ms";
+        }
 
         HWND hParent;
         hr = window->GetParentWindowHandle(&hParent);
@@ -150,11 +313,22 @@ HRESULT RenderAreaMessageHandler::OnRender()
             m_renderTarget->BeginDraw();
             m_renderTarget->Clear();
 
+            //frames of reduced resolution are stretched to the window with bilinear filtering
             m_renderTarget->DrawBitmap(bitmap, 
-                D2D1::RectF(0.0, 0.0, static_cast<float>(width), static_cast<float>(height)));
+                D2D1::RectF(0.0, 0.0, static_cast<float>(clientWidth), static_cast<float>(clientHeight)),
+                1.0f,
+                D2D1_BITMAP_INTERPOLATION_MODE_LINEAR);
 
             m_renderTarget->EndDraw();
         }
+
+        // keep refining while the camera rests, input messages are still handled in between.
+        // a frame of reduced resolution is followed by a full one once the camera stops
+        if (SUCCEEDED(hr) && (scale < 1.0f || (m_samplingMode == sampling_progressive && m_progressive.samples() < progressive_max_samples) ||
+            (m_samplingMode == sampling_adaptive && !m_adaptive.converged())))
+        {
+            hr = window->RedrawWindow();
+        }
     }
     return hr;
 }
@@ -219,6 +393,7 @@ HRESULT RenderAreaMessageHandler::OnMouseMove(D2D1_POINT_2F mousePosition)
 
         m_phi = m_lastphi - dx / (3.55f);
         m_theta = m_lasttheta - dy / (3.55f);
+        RecordCameraView();
 
         ComPtr<IWindow> window;
         hr = GetWindow(&window);
@@ -246,6 +421,7 @@ HRESULT RenderAreaMessageHandler::OnMouseWheel(D2D1_POINT_2F mousePosition, shor
     {
         m_eyedist /= 1.1f;
     }
+    RecordCameraView();
 
     ComPtr<IWindow> window;
     HRESULT hr = GetWindow(&window);
@@ -260,7 +436,232 @@ HRESULT RenderAreaMessageHandler::OnMouseWheel(D2D1_POINT_2F mousePosition, shor
 
 HRESULT RenderAreaMessageHandler::OnKeyDown(unsigned int vKey)
 {
-    return S_OK;
+    HRESULT hr = S_OK;
+
+    if (vKey == 'Z')
+    {
+        //switch between row-major and Morton order pixel traversal
+        m_pixelOrder = (m_pixelOrder == pixel_order_morton) ? pixel_order_row_major : pixel_order_morton;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'P')
+    {
+        //cycle between the amp renderer and the CPU renderer with single rays or 4, 8 and 16-ray packets
+        static const int packet_sizes[] = { 0, 1, 4, 8, 16 };
+        const int count = sizeof(packet_sizes) / sizeof(packet_sizes[0]);
+
+        int next = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (packet_sizes[i] == m_cpuPacketSize)
+            {
+                next = (i + 1) % count;
+            }
+        }
+        m_cpuPacketSize = packet_sizes[next];
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'W')
+    {
+        //switch between the single kernel and the wavefront amp renderer
+        m_useWavefront = !m_useWavefront;
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'T')
+    {
+        //switch temporal reprojection of the last frame on or off
+        m_useReprojection = !m_useReprojection;
+        m_reprojection.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'G')
+    {
+        //cycle through the debug views of the G-buffer outputs and back to the renderers
+        m_gbufferView = m_gbufferView == 0 ? gbuffer_depth : (m_gbufferView << 1) & gbuffer_all;
+        m_gbuffer.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'N')
+    {
+        //switch the a-trous denoiser over single light samples on or off
+        m_useDenoiser = !m_useDenoiser;
+        m_gbuffer.reset();
+        m_denoiser.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'A')
+    {
+        //cycle between single samples, progressive accumulation and adaptive sampling
+        m_samplingMode = (m_samplingMode + 1) % sampling_mode_count;
+        m_progressive.reset();
+        m_adaptive.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'H' || vKey == VK_OEM_PLUS || vKey == VK_OEM_MINUS)
+    {
+        //sample count heatmap and sample budget of adaptive sampling
+        if (vKey == 'H')
+        {
+            m_adaptive.set_heatmap(!m_adaptive.get_heatmap());
+        }
+        else
+        {
+            m_adaptive.set_sample_budget(vKey == VK_OEM_PLUS ? m_adaptive.get_sample_budget() * 2 : m_adaptive.get_sample_budget() / 2);
+        }
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'R')
+    {
+        //start recording the camera path, or stop and save it for raytracing_bench --replay
+        if (!m_recordingPath)
+        {
+            m_cameraPath.clear();
+            m_recordingPath = true;
+            QueryPerformanceCounter(&m_recordStart);
+            RecordCameraView();
+        }
+        else
+        {
+            m_recordingPath = false;
+            m_cameraPathSaved = m_cameraPath.save("camera_path.rtcp");
+            if (!m_cameraPathSaved)
+            {
+                hr = E_FAIL;
+            }
+        }
+
+        ComPtr<IWindow> window;
+        HRESULT hrWindow = GetWindow(&window);
+
+        if (SUCCEEDED(hrWindow))
+        {
+            hrWindow = window->RedrawWindow();
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            hr = hrWindow;
+        }
+    }
+    else if (vKey == 'L')
+    {
+        //cycle between the single default light and fields of many lights
+        static const int light_counts[] = { 1, 64, 4096 };
+        const int count = sizeof(light_counts) / sizeof(light_counts[0]);
+
+        int next = 0;
+        for (int i = 0; i < count; i++)
+        {
+            if (light_counts[i] == m_lights.light_count())
+            {
+                next = (i + 1) % count;
+            }
+        }
+        SetLightCount(light_counts[next]);
+        m_progressive.reset();
+        m_adaptive.reset();
+        m_reprojection.reset();
+        m_gbuffer.reset();
+        m_denoiser.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'D')
+    {
+        //switch dynamic resolution while the camera moves on or off
+        m_dynamicResolution.set_enabled(!m_dynamicResolution.get_enabled());
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+    else if (vKey == 'B')
+    {
+        //rebuild the scene with the next BVH builder to compare build time and frame time
+        m_bvhMethod = (m_bvhMethod + 1) % bvh_build_method_count;
+        m_scene.build(m_bvhMethod);
+        m_progressive.reset();
+        m_adaptive.reset();
+        m_reprojection.reset();
+        m_gbuffer.reset();
+        m_denoiser.reset();
+
+        ComPtr<IWindow> window;
+        hr = GetWindow(&window);
+
+        if (SUCCEEDED(hr))
+        {
+            hr = window->RedrawWindow();
+        }
+    }
+
+    return hr;
 }
 
 HRESULT RenderAreaMessageHandler::Initialize()
@@ -269,5 +670,108 @@ HRESULT RenderAreaMessageHandler::Initialize()
 
     HRESULT hr = Direct2DUtility::GetD2DFactory(&m_d2dFactory);
 
+    if (SUCCEEDED(hr))
+    {
+        LoadMeshFromCommandLine();
+    }
+
     return hr;
+}
+
+// Replaces the spheres of the default scene with the OBJ or PLY mesh named on the
+// command line. A mesh that fails to load leaves the default scene in place.
+void RenderAreaMessageHandler::LoadMeshFromCommandLine()
+{
+    int argc = 0;
+    LPWSTR* argv = ::CommandLineToArgvW(::GetCommandLineW(), &argc);
+
+    if (argv == nullptr)
+    {
+        return;
+    }
+
+    if (argc > 1)
+    {
+        LARGE_INTEGER frequency, before, after;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&before);
+
+        triangle_mesh mesh;
+        if (SUCCEEDED(MeshLoader::Load(argv[1], &mesh)) && mesh.triangle_count() > 0)
+        {
+            QueryPerformanceCounter(&after);
+            m_meshLoadTime = (after.QuadPart - before.QuadPart) * 1000.0 / frequency.QuadPart;
+
+            m_scene.clear();
+            m_scene.add_plane(vector3<float>(0.0f, 1.0f, 0.0f), 0.0f, 2);
+            m_scene.add_mesh(mesh, 1, vector3<float>(0.0f, 0.0f, -10.0f), 30.0f);
+            m_scene.build(m_bvhMethod);
+        }
+    }
+
+    ::LocalFree(argv);
+}
+
+// Replaces the lights with count point lights. A single light is the default one, more
+// lights are scattered above the scene and share three times its power.
+void RenderAreaMessageHandler::SetLightCount(int count)
+{
+    m_lights.clear();
+
+    if (count == 1)
+    {
+        m_lights.add_point_light(vector3<float>(20, 30, 10), color<float>::white() * 1000.0f);
+    }
+    else
+    {
+        add_scattered_lights(m_lights, count, vector3<float>(-50.0f, 10.0f, -60.0f), vector3<float>(50.0f, 40.0f, 20.0f), 3000.0f);
+    }
+
+    m_lights.build();
+}
+
+// Writes the G-buffer debug view of m_gbufferView to result. Only the output on show is
+// written, each one is a render() of its own.
+void RenderAreaMessageHandler::RenderGbufferView(const Concurrency::array_view<unsigned int, 2>& result, float resolution)
+{
+    const int width = result.extent[1];
+    const int height = result.extent[0];
+
+    switch (m_gbufferView)
+    {
+    case gbuffer_depth:
+        m_gbuffer.render<gbuffer_depth>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    case gbuffer_normal:
+        m_gbuffer.render<gbuffer_normal>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    case gbuffer_material:
+        m_gbuffer.render<gbuffer_material>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    case gbuffer_albedo:
+        m_gbuffer.render<gbuffer_albedo>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    case gbuffer_color:
+        m_gbuffer.render<gbuffer_color>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    case gbuffer_motion:
+        m_gbuffer.render<gbuffer_motion>(width, height, m_scene.storage(), m_lights.storage(), m_phi, m_theta, m_eyedist, resolution, m_pixelOrder);
+        break;
+    }
+
+    m_gbuffer.show(result, m_gbufferView, 2.0f * m_eyedist, 16.0f, m_pixelOrder);
+}
+
+// Appends the current view to the camera path while recording.
+void RenderAreaMessageHandler::RecordCameraView()
+{
+    if (m_recordingPath)
+    {
+        LARGE_INTEGER frequency, now;
+        QueryPerformanceFrequency(&frequency);
+        QueryPerformanceCounter(&now);
+
+        float time = static_cast<float>((now.QuadPart - m_recordStart.QuadPart) * 1000.0 / frequency.QuadPart);
+        m_cameraPath.add(time, m_phi, m_theta, m_eyedist);
+    }
 }
\ No newline at end of file
@@ -4,8 +4,22 @@
 #include "WindowLayout.h"
 #include "WindowLayoutChildInterface.h"
 #include "WindowMessageHandlerImpl.h"
+#include "wavefront.h"
+#include "adaptive.h"
+#include "reprojection.h"
+#include "denoise.h"
+#include "camera_path.h"
+#include "dynamic_resolution.h"
 
 
+enum sampling_mode
+{
+    sampling_single,
+    sampling_progressive,
+    sampling_adaptive,
+    sampling_mode_count
+};
+
 class RenderAreaMessageHandler : 
     public IInitializable,
     public Hilo::WindowApiHelpers::WindowMessageHandler
@@ -39,6 +53,11 @@ protected:
     }
 
 private:
+    void LoadMeshFromCommandLine();
+    void SetLightCount(int count);
+    void RecordCameraView();
+    void RenderGbufferView(const Concurrency::array_view<unsigned int, 2>& result, float resolution);
+
     ComPtr<ID2D1Factory> m_d2dFactory;
     ComPtr<ID2D1HwndRenderTarget> m_renderTarget;
     HANDLE m_pDepthStreamHandle;
@@ -50,6 +69,36 @@ private:
     HANDLE m_hEvNuiProcessStop;
 
     bool m_useDouble;
+    scene_data<float> m_scene;
+    light_data<float> m_lights;
+    int m_pixelOrder;
+    int m_bvhMethod;
+    // 0 renders with amp, otherwise on the CPU with packets of this many rays
+    int m_cpuPacketSize;
+    bool m_useWavefront;
+    wavefront_renderer<float> m_wavefront;
+    int m_samplingMode;
+    progressive_renderer<float> m_progressive;
+    adaptive_renderer<float> m_adaptive;
+    bool m_useReprojection;
+    reprojection_renderer<float> m_reprojection;
+    int m_gbufferView;
+    gbuffer<float> m_gbuffer;
+    bool m_useDenoiser;
+    atrous_denoiser<float> m_denoiser;
+    double m_meshLoadTime;
+
+    //reduced internal resolution while the camera moves
+    dynamic_resolution m_dynamicResolution;
+    float m_renderedPhi;
+    float m_renderedTheta;
+    float m_renderedEyedist;
+
+    //camera path recording for replay in the headless benchmark
+    camera_path m_cameraPath;
+    bool m_recordingPath;
+    bool m_cameraPathSaved;
+    LARGE_INTEGER m_recordStart;
 
     //mouse control
     float m_phi;
@@ -0,0 +1,327 @@
+#pragma once
+
+#include "progressive.h"
+
+// Adaptive sampling for a camera at rest. Like the progressive renderer it
+// accumulates jittered samples across frames, but after a few uniform frames the
+// samples go where the image is still noisy. Every pixel tracks the mean and variance
+// of its (clamped) luminance, every 8 x 8 tile takes the largest standard error of its
+// pixels, relative to their brightness, and the per-frame sample budget is split
+// between the tiles above the error threshold in proportion to their error. Tiles
+// below the threshold stop sampling, and the image is done when no tile is left.
+
+enum
+{
+	adaptive_tile_size = 8,
+	// uniform samples per pixel before the variance estimates are trusted
+	adaptive_min_samples = 4,
+	adaptive_max_samples = progressive_max_samples,
+	// most samples a pixel takes in one frame, bounds the frame time
+	adaptive_max_frame_samples = 16
+};
+
+enum adaptive_value
+{
+	adaptive_sum_r,
+	adaptive_sum_g,
+	adaptive_sum_b,
+	adaptive_sum_luminance,
+	adaptive_sum_luminance_squared,
+	adaptive_value_count
+};
+
+// Blue to red ramp over [0, 1].
+template <typename fp_t>
+color<fp_t> heat_color(fp_t t) restrict(amp)
+{
+	using namespace Concurrency;
+
+	return color<fp_t>(
+		direct3d::saturate(fast_math::fmin(4.0f * t - 1.5f, 4.5f - 4.0f * t)),
+		direct3d::saturate(fast_math::fmin(4.0f * t - 0.5f, 3.5f - 4.0f * t)),
+		direct3d::saturate(fast_math::fmin(4.0f * t + 0.5f, 2.5f - 4.0f * t)));
+}
+
+template <typename fp_t>
+class adaptive_renderer
+{
+public:
+	adaptive_renderer() : sample_budget(640 * 640), error_threshold(0.01f), show_heatmap(false), frame(0), frame_samples(0), active_tiles(0), phi(0), theta(0), eyedist(0) {}
+
+	// Samples the noisy tiles within the budget and writes the tone-mapped averages, or
+	// the sample count heatmap, to result. aa_factor scales the image as in render_reflection.
+	void render(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor = 1.0f)
+	{
+		using namespace Concurrency;
+
+		const int width = result.extent[1];
+		const int height = result.extent[0];
+		const int pixels = width * height;
+		const int tiles_x = (width + adaptive_tile_size - 1) / adaptive_tile_size;
+		const int tiles_y = (height + adaptive_tile_size - 1) / adaptive_tile_size;
+
+		if (!sums || sums->extent[0] != adaptive_value_count * pixels || phi != this->phi || theta != this->theta || eyedist != this->eyedist)
+		{
+			this->phi = phi;
+			this->theta = theta;
+			this->eyedist = eyedist;
+			frame = 0;
+
+			reset();
+			sum_data.resize(adaptive_value_count * pixels);
+			count_data.resize(pixels);
+			tile_error_data.resize(tiles_x * tiles_y);
+			tile_samples_data.resize(tiles_x * tiles_y);
+
+			sums.reset(new array_view<fp_t, 1>(static_cast<int>(sum_data.size()), sum_data));
+			counts.reset(new array_view<int, 1>(static_cast<int>(count_data.size()), count_data));
+			sums->discard_data();
+			counts->discard_data();
+		}
+
+		array_view<fp_t, 1> sum(*sums);
+		array_view<int, 1> count(*counts);
+
+		if (frame < adaptive_min_samples)
+		{
+			std::fill(tile_samples_data.begin(), tile_samples_data.end(), 1);
+			active_tiles = tiles_x * tiles_y;
+		}
+		else
+		{
+			estimate_errors(sum, count, width, height, tiles_x, tiles_y);
+			allocate_samples(width, height, tiles_x, tiles_y);
+		}
+
+		frame_samples = 0;
+		for (int t = 0; t < tiles_x * tiles_y; t++)
+		{
+			frame_samples += tile_samples_data[t] * tile_pixel_count(t, width, height, tiles_x);
+		}
+
+		array_view<const int, 1> tile_samples(static_cast<int>(tile_samples_data.size()), tile_samples_data);
+
+		perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+		material_storage<fp_t> materials;
+
+		const fp_t edge = 640 * aa_factor;
+		const int xshift = static_cast<int>((width - edge) / 2);
+		const int yshift = static_cast<int>((height - edge) / 2);
+		const bool first = frame == 0;
+		const bool heatmap = show_heatmap;
+
+		parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+		{
+			const int x = idx[1];
+			const int y = idx[0];
+			const int i = y * width + x;
+
+			fp_t s[adaptive_value_count];
+			for (int k = 0; k < adaptive_value_count; k++)
+			{
+				s[k] = first ? 0.0f : sum[k * pixels + i];
+			}
+			int n = first ? 0 : count[i];
+
+			const int samples = direct3d::imin(tile_samples[(y / adaptive_tile_size) * tiles_x + x / adaptive_tile_size], adaptive_max_samples - n);
+
+			for (int k = 0; k < samples; k++, n++)
+			{
+				const sample_random random(static_cast<unsigned int>(i), static_cast<unsigned int>(n));
+
+				fp_t jitter_x = 0.0f;
+				fp_t jitter_y = 0.0f;
+				if (n > 0)
+				{
+					jitter_x = random.uniform(dimension_jitter_x) - 0.5f;
+					jitter_y = random.uniform(dimension_jitter_y) - 0.5f;
+				}
+
+				fp_t sy = 1.0f - (static_cast<fp_t>(y - yshift) + jitter_y) / edge;
+				fp_t sx = (static_cast<fp_t>(x - xshift) + jitter_x) / edge;
+
+				color<fp_t> c(reflection(camera.generate_ray(sx, sy), scene, materials, lights, 3, random));
+				fp_t luminance = 0.2126f * direct3d::saturate(c.r) + 0.7152f * direct3d::saturate(c.g) + 0.0722f * direct3d::saturate(c.b);
+
+				s[adaptive_sum_r] += c.r;
+				s[adaptive_sum_g] += c.g;
+				s[adaptive_sum_b] += c.b;
+				s[adaptive_sum_luminance] += luminance;
+				s[adaptive_sum_luminance_squared] += luminance * luminance;
+			}
+
+			for (int k = 0; k < adaptive_value_count; k++)
+			{
+				sum[k * pixels + i] = s[k];
+			}
+			count[i] = n;
+
+			if (heatmap)
+			{
+				fp_t t = fast_math::log2(static_cast<float>(n)) / fast_math::log2(static_cast<float>(adaptive_max_samples));
+				result[idx] = tone_map(heat_color(t));
+			}
+			else
+			{
+				result[idx] = tone_map(color<fp_t>(s[adaptive_sum_r], s[adaptive_sum_g], s[adaptive_sum_b]) * (1.0f / direct3d::imax(n, 1)));
+			}
+		});
+
+		frame++;
+	}
+
+	// starts over, for example after the scene changed
+	void reset()
+	{
+		if (sums)
+		{
+			sums->discard_data();
+			counts->discard_data();
+			sums.reset();
+			counts.reset();
+		}
+		frame = 0;
+		active_tiles = 0;
+	}
+
+	// total samples of all pixels per frame
+	void set_sample_budget(int samples)
+	{
+		sample_budget = std::max(samples, 1);
+	}
+
+	int get_sample_budget() const
+	{
+		return sample_budget;
+	}
+
+	// tiles whose relative standard error is below this take no more samples
+	void set_error_threshold(fp_t threshold)
+	{
+		error_threshold = threshold;
+	}
+
+	// shows log2 of the samples per pixel instead of the image
+	void set_heatmap(bool heatmap)
+	{
+		show_heatmap = heatmap;
+	}
+
+	bool get_heatmap() const
+	{
+		return show_heatmap;
+	}
+
+	bool converged() const
+	{
+		return frame >= adaptive_min_samples && active_tiles == 0;
+	}
+
+	// samples taken by the last frame
+	int last_frame_samples() const
+	{
+		return frame_samples;
+	}
+
+	int noisy_tiles() const
+	{
+		return active_tiles;
+	}
+
+private:
+	static int tile_pixel_count(int tile, int width, int height, int tiles_x)
+	{
+		const int x = (tile % tiles_x) * adaptive_tile_size;
+		const int y = (tile / tiles_x) * adaptive_tile_size;
+
+		return std::min(static_cast<int>(adaptive_tile_size), width - x) * std::min(static_cast<int>(adaptive_tile_size), height - y);
+	}
+
+	// largest relative standard error of the pixels of every tile, done pixels count as 0
+	void estimate_errors(const Concurrency::array_view<fp_t, 1>& sum, const Concurrency::array_view<int, 1>& count, int width, int height, int tiles_x, int tiles_y)
+	{
+		using namespace Concurrency;
+
+		const int pixels = width * height;
+		array_view<float, 1> tile_error(static_cast<int>(tile_error_data.size()), tile_error_data);
+		tile_error.discard_data();
+
+		parallel_for_each(extent<1>(tiles_x * tiles_y), [=](index<1> idx) restrict(amp)
+		{
+			const int x0 = (idx[0] % tiles_x) * adaptive_tile_size;
+			const int y0 = (idx[0] / tiles_x) * adaptive_tile_size;
+
+			float error = 0.0f;
+
+			for (int y = y0; y < direct3d::imin(y0 + adaptive_tile_size, height); y++)
+			{
+				for (int x = x0; x < direct3d::imin(x0 + adaptive_tile_size, width); x++)
+				{
+					const int i = y * width + x;
+					const int n = count[i];
+
+					if (n < adaptive_max_samples)
+					{
+						fp_t mean = sum[adaptive_sum_luminance * pixels + i] / n;
+						fp_t variance = fast_math::fmax((sum[adaptive_sum_luminance_squared * pixels + i] - mean * mean * n) / (n - 1), 0.0f);
+
+						// relative to the brightness, with a floor that keeps dark pixels from dominating
+						fp_t standard_error = fast_math::sqrt(variance / n);
+						error = fast_math::fmax(error, static_cast<float>(standard_error / (mean + 0.1f)));
+					}
+				}
+			}
+
+			tile_error[idx] = error;
+		});
+
+		tile_error.synchronize();
+	}
+
+	// splits the budget between the noisy tiles in proportion to their error
+	void allocate_samples(int width, int height, int tiles_x, int tiles_y)
+	{
+		const int tiles = tiles_x * tiles_y;
+
+		double error_sum = 0.0;
+		active_tiles = 0;
+		for (int t = 0; t < tiles; t++)
+		{
+			if (tile_error_data[t] > error_threshold)
+			{
+				error_sum += tile_error_data[t];
+				active_tiles++;
+			}
+		}
+
+		for (int t = 0; t < tiles; t++)
+		{
+			tile_samples_data[t] = 0;
+
+			if (tile_error_data[t] > error_threshold)
+			{
+				// stochastic rounding keeps the expected total at the budget
+				double share = sample_budget * (tile_error_data[t] / error_sum) / tile_pixel_count(t, width, height, tiles_x);
+				double dither = hash_to_unit(hash_uint(static_cast<unsigned int>(t) ^ hash_uint(static_cast<unsigned int>(frame))));
+
+				tile_samples_data[t] = std::min(static_cast<int>(share + dither), static_cast<int>(adaptive_max_frame_samples));
+			}
+		}
+	}
+
+	int sample_budget;
+	fp_t error_threshold;
+	bool show_heatmap;
+	int frame;
+	int frame_samples;
+	int active_tiles;
+	fp_t phi;
+	fp_t theta;
+	fp_t eyedist;
+	std::vector<fp_t> sum_data;
+	std::vector<int> count_data;
+	std::vector<float> tile_error_data;
+	std::vector<int> tile_samples_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> sums;
+	std::unique_ptr<Concurrency::array_view<int, 1>> counts;
+};
@@ -15,6 +15,7 @@ template<typename fp_t> inline fp_t floor(fp_t x) restrict(cpu) { return ::floor
 template<typename fp_t> inline fp_t fmin(fp_t x, fp_t y) restrict(cpu) { return std::min(x, y); }
 template<typename fp_t> inline fp_t fmax(fp_t x, fp_t y) restrict(cpu) { return std::max(x, y); }
 template<typename fp_t> inline fp_t pow(fp_t x, fp_t y) restrict(cpu) { return ::pow(x, y); }
+template<typename fp_t> inline fp_t exp(fp_t x) restrict(cpu) { return ::exp(x); }
 
 inline float sqrt(float x) restrict(amp) { return Concurrency::fast_math::sqrt(x); }
 inline float rsqrt(float x) restrict(amp) { return Concurrency::fast_math::rsqrt(x); }
@@ -24,6 +25,7 @@ inline float floor(float x) restrict(amp) { return Concurrency::fast_math::floor
 inline float fmin(float x, float y) restrict(amp) { return Concurrency::fast_math::fmin(x, y); }
 inline float fmax(float x, float y) restrict(amp) { return Concurrency::fast_math::fmax(x, y); }
 inline float pow(float x, float y) restrict(amp) { return Concurrency::fast_math::pow(x, y); }
+inline float exp(float x) restrict(amp) { return Concurrency::fast_math::exp(x); }
 
 inline double sqrt(double x) restrict(amp) { return Concurrency::precise_math::sqrt(x); }
 inline double rsqrt(double x) restrict(amp) { return Concurrency::precise_math::rsqrt(x); }
@@ -33,5 +35,6 @@ inline double floor(double x) restrict(amp) { return Concurrency::precise_math::
 inline double fmin(double x, double y) restrict(amp) { return Concurrency::precise_math::fmin(x, y); }
 inline double fmax(double x, double y) restrict(amp) { return Concurrency::precise_math::fmax(x, y); }
 inline double pow(double x, double y) restrict(amp) { return Concurrency::precise_math::pow(x, y); }
+inline double exp(double x) restrict(amp) { return Concurrency::precise_math::exp(x); }
 
 }
\ No newline at end of file
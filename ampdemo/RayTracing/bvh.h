@@ -0,0 +1,901 @@
+#pragma once
+
+#include "raycommon.h"
+#include "morton.h"
+#include <atomic>
+#include <chrono>
+#include <limits>
+#include <ppl.h>
+
+template <typename fp_t>
+fp_t vector_axis(const vector3<fp_t>& v, int axis) restrict(cpu, amp)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
+// Axis aligned bounding box, only used on the CPU while building the hierarchy.
+template <typename fp_t>
+class aabb
+{
+public:
+	vector3<fp_t> lower;
+	vector3<fp_t> upper;
+
+	aabb() restrict(cpu)
+		: lower(std::numeric_limits<fp_t>::max(), std::numeric_limits<fp_t>::max(), std::numeric_limits<fp_t>::max()),
+		upper(-std::numeric_limits<fp_t>::max(), -std::numeric_limits<fp_t>::max(), -std::numeric_limits<fp_t>::max()) {}
+	explicit aabb(const vector3<fp_t>& lower, const vector3<fp_t>& upper) restrict(cpu) : lower(lower), upper(upper) {}
+
+	bool is_empty() const restrict(cpu)
+	{
+		return lower.x > upper.x;
+	}
+
+	void grow(const vector3<fp_t>& p) restrict(cpu)
+	{
+		lower = vector3<fp_t>(std::min(lower.x, p.x), std::min(lower.y, p.y), std::min(lower.z, p.z));
+		upper = vector3<fp_t>(std::max(upper.x, p.x), std::max(upper.y, p.y), std::max(upper.z, p.z));
+	}
+
+	void grow(const aabb& box) restrict(cpu)
+	{
+		if (!box.is_empty())
+		{
+			grow(box.lower);
+			grow(box.upper);
+		}
+	}
+
+	vector3<fp_t> centroid() const restrict(cpu)
+	{
+		return (lower + upper) * 0.5f;
+	}
+
+	fp_t surface_area() const restrict(cpu)
+	{
+		if (is_empty()) return 0.0f;
+
+		vector3<fp_t> e(upper - lower);
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	int largest_axis() const restrict(cpu)
+	{
+		vector3<fp_t> e(upper - lower);
+
+		if (e.x >= e.y && e.x >= e.z) return 0;
+		return e.y >= e.z ? 1 : 2;
+	}
+};
+
+// Flattened BVH node. Interior nodes have count == 0 and their two children stored
+// next to each other at first and first + 1, leaves reference the primitives
+// [first, first + count) of the reordered primitive array.
+template <typename fp_t>
+struct bvh_node
+{
+	fp_t lower_x, lower_y, lower_z;
+	fp_t upper_x, upper_y, upper_z;
+	int first;
+	int count;
+
+	void set_bounds(const aabb<fp_t>& box) restrict(cpu)
+	{
+		lower_x = box.lower.x; lower_y = box.lower.y; lower_z = box.lower.z;
+		upper_x = box.upper.x; upper_y = box.upper.y; upper_z = box.upper.z;
+	}
+
+	aabb<fp_t> bounds() const restrict(cpu)
+	{
+		return aabb<fp_t>(vector3<fp_t>(lower_x, lower_y, lower_z), vector3<fp_t>(upper_x, upper_y, upper_z));
+	}
+
+	// slab test against the ray, only hits closer than t_max are reported
+	bool hit(const vector3<fp_t>& origin, const vector3<fp_t>& inv_dir, fp_t t_max) const restrict(cpu, amp)
+	{
+		fp_t tx0 = (lower_x - origin.x) * inv_dir.x;
+		fp_t tx1 = (upper_x - origin.x) * inv_dir.x;
+		fp_t ty0 = (lower_y - origin.y) * inv_dir.y;
+		fp_t ty1 = (upper_y - origin.y) * inv_dir.y;
+		fp_t tz0 = (lower_z - origin.z) * inv_dir.z;
+		fp_t tz1 = (upper_z - origin.z) * inv_dir.z;
+
+		fp_t t_near = gpu::fmax(gpu::fmax(gpu::fmin(tx0, tx1), gpu::fmin(ty0, ty1)), gpu::fmin(tz0, tz1));
+		fp_t t_far = gpu::fmin(gpu::fmin(gpu::fmax(tx0, tx1), gpu::fmax(ty0, ty1)), gpu::fmax(tz0, tz1));
+
+		return t_near <= t_far && t_far >= 0 && t_near < t_max;
+	}
+};
+
+enum
+{
+	// traversal stack depth, the builders keep the tree shallower than this
+	bvh_stack_size = 64,
+	bvh_max_leaf_size = 4,
+	bvh_sah_bin_count = 16,
+	// ranges with more primitives than this are reduced and built in parallel
+	bvh_parallel_threshold = 4096
+};
+
+// True when the left child lies nearer along direction than the right one. Visiting
+// the nearer child first finds close hits early, and they cull the farther subtree.
+template <typename fp_t>
+bool bvh_left_first(const bvh_node<fp_t>& left, const bvh_node<fp_t>& right, const vector3<fp_t>& direction) restrict(cpu, amp)
+{
+	fp_t order = (right.lower_x + right.upper_x - left.lower_x - left.upper_x) * direction.x
+		+ (right.lower_y + right.upper_y - left.lower_y - left.upper_y) * direction.y
+		+ (right.lower_z + right.upper_z - left.lower_z - left.upper_z) * direction.z;
+
+	return order >= 0;
+}
+
+// Walks the hierarchy with a fixed-size stack and calls pool.intersect_range(first,
+// count, ray, hit) for every leaf whose box is closer than the closest hit so far.
+// Several hierarchies can share one node array, root selects the one to walk.
+template <typename fp_t, typename pool_t>
+void bvh_traverse(const Concurrency::array_view<const bvh_node<fp_t>, 1>& nodes, const pool_t& pool, const ray<fp_t>& ray, hit_record<fp_t>& hit, int root = 0) restrict(cpu, amp)
+{
+	vector3<fp_t> inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	int stack[bvh_stack_size];
+	int stack_size = 0;
+	stack[stack_size++] = root;
+
+	while (stack_size > 0)
+	{
+		const bvh_node<fp_t>& node = nodes[stack[--stack_size]];
+
+		if (!node.hit(ray.origin, inv_dir, hit.distance))
+		{
+			continue;
+		}
+
+		if (node.count > 0)
+		{
+			pool.intersect_range(node.first, node.count, ray, hit);
+		}
+		else
+		{
+			const bool left_first = bvh_left_first(nodes[node.first], nodes[node.first + 1], ray.direction);
+			stack[stack_size++] = left_first ? node.first + 1 : node.first;
+			stack[stack_size++] = left_first ? node.first : node.first + 1;
+		}
+	}
+}
+
+// Any-hit counterpart of bvh_traverse for shadow rays. Returns true as soon as
+// pool.occluded_range(first, count, ray, max_distance) finds a blocker, nothing is
+// computed for the hit itself.
+template <typename fp_t, typename pool_t>
+bool bvh_occluded(const Concurrency::array_view<const bvh_node<fp_t>, 1>& nodes, const pool_t& pool, const ray<fp_t>& ray, fp_t max_distance, int root = 0) restrict(cpu, amp)
+{
+	vector3<fp_t> inv_dir(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z);
+
+	int stack[bvh_stack_size];
+	int stack_size = 0;
+	stack[stack_size++] = root;
+
+	while (stack_size > 0)
+	{
+		const bvh_node<fp_t>& node = nodes[stack[--stack_size]];
+
+		if (!node.hit(ray.origin, inv_dir, max_distance))
+		{
+			continue;
+		}
+
+		if (node.count > 0)
+		{
+			if (pool.occluded_range(node.first, node.count, ray, max_distance))
+			{
+				return true;
+			}
+		}
+		else
+		{
+			stack[stack_size++] = node.first + 1;
+			stack[stack_size++] = node.first;
+		}
+	}
+
+	return false;
+}
+
+enum bvh_build_method
+{
+	bvh_build_median,
+	bvh_build_sah,
+	bvh_build_lbvh,
+	bvh_build_method_count
+};
+
+// Primitive bounds and centroids in SoA layout, the input of the BVH builders.
+template <typename fp_t>
+class bvh_build_input
+{
+public:
+	std::vector<fp_t> lower_x, lower_y, lower_z;
+	std::vector<fp_t> upper_x, upper_y, upper_z;
+	std::vector<fp_t> centroid_x, centroid_y, centroid_z;
+
+	int size() const
+	{
+		return static_cast<int>(centroid_x.size());
+	}
+
+	void reserve(size_t count)
+	{
+		lower_x.reserve(count); lower_y.reserve(count); lower_z.reserve(count);
+		upper_x.reserve(count); upper_y.reserve(count); upper_z.reserve(count);
+		centroid_x.reserve(count); centroid_y.reserve(count); centroid_z.reserve(count);
+	}
+
+	void push_back(const aabb<fp_t>& box)
+	{
+		lower_x.push_back(box.lower.x); lower_y.push_back(box.lower.y); lower_z.push_back(box.lower.z);
+		upper_x.push_back(box.upper.x); upper_y.push_back(box.upper.y); upper_z.push_back(box.upper.z);
+
+		vector3<fp_t> c(box.centroid());
+		centroid_x.push_back(c.x); centroid_y.push_back(c.y); centroid_z.push_back(c.z);
+	}
+
+	aabb<fp_t> bounds(int i) const
+	{
+		return aabb<fp_t>(vector3<fp_t>(lower_x[i], lower_y[i], lower_z[i]), vector3<fp_t>(upper_x[i], upper_y[i], upper_z[i]));
+	}
+
+	vector3<fp_t> centroid(int i) const
+	{
+		return vector3<fp_t>(centroid_x[i], centroid_y[i], centroid_z[i]);
+	}
+
+	fp_t centroid(int i, int axis) const
+	{
+		return axis == 0 ? centroid_x[i] : (axis == 1 ? centroid_y[i] : centroid_z[i]);
+	}
+};
+
+struct bvh_build_stats
+{
+	double build_ms;
+	double sah_cost;
+	int node_count;
+	int leaf_count;
+	int depth;
+};
+
+// Fills in everything but the build time. The SAH cost counts one unit per interior
+// node and per primitive test, weighted by the probability of hitting the node.
+template <typename fp_t>
+void compute_bvh_stats(const std::vector<bvh_node<fp_t>>& nodes, int primitive_count, bvh_build_stats& stats)
+{
+	stats.sah_cost = 0.0;
+	stats.node_count = static_cast<int>(nodes.size());
+	stats.leaf_count = 0;
+	stats.depth = 0;
+
+	if (primitive_count == 0)
+	{
+		return;
+	}
+
+	const double root_area = std::max(static_cast<double>(nodes[0].bounds().surface_area()), 1e-20);
+
+	std::vector<std::pair<int, int>> stack;
+	stack.push_back(std::make_pair(0, 1));
+
+	while (!stack.empty())
+	{
+		const bvh_node<fp_t>& node = nodes[stack.back().first];
+		const int depth = stack.back().second;
+		stack.pop_back();
+
+		const double p = node.bounds().surface_area() / root_area;
+		stats.depth = std::max(stats.depth, depth);
+
+		if (node.count > 0)
+		{
+			stats.leaf_count++;
+			stats.sah_cost += p * node.count;
+		}
+		else
+		{
+			stats.sah_cost += p;
+			stack.push_back(std::make_pair(node.first, depth + 1));
+			stack.push_back(std::make_pair(node.first + 1, depth + 1));
+		}
+	}
+}
+
+// Builds a BVH by splitting every node at the object median of its largest centroid
+// axis. On return order holds the primitive index for each leaf slot and nodes[0] is
+// the root. The tree depth stays within log2(n) + 1.
+template <typename fp_t>
+void build_bvh(const bvh_build_input<fp_t>& input, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes, bvh_build_stats* stats = nullptr)
+{
+	struct build_task
+	{
+		int node;
+		int begin;
+		int end;
+	};
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	const int count = input.size();
+
+	order.resize(count);
+	for (int i = 0; i < count; i++)
+	{
+		order[i] = i;
+	}
+
+	nodes.clear();
+	nodes.push_back(bvh_node<fp_t>());
+
+	std::vector<build_task> tasks;
+	build_task root = { 0, 0, count };
+	tasks.push_back(root);
+
+	while (!tasks.empty())
+	{
+		build_task task = tasks.back();
+		tasks.pop_back();
+
+		aabb<fp_t> bounds;
+		aabb<fp_t> centroid_bounds;
+		for (int i = task.begin; i < task.end; i++)
+		{
+			bounds.grow(input.bounds(order[i]));
+			centroid_bounds.grow(input.centroid(order[i]));
+		}
+
+		nodes[task.node].set_bounds(bounds);
+		nodes[task.node].first = task.begin;
+		nodes[task.node].count = task.end - task.begin;
+
+		const int axis = centroid_bounds.largest_axis();
+
+		if (task.end - task.begin <= bvh_max_leaf_size ||
+			vector_axis(centroid_bounds.lower, axis) >= vector_axis(centroid_bounds.upper, axis))
+		{
+			continue;
+		}
+
+		const int mid = (task.begin + task.end) / 2;
+		std::nth_element(order.begin() + task.begin, order.begin() + mid, order.begin() + task.end, [&](int a, int b)
+		{
+			return input.centroid(a, axis) < input.centroid(b, axis);
+		});
+
+		const int child = static_cast<int>(nodes.size());
+		nodes.resize(child + 2);
+
+		nodes[task.node].first = child;
+		nodes[task.node].count = 0;
+
+		build_task left = { child, task.begin, mid };
+		build_task right = { child + 1, mid, task.end };
+		tasks.push_back(left);
+		tasks.push_back(right);
+	}
+
+	if (stats)
+	{
+		stats->build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		compute_bvh_stats(nodes, count, *stats);
+	}
+}
+
+// Binned SAH builder. Bounds and bins of large ranges are reduced in parallel across
+// primitives and the two subtrees of a large node are built as separate tasks, so the
+// top of the tree is parallel over primitives and the rest over subtrees.
+template <typename fp_t>
+class bvh_sah_builder
+{
+public:
+	bvh_sah_builder(const bvh_build_input<fp_t>& input, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes)
+		: source(input), order(order), nodes(nodes), node_count(1)
+	{
+	}
+
+	void build()
+	{
+		const int count = source.size();
+
+		order.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			order[i] = i;
+		}
+
+		// The input is first copied in Morton order of the centroids, so the ranges of
+		// the lower levels gather from nearby memory instead of all over the input.
+		std::vector<int> remap;
+		sort_by_morton_code(remap);
+
+		nodes.assign(std::max(2 * count - 1, 1), bvh_node<fp_t>());
+		node_count = 1;
+
+		build_node(0, 0, count, 1);
+
+		nodes.resize(node_count);
+
+		Concurrency::parallel_for(0, count, [&](int i)
+		{
+			order[i] = remap[order[i]];
+		});
+	}
+
+private:
+	struct range_bounds
+	{
+		aabb<fp_t> bounds;
+		aabb<fp_t> centroids;
+	};
+
+	// bin bounds are kept as plain arrays, growing them is the innermost loop of the build
+	struct bin
+	{
+		fp_t lower[3];
+		fp_t upper[3];
+		int count;
+
+		bin()
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lower[axis] = std::numeric_limits<fp_t>::max();
+				upper[axis] = -std::numeric_limits<fp_t>::max();
+			}
+			count = 0;
+		}
+
+		void grow(const fp_t* box_lower, const fp_t* box_upper)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lower[axis] = std::min(lower[axis], box_lower[axis]);
+				upper[axis] = std::max(upper[axis], box_upper[axis]);
+			}
+		}
+
+		void merge(const bin& other)
+		{
+			grow(other.lower, other.upper);
+			count += other.count;
+		}
+
+		aabb<fp_t> bounds() const
+		{
+			return count > 0 ? aabb<fp_t>(vector3<fp_t>(lower[0], lower[1], lower[2]), vector3<fp_t>(upper[0], upper[1], upper[2])) : aabb<fp_t>();
+		}
+	};
+
+	struct bin_set
+	{
+		bin bins[3][bvh_sah_bin_count];
+
+		void merge(const bin_set& other)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (int b = 0; b < bvh_sah_bin_count; b++)
+				{
+					bins[axis][b].merge(other.bins[axis][b]);
+				}
+			}
+		}
+	};
+
+	// maps centroids to bins along each axis, axes without extent get no bins
+	struct bin_mapping
+	{
+		fp_t lower[3];
+		fp_t scale[3];
+		bool active[3];
+
+		explicit bin_mapping(const aabb<fp_t>& centroids)
+		{
+			for (int axis = 0; axis < 3; axis++)
+			{
+				lower[axis] = vector_axis(centroids.lower, axis);
+				fp_t extent = vector_axis(centroids.upper, axis) - lower[axis];
+				active[axis] = extent > 0;
+				scale[axis] = active[axis] ? bvh_sah_bin_count / extent : 0;
+			}
+		}
+
+		int index(fp_t centroid, int axis) const
+		{
+			int b = static_cast<int>((centroid - lower[axis]) * scale[axis]);
+			return std::min(std::max(b, 0), bvh_sah_bin_count - 1);
+		}
+	};
+
+	// runs body(begin, end) over chunks of the range, in parallel when it is large
+	template <typename result_t, typename body_t>
+	result_t reduce_range(int begin, int end, const body_t& body) const
+	{
+		const int count = end - begin;
+
+		if (count <= bvh_parallel_threshold)
+		{
+			return body(begin, end);
+		}
+
+		const int chunk_count = (count + bvh_parallel_threshold - 1) / bvh_parallel_threshold;
+		std::vector<result_t> partials(chunk_count);
+
+		Concurrency::parallel_for(0, chunk_count, [&](int chunk)
+		{
+			const int chunk_begin = begin + chunk * bvh_parallel_threshold;
+			partials[chunk] = body(chunk_begin, std::min(chunk_begin + bvh_parallel_threshold, end));
+		});
+
+		for (int chunk = 1; chunk < chunk_count; chunk++)
+		{
+			partials[0].merge(partials[chunk]);
+		}
+
+		return partials[0];
+	}
+
+	void build_node(int node, int begin, int end, int depth)
+	{
+		const int count = end - begin;
+
+		struct bounds_result : range_bounds
+		{
+			void merge(const bounds_result& other)
+			{
+				this->bounds.grow(other.bounds);
+				this->centroids.grow(other.centroids);
+			}
+		};
+
+		bounds_result range = reduce_range<bounds_result>(begin, end, [&](int b, int e)
+		{
+			bounds_result r;
+			for (int i = b; i < e; i++)
+			{
+				r.bounds.grow(input.bounds(order[i]));
+				r.centroids.grow(input.centroid(order[i]));
+			}
+			return r;
+		});
+
+		nodes[node].set_bounds(range.bounds);
+		nodes[node].first = begin;
+		nodes[node].count = count;
+
+		const int largest_axis = range.centroids.largest_axis();
+		if (count == 1 || vector_axis(range.centroids.lower, largest_axis) >= vector_axis(range.centroids.upper, largest_axis))
+		{
+			return;
+		}
+
+		int split_axis = largest_axis;
+		int split_bin = -1;
+		const bin_mapping mapping(range.centroids);
+
+		// once the remaining depth budget only allows balanced splits, fall back to the median
+		int log2_count = 0;
+		while ((1 << log2_count) < count) log2_count++;
+
+		if (depth + log2_count + 1 < bvh_stack_size - 1)
+		{
+			bin_set bins = reduce_range<bin_set>(begin, end, [&](int b, int e)
+			{
+				bin_set r;
+				for (int i = b; i < e; i++)
+				{
+					const int primitive = order[i];
+					const fp_t box_lower[3] = { input.lower_x[primitive], input.lower_y[primitive], input.lower_z[primitive] };
+					const fp_t box_upper[3] = { input.upper_x[primitive], input.upper_y[primitive], input.upper_z[primitive] };
+
+					for (int axis = 0; axis < 3; axis++)
+					{
+						if (mapping.active[axis])
+						{
+							bin& target = r.bins[axis][mapping.index(input.centroid(primitive, axis), axis)];
+							target.grow(box_lower, box_upper);
+							target.count++;
+						}
+					}
+				}
+				return r;
+			});
+
+			const fp_t parent_area = std::max(range.bounds.surface_area(), static_cast<fp_t>(1e-20f));
+			// small ranges may stay a leaf, larger ones take the best split whatever it costs
+			fp_t best_cost = count <= bvh_max_leaf_size ? static_cast<fp_t>(count) : std::numeric_limits<fp_t>::max();
+
+			for (int axis = 0; axis < 3; axis++)
+			{
+				fp_t right_area[bvh_sah_bin_count];
+				int right_count[bvh_sah_bin_count];
+
+				aabb<fp_t> right;
+				int right_total = 0;
+				for (int b = bvh_sah_bin_count - 1; b > 0; b--)
+				{
+					right.grow(bins.bins[axis][b].bounds());
+					right_total += bins.bins[axis][b].count;
+					right_area[b] = right.surface_area();
+					right_count[b] = right_total;
+				}
+
+				aabb<fp_t> left;
+				int left_total = 0;
+				for (int b = 1; b < bvh_sah_bin_count; b++)
+				{
+					left.grow(bins.bins[axis][b - 1].bounds());
+					left_total += bins.bins[axis][b - 1].count;
+
+					if (left_total == 0 || right_count[b] == 0)
+					{
+						continue;
+					}
+
+					fp_t cost = 1.0f + (left.surface_area() * left_total + right_area[b] * right_count[b]) / parent_area;
+					if (cost < best_cost)
+					{
+						best_cost = cost;
+						split_axis = axis;
+						split_bin = b;
+					}
+				}
+			}
+
+			if (split_bin < 0 && count <= bvh_max_leaf_size)
+			{
+				return;
+			}
+		}
+
+		int mid = begin;
+		if (split_bin >= 0)
+		{
+			mid = static_cast<int>(std::partition(order.begin() + begin, order.begin() + end, [&](int primitive)
+			{
+				return mapping.index(input.centroid(primitive, split_axis), split_axis) < split_bin;
+			}) - order.begin());
+		}
+
+		if (mid == begin || mid == end)
+		{
+			mid = (begin + end) / 2;
+			std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b)
+			{
+				return input.centroid(a, largest_axis) < input.centroid(b, largest_axis);
+			});
+		}
+
+		const int child = node_count.fetch_add(2);
+		nodes[node].first = child;
+		nodes[node].count = 0;
+
+		if (mid - begin > bvh_parallel_threshold && end - mid > bvh_parallel_threshold)
+		{
+			Concurrency::task_group tasks;
+			tasks.run([&] { build_node(child, begin, mid, depth + 1); });
+			build_node(child + 1, mid, end, depth + 1);
+			tasks.wait();
+		}
+		else
+		{
+			build_node(child, begin, mid, depth + 1);
+			build_node(child + 1, mid, end, depth + 1);
+		}
+	}
+
+	void sort_by_morton_code(std::vector<int>& remap)
+	{
+		const int count = source.size();
+
+		aabb<fp_t> centroids;
+		for (int i = 0; i < count; i++)
+		{
+			centroids.grow(source.centroid(i));
+		}
+
+		vector3<fp_t> extent(centroids.upper - centroids.lower);
+		const fp_t scale[3] =
+		{
+			extent.x > 0 ? 1023.0f / extent.x : 0.0f,
+			extent.y > 0 ? 1023.0f / extent.y : 0.0f,
+			extent.z > 0 ? 1023.0f / extent.z : 0.0f
+		};
+
+		std::vector<std::pair<unsigned int, int>> keys(count);
+		Concurrency::parallel_for(0, count, [&](int i)
+		{
+			unsigned int x = static_cast<unsigned int>((source.centroid_x[i] - centroids.lower.x) * scale[0]);
+			unsigned int y = static_cast<unsigned int>((source.centroid_y[i] - centroids.lower.y) * scale[1]);
+			unsigned int z = static_cast<unsigned int>((source.centroid_z[i] - centroids.lower.z) * scale[2]);
+			keys[i] = std::make_pair(morton_encode3(x, y, z), i);
+		});
+
+		Concurrency::parallel_sort(keys.begin(), keys.end());
+
+		remap.resize(count);
+		input.lower_x.resize(count); input.lower_y.resize(count); input.lower_z.resize(count);
+		input.upper_x.resize(count); input.upper_y.resize(count); input.upper_z.resize(count);
+		input.centroid_x.resize(count); input.centroid_y.resize(count); input.centroid_z.resize(count);
+
+		Concurrency::parallel_for(0, count, [&](int i)
+		{
+			const int j = keys[i].second;
+			remap[i] = j;
+			input.lower_x[i] = source.lower_x[j]; input.lower_y[i] = source.lower_y[j]; input.lower_z[i] = source.lower_z[j];
+			input.upper_x[i] = source.upper_x[j]; input.upper_y[i] = source.upper_y[j]; input.upper_z[i] = source.upper_z[j];
+			input.centroid_x[i] = source.centroid_x[j]; input.centroid_y[i] = source.centroid_y[j]; input.centroid_z[i] = source.centroid_z[j];
+		});
+	}
+
+	const bvh_build_input<fp_t>& source;
+	bvh_build_input<fp_t> input;
+	std::vector<int>& order;
+	std::vector<bvh_node<fp_t>>& nodes;
+	std::atomic<int> node_count;
+};
+
+template <typename fp_t>
+void build_bvh_sah(const bvh_build_input<fp_t>& input, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes, bvh_build_stats* stats = nullptr)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	bvh_sah_builder<fp_t> builder(input, order, nodes);
+	builder.build();
+
+	if (stats)
+	{
+		stats->build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		compute_bvh_stats(nodes, input.size(), *stats);
+	}
+}
+
+// Cost of bringing the hierarchies of a scene up to date with moved primitives.
+struct bvh_update_stats
+{
+	double refit_ms;
+	double rebuild_ms;
+	// largest SAH cost growth of a refitted tree, before any rebuild
+	double cost_growth;
+	int rebuilds;
+};
+
+// Keeps a BVH over moving primitives usable without rebuilding it. refit() recomputes
+// the bounds of every node in place from the moved primitives, bottom-up: the nodes are
+// grouped by depth and the levels are done deepest first, each in parallel, so children
+// are always done before their parent. The topology stays as built, and as primitives
+// drift apart the boxes grow and overlap; the SAH cost relative to the cost right after
+// the build tells when a rebuild pays off again.
+template <typename fp_t>
+class bvh_refitter
+{
+public:
+	bvh_refitter() : build_cost(0.0), cost(0.0)
+	{
+	}
+
+	// Call after every build of nodes, before the first refit.
+	void prepare(const std::vector<bvh_node<fp_t>>& nodes, int primitive_count)
+	{
+		levels.clear();
+		level_nodes.clear();
+
+		if (primitive_count > 0)
+		{
+			// breadth first, each level is a contiguous range of level_nodes
+			level_nodes.push_back(0);
+			size_t begin = 0;
+
+			while (begin < level_nodes.size())
+			{
+				const size_t end = level_nodes.size();
+				levels.push_back(static_cast<int>(begin));
+
+				for (size_t i = begin; i < end; i++)
+				{
+					const bvh_node<fp_t>& node = nodes[level_nodes[i]];
+					if (node.count == 0)
+					{
+						level_nodes.push_back(node.first);
+						level_nodes.push_back(node.first + 1);
+					}
+				}
+				begin = end;
+			}
+			levels.push_back(static_cast<int>(level_nodes.size()));
+		}
+
+		build_cost = sah_cost(nodes);
+		cost = build_cost;
+	}
+
+	// Updates the node bounds from primitive_bounds(i), the box of the primitive in leaf
+	// slot i, and returns the cost growth.
+	template <typename bounds_t>
+	double refit(std::vector<bvh_node<fp_t>>& nodes, const bounds_t& primitive_bounds)
+	{
+		for (int level = static_cast<int>(levels.size()) - 2; level >= 0; level--)
+		{
+			Concurrency::parallel_for(levels[level], levels[level + 1], [&](int i)
+			{
+				bvh_node<fp_t>& node = nodes[level_nodes[i]];
+				aabb<fp_t> box;
+
+				if (node.count > 0)
+				{
+					for (int k = node.first; k < node.first + node.count; k++)
+					{
+						box.grow(primitive_bounds(k));
+					}
+				}
+				else
+				{
+					box.grow(nodes[node.first].bounds());
+					box.grow(nodes[node.first + 1].bounds());
+				}
+
+				node.set_bounds(box);
+			});
+		}
+
+		cost = sah_cost(nodes);
+		return cost_growth();
+	}
+
+	// SAH cost of the refitted tree over its cost after the build, 1 right after it
+	double cost_growth() const
+	{
+		return build_cost > 0.0 ? cost / build_cost : 1.0;
+	}
+
+	double get_cost() const
+	{
+		return cost;
+	}
+
+private:
+	// the cost of compute_bvh_stats, summed in parallel over the node array
+	double sah_cost(const std::vector<bvh_node<fp_t>>& nodes) const
+	{
+		if (levels.empty())
+		{
+			return 0.0;
+		}
+
+		const int count = static_cast<int>(nodes.size());
+		const int chunk_count = (count + bvh_parallel_threshold - 1) / bvh_parallel_threshold;
+		std::vector<double> partials(chunk_count);
+
+		Concurrency::parallel_for(0, chunk_count, [&](int chunk)
+		{
+			const int end = std::min((chunk + 1) * bvh_parallel_threshold, count);
+			double sum = 0.0;
+
+			for (int i = chunk * bvh_parallel_threshold; i < end; i++)
+			{
+				sum += nodes[i].bounds().surface_area() * std::max(nodes[i].count, 1);
+			}
+			partials[chunk] = sum;
+		});
+
+		double sum = 0.0;
+		for (int chunk = 0; chunk < chunk_count; chunk++)
+		{
+			sum += partials[chunk];
+		}
+
+		return sum / std::max(static_cast<double>(nodes[0].bounds().surface_area()), 1e-20);
+	}
+
+	std::vector<int> level_nodes;
+	// first entry of level_nodes for every level, and the end
+	std::vector<int> levels;
+	double build_cost;
+	double cost;
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Camera path recorded from the viewer's orbit and zoom input, for replaying the exact
+// sequence of views in the headless benchmark. The file is a 16 byte header (magic
+// "RTCP", version, frame count, reserved) followed by four 32-bit floats per frame:
+// milliseconds since the recording started, phi, theta and eyedist.
+
+struct camera_path_frame
+{
+	float time_ms;
+	float phi;
+	float theta;
+	float eyedist;
+};
+
+class camera_path
+{
+public:
+	enum
+	{
+		magic = 0x50435452, // "RTCP"
+		version = 1
+	};
+
+	void clear()
+	{
+		frames.clear();
+	}
+
+	// Appends a view, views equal to the last one are skipped.
+	void add(float time_ms, float phi, float theta, float eyedist)
+	{
+		if (!frames.empty() && frames.back().phi == phi && frames.back().theta == theta && frames.back().eyedist == eyedist)
+		{
+			return;
+		}
+
+		camera_path_frame frame = { time_ms, phi, theta, eyedist };
+		frames.push_back(frame);
+	}
+
+	int size() const
+	{
+		return static_cast<int>(frames.size());
+	}
+
+	const camera_path_frame& operator[](int i) const
+	{
+		return frames[i];
+	}
+
+	bool save(const std::string& path) const
+	{
+		std::ofstream file(path.c_str(), std::ios::binary);
+
+		const unsigned int header[4] = { magic, version, static_cast<unsigned int>(frames.size()), 0 };
+		file.write(reinterpret_cast<const char*>(header), sizeof(header));
+
+		if (!frames.empty())
+		{
+			file.write(reinterpret_cast<const char*>(frames.data()), frames.size() * sizeof(camera_path_frame));
+		}
+
+		return static_cast<bool>(file);
+	}
+
+	// Fails on files of another format or version and on truncated files.
+	bool load(const std::string& path)
+	{
+		std::ifstream file(path.c_str(), std::ios::binary);
+
+		unsigned int header[4] = {};
+		if (!file.read(reinterpret_cast<char*>(header), sizeof(header)) || header[0] != magic || header[1] != version)
+		{
+			return false;
+		}
+
+		// the count must fit the file before it sizes anything
+		file.seekg(0, std::ios::end);
+		const std::streamoff bytes = static_cast<std::streamoff>(file.tellg()) - static_cast<std::streamoff>(sizeof(header));
+		file.seekg(sizeof(header), std::ios::beg);
+
+		if (bytes < static_cast<std::streamoff>(header[2]) * static_cast<std::streamoff>(sizeof(camera_path_frame)))
+		{
+			return false;
+		}
+
+		std::vector<camera_path_frame> loaded(header[2]);
+		if (!loaded.empty() && !file.read(reinterpret_cast<char*>(loaded.data()), loaded.size() * sizeof(camera_path_frame)))
+		{
+			return false;
+		}
+
+		frames.swap(loaded);
+		return true;
+	}
+
+private:
+	std::vector<camera_path_frame> frames;
+};
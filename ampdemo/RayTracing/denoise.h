@@ -0,0 +1,431 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "gbuffer.h"
+
+// Edge-avoiding a-trous wavelet denoiser (Dammertz et al., "Edge-Avoiding A-Trous
+// Wavelet Transform for fast Global Illumination Filtering"; Schied et al.,
+// "Spatiotemporal Variance-Guided Filtering") for the colour output of a G-buffer with
+// few light samples per pixel.
+//
+// Every iteration blurs the image with a 3 x 3 B-spline kernel whose taps are spaced
+// 2^iteration pixels apart, so five iterations cover 63 pixels with 45 taps. Each tap is
+// weighted down by how much it differs from the centre pixel in luminance, normal, depth
+// and albedo, which keeps the blur inside surfaces and off texture edges. The luminance
+// tolerance follows the local noise, from the luminance variance around the pixel.
+//
+// With temporal accumulation the noisy colour is first blended with the history of
+// earlier frames, found through the motion vectors and rejected where its depth or
+// normal do not match. The history is the output of the first iteration, as in SVGF.
+//
+// Every pass is a kernel over the G-buffer planes, which stay on the accelerator. The
+// colour of the iterations, the history and the guides derived from the G-buffer live in
+// buffers of the denoiser that are never copied back, only the tone-mapped result is.
+
+template <typename fp_t>
+class atrous_denoiser
+{
+public:
+	// gbuffer outputs the denoiser reads, motion only with temporal accumulation
+	enum
+	{
+		inputs = gbuffer_color | gbuffer_depth | gbuffer_normal | gbuffer_albedo | gbuffer_motion
+	};
+
+	atrous_denoiser() : iterations(5), temporal(true), sigma_luminance(4.0f), sigma_normal(0.05f), sigma_depth(1.0f), sigma_albedo(0.1f), min_alpha(0.2f),
+		width(0), height(0), has_history(false), history_buffer(0), history_age(0), denoise_ms(0.0) {}
+
+	// Filters the colour output of the last render of buffers, which must include the
+	// depth, normal and albedo outputs, and writes the tone-mapped image to result, a view
+	// of the buffers' size. Temporal accumulation needs the motion output as well, it is
+	// skipped for renders without it. Waits for the kernels, so that last_denoise_ms() is
+	// their time, but leaves the result on the accelerator.
+	void denoise(const gbuffer<fp_t>& buffers, const Concurrency::array_view<unsigned int, 2>& result, int order = pixel_order_row_major)
+	{
+		using namespace Concurrency;
+
+		auto start = std::chrono::high_resolution_clock::now();
+
+		if (buffers.get_width() != width || buffers.get_height() != height)
+		{
+			width = buffers.get_width();
+			height = buffers.get_height();
+			reset();
+
+			const int pixels = width * height;
+			for (int i = 0; i < 3; i++)
+			{
+				allocate(color_data[i], color_views[i], 4 * pixels);
+			}
+			allocate(scale_data, scale_view, 2 * pixels);
+			allocate(box_data, box_view, 2 * pixels);
+			allocate(history_guide_data, history_guide_view, 4 * pixels);
+			allocate(age_data[0], age_views[0], pixels);
+			allocate(age_data[1], age_views[1], pixels);
+		}
+
+		// the old history is read once, by accumulate, after which its buffer is free
+		const int current = (history_buffer + 1) % 3;
+		accumulate(buffers, current, temporal && has_history && (buffers.outputs() & gbuffer_motion), order);
+		scale_guides(buffers, current, order);
+
+		// the output of the first iteration is kept as the next history, the others
+		// alternate between the two buffers left
+		int source = current;
+		int kept = current;
+		for (int i = 0; i < iterations; i++)
+		{
+			int target = 0;
+			while (target == source || (i > 0 && target == kept))
+			{
+				target++;
+			}
+
+			filter(buffers, source, target, i, order);
+
+			if (i == 0)
+			{
+				kept = target;
+			}
+			source = target;
+		}
+
+		history_buffer = kept;
+		write_result(buffers, source, result, order);
+		has_history = temporal;
+
+		accelerator().get_default_view().wait();
+		denoise_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	// Drops the history, for example after the scene changed.
+	void reset()
+	{
+		has_history = false;
+	}
+
+	void set_iterations(int count)
+	{
+		iterations = std::min(std::max(count, 0), 8);
+	}
+
+	int get_iterations() const
+	{
+		return iterations;
+	}
+
+	void set_temporal(bool enable)
+	{
+		temporal = enable;
+		reset();
+	}
+
+	bool get_temporal() const
+	{
+		return temporal;
+	}
+
+	double last_denoise_ms() const
+	{
+		return denoise_ms;
+	}
+
+private:
+	// Buffers of the denoiser are created on the accelerator and never copied in, they
+	// keep their contents between frames.
+	template <typename value_t>
+	static void allocate(std::vector<value_t>& data, std::unique_ptr<Concurrency::array_view<value_t, 1>>& view, int size)
+	{
+		data.resize(size);
+		view.reset(new Concurrency::array_view<value_t, 1>(size, data));
+		view->discard_data();
+	}
+
+	// Writes the colour to the planes of buffer target with its luminance in the fourth.
+	// With history the colour is blended with the history at the pixel its surface was on
+	// in the previous frame. A pixel's history weight grows with the number of frames it
+	// has matched, up to 1 - min_alpha.
+	void accumulate(const gbuffer<fp_t>& buffers, int target, bool use_history, int order)
+	{
+		using namespace Concurrency;
+
+		const int width = this->width;
+		const int height = this->height;
+		const int pixels = width * height;
+		const fp_t min_alpha = this->min_alpha;
+
+		array_view<const fp_t, 1> color_value(buffers.color_value());
+		array_view<const fp_t, 1> depth(buffers.depth());
+		array_view<const fp_t, 1> normal(buffers.normal());
+		array_view<const fp_t, 1> motion(buffers.motion());
+		array_view<const fp_t, 1> history(*color_views[history_buffer]);
+		array_view<const fp_t, 1> history_guide(*history_guide_view);
+		array_view<const int, 1> previous_age(*age_views[history_age]);
+		array_view<int, 1> age(*age_views[1 - history_age]);
+		array_view<fp_t, 1> current(*color_views[target]);
+
+		parallel_for_each_pixel(extent<2>(height, width), order, [=](int x, int y) restrict(amp)
+		{
+			const int i = y * width + x;
+
+			color<fp_t> c(color_value[i], color_value[pixels + i], color_value[2 * pixels + i]);
+			int pixel_age = 1;
+
+			if (use_history && depth[i] > 0.0f)
+			{
+				const int px = static_cast<int>(gpu::floor(x + motion[i] + 0.5f));
+				const int py = static_cast<int>(gpu::floor(y + motion[pixels + i] + 0.5f));
+
+				if (px >= 0 && px < width && py >= 0 && py < height)
+				{
+					const int j = py * width + px;
+					const fp_t n_dot = normal[i] * history_guide[pixels + j] + normal[pixels + i] * history_guide[2 * pixels + j] + normal[2 * pixels + i] * history_guide[3 * pixels + j];
+
+					// the depth is along the ray from another eye, so the tolerance is wide
+					if (gpu::fabs(history_guide[j] - depth[i]) < 0.1f * depth[i] && n_dot > 0.9f)
+					{
+						pixel_age = direct3d::imin(previous_age[j] + 1, 1 << 16);
+						const fp_t alpha = gpu::fmax(static_cast<fp_t>(1.0f) / pixel_age, min_alpha);
+
+						const color<fp_t> h(history[j], history[pixels + j], history[2 * pixels + j]);
+						c = h * (1.0f - alpha) + c * alpha;
+					}
+				}
+			}
+
+			current[i] = c.r;
+			current[pixels + i] = c.g;
+			current[2 * pixels + i] = c.b;
+			current[3 * pixels + i] = 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+			age[i] = pixel_age;
+		});
+
+		history_age = 1 - history_age;
+	}
+
+	// Per pixel inverse tolerances of the edge-stopping terms, in the planes of the scale
+	// buffer. The depth one is for a tap one pixel away and comes from the depth gradient,
+	// so that slanted surfaces are not cut up. The luminance one comes from the standard
+	// deviation of the luminance of buffer source in a 7 x 7 box around the pixel, as SVGF
+	// does where it has no temporal variance: noisy pixels blend with anything in reach,
+	// smooth ones keep their detail. The box sums are separable, the row sums go through
+	// the box buffer.
+	void scale_guides(const gbuffer<fp_t>& buffers, int source, int order)
+	{
+		using namespace Concurrency;
+
+		const int width = this->width;
+		const int height = this->height;
+		const int pixels = width * height;
+		const int radius = 3;
+		const fp_t sigma_luminance = this->sigma_luminance;
+		const fp_t sigma_depth = this->sigma_depth;
+
+		array_view<const fp_t, 1> luminance(*color_views[source]);
+		array_view<const fp_t, 1> depth(buffers.depth());
+		array_view<fp_t, 1> row_sums(*box_view);
+		array_view<fp_t, 1> scale(*scale_view);
+
+		// sums over the window, which is cut off at the edges
+		parallel_for_each_pixel(extent<2>(height, width), order, [=](int x, int y) restrict(amp)
+		{
+			const int row = 3 * pixels + y * width;
+			const int first = direct3d::imax(x - radius, 0);
+			const int last = direct3d::imin(x + radius, width - 1);
+
+			fp_t sum = 0.0f;
+			fp_t square_sum = 0.0f;
+			for (int qx = first; qx <= last; qx++)
+			{
+				const fp_t l = luminance[row + qx];
+				sum += l;
+				square_sum += l * l;
+			}
+
+			row_sums[y * width + x] = sum;
+			row_sums[pixels + y * width + x] = square_sum;
+		});
+
+		parallel_for_each_pixel(extent<2>(height, width), order, [=](int x, int y) restrict(amp)
+		{
+			const int i = y * width + x;
+			const int first = direct3d::imax(y - radius, 0);
+			const int last = direct3d::imin(y + radius, height - 1);
+
+			fp_t sum = 0.0f;
+			fp_t square_sum = 0.0f;
+			for (int qy = first; qy <= last; qy++)
+			{
+				sum += row_sums[qy * width + x];
+				square_sum += row_sums[pixels + qy * width + x];
+			}
+
+			const fp_t inverse_count = 1.0f / ((last - first + 1) * (direct3d::imin(x + radius, width - 1) - direct3d::imax(x - radius, 0) + 1));
+			const fp_t mean = sum * inverse_count;
+			const fp_t variance = gpu::fmax(square_sum * inverse_count - mean * mean, static_cast<fp_t>(0.0f));
+
+			scale[pixels + i] = 1.0f / (sigma_luminance * gpu::sqrt(variance) + 1e-4f);
+
+			const int row = y * width;
+			const int up = direct3d::imax(y - 1, 0) * width;
+			const int down = direct3d::imin(y + 1, height - 1) * width;
+			const fp_t dx = gpu::fabs(depth[row + direct3d::imin(x + 1, width - 1)] - depth[row + direct3d::imax(x - 1, 0)]);
+			const fp_t dy = gpu::fabs(depth[down + x] - depth[up + x]);
+
+			scale[i] = 1.0f / (sigma_depth * 0.5f * gpu::fmax(dx, dy) + 1e-3f * depth[i] + 1e-4f);
+		});
+	}
+
+	// One a-trous iteration from the colour and luminance of buffer source to those of
+	// buffer target. Taps that fall outside the image are left out, the weight sum then
+	// renormalizes over the taps left. The kernel weights are products of the 1/4, 1/2,
+	// 1/4 B-spline weights of the row and the column. 1 - dot(n, m) is |n - m|^2 / 2 for
+	// unit normals, so the normal term is a squared distance like the albedo one.
+	void filter(const gbuffer<fp_t>& buffers, int source_buffer, int target_buffer, int iteration, int order)
+	{
+		using namespace Concurrency;
+
+		const int width = this->width;
+		const int height = this->height;
+		const int pixels = width * height;
+		const int step = 1 << iteration;
+
+		const fp_t depth_factor = 1.0f / step;
+		const fp_t normal_factor = 0.5f / sigma_normal;
+		const fp_t albedo_factor = 1.0f / (sigma_albedo * sigma_albedo);
+
+		array_view<const fp_t, 1> source(*color_views[source_buffer]);
+		array_view<const fp_t, 1> scale(*scale_view);
+		array_view<const fp_t, 1> depth(buffers.depth());
+		array_view<const fp_t, 1> normal(buffers.normal());
+		array_view<const fp_t, 1> albedo(buffers.albedo());
+		array_view<fp_t, 1> target(*color_views[target_buffer]);
+
+		parallel_for_each_pixel(extent<2>(height, width), order, [=](int x, int y) restrict(amp)
+		{
+			const int p = y * width + x;
+
+			const fp_t luminance = source[3 * pixels + p];
+			const fp_t luminance_scale = scale[pixels + p];
+			const fp_t pixel_depth = depth[p];
+			const fp_t depth_scale = scale[p] * depth_factor;
+			const vector3<fp_t> n(normal[p], normal[pixels + p], normal[2 * pixels + p]);
+			const vector3<fp_t> a(albedo[p], albedo[pixels + p], albedo[2 * pixels + p]);
+
+			// the centre tap has full weight
+			fp_t weight_sum = 0.25f;
+			color<fp_t> sum(color<fp_t>(source[p], source[pixels + p], source[2 * pixels + p]) * 0.25f);
+
+			for (int ty = -1; ty <= 1; ty++)
+			{
+				const int qy = y + ty * step;
+				if (qy < 0 || qy >= height)
+				{
+					continue;
+				}
+
+				for (int tx = -1; tx <= 1; tx++)
+				{
+					const int qx = x + tx * step;
+					if ((tx == 0 && ty == 0) || qx < 0 || qx >= width)
+					{
+						continue;
+					}
+
+					// diagonal taps are twice as far away in depth
+					const int q = qy * width + qx;
+					const bool diagonal = tx != 0 && ty != 0;
+					const fp_t k = diagonal ? 0.0625f : 0.125f;
+
+					const vector3<fp_t> dn(vector3<fp_t>(normal[q], normal[pixels + q], normal[2 * pixels + q]) - n);
+					const vector3<fp_t> da(vector3<fp_t>(albedo[q], albedo[pixels + q], albedo[2 * pixels + q]) - a);
+
+					const fp_t distance = gpu::fabs(source[3 * pixels + q] - luminance) * luminance_scale
+						+ gpu::fabs(depth[q] - pixel_depth) * depth_scale * (diagonal ? 0.5f : 1.0f)
+						+ dn.dot(dn) * normal_factor
+						+ da.dot(da) * albedo_factor;
+
+					const fp_t w = k * gpu::exp(-distance);
+
+					weight_sum += w;
+					sum = sum + color<fp_t>(source[q], source[pixels + q], source[2 * pixels + q]) * w;
+				}
+			}
+
+			sum = sum * (1.0f / weight_sum);
+
+			target[p] = sum.r;
+			target[pixels + p] = sum.g;
+			target[2 * pixels + p] = sum.b;
+			target[3 * pixels + p] = 0.2126f * sum.r + 0.7152f * sum.g + 0.0722f * sum.b;
+		});
+	}
+
+	// Tone-maps the colour of buffer source into result like the renderers and, with
+	// temporal accumulation, keeps the depth and normal of the frame as the history guide.
+	void write_result(const gbuffer<fp_t>& buffers, int source_buffer, const Concurrency::array_view<unsigned int, 2>& result, int order)
+	{
+		using namespace Concurrency;
+
+		const int width = this->width;
+		const int pixels = width * height;
+		const bool keep_guide = temporal;
+
+		array_view<const fp_t, 1> source(*color_views[source_buffer]);
+		array_view<const fp_t, 1> depth(buffers.depth());
+		array_view<const fp_t, 1> normal(buffers.normal());
+		array_view<fp_t, 1> history_guide(*history_guide_view);
+
+		parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
+		{
+			const int p = y * width + x;
+
+			result(y, x) = tone_map(color<fp_t>(source[p], source[pixels + p], source[2 * pixels + p]));
+
+			if (keep_guide)
+			{
+				history_guide[p] = depth[p];
+				history_guide[pixels + p] = normal[p];
+				history_guide[2 * pixels + p] = normal[pixels + p];
+				history_guide[3 * pixels + p] = normal[2 * pixels + p];
+			}
+		});
+	}
+
+	int iterations;
+	bool temporal;
+	fp_t sigma_luminance;
+	fp_t sigma_normal;
+	fp_t sigma_depth;
+	fp_t sigma_albedo;
+	fp_t min_alpha;
+
+	int width;
+	int height;
+	bool has_history;
+	// buffer holding the history colour, and age buffer holding its ages
+	int history_buffer;
+	int history_age;
+	double denoise_ms;
+
+	// three buffers of r, g, b and luminance planes rotate between the accumulated
+	// colour, the history and the ping-pong targets of the iterations
+	std::vector<fp_t> color_data[3];
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> color_views[3];
+	// inverse depth and luminance tolerances
+	std::vector<fp_t> scale_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> scale_view;
+	// row sums of the luminance and its square for the variance
+	std::vector<fp_t> box_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> box_view;
+	// depth and normal planes of the history
+	std::vector<fp_t> history_guide_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> history_guide_view;
+	// frames the history of each pixel has matched, ping-pong
+	std::vector<int> age_data[2];
+	std::unique_ptr<Concurrency::array_view<int, 1>> age_views[2];
+};
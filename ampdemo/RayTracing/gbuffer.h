@@ -0,0 +1,315 @@
+#pragma once
+
+#include "progressive.h"
+
+// G-buffer pass of the reflection scene. The primary ray of every pixel is traced once
+// and its hit is written to any set of outputs, each a structure-of-arrays buffer that
+// stays on the accelerator, so debug views and the denoiser read the surfaces without
+// tracing the scene again. The outputs are picked by the template argument of render():
+// the branches of outputs that are not asked for compile away and their buffers shrink
+// to a single element that is never copied.
+
+enum gbuffer_output
+{
+	// distance along the primary ray, 0 where it missed
+	gbuffer_depth = 1,
+	// unit surface normal, x, y and z planes, 0 where the ray missed
+	gbuffer_normal = 2,
+	// material id, -1 where the ray missed
+	gbuffer_material = 4,
+	// unlit surface colour, r, g and b planes
+	gbuffer_albedo = 8,
+	// HDR colour as render_reflection shades it, averaged over the colour samples of the
+	// primary hit, r, g and b planes. Every render after the first draws new samples, so
+	// that temporal accumulation averages independent ones.
+	gbuffer_color = 16,
+	// x and y offset in pixels from a pixel to where its surface was in the previous
+	// render, directions of missed rays count as infinitely far away
+	gbuffer_motion = 32,
+	gbuffer_all = 63
+};
+
+template <typename fp_t>
+class gbuffer
+{
+public:
+	gbuffer() : width(0), height(0), rendered(0), has_previous(false), previous_phi(0), previous_theta(0), previous_eyedist(0), previous_aa_factor(0), previous_width(0), previous_height(0), color_samples(1), frame(0) {}
+
+	// Traces one primary ray per pixel of a width by height image and writes outputs, a
+	// combination of gbuffer_output flags. aa_factor scales the image as in
+	// render_reflection.
+	template <int outputs>
+	void render(int width, int height, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor, int order = pixel_order_row_major)
+	{
+		using namespace Concurrency;
+
+		this->width = width;
+		this->height = height;
+		rendered = outputs;
+
+		const int pixels = width * height;
+		allocate(depth_data, depth_view, (outputs & gbuffer_depth) ? pixels : 1);
+		allocate(normal_data, normal_view, (outputs & gbuffer_normal) ? 3 * pixels : 1);
+		allocate(material_data, material_view, (outputs & gbuffer_material) ? pixels : 1);
+		allocate(albedo_data, albedo_view, (outputs & gbuffer_albedo) ? 3 * pixels : 1);
+		allocate(color_data, color_view, (outputs & gbuffer_color) ? 3 * pixels : 1);
+		allocate(motion_data, motion_view, (outputs & gbuffer_motion) ? 2 * pixels : 1);
+
+		perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+		material_storage<fp_t> materials;
+
+		const fp_t edge = 640 * aa_factor;
+		const int xshift = static_cast<int>((width - edge) / 2);
+		const int yshift = static_cast<int>((height - edge) / 2);
+
+		// the first render, and one after reset(), has no motion
+		if (!has_previous)
+		{
+			set_previous(phi, theta, eyedist, aa_factor);
+		}
+
+		perspective_camera<fp_t> previous(reflection_camera(previous_phi, previous_theta, previous_eyedist));
+		const fp_t previous_edge = 640 * previous_aa_factor;
+		const int previous_xshift = static_cast<int>((previous_width - previous_edge) / 2);
+		const int previous_yshift = static_cast<int>((previous_height - previous_edge) / 2);
+
+		array_view<fp_t, 1> depth(*depth_view);
+		array_view<fp_t, 1> normal(*normal_view);
+		array_view<int, 1> material_id(*material_view);
+		array_view<fp_t, 1> albedo(*albedo_view);
+		array_view<fp_t, 1> color_value(*color_view);
+		array_view<fp_t, 1> motion(*motion_view);
+		const int samples = color_samples;
+		const unsigned int first_sample = frame * static_cast<unsigned int>(samples);
+
+		parallel_for_each_pixel(extent<2>(height, width), order, [=](int x, int y) restrict(amp)
+		{
+			const int i = y * width + x;
+
+			fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+			fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+
+			ray<fp_t> ray(camera.generate_ray(sx, sy));
+			intersect_result<fp_t> ir(scene.intersect(ray));
+
+			if (outputs & gbuffer_depth)
+			{
+				depth[i] = ir.is_hit ? ir.distance : 0.0f;
+			}
+
+			if (outputs & gbuffer_normal)
+			{
+				vector3<fp_t> n(ir.is_hit ? ir.normal : vector3<fp_t>(0, 0, 0));
+				normal[i] = n.x;
+				normal[pixels + i] = n.y;
+				normal[2 * pixels + i] = n.z;
+			}
+
+			if (outputs & gbuffer_material)
+			{
+				material_id[i] = ir.is_hit ? ir.material : -1;
+			}
+
+			if (outputs & gbuffer_albedo)
+			{
+				color<fp_t> a(ir.is_hit ? materials.albedo(ir.material, ir.position) : color<fp_t>::black());
+				albedo[i] = a.r;
+				albedo[pixels + i] = a.g;
+				albedo[2 * pixels + i] = a.b;
+			}
+
+			if (outputs & gbuffer_color)
+			{
+				color<fp_t> c(shade_reflection(ray, ir, scene, materials, lights, 3, sample_random(static_cast<unsigned int>(i), first_sample)));
+				for (int sample = 1; sample < samples; sample++)
+				{
+					c = c + shade_reflection(ray, ir, scene, materials, lights, 3, sample_random(static_cast<unsigned int>(i), first_sample + sample));
+				}
+				c = c * (1.0f / samples);
+
+				color_value[i] = c.r;
+				color_value[pixels + i] = c.g;
+				color_value[2 * pixels + i] = c.b;
+			}
+
+			if (outputs & gbuffer_motion)
+			{
+				// a direction seen from the previous eye stands for a point at infinity
+				vector3<fp_t> point(ir.is_hit ? ir.position : previous.eye + ray.direction);
+
+				fp_t px, py, pdepth;
+				fp_t mx = 0.0f;
+				fp_t my = 0.0f;
+				if (previous.project(point, px, py, pdepth))
+				{
+					mx = px * previous_edge + previous_xshift - x;
+					my = (1.0f - py) * previous_edge + previous_yshift - y;
+				}
+
+				motion[i] = mx;
+				motion[pixels + i] = my;
+			}
+		});
+
+		set_previous(phi, theta, eyedist, aa_factor);
+		frame++;
+	}
+
+	// Writes a debug view of one output of the last render to result, which must have
+	// the size of that render. Depths are shown from white at 0 to black at max_depth,
+	// motion as red and green offsets around grey that saturate at max_motion pixels.
+	// Outputs the last render did not write are shown black.
+	void show(const Concurrency::array_view<unsigned int, 2>& result, int output, fp_t max_depth, fp_t max_motion, int order = pixel_order_row_major) const
+	{
+		using namespace Concurrency;
+
+		if (!(rendered & output))
+		{
+			output = 0;
+		}
+
+		const int width = this->width;
+		const int pixels = width * height;
+
+		array_view<const fp_t, 1> depth(*depth_view);
+		array_view<const fp_t, 1> normal(*normal_view);
+		array_view<const int, 1> material_id(*material_view);
+		array_view<const fp_t, 1> albedo(*albedo_view);
+		array_view<const fp_t, 1> color_value(*color_view);
+		array_view<const fp_t, 1> motion(*motion_view);
+
+		parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
+		{
+			const int i = y * width + x;
+
+			color<fp_t> c(color<fp_t>::black());
+			switch (output)
+			{
+			case gbuffer_depth:
+				if (depth[i] > 0.0f)
+				{
+					fp_t d = 1.0f - direct3d::saturate(depth[i] / max_depth);
+					c = color<fp_t>(d, d, d);
+				}
+				break;
+			case gbuffer_normal:
+				c = color<fp_t>(normal[i] + 1.0f, normal[pixels + i] + 1.0f, normal[2 * pixels + i] + 1.0f) * 0.5f;
+				break;
+			case gbuffer_material:
+				if (material_id[i] >= 0)
+				{
+					unsigned int h = hash_uint(static_cast<unsigned int>(material_id[i]));
+					c = color<fp_t>(hash_to_unit(h), hash_to_unit(hash_uint(h)), hash_to_unit(hash_uint(h + 1)));
+				}
+				break;
+			case gbuffer_albedo:
+				c = color<fp_t>(albedo[i], albedo[pixels + i], albedo[2 * pixels + i]);
+				break;
+			case gbuffer_color:
+				c = color<fp_t>(color_value[i], color_value[pixels + i], color_value[2 * pixels + i]);
+				break;
+			case gbuffer_motion:
+				c = color<fp_t>(0.5f + 0.5f * motion[i] / max_motion, 0.5f + 0.5f * motion[pixels + i] / max_motion, 0.5f);
+				break;
+			}
+
+			result(y, x) = tone_map(c);
+		});
+	}
+
+	// Forgets the previous view, the next render has no motion and draws the samples of
+	// the first one.
+	void reset()
+	{
+		has_previous = false;
+		frame = 0;
+	}
+
+	// Light samples per pixel of the colour output. They share the primary hit, so more of
+	// them cost shading and shadow rays but no primary traversal.
+	void set_color_samples(int samples)
+	{
+		color_samples = std::max(samples, 1);
+	}
+
+	int get_color_samples() const
+	{
+		return color_samples;
+	}
+
+	int get_width() const
+	{
+		return width;
+	}
+
+	int get_height() const
+	{
+		return height;
+	}
+
+	// outputs written by the last render
+	int outputs() const
+	{
+		return rendered;
+	}
+
+	// Planes of each output, indexed plane * width * height + y * width + x. Only the
+	// outputs of the last render hold data.
+	const Concurrency::array_view<fp_t, 1>& depth() const { return *depth_view; }
+	const Concurrency::array_view<fp_t, 1>& normal() const { return *normal_view; }
+	const Concurrency::array_view<int, 1>& material_ids() const { return *material_view; }
+	const Concurrency::array_view<fp_t, 1>& albedo() const { return *albedo_view; }
+	const Concurrency::array_view<fp_t, 1>& color_value() const { return *color_view; }
+	const Concurrency::array_view<fp_t, 1>& motion() const { return *motion_view; }
+
+private:
+	// Every output is overwritten in full, so the old contents are never copied in.
+	template <typename value_t>
+	static void allocate(std::vector<value_t>& data, std::unique_ptr<Concurrency::array_view<value_t, 1>>& view, int size)
+	{
+		if (!view || view->extent[0] != size)
+		{
+			data.resize(size);
+			view.reset(new Concurrency::array_view<value_t, 1>(size, data));
+		}
+		view->discard_data();
+	}
+
+	void set_previous(fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor)
+	{
+		has_previous = true;
+		previous_phi = phi;
+		previous_theta = theta;
+		previous_eyedist = eyedist;
+		previous_aa_factor = aa_factor;
+		previous_width = width;
+		previous_height = height;
+	}
+
+	int width;
+	int height;
+	int rendered;
+
+	bool has_previous;
+	fp_t previous_phi;
+	fp_t previous_theta;
+	fp_t previous_eyedist;
+	fp_t previous_aa_factor;
+	int previous_width;
+	int previous_height;
+	int color_samples;
+	unsigned int frame;
+
+	std::vector<fp_t> depth_data;
+	std::vector<fp_t> normal_data;
+	std::vector<int> material_data;
+	std::vector<fp_t> albedo_data;
+	std::vector<fp_t> color_data;
+	std::vector<fp_t> motion_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> depth_view;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> normal_view;
+	std::unique_ptr<Concurrency::array_view<int, 1>> material_view;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> albedo_view;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> color_view;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> motion_view;
+};
@@ -1,152 +1,1487 @@
 #pragma once
 
-#include "raycommon.h"
+#include "lbvh.h"
+#include "packet.h"
+#include "transform.h"
+#include <memory>
 
-class geometry
+template <typename fp_t>
+class sphere
 {
 public:
-	enum geometry_type
+	vector3<fp_t> center;
+	fp_t radius;
+	int material;
+
+	explicit sphere(const vector3<fp_t>& center, fp_t radius, int material = 0) restrict(cpu, amp) : center(center), radius(radius), material(material) {}
+
+	// distance to the front surface, only hits in front of the ray origin are reported
+	static bool hit(const vector3<fp_t>& center, fp_t radius, const ray<fp_t>& ray, fp_t& distance) restrict(cpu, amp)
 	{
-		geometry_none,
-		geometry_sphere,
-		geometry_plane
-	};
+		vector3<fp_t> v = ray.origin - center;
+		fp_t a0 = v.sqr_length() - radius * radius;
+		fp_t d_dot_v = ray.direction.dot(v);
+
+		if (d_dot_v <= 0)
+		{
+			fp_t discr = d_dot_v * d_dot_v - a0;
+
+			if (discr >= 0)
+			{
+				distance = -d_dot_v - gpu::sqrt(discr);
+				return true;
+			}
+		}
+
+		return false;
+	}
 
-	template <typename fp_t>
-	intersect_result<fp_t> intersect(const ray<fp_t>& ray) const restrict(amp)
+	intersect_result<fp_t> intersect(const ray<fp_t>& ray) const restrict(cpu, amp)
 	{
-		switch (type)
+		fp_t distance;
+
+		if (hit(center, radius, ray, distance))
 		{
-		case geometry_sphere:
-			return static_cast<const sphere<fp_t>*>(this)->intersect_impl(ray);
-		case geometry_plane:
-			return static_cast<const plane<fp_t>*>(this)->intersect_impl(ray);
-		default:
-			return intersect_result<fp_t>();
+			vector3<fp_t> position(ray.get_point(distance));
+			return intersect_result<fp_t>(true, material, distance, position, (position - center).normalize());
 		}
+
+		return intersect_result<fp_t>();
+	}
+
+	aabb<fp_t> bounds() const restrict(cpu)
+	{
+		vector3<fp_t> r(radius, radius, radius);
+		return aabb<fp_t>(center - r, center + r);
 	}
-protected:
-	geometry(int type, int material) restrict(cpu, amp) : material(material), type(type) {}
+};
+
+template <typename fp_t>
+class plane
+{
+public:
+	vector3<fp_t> normal;
+	fp_t d;
 	int material;
-private:
-	int type;
+
+	explicit plane(const vector3<fp_t>& normal, fp_t d, int material = 0) restrict(cpu, amp) : normal(normal), d(d), material(material) {}
+
+	// the plane is one-sided, rays coming from behind it miss
+	static bool hit(const vector3<fp_t>& normal, fp_t d, const ray<fp_t>& ray, fp_t& distance) restrict(cpu, amp)
+	{
+		fp_t a = ray.direction.dot(normal);
+
+		if (a >= 0) return false;
+
+		fp_t b = normal.dot(ray.origin - normal * d);
+		distance = -b / a;
+
+		return true;
+	}
+
+	intersect_result<fp_t> intersect(const ray<fp_t>& ray) const restrict(cpu, amp)
+	{
+		fp_t distance;
+
+		if (hit(normal, d, ray, distance))
+		{
+			return intersect_result<fp_t>(true, material, distance, ray.get_point(distance), normal);
+		}
+
+		return intersect_result<fp_t>();
+	}
 };
 
+// Watertight ray/triangle test (Woop, Benthin and Wald, "Watertight Ray/Triangle
+// Intersection"). The vertices are moved into a ray space where the ray runs along +z,
+// so edges shared by two triangles are evaluated identically and rays cannot slip
+// through the seams of a closed mesh.
 template <typename fp_t>
-class sphere : public geometry
+class triangle
 {
 public:
-	vector3<fp_t> center;
-	fp_t radius;
+	// per-ray shear constants, computed once and reused for every triangle
+	class ray_shear
+	{
+	public:
+		int kx, ky, kz;
+		fp_t sx, sy, sz;
+
+		explicit ray_shear(const vector3<fp_t>& direction) restrict(cpu, amp)
+		{
+			fp_t ax = gpu::fabs(direction.x);
+			fp_t ay = gpu::fabs(direction.y);
+			fp_t az = gpu::fabs(direction.z);
+
+			kz = (ax > ay) ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+			kx = kz == 2 ? 0 : kz + 1;
+			ky = kx == 2 ? 0 : kx + 1;
+
+			// keep the winding when the dominant direction is negative
+			if (vector_axis(direction, kz) < 0)
+			{
+				int t = kx;
+				kx = ky;
+				ky = t;
+			}
+
+			sx = vector_axis(direction, kx) / vector_axis(direction, kz);
+			sy = vector_axis(direction, ky) / vector_axis(direction, kz);
+			sz = 1.0f / vector_axis(direction, kz);
+		}
+	};
+
+	static bool hit(const vector3<fp_t>& a, const vector3<fp_t>& b, const vector3<fp_t>& c, const ray<fp_t>& ray, const ray_shear& shear, fp_t max_distance, fp_t& distance) restrict(cpu, amp)
+	{
+		vector3<fp_t> pa(a - ray.origin);
+		vector3<fp_t> pb(b - ray.origin);
+		vector3<fp_t> pc(c - ray.origin);
+
+		fp_t az = vector_axis(pa, shear.kz);
+		fp_t bz = vector_axis(pb, shear.kz);
+		fp_t cz = vector_axis(pc, shear.kz);
+
+		fp_t ax = vector_axis(pa, shear.kx) - shear.sx * az;
+		fp_t ay = vector_axis(pa, shear.ky) - shear.sy * az;
+		fp_t bx = vector_axis(pb, shear.kx) - shear.sx * bz;
+		fp_t by = vector_axis(pb, shear.ky) - shear.sy * bz;
+		fp_t cx = vector_axis(pc, shear.kx) - shear.sx * cz;
+		fp_t cy = vector_axis(pc, shear.ky) - shear.sy * cz;
+
+		fp_t u = cx * by - cy * bx;
+		fp_t v = ax * cy - ay * cx;
+		fp_t w = bx * ay - by * ax;
+
+		if ((u < 0 || v < 0 || w < 0) && (u > 0 || v > 0 || w > 0))
+		{
+			return false;
+		}
+
+		fp_t det = u + v + w;
+
+		if (det == 0)
+		{
+			return false;
+		}
+
+		distance = (u * az + v * bz + w * cz) * shear.sz / det;
+
+		// closer hits are taken for the surface a shadow or reflection ray starts from
+		return distance > min_distance() && distance < max_distance;
+	}
 
-	explicit sphere(const vector3<fp_t>& center, fp_t radius, int material) restrict(cpu, amp) : geometry(geometry_sphere, material), center(center), radius(radius) { init(); }
+	static fp_t min_distance() restrict(cpu, amp)
+	{
+		return 1e-3f;
+	}
 
-	intersect_result<fp_t> intersect_impl(const ray<fp_t>& ray) const restrict(amp)
+	static vector3<fp_t> normal(const vector3<fp_t>& a, const vector3<fp_t>& b, const vector3<fp_t>& c) restrict(cpu, amp)
 	{
-		vector3<fp_t> v = ray.origin - center;
-		fp_t a0 = v.sqr_length() - sqr_radius;
-		fp_t d_dot_v = ray.direction.dot(v);
+		return (b - a).cross(c - a).normalize();
+	}
+};
+
+// Device side sphere pool in SoA layout, stored in BVH leaf order.
+template <typename fp_t>
+class sphere_pool
+{
+public:
+	Concurrency::array_view<const fp_t, 1> center_x;
+	Concurrency::array_view<const fp_t, 1> center_y;
+	Concurrency::array_view<const fp_t, 1> center_z;
+	Concurrency::array_view<const fp_t, 1> radius;
+	Concurrency::array_view<const int, 1> material;
+	int count;
+
+	explicit sphere_pool(
+		const Concurrency::array_view<const fp_t, 1>& center_x,
+		const Concurrency::array_view<const fp_t, 1>& center_y,
+		const Concurrency::array_view<const fp_t, 1>& center_z,
+		const Concurrency::array_view<const fp_t, 1>& radius,
+		const Concurrency::array_view<const int, 1>& material,
+		int count) restrict(cpu)
+		: center_x(center_x), center_y(center_y), center_z(center_z), radius(radius), material(material), count(count)
+	{
+	}
 
-		if (d_dot_v <= 0 )
+	void intersect_range(int first, int range_count, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		for (int i = first; i < first + range_count; i++)
 		{
-			fp_t discr = d_dot_v * d_dot_v - a0;
-			fp_t distance = -d_dot_v - gpu::sqrt(discr);
-			vector3<fp_t> position(ray.get_point(distance));
+			fp_t distance;
 
-			if (discr >= 0)
+			if (sphere<fp_t>::hit(vector3<fp_t>(center_x[i], center_y[i], center_z[i]), radius[i], ray, distance) && distance < hit.distance)
 			{
-				return intersect_result<fp_t>(
-					true, 
-					material, 
-					distance,
-					position,
-					(position - center).normalize()
-					);
+				hit.distance = distance;
+				hit.kind = primitive_sphere;
+				hit.index = i;
+			}
+		}
+	}
+
+	bool occluded_range(int first, int range_count, const ray<fp_t>& ray, fp_t max_distance) const restrict(cpu, amp)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			fp_t distance;
 
+			if (sphere<fp_t>::hit(vector3<fp_t>(center_x[i], center_y[i], center_z[i]), radius[i], ray, distance) && distance <= max_distance)
+			{
+				return true;
 			}
 		}
 
-		return intersect_result<fp_t>();
+		return false;
 	}
 
-private:
-	fp_t sqr_radius;
-	void init() restrict(cpu, amp)
+	intersect_result<fp_t> result(int i, const ray<fp_t>& ray, fp_t distance) const restrict(cpu, amp)
+	{
+		vector3<fp_t> position(ray.get_point(distance));
+		vector3<fp_t> center(center_x[i], center_y[i], center_z[i]);
+
+		return intersect_result<fp_t>(true, material[i], distance, position, (position - center).normalize());
+	}
+
+	template <int packet_size>
+	void intersect_packet(int first, int range_count, ray_packet<fp_t, packet_size>& packet) const restrict(cpu)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			const fp_t cx = center_x[i];
+			const fp_t cy = center_y[i];
+			const fp_t cz = center_z[i];
+			const fp_t r = radius[i];
+
+			for (int lane = 0; lane < packet_size; lane++)
+			{
+				fp_t vx = packet.origin_x[lane] - cx;
+				fp_t vy = packet.origin_y[lane] - cy;
+				fp_t vz = packet.origin_z[lane] - cz;
+
+				fp_t a0 = (vx * vx + vy * vy + vz * vz) - r * r;
+				fp_t d_dot_v = packet.direction_x[lane] * vx + packet.direction_y[lane] * vy + packet.direction_z[lane] * vz;
+				fp_t discr = d_dot_v * d_dot_v - a0;
+				fp_t distance = -d_dot_v - std::sqrt(std::max(discr, static_cast<fp_t>(0.0f)));
+
+				bool closer = d_dot_v <= 0 && discr >= 0 && distance < packet.distance[lane];
+
+				packet.distance[lane] = closer ? distance : packet.distance[lane];
+				packet.kind[lane] = closer ? static_cast<int>(primitive_sphere) : packet.kind[lane];
+				packet.index[lane] = closer ? i : packet.index[lane];
+			}
+		}
+	}
+
+	void synchronize() const restrict(cpu)
 	{
-		sqr_radius = radius * radius;
+		center_x.synchronize();
+		center_y.synchronize();
+		center_z.synchronize();
+		radius.synchronize();
+		material.synchronize();
 	}
 };
 
+// Device side plane pool in SoA layout. Planes are unbounded and tested linearly.
 template <typename fp_t>
-class plane : public geometry
+class plane_pool
 {
 public:
-	vector3<fp_t> normal;
-	fp_t d;
+	Concurrency::array_view<const fp_t, 1> normal_x;
+	Concurrency::array_view<const fp_t, 1> normal_y;
+	Concurrency::array_view<const fp_t, 1> normal_z;
+	Concurrency::array_view<const fp_t, 1> d;
+	Concurrency::array_view<const int, 1> material;
+	int count;
 
-	explicit plane(const vector3<fp_t>& normal, fp_t d, int material) restrict(cpu, amp) : geometry(geometry_plane, material), normal(normal), d(d) { init(); }
+	explicit plane_pool(
+		const Concurrency::array_view<const fp_t, 1>& normal_x,
+		const Concurrency::array_view<const fp_t, 1>& normal_y,
+		const Concurrency::array_view<const fp_t, 1>& normal_z,
+		const Concurrency::array_view<const fp_t, 1>& d,
+		const Concurrency::array_view<const int, 1>& material,
+		int count) restrict(cpu)
+		: normal_x(normal_x), normal_y(normal_y), normal_z(normal_z), d(d), material(material), count(count)
+	{
+	}
 
-	intersect_result<fp_t> intersect_impl(const ray<fp_t>& ray) const restrict(amp)
+	void intersect_range(int first, int range_count, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
 	{
-		fp_t a = ray.direction.dot(normal);
+		for (int i = first; i < first + range_count; i++)
+		{
+			fp_t distance;
 
-		if (a >= 0) return intersect_result<fp_t>();
+			if (plane<fp_t>::hit(vector3<fp_t>(normal_x[i], normal_y[i], normal_z[i]), d[i], ray, distance) && distance < hit.distance)
+			{
+				hit.distance = distance;
+				hit.kind = primitive_plane;
+				hit.index = i;
+			}
+		}
+	}
+
+	bool occluded_range(int first, int range_count, const ray<fp_t>& ray, fp_t max_distance) const restrict(cpu, amp)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			fp_t distance;
+
+			if (plane<fp_t>::hit(vector3<fp_t>(normal_x[i], normal_y[i], normal_z[i]), d[i], ray, distance) && distance <= max_distance)
+			{
+				return true;
+			}
+		}
 
-		fp_t b = normal.dot(ray.origin - position);
-		fp_t distance = -b / a;
+		return false;
+	}
 
-		return intersect_result<fp_t>(true, material, distance, ray.get_point(distance), normal); 
+	intersect_result<fp_t> result(int i, const ray<fp_t>& ray, fp_t distance) const restrict(cpu, amp)
+	{
+		return intersect_result<fp_t>(true, material[i], distance, ray.get_point(distance), vector3<fp_t>(normal_x[i], normal_y[i], normal_z[i]));
 	}
-private:
-	vector3<fp_t> position;
-	void init() restrict(cpu, amp)
+
+	template <int packet_size>
+	void intersect_packet(int first, int range_count, ray_packet<fp_t, packet_size>& packet) const restrict(cpu)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			const fp_t nx = normal_x[i];
+			const fp_t ny = normal_y[i];
+			const fp_t nz = normal_z[i];
+			const fp_t nd = d[i];
+
+			for (int lane = 0; lane < packet_size; lane++)
+			{
+				fp_t a = packet.direction_x[lane] * nx + packet.direction_y[lane] * ny + packet.direction_z[lane] * nz;
+				fp_t b = nx * (packet.origin_x[lane] - nx * nd) + ny * (packet.origin_y[lane] - ny * nd) + nz * (packet.origin_z[lane] - nz * nd);
+				fp_t distance = -b / a;
+
+				bool closer = a < 0 && distance < packet.distance[lane];
+
+				packet.distance[lane] = closer ? distance : packet.distance[lane];
+				packet.kind[lane] = closer ? static_cast<int>(primitive_plane) : packet.kind[lane];
+				packet.index[lane] = closer ? i : packet.index[lane];
+			}
+		}
+	}
+
+	void synchronize() const restrict(cpu)
 	{
-		position = normal * d;
+		normal_x.synchronize();
+		normal_y.synchronize();
+		normal_z.synchronize();
+		d.synchronize();
+		material.synchronize();
 	}
 };
 
-template<typename fp_t>
-class scene_storage
+// Device side triangle pool. Vertices are shared through an index buffer holding
+// three indices per triangle, triangles are stored in BVH leaf order.
+template <typename fp_t>
+class triangle_pool
 {
 public:
-	enum
+	Concurrency::array_view<const fp_t, 1> vertex_x;
+	Concurrency::array_view<const fp_t, 1> vertex_y;
+	Concurrency::array_view<const fp_t, 1> vertex_z;
+	Concurrency::array_view<const int, 1> indices;
+	Concurrency::array_view<const int, 1> material;
+	int count;
+
+	explicit triangle_pool(
+		const Concurrency::array_view<const fp_t, 1>& vertex_x,
+		const Concurrency::array_view<const fp_t, 1>& vertex_y,
+		const Concurrency::array_view<const fp_t, 1>& vertex_z,
+		const Concurrency::array_view<const int, 1>& indices,
+		const Concurrency::array_view<const int, 1>& material,
+		int count) restrict(cpu)
+		: vertex_x(vertex_x), vertex_y(vertex_y), vertex_z(vertex_z), indices(indices), material(material), count(count)
 	{
-		geometry_max_size = 16,
-		geometry_count = 3
-	};
+	}
 
-	scene_storage() restrict(cpu)
+	vector3<fp_t> vertex(int i) const restrict(cpu, amp)
 	{
-		new(geometries + 0) plane<fp_t>(vector3<fp_t>(0.0f, 1.0f, 0.0f), 0.0f, 2);
-		new(geometries + 1) sphere<fp_t>(vector3<fp_t>(-15.0f, 15.0f, -10.0f), 15.0f, 0);
-		new(geometries + 2) sphere<fp_t>(vector3<fp_t>(12.0f, 10.0f, -10.0f), 10.0f, 1);
+		return vector3<fp_t>(vertex_x[i], vertex_y[i], vertex_z[i]);
 	}
 
-	intersect_result<fp_t> intersect(const ray<fp_t>& ray) const restrict(cpu, amp)
+	void intersect_range(int first, int range_count, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
 	{
-		fp_t z = 0.0f;
-		fp_t min_dist = 1.0f / z;
-		intersect_result<fp_t> min_result;
+		typename triangle<fp_t>::ray_shear shear(ray.direction);
 
-		for (int i = 0; i < geometry_count; i++)
+		for (int i = first; i < first + range_count; i++)
 		{
-			const geometry_object* o = &geometries[i];
-			const geometry* g = reinterpret_cast<const geometry*>(o);
+			fp_t distance;
+
+			if (triangle<fp_t>::hit(vertex(indices[3 * i]), vertex(indices[3 * i + 1]), vertex(indices[3 * i + 2]), ray, shear, hit.distance, distance))
+			{
+				hit.distance = distance;
+				hit.kind = primitive_triangle;
+				hit.index = i;
+			}
+		}
+	}
+
+	bool occluded_range(int first, int range_count, const ray<fp_t>& ray, fp_t max_distance) const restrict(cpu, amp)
+	{
+		typename triangle<fp_t>::ray_shear shear(ray.direction);
 
-			intersect_result<fp_t> result(g->intersect(ray));
+		for (int i = first; i < first + range_count; i++)
+		{
+			fp_t distance;
 
-			if (result.is_hit && result.distance < min_dist)
+			if (triangle<fp_t>::hit(vertex(indices[3 * i]), vertex(indices[3 * i + 1]), vertex(indices[3 * i + 2]), ray, shear, max_distance, distance))
 			{
-				min_dist = result.distance;
-				min_result = result;
+				return true;
 			}
 		}
 
-		return min_result;
+		return false;
 	}
-private:
-	struct geometry_object
+
+	// meshes are shaded two-sided, the normal always faces the incoming ray
+	intersect_result<fp_t> result(int i, const ray<fp_t>& ray, fp_t distance) const restrict(cpu, amp)
+	{
+		vector3<fp_t> normal(triangle<fp_t>::normal(vertex(indices[3 * i]), vertex(indices[3 * i + 1]), vertex(indices[3 * i + 2])));
+
+		if (normal.dot(ray.direction) > 0)
+		{
+			normal = normal.negate();
+		}
+
+		return intersect_result<fp_t>(true, material[i], distance, ray.get_point(distance), normal);
+	}
+
+	// The watertight test needs a per-lane shear and is not vectorized, the packet only
+	// saves the vertex fetches and the traversal.
+	template <int packet_size>
+	void intersect_packet(int first, int range_count, ray_packet<fp_t, packet_size>& packet) const restrict(cpu)
+	{
+		for (int lane = 0; lane < packet_size; lane++)
+		{
+			ray<fp_t> lane_ray(packet.get_ray(lane));
+			typename triangle<fp_t>::ray_shear shear(lane_ray.direction);
+
+			for (int i = first; i < first + range_count; i++)
+			{
+				fp_t distance;
+
+				if (triangle<fp_t>::hit(vertex(indices[3 * i]), vertex(indices[3 * i + 1]), vertex(indices[3 * i + 2]), lane_ray, shear, packet.distance[lane], distance))
+				{
+					packet.distance[lane] = distance;
+					packet.kind[lane] = primitive_triangle;
+					packet.index[lane] = i;
+				}
+			}
+		}
+	}
+
+	void synchronize() const restrict(cpu)
+	{
+		vertex_x.synchronize();
+		vertex_y.synchronize();
+		vertex_z.synchronize();
+		indices.synchronize();
+		material.synchronize();
+	}
+};
+
+// Device side instances of shapes, the two-level part of the scene. A shape is a sphere
+// set or a mesh in its own object space with its own BVH, the bottom level; all shapes
+// share the object space pools and one node array, rooted at shape_root. An instance
+// places a shape with an affine transform, the top level BVH over the world bounds of
+// the instances leads rays to the instances they may hit. There a ray is moved into
+// object space with a renormalized direction, since the sphere test needs a unit one,
+// and distances are scaled back to world space. Geometry is stored once per shape
+// however many instances show it.
+template <typename fp_t>
+class instance_pool
+{
+public:
+	sphere_pool<fp_t> spheres;
+	triangle_pool<fp_t> triangles;
+	Concurrency::array_view<const bvh_node<fp_t>, 1> shape_nodes;
+	Concurrency::array_view<const int, 1> shape_kind;
+	Concurrency::array_view<const int, 1> shape_root;
+	Concurrency::array_view<const affine_transform<fp_t>, 1> to_object;
+	Concurrency::array_view<const int, 1> shape;
+	// instance of every slot of the top level leaves
+	Concurrency::array_view<const int, 1> order;
+	int count;
+
+	explicit instance_pool(
+		const sphere_pool<fp_t>& spheres,
+		const triangle_pool<fp_t>& triangles,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& shape_nodes,
+		const Concurrency::array_view<const int, 1>& shape_kind,
+		const Concurrency::array_view<const int, 1>& shape_root,
+		const Concurrency::array_view<const affine_transform<fp_t>, 1>& to_object,
+		const Concurrency::array_view<const int, 1>& shape,
+		const Concurrency::array_view<const int, 1>& order,
+		int count) restrict(cpu)
+		: spheres(spheres), triangles(triangles), shape_nodes(shape_nodes), shape_kind(shape_kind), shape_root(shape_root),
+		to_object(to_object), shape(shape), order(order), count(count)
+	{
+	}
+
+	// The same shapes with new instances, the shape views are shared.
+	explicit instance_pool(
+		const instance_pool& shapes,
+		const Concurrency::array_view<const affine_transform<fp_t>, 1>& to_object,
+		const Concurrency::array_view<const int, 1>& shape,
+		const Concurrency::array_view<const int, 1>& order,
+		int count) restrict(cpu)
+		: spheres(shapes.spheres), triangles(shapes.triangles), shape_nodes(shapes.shape_nodes), shape_kind(shapes.shape_kind), shape_root(shapes.shape_root),
+		to_object(to_object), shape(shape), order(order), count(count)
+	{
+	}
+
+	// ray in the object space of instance, object space distances are length times the world ones
+	ray<fp_t> object_ray(int instance, const ray<fp_t>& ray, fp_t& length) const restrict(cpu, amp)
+	{
+		const affine_transform<fp_t> transform(to_object[instance]);
+		vector3<fp_t> direction(transform.direction(ray.direction));
+		length = direction.length();
+
+		return ::ray<fp_t>(transform.point(ray.origin), direction / length);
+	}
+
+	void intersect_instance(int instance, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		fp_t length;
+		::ray<fp_t> local(object_ray(instance, ray, length));
+		hit_record<fp_t> local_hit(hit.distance * length);
+
+		const int s = shape[instance];
+		if (shape_kind[s] == primitive_sphere)
+		{
+			bvh_traverse(shape_nodes, spheres, local, local_hit, shape_root[s]);
+		}
+		else
+		{
+			bvh_traverse(shape_nodes, triangles, local, local_hit, shape_root[s]);
+		}
+
+		if (local_hit.kind != primitive_none)
+		{
+			hit.distance = local_hit.distance / length;
+			hit.kind = local_hit.kind;
+			hit.index = local_hit.index;
+			hit.instance = instance;
+		}
+	}
+
+	void intersect_range(int first, int range_count, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			intersect_instance(order[i], ray, hit);
+		}
+	}
+
+	bool occluded_range(int first, int range_count, const ray<fp_t>& ray, fp_t max_distance) const restrict(cpu, amp)
+	{
+		for (int i = first; i < first + range_count; i++)
+		{
+			const int instance = order[i];
+
+			fp_t length;
+			::ray<fp_t> local(object_ray(instance, ray, length));
+
+			const int s = shape[instance];
+			if (shape_kind[s] == primitive_sphere ?
+				bvh_occluded(shape_nodes, spheres, local, max_distance * length, shape_root[s]) :
+				bvh_occluded(shape_nodes, triangles, local, max_distance * length, shape_root[s]))
+			{
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	// Hit of one given primitive of an instance, see scene_storage::intersect_primitive.
+	void intersect_primitive(int kind, int index, int instance, const ray<fp_t>& ray, hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		fp_t length;
+		::ray<fp_t> local(object_ray(instance, ray, length));
+		hit_record<fp_t> local_hit(hit.distance * length);
+
+		if (kind == primitive_sphere)
+		{
+			spheres.intersect_range(index, 1, local, local_hit);
+		}
+		else
+		{
+			triangles.intersect_range(index, 1, local, local_hit);
+		}
+
+		if (local_hit.kind != primitive_none)
+		{
+			hit.distance = local_hit.distance / length;
+			hit.kind = local_hit.kind;
+			hit.index = local_hit.index;
+			hit.instance = instance;
+		}
+	}
+
+	// The normal is found in object space and moved back with the inverse transpose, the
+	// position is taken on the world space ray.
+	intersect_result<fp_t> result(const ray<fp_t>& ray, const hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		fp_t length;
+		::ray<fp_t> local(object_ray(hit.instance, ray, length));
+
+		intersect_result<fp_t> r(hit.kind == primitive_sphere ?
+			spheres.result(hit.index, local, hit.distance * length) :
+			triangles.result(hit.index, local, hit.distance * length));
+
+		return intersect_result<fp_t>(true, r.material, hit.distance, ray.get_point(hit.distance), to_object[hit.instance].transpose_direction(r.normal).normalize());
+	}
+
+	// Instances are traced lane by lane, the packet only shares the top level traversal.
+	template <int packet_size>
+	void intersect_packet(int first, int range_count, ray_packet<fp_t, packet_size>& packet) const restrict(cpu)
+	{
+		for (int lane = 0; lane < packet_size; lane++)
+		{
+			ray<fp_t> lane_ray(packet.get_ray(lane));
+			hit_record<fp_t> hit(packet.hit(lane));
+
+			intersect_range(first, range_count, lane_ray, hit);
+
+			packet.distance[lane] = hit.distance;
+			packet.kind[lane] = hit.kind;
+			packet.index[lane] = hit.index;
+			packet.instance[lane] = hit.instance;
+		}
+	}
+
+	void synchronize() const restrict(cpu)
 	{
-		fp_t values[geometry_max_size];
-	} geometries[geometry_count];
+		spheres.synchronize();
+		triangles.synchronize();
+		shape_nodes.synchronize();
+		shape_kind.synchronize();
+		shape_root.synchronize();
+		to_object.synchronize();
+		shape.synchronize();
+		order.synchronize();
+	}
+};
+
+// Read-only view of a scene that can be captured by amp kernels. Every primitive type
+// is intersected by its own batched loop, bounded types through their own BVH.
+// Instances come last: their hits are the only ones that set hit_record::instance.
+template<typename fp_t>
+class scene_storage
+{
+public:
+	explicit scene_storage(
+		const sphere_pool<fp_t>& spheres,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& sphere_nodes,
+		const triangle_pool<fp_t>& triangles,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& triangle_nodes,
+		const plane_pool<fp_t>& planes,
+		const instance_pool<fp_t>& instances,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& instance_nodes) restrict(cpu)
+		: spheres(spheres), sphere_nodes(sphere_nodes), triangles(triangles), triangle_nodes(triangle_nodes), planes(planes),
+		instances(instances), instance_nodes(instance_nodes)
+	{
+	}
+
+	// The same scene with its spheres and triangles moved, the views of everything else
+	// are shared.
+	explicit scene_storage(
+		const scene_storage& other,
+		const sphere_pool<fp_t>& spheres,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& sphere_nodes,
+		const triangle_pool<fp_t>& triangles,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& triangle_nodes) restrict(cpu)
+		: spheres(spheres), sphere_nodes(sphere_nodes), triangles(triangles), triangle_nodes(triangle_nodes), planes(other.planes),
+		instances(other.instances), instance_nodes(other.instance_nodes)
+	{
+	}
+
+	// The same scene with its instances moved, the views of everything else are shared.
+	explicit scene_storage(
+		const scene_storage& other,
+		const instance_pool<fp_t>& instances,
+		const Concurrency::array_view<const bvh_node<fp_t>, 1>& instance_nodes) restrict(cpu)
+		: spheres(other.spheres), sphere_nodes(other.sphere_nodes), triangles(other.triangles), triangle_nodes(other.triangle_nodes), planes(other.planes),
+		instances(instances), instance_nodes(instance_nodes)
+	{
+	}
+
+	intersect_result<fp_t> intersect(const ray<fp_t>& ray) const restrict(cpu, amp)
+	{
+		return result(ray, closest_hit(ray));
+	}
+
+	hit_record<fp_t> closest_hit(const ray<fp_t>& ray) const restrict(cpu, amp)
+	{
+		fp_t z = 0.0f;
+		hit_record<fp_t> hit(1.0f / z);
+
+		// planes first, a close floor hit culls most of the hierarchy
+		planes.intersect_range(0, planes.count, ray, hit);
+
+		if (spheres.count > 0)
+		{
+			bvh_traverse(sphere_nodes, spheres, ray, hit);
+		}
+
+		if (triangles.count > 0)
+		{
+			bvh_traverse(triangle_nodes, triangles, ray, hit);
+		}
+
+		if (instances.count > 0)
+		{
+			bvh_traverse(instance_nodes, instances, ray, hit);
+		}
+
+		return hit;
+	}
+
+	// Hit of one given primitive, for checking that a cached hit still covers a pixel.
+	hit_record<fp_t> intersect_primitive(int kind, int index, int instance, const ray<fp_t>& ray) const restrict(cpu, amp)
+	{
+		fp_t z = 0.0f;
+		hit_record<fp_t> hit(1.0f / z);
+
+		if (instance >= 0)
+		{
+			instances.intersect_primitive(kind, index, instance, ray, hit);
+			return hit;
+		}
+
+		switch (kind)
+		{
+		case primitive_sphere:
+			spheres.intersect_range(index, 1, ray, hit);
+			break;
+		case primitive_plane:
+			planes.intersect_range(index, 1, ray, hit);
+			break;
+		case primitive_triangle:
+			triangles.intersect_range(index, 1, ray, hit);
+			break;
+		}
+
+		return hit;
+	}
+
+	// Shadow query: is anything hit within max_distance? Stops at the first blocker and
+	// computes no hit attributes. Planes and spheres report hits behind the origin like
+	// closest_hit does, so the result matches closest_hit(ray).distance <= max_distance.
+	bool occluded(const ray<fp_t>& ray, fp_t max_distance) const restrict(cpu, amp)
+	{
+		if (planes.occluded_range(0, planes.count, ray, max_distance))
+		{
+			return true;
+		}
+
+		if (spheres.count > 0 && bvh_occluded(sphere_nodes, spheres, ray, max_distance))
+		{
+			return true;
+		}
+
+		if (triangles.count > 0 && bvh_occluded(triangle_nodes, triangles, ray, max_distance))
+		{
+			return true;
+		}
+
+		return instances.count > 0 && bvh_occluded(instance_nodes, instances, ray, max_distance);
+	}
+
+	intersect_result<fp_t> result(const ray<fp_t>& ray, const hit_record<fp_t>& hit) const restrict(cpu, amp)
+	{
+		if (hit.instance >= 0)
+		{
+			return instances.result(ray, hit);
+		}
+
+		switch (hit.kind)
+		{
+		case primitive_sphere:
+			return spheres.result(hit.index, ray, hit.distance);
+		case primitive_plane:
+			return planes.result(hit.index, ray, hit.distance);
+		case primitive_triangle:
+			return triangles.result(hit.index, ray, hit.distance);
+		default:
+			return intersect_result<fp_t>();
+		}
+	}
+
+	// Closest hits of every lane of a prepared, coherent packet, read them with result().
+	template <int packet_size>
+	void intersect_packet(ray_packet<fp_t, packet_size>& packet) const restrict(cpu)
+	{
+		planes.intersect_packet(0, planes.count, packet);
+
+		if (spheres.count > 0)
+		{
+			bvh_traverse_packet(sphere_nodes, spheres, packet);
+		}
+
+		if (triangles.count > 0)
+		{
+			bvh_traverse_packet(triangle_nodes, triangles, packet);
+		}
+
+		if (instances.count > 0)
+		{
+			bvh_traverse_packet(instance_nodes, instances, packet);
+		}
+	}
+
+	const instance_pool<fp_t>& get_instances() const restrict(cpu)
+	{
+		return instances;
+	}
+
+	// Makes the host copies current before the views are read by CPU threads.
+	void synchronize() const restrict(cpu)
+	{
+		spheres.synchronize();
+		sphere_nodes.synchronize();
+		triangles.synchronize();
+		triangle_nodes.synchronize();
+		planes.synchronize();
+		instances.synchronize();
+		instance_nodes.synchronize();
+	}
+
+private:
+	sphere_pool<fp_t> spheres;
+	Concurrency::array_view<const bvh_node<fp_t>, 1> sphere_nodes;
+	triangle_pool<fp_t> triangles;
+	Concurrency::array_view<const bvh_node<fp_t>, 1> triangle_nodes;
+	plane_pool<fp_t> planes;
+	instance_pool<fp_t> instances;
+	Concurrency::array_view<const bvh_node<fp_t>, 1> instance_nodes;
+};
+
+// Views a host array, empty pools get a single placeholder element since amp views
+// need a non-empty extent.
+template <typename T>
+Concurrency::array_view<const T, 1> pool_view(const std::vector<T>& values)
+{
+	static const std::vector<T> placeholder(1);
+	const std::vector<T>& source = values.empty() ? placeholder : values;
+
+	return Concurrency::array_view<const T, 1>(static_cast<int>(source.size()), source);
+}
+
+template <typename T>
+void reorder_pool_array(std::vector<T>& values, const std::vector<int>& order)
+{
+	std::vector<T> reordered(order.size());
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		reordered[i] = values[order[i]];
+	}
+
+	values.swap(reordered);
+}
+
+// Indexed triangle mesh as read from disk, three indices per triangle.
+struct triangle_mesh
+{
+	std::vector<float> x, y, z;
+	std::vector<int> indices;
+
+	int vertex_count() const
+	{
+		return static_cast<int>(x.size());
+	}
+
+	int triangle_count() const
+	{
+		return static_cast<int>(indices.size() / 3);
+	}
+};
+
+// Spheres of an instanced shape in its object space.
+struct sphere_set
+{
+	std::vector<float> x, y, z, radius;
+	std::vector<int> material;
+
+	void add(float center_x, float center_y, float center_z, float sphere_radius, int sphere_material)
+	{
+		x.push_back(center_x);
+		y.push_back(center_y);
+		z.push_back(center_z);
+		radius.push_back(sphere_radius);
+		material.push_back(sphere_material);
+	}
+
+	int sphere_count() const
+	{
+		return static_cast<int>(radius.size());
+	}
+};
+
+template <typename T>
+size_t vector_bytes(const std::vector<T>& values)
+{
+	return values.size() * sizeof(T);
+}
+
+// Host side scene: owns the primitive pools and the hierarchies built over them. The
+// storage view stays valid, and cached on the accelerator, until the scene is rebuilt
+// or destroyed.
+//
+// Repeated objects are added once as a shape and placed by instances. Shapes are built
+// when they are added and never change, so moving instances with set_instance_transform
+// only rebuilds the top level hierarchy in update_instances.
+template<typename fp_t>
+class scene_data
+{
+public:
+	scene_data() restrict(cpu)
+		: sphere_stats(), triangle_stats()
+	{
+		add_plane(vector3<fp_t>(0.0f, 1.0f, 0.0f), 0.0f, 2);
+		add_sphere(vector3<fp_t>(-15.0f, 15.0f, -10.0f), 15.0f, 0);
+		add_sphere(vector3<fp_t>(12.0f, 10.0f, -10.0f), 10.0f, 1);
+		build();
+	}
+
+	// returns the id of the sphere, for move_sphere
+	int add_sphere(const vector3<fp_t>& center, fp_t radius, int material) restrict(cpu)
+	{
+		sphere_id.push_back(static_cast<int>(sphere_radius.size()));
+		sphere_center_x.push_back(center.x);
+		sphere_center_y.push_back(center.y);
+		sphere_center_z.push_back(center.z);
+		sphere_radius.push_back(radius);
+		sphere_material.push_back(material);
+
+		return sphere_id.back();
+	}
+
+	// adds the mesh scaled and moved so that it fits a box of the given size sitting at base
+	void add_mesh(const triangle_mesh& mesh, int material, const vector3<fp_t>& base, fp_t size) restrict(cpu)
+	{
+		fp_t scale;
+		vector3<fp_t> offset;
+		fit_mesh(mesh, base, size, scale, offset);
+
+		const int first_vertex = static_cast<int>(vertex_x.size());
+
+		for (int i = 0; i < mesh.vertex_count(); i++)
+		{
+			vertex_x.push_back(mesh.x[i] * scale + offset.x);
+			vertex_y.push_back(mesh.y[i] * scale + offset.y);
+			vertex_z.push_back(mesh.z[i] * scale + offset.z);
+		}
+
+		for (size_t i = 0; i < mesh.indices.size(); i++)
+		{
+			triangle_indices.push_back(first_vertex + mesh.indices[i]);
+		}
+
+		triangle_material.insert(triangle_material.end(), mesh.triangle_count(), material);
+	}
+
+	// Adds a sphere set for instancing and returns the id of the shape.
+	int add_shape(const sphere_set& spheres) restrict(cpu)
+	{
+		bvh_build_input<fp_t> input;
+		input.reserve(spheres.sphere_count());
+
+		for (int i = 0; i < spheres.sphere_count(); i++)
+		{
+			sphere<fp_t> s(vector3<fp_t>(spheres.x[i], spheres.y[i], spheres.z[i]), spheres.radius[i]);
+			input.push_back(s.bounds());
+		}
+
+		std::vector<int> order;
+		std::vector<bvh_node<fp_t>> nodes;
+		build_bvh_sah(input, order, nodes);
+
+		const int first = static_cast<int>(shape_sphere_radius.size());
+
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			shape_sphere_x.push_back(spheres.x[order[i]]);
+			shape_sphere_y.push_back(spheres.y[order[i]]);
+			shape_sphere_z.push_back(spheres.z[order[i]]);
+			shape_sphere_radius.push_back(spheres.radius[order[i]]);
+			shape_sphere_material.push_back(spheres.material[order[i]]);
+		}
+
+		return add_shape_nodes(primitive_sphere, nodes, first, spheres.sphere_count());
+	}
+
+	// Adds a mesh for instancing and returns the id of the shape. The mesh is scaled so
+	// that it fits a box of the given size sitting on the object space origin.
+	int add_shape(const triangle_mesh& mesh, int material, fp_t size) restrict(cpu)
+	{
+		fp_t scale;
+		vector3<fp_t> offset;
+		fit_mesh(mesh, vector3<fp_t>(), size, scale, offset);
+
+		const int first_vertex = static_cast<int>(shape_vertex_x.size());
+
+		for (int i = 0; i < mesh.vertex_count(); i++)
+		{
+			shape_vertex_x.push_back(mesh.x[i] * scale + offset.x);
+			shape_vertex_y.push_back(mesh.y[i] * scale + offset.y);
+			shape_vertex_z.push_back(mesh.z[i] * scale + offset.z);
+		}
+
+		bvh_build_input<fp_t> input;
+		input.reserve(mesh.triangle_count());
+
+		for (int i = 0; i < mesh.triangle_count(); i++)
+		{
+			aabb<fp_t> box;
+			for (int k = 0; k < 3; k++)
+			{
+				const int v = first_vertex + mesh.indices[3 * i + k];
+				box.grow(vector3<fp_t>(shape_vertex_x[v], shape_vertex_y[v], shape_vertex_z[v]));
+			}
+			input.push_back(box);
+		}
+
+		std::vector<int> order;
+		std::vector<bvh_node<fp_t>> nodes;
+		build_bvh_sah(input, order, nodes);
+
+		const int first = static_cast<int>(shape_triangle_material.size());
+
+		for (size_t i = 0; i < order.size(); i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				shape_triangle_indices.push_back(first_vertex + mesh.indices[3 * order[i] + k]);
+			}
+		}
+
+		shape_triangle_material.insert(shape_triangle_material.end(), mesh.triangle_count(), material);
+
+		return add_shape_nodes(primitive_triangle, nodes, first, mesh.triangle_count());
+	}
+
+	// Places a copy of shape in the scene and returns the id of the instance. It is seen
+	// after the next build() or update_instances().
+	int add_instance(int shape, const affine_transform<fp_t>& to_world) restrict(cpu)
+	{
+		instance_shape.push_back(shape);
+		instance_to_world.push_back(to_world);
+		instance_to_object.push_back(to_world.inverse());
+
+		return static_cast<int>(instance_shape.size()) - 1;
+	}
+
+	void set_instance_transform(int instance, const affine_transform<fp_t>& to_world) restrict(cpu)
+	{
+		instance_to_world[instance] = to_world;
+		instance_to_object[instance] = to_world.inverse();
+	}
+
+	const affine_transform<fp_t>& get_instance_transform(int instance) const restrict(cpu)
+	{
+		return instance_to_world[instance];
+	}
+
+	// Rebuilds the top level hierarchy over the instances and swaps in their new views,
+	// the views of the shapes and of the world space primitives are kept. Instances may
+	// have been moved or added since the last build(), shapes need a full build().
+	void update_instances() restrict(cpu)
+	{
+		build_instances();
+
+		storage_view.reset(new scene_storage<fp_t>(*storage_view,
+			instance_pool<fp_t>(storage_view->get_instances(), pool_view(instance_to_object), pool_view(instance_shape), pool_view(instance_order), instance_count),
+			pool_view(instance_nodes)));
+	}
+
+	void clear() restrict(cpu)
+	{
+		sphere_center_x.clear(); sphere_center_y.clear(); sphere_center_z.clear(); sphere_radius.clear(); sphere_material.clear(); sphere_id.clear();
+		vertex_x.clear(); vertex_y.clear(); vertex_z.clear(); triangle_indices.clear(); triangle_material.clear();
+		plane_normal_x.clear(); plane_normal_y.clear(); plane_normal_z.clear(); plane_d.clear(); plane_material.clear();
+		shape_sphere_x.clear(); shape_sphere_y.clear(); shape_sphere_z.clear(); shape_sphere_radius.clear(); shape_sphere_material.clear();
+		shape_vertex_x.clear(); shape_vertex_y.clear(); shape_vertex_z.clear(); shape_triangle_indices.clear(); shape_triangle_material.clear();
+		shape_nodes.clear(); shape_kind.clear(); shape_root.clear(); shape_primitive_count.clear();
+		instance_shape.clear(); instance_to_world.clear(); instance_to_object.clear();
+	}
+
+	void add_plane(const vector3<fp_t>& normal, fp_t d, int material) restrict(cpu)
+	{
+		plane_normal_x.push_back(normal.x);
+		plane_normal_y.push_back(normal.y);
+		plane_normal_z.push_back(normal.z);
+		plane_d.push_back(d);
+		plane_material.push_back(material);
+	}
+
+	// Reorders the spheres and triangles into BVH leaf order and rebuilds their
+	// hierarchies and the one over the instances, call it after adding primitives or
+	// shapes. The statistics sum the sphere and triangle trees.
+	void build(int method = bvh_build_sah) restrict(cpu)
+	{
+		build_method = method;
+		plane_count = static_cast<int>(plane_d.size());
+
+		build_spheres();
+		build_triangles();
+		build_instances();
+
+		storage_view.reset(new scene_storage<fp_t>(
+			sphere_pool<fp_t>(pool_view(sphere_center_x), pool_view(sphere_center_y), pool_view(sphere_center_z), pool_view(sphere_radius), pool_view(sphere_material), sphere_count),
+			pool_view(sphere_nodes),
+			triangle_pool<fp_t>(pool_view(vertex_x), pool_view(vertex_y), pool_view(vertex_z), pool_view(triangle_indices), pool_view(triangle_material), triangle_count),
+			pool_view(triangle_nodes),
+			plane_pool<fp_t>(pool_view(plane_normal_x), pool_view(plane_normal_y), pool_view(plane_normal_z), pool_view(plane_d), pool_view(plane_material), plane_count),
+			instance_pool<fp_t>(
+				sphere_pool<fp_t>(pool_view(shape_sphere_x), pool_view(shape_sphere_y), pool_view(shape_sphere_z), pool_view(shape_sphere_radius), pool_view(shape_sphere_material), static_cast<int>(shape_sphere_radius.size())),
+				triangle_pool<fp_t>(pool_view(shape_vertex_x), pool_view(shape_vertex_y), pool_view(shape_vertex_z), pool_view(shape_triangle_indices), pool_view(shape_triangle_material), static_cast<int>(shape_triangle_material.size())),
+				pool_view(shape_nodes), pool_view(shape_kind), pool_view(shape_root),
+				pool_view(instance_to_object), pool_view(instance_shape), pool_view(instance_order), instance_count),
+			pool_view(instance_nodes)));
+	}
+
+	// Moves a sphere of the built scene, ids count the spheres in the order they were
+	// added. The move is seen after the next update_dynamic() or build().
+	void move_sphere(int id, const vector3<fp_t>& center) restrict(cpu)
+	{
+		const int i = sphere_slot[id];
+		sphere_center_x[i] = center.x;
+		sphere_center_y[i] = center.y;
+		sphere_center_z[i] = center.z;
+		spheres_moved = true;
+	}
+
+	vector3<fp_t> get_sphere_center(int id) const restrict(cpu)
+	{
+		const int i = sphere_slot[id];
+		return vector3<fp_t>(sphere_center_x[i], sphere_center_y[i], sphere_center_z[i]);
+	}
+
+	fp_t get_sphere_radius(int id) const restrict(cpu)
+	{
+		return sphere_radius[sphere_slot[id]];
+	}
+
+	// Moves a mesh vertex in world space, vertices keep the order add_mesh added them in.
+	void move_vertex(int vertex, const vector3<fp_t>& position) restrict(cpu)
+	{
+		vertex_x[vertex] = position.x;
+		vertex_y[vertex] = position.y;
+		vertex_z[vertex] = position.z;
+		vertices_moved = true;
+	}
+
+	// Brings the sphere and triangle hierarchies up to date with the moved primitives.
+	// A tree is refitted in place, and rebuilt when that has let its SAH cost grow to
+	// more than rebuild_threshold times its cost after its last build. Only the views
+	// of the spheres and triangles are replaced.
+	bvh_update_stats update_dynamic(double rebuild_threshold = 2.0) restrict(cpu)
+	{
+		bvh_update_stats update = {};
+		update.cost_growth = 1.0;
+
+		if (spheres_moved && sphere_count > 0)
+		{
+			refit_or_rebuild(sphere_refitter, sphere_nodes, rebuild_threshold, update, [this](int i)
+			{
+				return sphere<fp_t>(vector3<fp_t>(sphere_center_x[i], sphere_center_y[i], sphere_center_z[i]), sphere_radius[i]).bounds();
+			}, [this] { build_spheres(); });
+		}
+
+		if (vertices_moved && triangle_count > 0)
+		{
+			refit_or_rebuild(triangle_refitter, triangle_nodes, rebuild_threshold, update, [this](int i)
+			{
+				return triangle_bounds(i);
+			}, [this] { build_triangles(); });
+		}
+
+		spheres_moved = false;
+		vertices_moved = false;
+
+		storage_view.reset(new scene_storage<fp_t>(*storage_view,
+			sphere_pool<fp_t>(pool_view(sphere_center_x), pool_view(sphere_center_y), pool_view(sphere_center_z), pool_view(sphere_radius), pool_view(sphere_material), sphere_count),
+			pool_view(sphere_nodes),
+			triangle_pool<fp_t>(pool_view(vertex_x), pool_view(vertex_y), pool_view(vertex_z), pool_view(triangle_indices), pool_view(triangle_material), triangle_count),
+			pool_view(triangle_nodes)));
+
+		return update;
+	}
+
+	const bvh_build_stats& build_stats() const restrict(cpu)
+	{
+		return stats;
+	}
+
+	// statistics of the last top level build, over the instances
+	const bvh_build_stats& instance_build_stats() const restrict(cpu)
+	{
+		return instance_stats;
+	}
+
+	const scene_storage<fp_t>& storage() const restrict(cpu)
+	{
+		return *storage_view;
+	}
+
+	int primitive_count() const restrict(cpu)
+	{
+		return sphere_count + triangle_count + plane_count;
+	}
+
+	int triangle_primitive_count() const restrict(cpu)
+	{
+		return triangle_count;
+	}
+
+	int shape_count() const restrict(cpu)
+	{
+		return static_cast<int>(shape_kind.size());
+	}
+
+	int get_instance_count() const restrict(cpu)
+	{
+		return instance_count;
+	}
+
+	// primitives the instances show, as many as a scene without instancing would store
+	long long instanced_primitive_count() const restrict(cpu)
+	{
+		long long count = 0;
+		for (int i = 0; i < instance_count; i++)
+		{
+			count += shape_primitive_count[instance_shape[i]];
+		}
+		return count;
+	}
+
+	// host memory of the primitives and hierarchies, the same amount is cached on the accelerator
+	size_t geometry_bytes() const restrict(cpu)
+	{
+		return vector_bytes(sphere_center_x) * 4 + vector_bytes(sphere_material) + vector_bytes(sphere_nodes)
+			+ vector_bytes(vertex_x) * 3 + vector_bytes(triangle_indices) + vector_bytes(triangle_material) + vector_bytes(triangle_nodes)
+			+ vector_bytes(plane_d) * 4 + vector_bytes(plane_material)
+			+ vector_bytes(shape_sphere_x) * 4 + vector_bytes(shape_sphere_material)
+			+ vector_bytes(shape_vertex_x) * 3 + vector_bytes(shape_triangle_indices) + vector_bytes(shape_triangle_material)
+			+ vector_bytes(shape_nodes) + vector_bytes(shape_kind) + vector_bytes(shape_root)
+			+ vector_bytes(instance_to_object) + vector_bytes(instance_shape) + vector_bytes(instance_order) + vector_bytes(instance_nodes);
+	}
+
+private:
+	static void fit_mesh(const triangle_mesh& mesh, const vector3<fp_t>& base, fp_t size, fp_t& scale, vector3<fp_t>& offset) restrict(cpu)
+	{
+		aabb<fp_t> bounds;
+		for (int i = 0; i < mesh.vertex_count(); i++)
+		{
+			bounds.grow(vector3<fp_t>(mesh.x[i], mesh.y[i], mesh.z[i]));
+		}
+
+		vector3<fp_t> extent(bounds.upper - bounds.lower);
+		scale = size / std::max(std::max(extent.x, extent.y), std::max(extent.z, static_cast<fp_t>(1e-20f)));
+		offset = base - vector3<fp_t>(bounds.centroid().x, bounds.lower.y, bounds.centroid().z) * scale;
+	}
+
+	// Appends the hierarchy of a new shape to the shared node array, child links move by
+	// the nodes before it and leaf ranges by the primitives of its kind before it.
+	int add_shape_nodes(int kind, const std::vector<bvh_node<fp_t>>& nodes, int first_primitive, int primitive_count) restrict(cpu)
+	{
+		const int root = static_cast<int>(shape_nodes.size());
+
+		for (size_t i = 0; i < nodes.size(); i++)
+		{
+			bvh_node<fp_t> node(nodes[i]);
+			node.first += node.count > 0 ? first_primitive : root;
+			shape_nodes.push_back(node);
+		}
+
+		shape_kind.push_back(kind);
+		shape_root.push_back(root);
+		shape_primitive_count.push_back(primitive_count);
+
+		return static_cast<int>(shape_kind.size()) - 1;
+	}
+
+	// Builds the sphere hierarchy and reorders the spheres into its leaf order.
+	void build_spheres() restrict(cpu)
+	{
+		sphere_count = static_cast<int>(sphere_radius.size());
+
+		bvh_build_input<fp_t> input;
+		input.reserve(sphere_count);
+
+		for (int i = 0; i < sphere_count; i++)
+		{
+			sphere<fp_t> s(vector3<fp_t>(sphere_center_x[i], sphere_center_y[i], sphere_center_z[i]), sphere_radius[i]);
+			input.push_back(s.bounds());
+		}
+
+		std::vector<int> order;
+		build_hierarchy(input, build_method, order, sphere_nodes, sphere_stats);
+
+		reorder_pool_array(sphere_center_x, order);
+		reorder_pool_array(sphere_center_y, order);
+		reorder_pool_array(sphere_center_z, order);
+		reorder_pool_array(sphere_radius, order);
+		reorder_pool_array(sphere_material, order);
+		reorder_pool_array(sphere_id, order);
+
+		sphere_slot.resize(sphere_count);
+		for (int i = 0; i < sphere_count; i++)
+		{
+			sphere_slot[sphere_id[i]] = i;
+		}
+
+		sphere_refitter.prepare(sphere_nodes, sphere_count);
+		spheres_moved = false;
+		sum_stats();
+	}
+
+	aabb<fp_t> triangle_bounds(int i) const restrict(cpu)
+	{
+		aabb<fp_t> box;
+		for (int k = 0; k < 3; k++)
+		{
+			const int v = triangle_indices[3 * i + k];
+			box.grow(vector3<fp_t>(vertex_x[v], vertex_y[v], vertex_z[v]));
+		}
+		return box;
+	}
+
+	// Builds the triangle hierarchy and reorders the triangles into its leaf order.
+	void build_triangles() restrict(cpu)
+	{
+		triangle_count = static_cast<int>(triangle_material.size());
+
+		bvh_build_input<fp_t> input;
+		input.reserve(triangle_count);
+
+		for (int i = 0; i < triangle_count; i++)
+		{
+			input.push_back(triangle_bounds(i));
+		}
+
+		std::vector<int> order;
+		build_hierarchy(input, build_method, order, triangle_nodes, triangle_stats);
+
+		std::vector<int> reordered_indices(triangle_indices.size());
+		for (int i = 0; i < triangle_count; i++)
+		{
+			for (int k = 0; k < 3; k++)
+			{
+				reordered_indices[3 * i + k] = triangle_indices[3 * order[i] + k];
+			}
+		}
+		triangle_indices.swap(reordered_indices);
+		reorder_pool_array(triangle_material, order);
+
+		triangle_refitter.prepare(triangle_nodes, triangle_count);
+		vertices_moved = false;
+		sum_stats();
+	}
+
+	void sum_stats() restrict(cpu)
+	{
+		stats = sphere_stats;
+		stats.build_ms += triangle_stats.build_ms;
+		stats.sah_cost += triangle_stats.sah_cost;
+		stats.node_count += triangle_stats.node_count;
+		stats.leaf_count += triangle_stats.leaf_count;
+		stats.depth = std::max(stats.depth, triangle_stats.depth);
+	}
+
+	template <typename bounds_t, typename rebuild_t>
+	void refit_or_rebuild(bvh_refitter<fp_t>& refitter, std::vector<bvh_node<fp_t>>& nodes, double rebuild_threshold, bvh_update_stats& update, const bounds_t& bounds, const rebuild_t& rebuild) restrict(cpu)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		const double growth = refitter.refit(nodes, bounds);
+		auto refitted = std::chrono::high_resolution_clock::now();
+
+		update.refit_ms += std::chrono::duration<double, std::milli>(refitted - start).count();
+		update.cost_growth = std::max(update.cost_growth, growth);
+
+		if (growth > rebuild_threshold)
+		{
+			rebuild();
+			update.rebuild_ms += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - refitted).count();
+			update.rebuilds++;
+		}
+	}
+
+	void build_instances() restrict(cpu)
+	{
+		instance_count = static_cast<int>(instance_shape.size());
+
+		bvh_build_input<fp_t> input;
+		input.reserve(instance_count);
+
+		for (int i = 0; i < instance_count; i++)
+		{
+			input.push_back(instance_to_world[i].bounds(shape_nodes[shape_root[instance_shape[i]]].bounds()));
+		}
+
+		build_hierarchy(input, build_method, instance_order, instance_nodes, instance_stats);
+	}
+
+	void build_hierarchy(const bvh_build_input<fp_t>& input, int method, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes, bvh_build_stats& tree_stats) restrict(cpu)
+	{
+		if (method == bvh_build_median)
+		{
+			build_bvh(input, order, nodes, &tree_stats);
+		}
+		else if (method == bvh_build_lbvh)
+		{
+			build_bvh_lbvh(input, order, nodes, &tree_stats, input.size() > lbvh_wide_key_threshold);
+		}
+
+		// clustered Morton codes can make a linear BVH deeper than the traversal stack
+		if (method == bvh_build_sah || (method == bvh_build_lbvh && tree_stats.depth >= bvh_stack_size))
+		{
+			build_bvh_sah(input, order, nodes, &tree_stats);
+		}
+	}
+
+	std::vector<fp_t> sphere_center_x, sphere_center_y, sphere_center_z, sphere_radius;
+	std::vector<int> sphere_material;
+	// id of the sphere in every slot, and the slot of every id
+	std::vector<int> sphere_id, sphere_slot;
+	std::vector<bvh_node<fp_t>> sphere_nodes;
+	std::vector<fp_t> vertex_x, vertex_y, vertex_z;
+	std::vector<int> triangle_indices;
+	std::vector<int> triangle_material;
+	std::vector<bvh_node<fp_t>> triangle_nodes;
+	std::vector<fp_t> plane_normal_x, plane_normal_y, plane_normal_z, plane_d;
+	std::vector<int> plane_material;
+	std::vector<fp_t> shape_sphere_x, shape_sphere_y, shape_sphere_z, shape_sphere_radius;
+	std::vector<int> shape_sphere_material;
+	std::vector<fp_t> shape_vertex_x, shape_vertex_y, shape_vertex_z;
+	std::vector<int> shape_triangle_indices;
+	std::vector<int> shape_triangle_material;
+	std::vector<bvh_node<fp_t>> shape_nodes;
+	std::vector<int> shape_kind, shape_root, shape_primitive_count;
+	std::vector<int> instance_shape;
+	std::vector<affine_transform<fp_t>> instance_to_world, instance_to_object;
+	std::vector<int> instance_order;
+	std::vector<bvh_node<fp_t>> instance_nodes;
+	int sphere_count;
+	int triangle_count;
+	int plane_count;
+	int instance_count;
+	int build_method;
+	bool spheres_moved;
+	bool vertices_moved;
+	bvh_build_stats stats;
+	bvh_build_stats sphere_stats;
+	bvh_build_stats triangle_stats;
+	bvh_build_stats instance_stats;
+	bvh_refitter<fp_t> sphere_refitter;
+	bvh_refitter<fp_t> triangle_refitter;
+	std::unique_ptr<scene_storage<fp_t>> storage_view;
 };
\ No newline at end of file
@@ -0,0 +1,315 @@
+#pragma once
+
+#include "bvh.h"
+
+// Linear BVH builder (Karras, "Maximizing Parallelism in the Construction of BVHs,
+// Octrees, and k-d Trees"). Primitives are sorted by the Morton code of their centroid
+// and every internal node is emitted independently from the sorted codes, so all
+// stages are parallel and the build is fast enough to run every frame. The trees are
+// of lower quality than the SAH builder's, leaves hold a single primitive.
+//
+// Internal node i of the n - 1 internal nodes stores its two children in the slots
+// 1 + 2 * i and 2 + 2 * i of the flattened array, the root is slot 0. While building,
+// internal node i is element i and leaf j is element n - 1 + j.
+
+enum
+{
+	lbvh_radix_bits = 8,
+	lbvh_radix_size = 1 << lbvh_radix_bits,
+	lbvh_sort_chunk = 16384,
+	// above this many primitives 10 bits per axis leave too many equal codes
+	lbvh_wide_key_threshold = 1 << 18
+};
+
+inline int count_leading_zeros(unsigned int x)
+{
+	if (x == 0) return 32;
+
+	int n = 0;
+	if ((x & 0xffff0000) == 0) { n += 16; x <<= 16; }
+	if ((x & 0xff000000) == 0) { n += 8; x <<= 8; }
+	if ((x & 0xf0000000) == 0) { n += 4; x <<= 4; }
+	if ((x & 0xc0000000) == 0) { n += 2; x <<= 2; }
+	if ((x & 0x80000000) == 0) { n += 1; }
+	return n;
+}
+
+inline int count_leading_zeros(unsigned long long x)
+{
+	const unsigned int high = static_cast<unsigned int>(x >> 32);
+	return high != 0 ? count_leading_zeros(high) : 32 + count_leading_zeros(static_cast<unsigned int>(x));
+}
+
+// Stable LSD radix sort of (key, value) pairs over the low key_bits bits of the keys.
+// Each pass builds per-chunk digit histograms in parallel, scans them and scatters
+// every chunk in parallel to its precomputed offsets.
+template <typename key_t>
+void parallel_radix_sort(std::vector<key_t>& keys, std::vector<int>& values, int key_bits)
+{
+	const int count = static_cast<int>(keys.size());
+	const int chunk_count = (count + lbvh_sort_chunk - 1) / lbvh_sort_chunk;
+
+	std::vector<key_t> keys_out(count);
+	std::vector<int> values_out(count);
+	std::vector<int> offsets(chunk_count * lbvh_radix_size);
+
+	for (int shift = 0; shift < key_bits; shift += lbvh_radix_bits)
+	{
+		Concurrency::parallel_for(0, chunk_count, [&](int chunk)
+		{
+			int* histogram = &offsets[chunk * lbvh_radix_size];
+			std::fill(histogram, histogram + lbvh_radix_size, 0);
+
+			const int end = std::min(count, (chunk + 1) * lbvh_sort_chunk);
+			for (int i = chunk * lbvh_sort_chunk; i < end; i++)
+			{
+				histogram[(keys[i] >> shift) & (lbvh_radix_size - 1)]++;
+			}
+		});
+
+		// digit major, chunk minor exclusive scan keeps the sort stable
+		int sum = 0;
+		for (int digit = 0; digit < lbvh_radix_size; digit++)
+		{
+			for (int chunk = 0; chunk < chunk_count; chunk++)
+			{
+				int& offset = offsets[chunk * lbvh_radix_size + digit];
+				int bucket = offset;
+				offset = sum;
+				sum += bucket;
+			}
+		}
+
+		Concurrency::parallel_for(0, chunk_count, [&](int chunk)
+		{
+			int* offset = &offsets[chunk * lbvh_radix_size];
+
+			const int end = std::min(count, (chunk + 1) * lbvh_sort_chunk);
+			for (int i = chunk * lbvh_sort_chunk; i < end; i++)
+			{
+				int target = offset[(keys[i] >> shift) & (lbvh_radix_size - 1)]++;
+				keys_out[target] = keys[i];
+				values_out[target] = values[i];
+			}
+		});
+
+		keys.swap(keys_out);
+		values.swap(values_out);
+	}
+}
+
+template <typename fp_t, typename key_t>
+class lbvh_builder
+{
+public:
+	lbvh_builder(const bvh_build_input<fp_t>& input, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes)
+		: input(input), order(order), nodes(nodes), count(input.size())
+	{
+	}
+
+	void build()
+	{
+		order.resize(count);
+
+		if (count <= 1)
+		{
+			nodes.assign(1, bvh_node<fp_t>());
+			if (count == 1)
+			{
+				order[0] = 0;
+				nodes[0].set_bounds(input.bounds(0));
+				nodes[0].first = 0;
+				nodes[0].count = 1;
+			}
+			return;
+		}
+
+		compute_codes();
+		parallel_radix_sort(codes, order, key_bits);
+
+		nodes.assign(2 * count - 1, bvh_node<fp_t>());
+		slots.assign(2 * count - 1, 0);
+		parents.assign(2 * count - 1, -1);
+		visits.reset(new std::atomic<int>[count - 1]);
+
+		Concurrency::parallel_for(0, count - 1, [&](int i)
+		{
+			visits[i] = 0;
+			emit_internal(i);
+		});
+
+		Concurrency::parallel_for(0, count, [&](int j)
+		{
+			fit_bounds(j);
+		});
+	}
+
+private:
+	void compute_codes()
+	{
+		aabb<fp_t> centroids;
+		for (int i = 0; i < count; i++)
+		{
+			centroids.grow(input.centroid(i));
+		}
+
+		// 10 bits per axis for 32-bit keys, 21 bits per axis for 64-bit keys
+		const int axis_bits = sizeof(key_t) == 4 ? 10 : 21;
+		const fp_t cells = static_cast<fp_t>((1 << axis_bits) - 1);
+		key_bits = 3 * axis_bits;
+
+		vector3<fp_t> extent(centroids.upper - centroids.lower);
+		const fp_t scale_x = extent.x > 0 ? cells / extent.x : 0.0f;
+		const fp_t scale_y = extent.y > 0 ? cells / extent.y : 0.0f;
+		const fp_t scale_z = extent.z > 0 ? cells / extent.z : 0.0f;
+
+		codes.resize(count);
+		Concurrency::parallel_for(0, count, [&](int i)
+		{
+			unsigned int x = static_cast<unsigned int>((input.centroid_x[i] - centroids.lower.x) * scale_x);
+			unsigned int y = static_cast<unsigned int>((input.centroid_y[i] - centroids.lower.y) * scale_y);
+			unsigned int z = static_cast<unsigned int>((input.centroid_z[i] - centroids.lower.z) * scale_z);
+
+			codes[i] = sizeof(key_t) == 4 ? static_cast<key_t>(morton_encode3(x, y, z)) : static_cast<key_t>(morton_encode3_64(x, y, z));
+			order[i] = i;
+		});
+	}
+
+	// length of the common prefix of the codes at i and j, duplicates are told apart by index
+	int common_prefix(int i, int j) const
+	{
+		if (j < 0 || j >= count)
+		{
+			return -1;
+		}
+
+		key_t a = codes[i];
+		key_t b = codes[j];
+
+		if (a == b)
+		{
+			return static_cast<int>(sizeof(key_t) * 8) + count_leading_zeros(static_cast<unsigned int>(i ^ j));
+		}
+
+		return count_leading_zeros(a ^ b);
+	}
+
+	void emit_internal(int i)
+	{
+		// direction of the range covered by node i
+		const int d = common_prefix(i, i + 1) - common_prefix(i, i - 1) > 0 ? 1 : -1;
+		const int prefix_min = common_prefix(i, i - d);
+
+		int length_max = 2;
+		while (common_prefix(i, i + length_max * d) > prefix_min)
+		{
+			length_max *= 2;
+		}
+
+		int length = 0;
+		for (int t = length_max / 2; t >= 1; t /= 2)
+		{
+			if (common_prefix(i, i + (length + t) * d) > prefix_min)
+			{
+				length += t;
+			}
+		}
+
+		const int j = i + length * d;
+		const int prefix_node = common_prefix(i, j);
+
+		// binary search for the highest differing bit inside the range
+		int split = 0;
+		int divisor = 2;
+		int t = (length + divisor - 1) / divisor;
+		for (;;)
+		{
+			if (common_prefix(i, i + (split + t) * d) > prefix_node)
+			{
+				split += t;
+			}
+
+			if (t == 1)
+			{
+				break;
+			}
+
+			divisor *= 2;
+			t = (length + divisor - 1) / divisor;
+		}
+
+		const int gamma = i + split * d + std::min(d, 0);
+
+		const int left = std::min(i, j) == gamma ? leaf_element(gamma) : gamma;
+		const int right = std::max(i, j) == gamma + 1 ? leaf_element(gamma + 1) : gamma + 1;
+
+		slots[left] = 1 + 2 * i;
+		slots[right] = 2 + 2 * i;
+		parents[left] = i;
+		parents[right] = i;
+	}
+
+	int leaf_element(int j) const
+	{
+		return count - 1 + j;
+	}
+
+	// Walks from leaf j towards the root. The first thread to reach an internal node
+	// stops there, the second one finds both children fitted and fits the node itself.
+	void fit_bounds(int j)
+	{
+		bvh_node<fp_t>& leaf = nodes[slots[leaf_element(j)]];
+		leaf.set_bounds(input.bounds(order[j]));
+		leaf.first = j;
+		leaf.count = 1;
+
+		int i = parents[leaf_element(j)];
+		while (i >= 0 && visits[i].fetch_add(1) == 1)
+		{
+			aabb<fp_t> bounds(nodes[1 + 2 * i].bounds());
+			bounds.grow(nodes[2 + 2 * i].bounds());
+
+			bvh_node<fp_t>& node = nodes[slots[i]];
+			node.set_bounds(bounds);
+			node.first = 1 + 2 * i;
+			node.count = 0;
+
+			i = parents[i];
+		}
+	}
+
+	const bvh_build_input<fp_t>& input;
+	std::vector<int>& order;
+	std::vector<bvh_node<fp_t>>& nodes;
+	const int count;
+	int key_bits;
+	std::vector<key_t> codes;
+	std::vector<int> slots;
+	std::vector<int> parents;
+	std::unique_ptr<std::atomic<int>[]> visits;
+};
+
+// Builds a linear BVH, with 30-bit Morton codes or, when wide_keys is set, 63-bit ones
+// that keep large scenes from collapsing into runs of equal codes.
+template <typename fp_t>
+void build_bvh_lbvh(const bvh_build_input<fp_t>& input, std::vector<int>& order, std::vector<bvh_node<fp_t>>& nodes, bvh_build_stats* stats = nullptr, bool wide_keys = false)
+{
+	auto start = std::chrono::high_resolution_clock::now();
+
+	if (wide_keys)
+	{
+		lbvh_builder<fp_t, unsigned long long> builder(input, order, nodes);
+		builder.build();
+	}
+	else
+	{
+		lbvh_builder<fp_t, unsigned int> builder(input, order, nodes);
+		builder.build();
+	}
+
+	if (stats)
+	{
+		stats->build_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		compute_bvh_stats(nodes, input.size(), *stats);
+	}
+}
@@ -14,6 +14,9 @@ public:
 	light_sample(const light_sample& other) restrict(cpu, amp) : light_vec(other.light_vec), energy(other.energy) {}
 };
 
+template<typename fp_t>
+class point_light;
+
 template<typename fp_t>
 class light
 {
@@ -29,7 +32,7 @@ public:
 	}
 
 protected:
-	explicit light(int type) { }
+	explicit light(int type) restrict(cpu, amp) { }
 };
 
 template<typename fp_t>
@@ -39,7 +42,7 @@ public:
 	color<fp_t> intensity;
 	vector3<fp_t> position;
 
-	explicit point_light(const color<fp_t>& intensity, const vector3<fp_t>& position) restrict(cpu, amp) : light(light_point), intensity(intensity), position(position) {}
+	explicit point_light(const color<fp_t>& intensity, const vector3<fp_t>& position) restrict(cpu, amp) : light<fp_t>(light<fp_t>::light_point), intensity(intensity), position(position) {}
 
 	light_sample<fp_t> sample(const scene_storage<fp_t>& scene, const vector3<fp_t>& pos) const restrict(cpu, amp)
 	{
@@ -50,9 +53,8 @@ public:
 		vector3<fp_t> l = delta / r;
 
 		ray<fp_t> shadow_ray(pos, l);
-		intersect_result<fp_t> shadow_result(scene.intersect(shadow_ray));
 
-		if (shadow_result.is_hit && shadow_result.distance <= r)
+		if (scene.occluded(shadow_ray, r))
 			return light_sample<fp_t>();
 
 		fp_t attenuation = 1.0f / rr;
@@ -61,33 +63,316 @@ public:
 	}
 };
 
+// Light tree node, laid out like bvh_node plus the summed power of the lights below.
+template <typename fp_t>
+struct light_tree_node
+{
+	fp_t lower_x, lower_y, lower_z;
+	fp_t upper_x, upper_y, upper_z;
+	int first;
+	int count;
+	fp_t power;
+
+	// Estimated contribution of the cluster at pos: its power over the squared distance
+	// to its center. The distance is clamped to half the diagonal, since it tells little
+	// about the lights of a cluster that pos is close to or inside of.
+	fp_t importance(const vector3<fp_t>& pos) const restrict(cpu, amp)
+	{
+		vector3<fp_t> center((lower_x + upper_x) * 0.5f, (lower_y + upper_y) * 0.5f, (lower_z + upper_z) * 0.5f);
+		vector3<fp_t> diagonal(upper_x - lower_x, upper_y - lower_y, upper_z - lower_z);
+
+		fp_t distance_sqr = (center - pos).sqr_length();
+		fp_t radius_sqr = diagonal.sqr_length() * 0.25f;
+
+		return power / gpu::fmax(gpu::fmax(distance_sqr, radius_sqr), 1e-4f);
+	}
+};
+
+template <typename fp_t>
+fp_t light_power(const color<fp_t>& intensity) restrict(cpu, amp)
+{
+	return 0.2126f * intensity.r + 0.7152f * intensity.g + 0.0722f * intensity.b;
+}
+
+// Read-only view of the point lights of a scene that can be captured by amp kernels.
+// Shading picks one light at random with a probability that follows its estimated
+// contribution and divides its sample by that probability, so a shading point costs
+// one walk down the light tree and one shadow ray however many lights there are.
 template<typename fp_t>
 class light_storage
 {
 public:
-	enum
+	Concurrency::array_view<const fp_t, 1> position_x;
+	Concurrency::array_view<const fp_t, 1> position_y;
+	Concurrency::array_view<const fp_t, 1> position_z;
+	Concurrency::array_view<const fp_t, 1> intensity_r;
+	Concurrency::array_view<const fp_t, 1> intensity_g;
+	Concurrency::array_view<const fp_t, 1> intensity_b;
+	Concurrency::array_view<const light_tree_node<fp_t>, 1> nodes;
+	int count;
+
+	explicit light_storage(
+		const Concurrency::array_view<const fp_t, 1>& position_x,
+		const Concurrency::array_view<const fp_t, 1>& position_y,
+		const Concurrency::array_view<const fp_t, 1>& position_z,
+		const Concurrency::array_view<const fp_t, 1>& intensity_r,
+		const Concurrency::array_view<const fp_t, 1>& intensity_g,
+		const Concurrency::array_view<const fp_t, 1>& intensity_b,
+		const Concurrency::array_view<const light_tree_node<fp_t>, 1>& nodes,
+		int count) restrict(cpu)
+		: position_x(position_x), position_y(position_y), position_z(position_z), intensity_r(intensity_r), intensity_g(intensity_g), intensity_b(intensity_b), nodes(nodes), count(count)
 	{
-		light_max_size = sizeof(point_light<fp_t>),
-		light_count = 1
-	};
+	}
 
-	light_storage() restrict(cpu)
+	point_light<fp_t> get_light(int light_id) const restrict(cpu, amp)
 	{
-		new(lights + 0) point_light<fp_t>(color<fp_t>::white() * 1000.0f, vector3<fp_t>(20, 30, 10));
+		return point_light<fp_t>(color<fp_t>(intensity_r[light_id], intensity_g[light_id], intensity_b[light_id]), vector3<fp_t>(position_x[light_id], position_y[light_id], position_z[light_id]));
 	}
 
 	light_sample<fp_t> sample(int light_id, const scene_storage<fp_t>& scene, const vector3<fp_t>& pos) const restrict(cpu, amp)
 	{
-		const light_value* l = &lights[light_id];
+		return get_light(light_id).sample(scene, pos);
+	}
+
+	// Samples one light picked with u in [0, 1), the energy is divided by the probability
+	// of the pick so that the expected value is the sum over all lights.
+	light_sample<fp_t> sample(const scene_storage<fp_t>& scene, const vector3<fp_t>& pos, fp_t u) const restrict(cpu, amp)
+	{
+		fp_t probability = 0.0f;
+		const int light_id = select(pos, u, probability);
+
+		if (light_id < 0)
+		{
+			return light_sample<fp_t>();
+		}
 
-		const light<fp_t>* p = reinterpret_cast<const light<fp_t>*>(l);
-		return p->sample(scene, pos);
+		light_sample<fp_t> ls(sample(light_id, scene, pos));
+		return light_sample<fp_t>(ls.light_vec, ls.energy * (1.0f / probability));
 	}
 
+	// Walks down the tree choosing a child in proportion to its importance and, at the
+	// leaf, a light in proportion to its power over its squared distance. u is rescaled
+	// to [0, 1) after every choice. Returns -1 when no light contributes.
+	int select(const vector3<fp_t>& pos, fp_t u, fp_t& probability) const restrict(cpu, amp)
+	{
+		probability = 1.0f;
+
+		if (count == 0 || nodes[0].power <= 0.0f)
+		{
+			return -1;
+		}
+
+		int node = 0;
+		while (nodes[node].count == 0)
+		{
+			const int first = nodes[node].first;
+			fp_t left = nodes[first].importance(pos);
+			fp_t right = nodes[first + 1].importance(pos);
+
+			fp_t p_left = left / (left + right);
+			if (u < p_left)
+			{
+				u = u / p_left;
+				probability *= p_left;
+				node = first;
+			}
+			else
+			{
+				u = (u - p_left) / (1.0f - p_left);
+				probability *= 1.0f - p_left;
+				node = first + 1;
+			}
+
+			u = gpu::fmin(u, 0.99999994f);
+		}
+
+		// leaves of lights at one spot may hold more than bvh_max_leaf_size lights, so the
+		// weights are recomputed instead of kept in a fixed array
+		const int first = nodes[node].first;
+		const int last = first + nodes[node].count - 1;
+
+		fp_t weight_sum = 0.0f;
+		for (int i = first; i <= last; i++)
+		{
+			weight_sum += weight(i, pos);
+		}
+
+		if (weight_sum <= 0.0f)
+		{
+			return -1;
+		}
+
+		fp_t threshold = u * weight_sum;
+		int chosen = last;
+		fp_t chosen_weight = 0.0f;
+		for (int i = first; i <= last; i++)
+		{
+			chosen_weight = weight(i, pos);
+			if (threshold < chosen_weight || i == last)
+			{
+				chosen = i;
+				break;
+			}
+			threshold -= chosen_weight;
+		}
+
+		probability *= chosen_weight / weight_sum;
+
+		return chosen;
+	}
+
+	// power over squared distance, the leaf counterpart of light_tree_node::importance
+	fp_t weight(int light_id, const vector3<fp_t>& pos) const restrict(cpu, amp)
+	{
+		fp_t distance_sqr = (vector3<fp_t>(position_x[light_id], position_y[light_id], position_z[light_id]) - pos).sqr_length();
+
+		return gpu::fmax(light_power(color<fp_t>(intensity_r[light_id], intensity_g[light_id], intensity_b[light_id])), 0.0f) / gpu::fmax(distance_sqr, 1e-4f);
+	}
+
+	// Makes the host copies current before the views are read by CPU threads.
+	void synchronize() const restrict(cpu)
+	{
+		position_x.synchronize();
+		position_y.synchronize();
+		position_z.synchronize();
+		intensity_r.synchronize();
+		intensity_g.synchronize();
+		intensity_b.synchronize();
+		nodes.synchronize();
+	}
+};
+
+// Host side lights of a scene: owns the point lights and the light tree over them. Like
+// scene_data the storage view stays valid until the lights are rebuilt or destroyed.
+template<typename fp_t>
+class light_data
+{
+public:
+	light_data() restrict(cpu)
+	{
+		add_point_light(vector3<fp_t>(20, 30, 10), color<fp_t>::white() * 1000.0f);
+		build();
+	}
+
+	void add_point_light(const vector3<fp_t>& position, const color<fp_t>& intensity) restrict(cpu)
+	{
+		position_x.push_back(position.x);
+		position_y.push_back(position.y);
+		position_z.push_back(position.z);
+		intensity_r.push_back(intensity.r);
+		intensity_g.push_back(intensity.g);
+		intensity_b.push_back(intensity.b);
+	}
+
+	void clear() restrict(cpu)
+	{
+		position_x.clear(); position_y.clear(); position_z.clear();
+		intensity_r.clear(); intensity_g.clear(); intensity_b.clear();
+	}
+
+	// Builds the light tree and reorders the lights into its leaf order, call it after
+	// adding lights. Points have no surface area to weigh a SAH split with, so the tree
+	// is split at the median, which also keeps it balanced.
+	void build() restrict(cpu)
+	{
+		count = static_cast<int>(position_x.size());
+
+		bvh_build_input<fp_t> input;
+		input.reserve(count);
+
+		for (int i = 0; i < count; i++)
+		{
+			vector3<fp_t> p(position_x[i], position_y[i], position_z[i]);
+			input.push_back(aabb<fp_t>(p, p));
+		}
+
+		std::vector<int> order;
+		std::vector<bvh_node<fp_t>> tree;
+		build_bvh(input, order, tree);
+
+		reorder_pool_array(position_x, order);
+		reorder_pool_array(position_y, order);
+		reorder_pool_array(position_z, order);
+		reorder_pool_array(intensity_r, order);
+		reorder_pool_array(intensity_g, order);
+		reorder_pool_array(intensity_b, order);
+
+		// children are stored after their parents, so a reverse pass sums the power bottom-up
+		nodes.resize(tree.size());
+		for (int n = static_cast<int>(tree.size()) - 1; n >= 0; n--)
+		{
+			light_tree_node<fp_t>& node = nodes[n];
+			node.lower_x = tree[n].lower_x; node.lower_y = tree[n].lower_y; node.lower_z = tree[n].lower_z;
+			node.upper_x = tree[n].upper_x; node.upper_y = tree[n].upper_y; node.upper_z = tree[n].upper_z;
+			node.first = tree[n].first;
+			node.count = tree[n].count;
+			node.power = 0.0f;
+
+			if (count == 0)
+			{
+				continue;
+			}
+
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+				{
+					node.power += std::max(light_power(color<fp_t>(intensity_r[i], intensity_g[i], intensity_b[i])), static_cast<fp_t>(0.0f));
+				}
+			}
+			else
+			{
+				node.power = nodes[node.first].power + nodes[node.first + 1].power;
+			}
+		}
+
+		storage_view.reset(new light_storage<fp_t>(
+			pool_view(position_x), pool_view(position_y), pool_view(position_z),
+			pool_view(intensity_r), pool_view(intensity_g), pool_view(intensity_b),
+			pool_view(nodes), count));
+	}
+
+	const light_storage<fp_t>& storage() const restrict(cpu)
+	{
+		return *storage_view;
+	}
+
+	int light_count() const restrict(cpu)
+	{
+		return count;
+	}
 
 private:
-	struct light_value
+	std::vector<fp_t> position_x, position_y, position_z;
+	std::vector<fp_t> intensity_r, intensity_g, intensity_b;
+	std::vector<light_tree_node<fp_t>> nodes;
+	int count;
+	std::unique_ptr<light_storage<fp_t>> storage_view;
+};
+
+// Scatters count point lights with hashed positions and colors over the box between
+// lower and upper. Their intensities add up to total_intensity times a mean color.
+template<typename fp_t>
+void add_scattered_lights(light_data<fp_t>& lights, int count, const vector3<fp_t>& lower, const vector3<fp_t>& upper, fp_t total_intensity) restrict(cpu)
+{
+	vector3<fp_t> size(upper - lower);
+
+	for (int i = 0; i < count; i++)
 	{
-		fp_t values[light_max_size];
-	} lights[light_count];
-};
\ No newline at end of file
+		unsigned int h = hash_uint(static_cast<unsigned int>(i));
+		fp_t x = lower.x + size.x * hash_to_unit(h);
+		h = hash_uint(h);
+		fp_t y = lower.y + size.y * hash_to_unit(h);
+		h = hash_uint(h);
+		fp_t z = lower.z + size.z * hash_to_unit(h);
+
+		h = hash_uint(h);
+		fp_t r = 0.25f + 0.75f * hash_to_unit(h);
+		h = hash_uint(h);
+		fp_t g = 0.25f + 0.75f * hash_to_unit(h);
+		h = hash_uint(h);
+		fp_t b = 0.25f + 0.75f * hash_to_unit(h);
+
+		lights.add_point_light(vector3<fp_t>(x, y, z), color<fp_t>(r, g, b) * (total_intensity / count));
+	}
+}
@@ -2,6 +2,12 @@
 
 #include "light.h"
 
+template <typename fp_t>
+class checker;
+
+template <typename fp_t>
+class phong;
+
 template <typename fp_t>
 class material
 {
@@ -9,11 +15,11 @@ public:
 	enum material_type
 	{
 		material_checker,
-		material_phong
+		material_phong,
+		material_type_count
 	};
 	fp_t reflectiveness;
 
-	template<typename fp_t> 
 	color<fp_t> sample(const ray<fp_t>& ray, const vector3<fp_t>& position, const vector3<fp_t>& normal, light_sample<fp_t> ls) const restrict(cpu, amp)
 	{
 		switch (type)
@@ -26,6 +32,26 @@ public:
 			return color<fp_t>::black();
 		}
 	}
+
+	// Base colour at position, without lighting, as the denoiser's guide.
+	color<fp_t> albedo(const vector3<fp_t>& position) const restrict(cpu, amp)
+	{
+		switch (type)
+		{
+		case material_checker:
+			return static_cast<const checker<fp_t>*>(this)->albedo_impl(position);
+		case material_phong:
+			return static_cast<const phong<fp_t>*>(this)->albedo_impl(position);
+		default:
+			return color<fp_t>::black();
+		}
+	}
+
+	int get_type() const restrict(cpu, amp)
+	{
+		return type;
+	}
+
 protected:
 	explicit material(int type, fp_t reflectiveness) restrict(cpu, amp) : type(type), reflectiveness(reflectiveness) {}
 
@@ -38,7 +64,7 @@ template <typename fp_t>
 class checker : public material<fp_t>
 {
 public:
-	checker(fp_t scale, fp_t reflectiveness) restrict(cpu, amp) : material(material_checker, reflectiveness), scale(scale) {}
+	checker(fp_t scale, fp_t reflectiveness) restrict(cpu, amp) : material<fp_t>(material<fp_t>::material_checker, reflectiveness), scale(scale) {}
 
 	color<fp_t> sample_impl(const ray<fp_t>& ray, const vector3<fp_t>& position, const vector3<fp_t>& normal, light_sample<fp_t> ls)const restrict(cpu, amp)
 	{
@@ -54,6 +80,13 @@ public:
 
 		return basic_color;
 	}
+
+	color<fp_t> albedo_impl(const vector3<fp_t>& position) const restrict(cpu, amp)
+	{
+		fp_t r = gpu::fabs(gpu::floor(position.x * scale) + gpu::floor(position.z * scale));
+
+		return (static_cast<int>(r) % 2) < 1 ? color<fp_t>::black() : color<fp_t>::white();
+	}
 private:
 	fp_t scale;
 };
@@ -63,7 +96,7 @@ class phong : public material<fp_t>
 {
 public:
 	phong(color<fp_t> diffuse, color<fp_t> specular, fp_t shininess, fp_t reflectiveness)
-		: material(material_phong, reflectiveness), diffuse(diffuse), specular(specular), shininess(shininess) {}
+		: material<fp_t>(material<fp_t>::material_phong, reflectiveness), diffuse(diffuse), specular(specular), shininess(shininess) {}
 
 	color<fp_t> sample_impl(const ray<fp_t>& ray, const vector3<fp_t>& position, const vector3<fp_t>& normal, light_sample<fp_t> ls) const restrict(cpu, amp)
 	{
@@ -80,6 +113,11 @@ public:
 		return ls.energy * (diffuse_term + specular_term);
 	}
 
+	color<fp_t> albedo_impl(const vector3<fp_t>& /*position*/) const restrict(cpu, amp)
+	{
+		return diffuse;
+	}
+
 private:
 	color<fp_t> diffuse;
 	color<fp_t> specular;
@@ -111,6 +149,33 @@ public:
 		return p->sample(ray, position, normal, ls);
 	}
 
+	// Samples a material known to be of type material_t without the switch on its type,
+	// for kernels that only see one material type.
+	template <typename material_t>
+	color<fp_t> sample_as(int material_id, const ray<fp_t>& ray, const vector3<fp_t>& position, const vector3<fp_t>& normal, light_sample<fp_t> ls) const restrict(cpu, amp)
+	{
+		const material_value* m = &materials[material_id];
+
+		const material_t* p = reinterpret_cast<const material_t*>(m);
+		return p->sample_impl(ray, position, normal, ls);
+	}
+
+	color<fp_t> albedo(int material_id, const vector3<fp_t>& position) const restrict(cpu, amp)
+	{
+		const material_value* m = &materials[material_id];
+
+		const material<fp_t>* p = reinterpret_cast<const material<fp_t>*>(m);
+		return p->albedo(position);
+	}
+
+	int get_type(int material_id) const restrict(cpu, amp)
+	{
+		const material_value* m = &materials[material_id];
+
+		const material<fp_t>* p = reinterpret_cast<const material<fp_t>*>(m);
+		return p->get_type();
+	}
+
 	fp_t get_reflectiveness(int material_id) const restrict(cpu, amp)
 	{
 		const material_value* m = &materials[material_id];
@@ -0,0 +1,206 @@
+#pragma once
+
+#include "bvh.h"
+
+// Ray packets for the CPU tracer (Wald et al., "Interactive Rendering with Coherent Ray
+// Tracing"; Boulos et al., "Interval Arithmetic for Ray Packet Traversal"). A packet
+// holds the rays of a small tile of adjacent pixels in SoA layout and walks the
+// hierarchy as a whole: a node is culled for the packet with one interval test over
+// the bounds of all its origins and inverse directions, and only the surviving nodes
+// are tested lane by lane. Lane loops have no early exits so that the compiler can
+// vectorize them.
+
+enum
+{
+	ray_packet_max_size = 16
+};
+
+// Pixel tile covered by a packet: 2 x 2, 4 x 2 or 4 x 4.
+template <int packet_size>
+struct ray_packet_shape
+{
+	enum
+	{
+		width = packet_size >= 8 ? 4 : (packet_size >= 2 ? 2 : 1),
+		height = packet_size / width
+	};
+};
+
+template <typename fp_t, int packet_size>
+class ray_packet
+{
+public:
+	fp_t origin_x[packet_size], origin_y[packet_size], origin_z[packet_size];
+	fp_t direction_x[packet_size], direction_y[packet_size], direction_z[packet_size];
+	fp_t inv_direction_x[packet_size], inv_direction_y[packet_size], inv_direction_z[packet_size];
+
+	// closest hit of every lane
+	fp_t distance[packet_size];
+	int kind[packet_size];
+	int index[packet_size];
+	int instance[packet_size];
+
+	void set_ray(int lane, const ray<fp_t>& r) restrict(cpu)
+	{
+		origin_x[lane] = r.origin.x;
+		origin_y[lane] = r.origin.y;
+		origin_z[lane] = r.origin.z;
+		direction_x[lane] = r.direction.x;
+		direction_y[lane] = r.direction.y;
+		direction_z[lane] = r.direction.z;
+	}
+
+	ray<fp_t> get_ray(int lane) const restrict(cpu)
+	{
+		return ray<fp_t>(vector3<fp_t>(origin_x[lane], origin_y[lane], origin_z[lane]), vector3<fp_t>(direction_x[lane], direction_y[lane], direction_z[lane]));
+	}
+
+	hit_record<fp_t> hit(int lane) const restrict(cpu)
+	{
+		hit_record<fp_t> record(distance[lane]);
+		record.kind = kind[lane];
+		record.index = index[lane];
+		record.instance = instance[lane];
+		return record;
+	}
+
+	// Resets the hits and computes the packet bounds for interval culling. Returns false
+	// when the directions do not share their signs on every axis: the interval test is
+	// then useless and the rays are better traced one by one.
+	bool prepare() restrict(cpu)
+	{
+		for (int lane = 0; lane < packet_size; lane++)
+		{
+			inv_direction_x[lane] = 1.0f / direction_x[lane];
+			inv_direction_y[lane] = 1.0f / direction_y[lane];
+			inv_direction_z[lane] = 1.0f / direction_z[lane];
+			distance[lane] = std::numeric_limits<fp_t>::infinity();
+			kind[lane] = primitive_none;
+			index[lane] = 0;
+			instance[lane] = -1;
+		}
+
+		return prepare_axis(0, origin_x, inv_direction_x) && prepare_axis(1, origin_y, inv_direction_y) && prepare_axis(2, origin_z, inv_direction_z);
+	}
+
+	// Conservative: only returns true when every lane misses the node.
+	bool interval_miss(const bvh_node<fp_t>& node) const restrict(cpu)
+	{
+		fp_t max_distance = distance[0];
+		for (int lane = 1; lane < packet_size; lane++)
+		{
+			max_distance = std::max(max_distance, distance[lane]);
+		}
+
+		fp_t entry_x, exit_x, entry_y, exit_y, entry_z, exit_z;
+		interval_axis(0, node.lower_x, node.upper_x, entry_x, exit_x);
+		interval_axis(1, node.lower_y, node.upper_y, entry_y, exit_y);
+		interval_axis(2, node.lower_z, node.upper_z, entry_z, exit_z);
+
+		fp_t t_near = std::max(std::max(entry_x, entry_y), entry_z);
+		fp_t t_far = std::min(std::min(exit_x, exit_y), exit_z);
+
+		return t_near > t_far || t_far < 0 || t_near >= max_distance;
+	}
+
+	// per-lane slab test, true if any lane hits the node closer than its closest hit
+	bool any_hit(const bvh_node<fp_t>& node) const restrict(cpu)
+	{
+		int hits = 0;
+
+		for (int lane = 0; lane < packet_size; lane++)
+		{
+			fp_t tx0 = (node.lower_x - origin_x[lane]) * inv_direction_x[lane];
+			fp_t tx1 = (node.upper_x - origin_x[lane]) * inv_direction_x[lane];
+			fp_t ty0 = (node.lower_y - origin_y[lane]) * inv_direction_y[lane];
+			fp_t ty1 = (node.upper_y - origin_y[lane]) * inv_direction_y[lane];
+			fp_t tz0 = (node.lower_z - origin_z[lane]) * inv_direction_z[lane];
+			fp_t tz1 = (node.upper_z - origin_z[lane]) * inv_direction_z[lane];
+
+			fp_t t_near = std::max(std::max(std::min(tx0, tx1), std::min(ty0, ty1)), std::min(tz0, tz1));
+			fp_t t_far = std::min(std::min(std::max(tx0, tx1), std::max(ty0, ty1)), std::max(tz0, tz1));
+
+			hits += (t_near <= t_far && t_far >= 0 && t_near < distance[lane]) ? 1 : 0;
+		}
+
+		return hits > 0;
+	}
+
+private:
+	bool prepare_axis(int axis, const fp_t* origin, const fp_t* inv_direction) restrict(cpu)
+	{
+		origin_min[axis] = origin_max[axis] = origin[0];
+		inv_min[axis] = inv_max[axis] = inv_direction[0];
+
+		int positive = 0;
+		for (int lane = 0; lane < packet_size; lane++)
+		{
+			origin_min[axis] = std::min(origin_min[axis], origin[lane]);
+			origin_max[axis] = std::max(origin_max[axis], origin[lane]);
+			inv_min[axis] = std::min(inv_min[axis], inv_direction[lane]);
+			inv_max[axis] = std::max(inv_max[axis], inv_direction[lane]);
+			positive += inv_direction[lane] > 0 ? 1 : 0;
+		}
+
+		negative[axis] = positive == 0;
+
+		// axis-parallel lanes have infinite inverse directions and break the interval products
+		return (positive == 0 || positive == packet_size) && inv_min[axis] > -std::numeric_limits<fp_t>::max() && inv_max[axis] < std::numeric_limits<fp_t>::max();
+	}
+
+	// Bounds of the entry and exit distances of all lanes on one axis, entry is a lower
+	// bound and exit an upper bound.
+	void interval_axis(int axis, fp_t lower, fp_t upper, fp_t& entry, fp_t& exit) const restrict(cpu)
+	{
+		if (!negative[axis])
+		{
+			fp_t a = lower - origin_max[axis];
+			fp_t b = upper - origin_min[axis];
+			entry = a * (a >= 0 ? inv_min[axis] : inv_max[axis]);
+			exit = b * (b >= 0 ? inv_max[axis] : inv_min[axis]);
+		}
+		else
+		{
+			fp_t a = origin_min[axis] - upper;
+			fp_t b = origin_max[axis] - lower;
+			entry = a * (a >= 0 ? -inv_max[axis] : -inv_min[axis]);
+			exit = b * (b >= 0 ? -inv_min[axis] : -inv_max[axis]);
+		}
+	}
+
+	fp_t origin_min[3], origin_max[3];
+	fp_t inv_min[3], inv_max[3];
+	bool negative[3];
+};
+
+// Packet counterpart of bvh_traverse, calls pool.intersect_packet(first, count, packet)
+// for every leaf that at least one lane reaches. Expects a coherent, prepared packet.
+template <typename fp_t, int packet_size, typename pool_t>
+void bvh_traverse_packet(const Concurrency::array_view<const bvh_node<fp_t>, 1>& nodes, const pool_t& pool, ray_packet<fp_t, packet_size>& packet) restrict(cpu)
+{
+	int stack[bvh_stack_size];
+	int stack_size = 0;
+	stack[stack_size++] = 0;
+
+	while (stack_size > 0)
+	{
+		const bvh_node<fp_t>& node = nodes[stack[--stack_size]];
+
+		if (packet.interval_miss(node) || !packet.any_hit(node))
+		{
+			continue;
+		}
+
+		if (node.count > 0)
+		{
+			pool.intersect_packet(node.first, node.count, packet);
+		}
+		else
+		{
+			// ordered by the first lane, the packet directions share their signs
+			const bool left_first = bvh_left_first(nodes[node.first], nodes[node.first + 1], vector3<fp_t>(packet.direction_x[0], packet.direction_y[0], packet.direction_z[0]));
+			stack[stack_size++] = left_first ? node.first + 1 : node.first;
+			stack[stack_size++] = left_first ? node.first : node.first + 1;
+		}
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "render.h"
+
+// Progressive renderer for a camera at rest. Every frame traces one more jittered
+// sample per pixel into an HDR accumulation buffer that stays on the accelerator, and
+// displays the tone-mapped average, so the image converges while the viewer is idle.
+// Moving the camera, resizing or calling reset() starts over from the first sample,
+// which is taken at the pixel position of the single-sample renderer.
+
+enum
+{
+	// the viewer stops queueing frames once a still image has this many samples
+	progressive_max_samples = 1024
+};
+
+// Clamps like the single-sample renderer, so the converged image keeps its look.
+template <typename fp_t>
+unsigned int tone_map(const color<fp_t>& c) restrict(amp)
+{
+	unsigned int r = static_cast<unsigned int>(Concurrency::direct3d::saturate(c.r) * 255);
+	unsigned int g = static_cast<unsigned int>(Concurrency::direct3d::saturate(c.g) * 255);
+	unsigned int b = static_cast<unsigned int>(Concurrency::direct3d::saturate(c.b) * 255);
+
+	return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+template <typename fp_t>
+class progressive_renderer
+{
+public:
+	progressive_renderer() : sample_count(0), phi(0), theta(0), eyedist(0) {}
+
+	// Adds one sample per pixel and writes the tone-mapped average to result. aa_factor
+	// scales the image as in render_reflection.
+	void render(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor, int order = pixel_order_row_major)
+	{
+		using namespace Concurrency;
+
+		const int width = result.extent[1];
+		const int height = result.extent[0];
+
+		if (!accumulator || accumulator->extent[0] != 3 * width * height || phi != this->phi || theta != this->theta || eyedist != this->eyedist)
+		{
+			this->phi = phi;
+			this->theta = theta;
+			this->eyedist = eyedist;
+			sample_count = 0;
+
+			// the first sample overwrites the sums, nothing needs to be copied in or out
+			reset();
+			accumulator_data.resize(3 * width * height);
+			accumulator.reset(new array_view<fp_t, 1>(static_cast<int>(accumulator_data.size()), accumulator_data));
+			accumulator->discard_data();
+		}
+
+		perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+		material_storage<fp_t> materials;
+
+		const fp_t edge = 640 * aa_factor;
+		const int xshift = static_cast<int>((width - edge) / 2);
+		const int yshift = static_cast<int>((height - edge) / 2);
+		const int pixels = width * height;
+		const unsigned int sample = static_cast<unsigned int>(sample_count);
+		const fp_t weight = 1.0f / (sample_count + 1);
+		array_view<fp_t, 1> sum(*accumulator);
+
+		parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
+		{
+			const int i = y * width + x;
+
+			const sample_random random(static_cast<unsigned int>(i), sample);
+
+			fp_t jitter_x = 0.0f;
+			fp_t jitter_y = 0.0f;
+			if (sample > 0)
+			{
+				jitter_x = random.uniform(dimension_jitter_x) - 0.5f;
+				jitter_y = random.uniform(dimension_jitter_y) - 0.5f;
+			}
+
+			fp_t sy = 1.0f - (static_cast<fp_t>(y - yshift) + jitter_y) / edge;
+			fp_t sx = (static_cast<fp_t>(x - xshift) + jitter_x) / edge;
+
+			color<fp_t> c(reflection(camera.generate_ray(sx, sy), scene, materials, lights, 3, random));
+
+			sum[i] = (sample > 0 ? sum[i] : 0.0f) + c.r;
+			sum[pixels + i] = (sample > 0 ? sum[pixels + i] : 0.0f) + c.g;
+			sum[2 * pixels + i] = (sample > 0 ? sum[2 * pixels + i] : 0.0f) + c.b;
+
+			result(y, x) = tone_map(color<fp_t>(sum[i], sum[pixels + i], sum[2 * pixels + i]) * weight);
+		});
+
+		sample_count++;
+	}
+
+	// starts over, for example after the scene changed
+	void reset()
+	{
+		if (accumulator)
+		{
+			accumulator->discard_data();
+			accumulator.reset();
+		}
+	}
+
+	int samples() const
+	{
+		return sample_count;
+	}
+
+private:
+	int sample_count;
+	fp_t phi;
+	fp_t theta;
+	fp_t eyedist;
+	std::vector<fp_t> accumulator_data;
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> accumulator;
+};
@@ -20,6 +20,30 @@ public:
 };
 
 
+enum primitive_kind
+{
+	primitive_none,
+	primitive_sphere,
+	primitive_plane,
+	primitive_triangle
+};
+
+// Closest hit found so far while walking the primitive pools. Only the distance and the
+// primitive are tracked, the full intersect_result is built once for the closest one.
+// Primitives of instanced shapes are indexed in object space and name their instance,
+// instance is -1 for primitives placed in world space.
+template <typename fp_t>
+class hit_record
+{
+public:
+	fp_t distance;
+	int kind;
+	int index;
+	int instance;
+
+	explicit hit_record(fp_t distance) restrict(cpu, amp) : distance(distance), kind(primitive_none), index(0), instance(-1) {}
+};
+
 template <typename fp_t>
 class ray
 {
@@ -61,6 +85,23 @@ public:
 
 		return ray<fp_t>(eye, (front + r + u).normalize());
 	}
+
+	// Inverse of generate_ray: the screen position of point and its depth along front.
+	// Returns false for points that are not in front of the eye.
+	bool project(const vector3<fp_t>& point, fp_t& x, fp_t& y, fp_t& depth) const restrict(cpu, amp)
+	{
+		vector3<fp_t> d(point - eye);
+
+		depth = d.dot(front) / front.sqr_length();
+		if (depth <= 0.0f)
+		{
+			return false;
+		}
+
+		x = 0.5f + d.dot(right) / (right.sqr_length() * depth * fov_scale);
+		y = 0.5f + d.dot(up) / (up.sqr_length() * depth * fov_scale);
+		return true;
+	}
 };
 
 template <typename fp_t>
@@ -97,3 +138,96 @@ public:
 	static color blue() restrict(cpu, amp) { return color(0.0f, 0.0f, 1.0f); }
 };
 
+// Integer hash (Wellons, "lowbias32") for scene generation and per pixel patterns that
+// need no independent samples.
+inline unsigned int hash_uint(unsigned int x) restrict(cpu, amp)
+{
+	x ^= x >> 16;
+	x *= 0x7feb352d;
+	x ^= x >> 15;
+	x *= 0x846ca68b;
+	x ^= x >> 16;
+	return x;
+}
+
+// uniform in [0, 1) from the top 24 bits
+inline float hash_to_unit(unsigned int x) restrict(cpu, amp)
+{
+	return static_cast<float>(x >> 8) * (1.0f / 16777216.0f);
+}
+
+// High 32 bits of the 64 bit product, from 16 bit halves since amp code has no 64 bit
+// integers. The same code runs on the CPU, so both give the same bits.
+inline unsigned int mul_high(unsigned int a, unsigned int b) restrict(cpu, amp)
+{
+	const unsigned int a_low = a & 0xffff;
+	const unsigned int a_high = a >> 16;
+	const unsigned int b_low = b & 0xffff;
+	const unsigned int b_high = b >> 16;
+
+	// cannot overflow: below 2^16 + 2^16 + (2^16 - 1)^2
+	const unsigned int middle = ((a_low * b_low) >> 16) + ((a_high * b_low) & 0xffff) + a_low * b_high;
+
+	return a_high * b_high + ((a_high * b_low) >> 16) + (middle >> 16);
+}
+
+// Philox4x32-10 (Salmon et al., "Parallel Random Numbers: As Easy as 1, 2, 3"): ten
+// rounds of multiplications and key additions turn a 128 bit counter into 128 random
+// bits. Nothing is carried from one call to the next, so a number depends only on its
+// counter and key, never on the thread or the order that asked for it, and the rounds
+// are branch-free integer arithmetic that vectorizes over lanes.
+inline void philox4x32(unsigned int counter[4], unsigned int key0, unsigned int key1) restrict(cpu, amp)
+{
+	for (int round = 0; round < 10; round++)
+	{
+		const unsigned int high0 = mul_high(0xd2511f53u, counter[0]);
+		const unsigned int low0 = 0xd2511f53u * counter[0];
+		const unsigned int high1 = mul_high(0xcd9e8d57u, counter[2]);
+		const unsigned int low1 = 0xcd9e8d57u * counter[2];
+
+		counter[0] = high1 ^ counter[1] ^ key0;
+		counter[1] = low1;
+		counter[2] = high0 ^ counter[3] ^ key1;
+		counter[3] = low0;
+
+		key0 += 0x9e3779b9u;
+		key1 += 0xbb67ae85u;
+	}
+}
+
+// Dimensions of the random numbers of a sample, one per decision the sample makes.
+enum sample_dimension
+{
+	dimension_jitter_x,
+	dimension_jitter_y,
+	// the light sampled at bounce b uses dimension_light + b
+	dimension_light
+};
+
+// Random numbers of one sample of one pixel. Number d of the sample is the Philox output
+// for the counter (d / 4, sample, pixel, 0), so any sample's numbers can be drawn in any
+// order on any thread or accelerator and a frame comes out the same bits every time.
+class sample_random
+{
+public:
+	explicit sample_random(unsigned int pixel, unsigned int sample) restrict(cpu, amp) : pixel(pixel), sample(sample) {}
+
+	unsigned int bits(unsigned int dimension) const restrict(cpu, amp)
+	{
+		unsigned int counter[4] = { dimension >> 2, sample, pixel, 0 };
+		philox4x32(counter, 0x5eed5eedu, 0x0badcafeu);
+
+		const unsigned int lane = dimension & 3;
+		return lane == 0 ? counter[0] : lane == 1 ? counter[1] : lane == 2 ? counter[2] : counter[3];
+	}
+
+	// uniform in [0, 1)
+	float uniform(unsigned int dimension) const restrict(cpu, amp)
+	{
+		return hash_to_unit(bits(dimension));
+	}
+
+private:
+	unsigned int pixel;
+	unsigned int sample;
+};
@@ -1,9 +1,12 @@
 #pragma once
 
 #include "material.h"
+#include "morton.h"
 
+// Shades a primary ray from its first hit r, the reflection rays are traced one by one.
+// The hit of bounce b samples one light picked with dimension_light + b of random.
 template <typename fp_t>
-color<fp_t> reflection(ray<fp_t> i_ray, const scene_storage<fp_t>& scene, const material_storage<fp_t>& materials, const point_light<fp_t>& light, int max_reflect) restrict(cpu, amp)
+color<fp_t> shade_reflection(ray<fp_t> i_ray, intersect_result<fp_t> r, const scene_storage<fp_t>& scene, const material_storage<fp_t>& materials, const light_storage<fp_t>& lights, int max_reflect, const sample_random& random) restrict(cpu, amp)
 {
 	color<fp_t> final_color(0.0f, 0.0f, 0.0f);
 	fp_t reflectiveness = 1.0f;
@@ -13,11 +16,14 @@ color<fp_t> reflection(ray<fp_t> i_ray, const scene_storage<fp_t>& scene, const
     vector3<fp_t> last_normal;
 	for (int i = 0; i < max_reflect; i++)
 	{
-		intersect_result<fp_t> r(scene.intersect(i_ray));
+		if (i > 0)
+		{
+			r = scene.intersect(i_ray);
+		}
 
 		if (r.is_hit)
 		{
-			light_sample<fp_t> ls(light.sample(scene, r.position));
+			light_sample<fp_t> ls(lights.sample(scene, r.position, random.uniform(dimension_light + i)));
 
 			fp_t ref_c = materials.get_reflectiveness(r.material);
 			color<fp_t> color(materials.sample(r.material, i_ray, r.position, r.normal, ls));	
@@ -64,7 +70,13 @@ color<fp_t> reflection(ray<fp_t> i_ray, const scene_storage<fp_t>& scene, const
 }
 
 template <typename fp_t>
-void render_depth(const Concurrency::array_view<unsigned int, 2>& result)
+color<fp_t> reflection(const ray<fp_t>& i_ray, const scene_storage<fp_t>& scene, const material_storage<fp_t>& materials, const light_storage<fp_t>& lights, int max_reflect, const sample_random& random) restrict(cpu, amp)
+{
+	return shade_reflection(i_ray, scene.intersect(i_ray), scene, materials, lights, max_reflect, random);
+}
+
+template <typename fp_t>
+void render_depth(const Concurrency::array_view<unsigned int, 2>& result, int order = pixel_order_row_major)
 {
 	using namespace Concurrency;
 
@@ -79,11 +91,8 @@ void render_depth(const Concurrency::array_view<unsigned int, 2>& result)
 	const int xshift = (width - 640) / 2;
 	const int yshift = (height - 640) / 2;
 
-	parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+	parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
 	{
-		const int x = idx[1];
-		const int y = idx[0];
-
 		fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / 640 ;
 		fp_t sx = static_cast<fp_t>(x - xshift) / 640;
 
@@ -104,12 +113,12 @@ void render_depth(const Concurrency::array_view<unsigned int, 2>& result)
 			b = intdepth;
 		}
 
-		result[idx] = 0xff000000 | (r << 16) | (g << 8) | b;
+		result(y, x) = 0xff000000 | (r << 16) | (g << 8) | b;
 	});
 }
 
 template <typename fp_t>
-void render_normal(const Concurrency::array_view<unsigned int, 2>& result)
+void render_normal(const Concurrency::array_view<unsigned int, 2>& result, int order = pixel_order_row_major)
 {
 	using namespace Concurrency;
 
@@ -122,11 +131,8 @@ void render_normal(const Concurrency::array_view<unsigned int, 2>& result)
 	const int xshift = (width - 640) / 2;
 	const int yshift = (height - 640) / 2;
 
-	parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+	parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
 	{
-		const int x = idx[1];
-		const int y = idx[0];
-
 		fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / 640 ;
 		fp_t sx = static_cast<fp_t>(x - xshift) / 640;
 
@@ -144,16 +150,15 @@ void render_normal(const Concurrency::array_view<unsigned int, 2>& result)
 			b = static_cast<unsigned int>((ir.normal.z + 1) * 128);
 		}
 
-		result[idx] = 0xff000000 | (r << 16) | (g << 8) | b;
+		result(y, x) = 0xff000000 | (r << 16) | (g << 8) | b;
 	});
 }
 
 template <typename fp_t>
-void render_material(const Concurrency::array_view<unsigned int, 2>& result)
+void render_material(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, int order = pixel_order_row_major)
 {
 	using namespace Concurrency;
 
-	scene_storage<fp_t> scene;
 	perspective_camera<fp_t> camera(vector3<fp_t>(0, 5, 15), vector3<fp_t>(0, 0, -1), vector3<fp_t>(0, 1, 0), 90);
 
 	const int width = result.extent[1];
@@ -164,11 +169,8 @@ void render_material(const Concurrency::array_view<unsigned int, 2>& result)
 
 	material_storage<fp_t> t;
 
-	parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+	parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
 	{
-		const int x = idx[1];
-		const int y = idx[0];
-
 		fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / 640 ;
 		fp_t sx = static_cast<fp_t>(x - xshift) / 640;
 
@@ -181,21 +183,22 @@ void render_material(const Concurrency::array_view<unsigned int, 2>& result)
 
 		if (ir.is_hit)
 		{
-			color<fp_t> color(t.sample(ir.material, ray, ir.position, ir.normal));
+			// unshadowed white head light, so only the materials show
+			light_sample<fp_t> head_light(ray.direction.negate(), color<fp_t>::white());
+			color<fp_t> color(t.sample(ir.material, ray, ir.position, ir.normal, head_light));
 			r = static_cast<unsigned int>(direct3d::saturate(color.r) * 255);
 			g = static_cast<unsigned int>(direct3d::saturate(color.g) * 255);
 			b = static_cast<unsigned int>(direct3d::saturate(color.b) * 255);
 		}
 
-		result[idx] = 0xff000000 | (r << 16) | (g << 8) | b;
+		result(y, x) = 0xff000000 | (r << 16) | (g << 8) | b;
 	});
 }
 
+// Orbit camera of the reflection scene, angles in degrees.
 template <typename fp_t>
-void render_reflection(const Concurrency::array_view<unsigned int, 2>& result, fp_t phi, fp_t theta, fp_t eyedist, int aa_factor)
+perspective_camera<fp_t> reflection_camera(fp_t phi, fp_t theta, fp_t eyedist)
 {
-	using namespace Concurrency;
-
 	fp_t r_theta = (theta) * 3.1415926f / 180.0f;
 	fp_t r_phi = (- phi) * 3.1415926f / 180.0f;
 
@@ -212,25 +215,31 @@ void render_reflection(const Concurrency::array_view<unsigned int, 2>& result, f
 	fp_t uz = sin(r_theta1) * sin_phi;
 	fp_t uy = cos(r_theta1);
 
-	scene_storage<fp_t> scene;
-	perspective_camera<fp_t> camera(vector3<fp_t>(px * eyedist, py * eyedist, pz * eyedist), vector3<fp_t>(-px, -py, -pz), vector3<fp_t>(ux, uy, uz), 46);
-	point_light<fp_t> light(color<fp_t>::white() * 1000.0f, vector3<fp_t>(20, 30, 10));
+	return perspective_camera<fp_t>(vector3<fp_t>(px * eyedist, py * eyedist, pz * eyedist), vector3<fp_t>(-px, -py, -pz), vector3<fp_t>(ux, uy, uz), 46);
+}
+
+// aa_factor is the number of image pixels per pixel of the 640 pixel square the scene is
+// framed for. Factors above 1 supersample, factors below 1 render the same view at the
+// reduced resolution of the viewer's dynamic resolution.
+template <typename fp_t>
+void render_reflection(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor, int order = pixel_order_row_major)
+{
+	using namespace Concurrency;
+
+	perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
 
 	const int width = result.extent[1];
 	const int height = result.extent[0];
 
-	const int edge = 640 * aa_factor;
+	const fp_t edge = 640 * aa_factor;
 
-	const int xshift = (width - edge) / 2;
-	const int yshift = (height - edge) / 2;
+	const int xshift = static_cast<int>((width - edge) / 2);
+	const int yshift = static_cast<int>((height - edge) / 2);
 
 	material_storage<fp_t> materials;
 
-	parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+	parallel_for_each_pixel(result.extent, order, [=](int x, int y) restrict(amp)
 	{
-		const int x = idx[1];
-		const int y = idx[0];
-
 		fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge ;
 		fp_t sx = static_cast<fp_t>(x - xshift) / edge;
 
@@ -240,11 +249,161 @@ void render_reflection(const Concurrency::array_view<unsigned int, 2>& result, f
 		unsigned int g = 0;
 		unsigned int b = 0;
 
-		color<fp_t> color(reflection(ray, scene, materials, light, 3));
+		color<fp_t> color(reflection(ray, scene, materials, lights, 3, sample_random(static_cast<unsigned int>(y * width + x), 0)));
 		r = static_cast<unsigned int>(direct3d::saturate(color.r) * 255);
 		g = static_cast<unsigned int>(direct3d::saturate(color.g) * 255);
 		b = static_cast<unsigned int>(direct3d::saturate(color.b) * 255);
 
-		result[idx] = 0xff000000 | (r << 16) | (g << 8) | b;
+		result(y, x) = 0xff000000 | (r << 16) | (g << 8) | b;
+	});
+}
+
+// Timings of the CPU renderer. Primary rays are traced in a pass of their own so that
+// packet and single-ray traversal can be compared without the shading cost.
+struct cpu_render_stats
+{
+	double primary_ms;
+	int primary_rays;
+	int packets;
+	int incoherent_packets;
+
+	double rays_per_second() const
+	{
+		return primary_ms > 0 ? primary_rays * 1000.0 / primary_ms : 0.0;
+	}
+};
+
+// Finds the first hit of every pixel's primary ray. With packet_size 1 every ray is
+// traced on its own, otherwise packets cover tiles of adjacent pixels and fall back to
+// single rays when their directions are not coherent.
+template <typename fp_t, int packet_size>
+void trace_primary_cpu(const perspective_camera<fp_t>& camera, const scene_storage<fp_t>& scene, int width, int height, fp_t edge, std::vector<hit_record<fp_t>>& hits, cpu_render_stats& stats)
+{
+	typedef ray_packet_shape<packet_size> shape;
+
+	const int xshift = static_cast<int>((width - edge) / 2);
+	const int yshift = static_cast<int>((height - edge) / 2);
+
+	auto primary_ray = [&](int x, int y) -> ray<fp_t>
+	{
+		fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+		fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+		return camera.generate_ray(sx, sy);
+	};
+
+	const int tiles_x = (width + shape::width - 1) / shape::width;
+	const int tiles_y = (height + shape::height - 1) / shape::height;
+	std::atomic<int> incoherent(0);
+
+	Concurrency::parallel_for(0, tiles_y, [&](int ty)
+	{
+		int row_incoherent = 0;
+
+		for (int tx = 0; tx < tiles_x; tx++)
+		{
+			if (packet_size == 1)
+			{
+				hits[ty * width + tx] = scene.closest_hit(primary_ray(tx, ty));
+				continue;
+			}
+
+			// lanes past the right and bottom edges repeat the last pixel and are not stored
+			ray_packet<fp_t, packet_size> packet;
+			for (int lane = 0; lane < packet_size; lane++)
+			{
+				packet.set_ray(lane, primary_ray(std::min(tx * shape::width + lane % shape::width, width - 1), std::min(ty * shape::height + lane / shape::width, height - 1)));
+			}
+
+			bool coherent = packet.prepare();
+			if (coherent)
+			{
+				scene.intersect_packet(packet);
+			}
+			else
+			{
+				row_incoherent++;
+			}
+
+			for (int lane = 0; lane < packet_size; lane++)
+			{
+				int x = tx * shape::width + lane % shape::width;
+				int y = ty * shape::height + lane / shape::width;
+
+				if (x < width && y < height)
+				{
+					hits[y * width + x] = coherent ? packet.hit(lane) : scene.closest_hit(packet.get_ray(lane));
+				}
+			}
+		}
+
+		incoherent += row_incoherent;
+	});
+
+	stats.packets = packet_size == 1 ? width * height : tiles_x * tiles_y;
+	stats.incoherent_packets = incoherent;
+}
+
+// CPU version of render_reflection writing into a row-major image of width x height.
+// Primary rays are traced in packets of packet_size (1, 4, 8 or 16) rays, shadow and
+// reflection rays are incoherent and always traced one by one.
+template <typename fp_t>
+cpu_render_stats render_reflection_cpu(std::vector<unsigned int>& result, int width, int height, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor, int packet_size)
+{
+	perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+	material_storage<fp_t> materials;
+
+	const fp_t edge = 640 * aa_factor;
+
+	scene.synchronize();
+	lights.synchronize();
+
+	cpu_render_stats stats;
+	stats.primary_rays = width * height;
+
+	std::vector<hit_record<fp_t>> hits(width * height, hit_record<fp_t>(0.0f));
+
+	auto start = std::chrono::high_resolution_clock::now();
+
+	switch (packet_size)
+	{
+	case 4:
+		trace_primary_cpu<fp_t, 4>(camera, scene, width, height, edge, hits, stats);
+		break;
+	case 8:
+		trace_primary_cpu<fp_t, 8>(camera, scene, width, height, edge, hits, stats);
+		break;
+	case 16:
+		trace_primary_cpu<fp_t, 16>(camera, scene, width, height, edge, hits, stats);
+		break;
+	default:
+		trace_primary_cpu<fp_t, 1>(camera, scene, width, height, edge, hits, stats);
+		break;
+	}
+
+	stats.primary_ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	const int xshift = static_cast<int>((width - edge) / 2);
+	const int yshift = static_cast<int>((height - edge) / 2);
+
+	auto saturate = [](fp_t c) { return std::min(std::max(c, static_cast<fp_t>(0.0f)), static_cast<fp_t>(1.0f)); };
+
+	Concurrency::parallel_for(0, height, [&](int y)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+			fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+
+			ray<fp_t> ray(camera.generate_ray(sx, sy));
+
+			color<fp_t> color(shade_reflection(ray, scene.result(ray, hits[y * width + x]), scene, materials, lights, 3, sample_random(static_cast<unsigned int>(y * width + x), 0)));
+			unsigned int r = static_cast<unsigned int>(saturate(color.r) * 255);
+			unsigned int g = static_cast<unsigned int>(saturate(color.g) * 255);
+			unsigned int b = static_cast<unsigned int>(saturate(color.b) * 255);
+
+			result[y * width + x] = 0xff000000 | (r << 16) | (g << 8) | b;
+		}
 	});
-}
\ No newline at end of file
+
+	return stats;
+}
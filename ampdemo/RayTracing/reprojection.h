@@ -0,0 +1,384 @@
+#pragma once
+
+#include "progressive.h"
+
+// Temporal reprojection cache for an orbiting camera. A small orbit step changes little
+// of what is visible, so instead of tracing every pixel again the renderer keeps last
+// frame's hit position, primitive and shaded colour per pixel and carries them into the
+// new view:
+//
+//   scatter  - every cached hit is projected into the new camera, the closest one per
+//              pixel wins through an atomic minimum on its quantized depth
+//   gather   - a pixel keeps its reprojected colour when the sample passes validation:
+//              it is not surrounded by closer samples (it would be hidden behind a hole
+//              the scatter left in a nearer surface), and the new pixel's ray still hits
+//              the same primitive, tested against that primitive alone
+//   trace    - disoccluded pixels, pixels that failed validation and pixels due for a
+//              refresh are compacted into a list and traced like render_reflection
+//
+// Reflections and phong highlights depend on the view, so a reused colour is refreshed
+// once the direction it was shaded for is more than max_view_angle away from the
+// current one, and any colour once it is max_age frames old. Both limits are staggered
+// per pixel so that refreshes spread over several frames. Pixels whose ray hit nothing
+// have no position to reproject and are traced every frame.
+
+enum reprojection_value
+{
+	cache_position_x, cache_position_y, cache_position_z,
+	// direction of the ray the colour was shaded for
+	cache_view_x, cache_view_y, cache_view_z,
+	cache_color_r, cache_color_g, cache_color_b,
+	cache_value_count
+};
+
+enum reprojection_integer
+{
+	cache_kind,
+	cache_index,
+	cache_instance,
+	cache_age,
+	cache_integer_count
+};
+
+enum reprojection_counter
+{
+	reprojection_traced,
+	reprojection_disoccluded,
+	reprojection_failed,
+	reprojection_refreshed,
+	reprojection_counter_count
+};
+
+// Pixel counts of the last frame, every traced pixel is counted for one reason.
+struct reprojection_stats
+{
+	int pixels;
+	int traced;
+	int disoccluded;
+	int failed;
+	int refreshed;
+};
+
+// Device view of the cached samples of one frame.
+template <typename fp_t>
+class reprojection_cache
+{
+public:
+	Concurrency::array_view<fp_t, 1> values;
+	Concurrency::array_view<int, 1> integers;
+	int capacity;
+
+	explicit reprojection_cache(const Concurrency::array_view<fp_t, 1>& values, const Concurrency::array_view<int, 1>& integers, int capacity) restrict(cpu)
+		: values(values), integers(integers), capacity(capacity)
+	{
+	}
+
+	fp_t& value(int field, int i) const restrict(cpu, amp)
+	{
+		return values[field * capacity + i];
+	}
+
+	int& integer(int field, int i) const restrict(cpu, amp)
+	{
+		return integers[field * capacity + i];
+	}
+
+	vector3<fp_t> get_vector(int field, int i) const restrict(cpu, amp)
+	{
+		return vector3<fp_t>(value(field, i), value(field + 1, i), value(field + 2, i));
+	}
+
+	void set_vector(int field, int i, const vector3<fp_t>& v) const restrict(cpu, amp)
+	{
+		value(field, i) = v.x;
+		value(field + 1, i) = v.y;
+		value(field + 2, i) = v.z;
+	}
+};
+
+// Depth in 1/1024 units, ordered like the depths and small enough for 32 bits.
+template <typename fp_t>
+unsigned int reprojection_depth_key(fp_t depth) restrict(cpu, amp)
+{
+	return static_cast<unsigned int>(gpu::fmin(depth, static_cast<fp_t>(4000000.0f)) * 1024.0f);
+}
+
+template <typename fp_t>
+class reprojection_renderer
+{
+public:
+	reprojection_renderer() : current(0), max_age(60), max_view_angle(5.0f)
+	{
+		stats.pixels = stats.traced = stats.disoccluded = stats.failed = stats.refreshed = 0;
+		cache_count[0] = cache_count[1] = 0;
+	}
+
+	// Renders the view like render_reflection, reusing what it can of the last frame.
+	// aa_factor scales the image as in render_reflection and may change between frames.
+	void render(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor)
+	{
+		using namespace Concurrency;
+
+		const int width = result.extent[1];
+		const int height = result.extent[0];
+		const int pixels = width * height;
+
+		const int previous = current;
+		current = 1 - current;
+		resize(current, pixels);
+
+		// without a last frame the new cache stands in for it, with no samples to read
+		const int old_generation = cache_count[previous] > 0 ? previous : current;
+		reprojection_cache<fp_t> old_cache(*values[old_generation], *integers[old_generation], old_generation == previous ? cache_count[previous] : 0);
+		reprojection_cache<fp_t> new_cache(*values[current], *integers[current], pixels);
+		values[current]->discard_data();
+		integers[current]->discard_data();
+
+		depth_key_data.resize(pixels);
+		source_data.resize(pixels);
+		list_data.resize(pixels);
+		counter_data.resize(reprojection_counter_count);
+
+		array_view<unsigned int, 1> depth_keys(pixels, depth_key_data);
+		array_view<int, 1> sources(pixels, source_data);
+		array_view<int, 1> list(pixels, list_data);
+		array_view<int, 1> counters(reprojection_counter_count, counter_data);
+		depth_keys.discard_data();
+		sources.discard_data();
+		list.discard_data();
+
+		for (int k = 0; k < reprojection_counter_count; k++)
+		{
+			counters[k] = 0;
+		}
+
+		perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+		material_storage<fp_t> materials;
+
+		const fp_t edge = 640 * aa_factor;
+		const int xshift = static_cast<int>((width - edge) / 2);
+		const int yshift = static_cast<int>((height - edge) / 2);
+		const int old_count = old_cache.capacity;
+
+		parallel_for_each(extent<1>(pixels), [=](index<1> idx) restrict(amp)
+		{
+			depth_keys[idx] = 0xffffffff;
+			sources[idx] = -1;
+		});
+
+		// pixel of the new image a cached hit falls on, -1 outside of it
+		auto target = [=](int j, unsigned int& key) restrict(amp) -> int
+		{
+			fp_t sx, sy, depth;
+			if (old_cache.integer(cache_kind, j) == primitive_none || !camera.project(old_cache.get_vector(cache_position_x, j), sx, sy, depth))
+			{
+				return -1;
+			}
+
+			const int x = static_cast<int>(gpu::floor(sx * edge + xshift + 0.5f));
+			const int y = static_cast<int>(gpu::floor((1.0f - sy) * edge + yshift + 0.5f));
+			key = reprojection_depth_key(depth);
+
+			return x >= 0 && x < width && y >= 0 && y < height ? y * width + x : -1;
+		};
+
+		if (old_count > 0)
+		{
+			parallel_for_each(extent<1>(old_count), [=](index<1> idx) restrict(amp)
+			{
+				unsigned int key;
+				const int t = target(idx[0], key);
+				if (t >= 0)
+				{
+					atomic_fetch_min(&depth_keys[t], key);
+				}
+			});
+
+			// of several samples at the same depth any one may win
+			parallel_for_each(extent<1>(old_count), [=](index<1> idx) restrict(amp)
+			{
+				unsigned int key;
+				const int t = target(idx[0], key);
+				if (t >= 0 && depth_keys[t] == key)
+				{
+					sources[t] = idx[0];
+				}
+			});
+		}
+
+		// 1 - cos of an angle grows with its square, which staggers the angle limit linearly
+		const int age_limit = max_age;
+		const fp_t angle_limit = static_cast<fp_t>(1.0 - std::cos(max_view_angle * 3.1415926 / 180.0));
+
+		parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+		{
+			const int x = idx[1];
+			const int y = idx[0];
+			const int i = y * width + x;
+
+			fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+			fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+			ray<fp_t> ray(camera.generate_ray(sx, sy));
+
+			const int j = sources[i];
+			int reason = reprojection_disoccluded;
+
+			if (j >= 0)
+			{
+				// a sample with closer samples on most sides shows through a hole in a nearer surface
+				const float own = static_cast<float>(depth_keys[i]);
+				int closer = 0;
+				for (int dy = -1; dy <= 1; dy++)
+				{
+					for (int dx = -1; dx <= 1; dx++)
+					{
+						const int nx = x + dx;
+						const int ny = y + dy;
+						if ((dx != 0 || dy != 0) && nx >= 0 && nx < width && ny >= 0 && ny < height && sources[ny * width + nx] >= 0 &&
+							static_cast<float>(depth_keys[ny * width + nx]) < 0.9f * own)
+						{
+							closer++;
+						}
+					}
+				}
+
+				const int kind = old_cache.integer(cache_kind, j);
+				const int primitive = old_cache.integer(cache_index, j);
+				const int instance = old_cache.integer(cache_instance, j);
+				hit_record<fp_t> hit(scene.intersect_primitive(kind, primitive, instance, ray));
+
+				if (closer < 5 && hit.kind != primitive_none)
+				{
+					const int age = old_cache.integer(cache_age, j) + 1;
+					const vector3<fp_t> view(old_cache.get_vector(cache_view_x, j));
+					const int material_id = scene.result(ray, hit).material;
+					const bool view_dependent = materials.get_type(material_id) == material<fp_t>::material_phong || materials.get_reflectiveness(material_id) > 0.0f;
+
+					// between half and all of the limits, fixed per pixel
+					const fp_t stagger = 0.5f + 0.5f * hash_to_unit(hash_uint(static_cast<unsigned int>(i)));
+
+					if (age > age_limit * stagger || (view_dependent && view.dot(ray.direction) < 1.0f - angle_limit * stagger * stagger))
+					{
+						reason = reprojection_refreshed;
+					}
+					else
+					{
+						const color<fp_t> c(old_cache.value(cache_color_r, j), old_cache.value(cache_color_g, j), old_cache.value(cache_color_b, j));
+
+						// the sample keeps the position it was shaded at, so that it does not drift
+						// by up to half a pixel every frame
+						new_cache.set_vector(cache_position_x, i, old_cache.get_vector(cache_position_x, j));
+						new_cache.set_vector(cache_view_x, i, view);
+						new_cache.value(cache_color_r, i) = c.r;
+						new_cache.value(cache_color_g, i) = c.g;
+						new_cache.value(cache_color_b, i) = c.b;
+						new_cache.integer(cache_kind, i) = kind;
+						new_cache.integer(cache_index, i) = primitive;
+						new_cache.integer(cache_instance, i) = instance;
+						new_cache.integer(cache_age, i) = age;
+
+						result[idx] = tone_map(c);
+						return;
+					}
+				}
+				else
+				{
+					reason = reprojection_failed;
+				}
+			}
+
+			list[atomic_fetch_inc(&counters[reprojection_traced])] = i;
+			atomic_fetch_inc(&counters[reason]);
+		});
+
+		stats.pixels = pixels;
+		stats.traced = counters[reprojection_traced];
+		stats.disoccluded = counters[reprojection_disoccluded];
+		stats.failed = counters[reprojection_failed];
+		stats.refreshed = counters[reprojection_refreshed];
+
+		if (stats.traced > 0)
+		{
+			parallel_for_each(extent<1>(stats.traced), [=](index<1> idx) restrict(amp)
+			{
+				const int i = list[idx];
+				const int x = i % width;
+				const int y = i / width;
+
+				fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+				fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+				ray<fp_t> ray(camera.generate_ray(sx, sy));
+
+				hit_record<fp_t> hit(scene.closest_hit(ray));
+				intersect_result<fp_t> r(scene.result(ray, hit));
+				color<fp_t> c(shade_reflection(ray, r, scene, materials, lights, 3, sample_random(static_cast<unsigned int>(i), 0)));
+
+				new_cache.set_vector(cache_position_x, i, r.position);
+				new_cache.set_vector(cache_view_x, i, ray.direction);
+				new_cache.value(cache_color_r, i) = c.r;
+				new_cache.value(cache_color_g, i) = c.g;
+				new_cache.value(cache_color_b, i) = c.b;
+				new_cache.integer(cache_kind, i) = hit.kind;
+				new_cache.integer(cache_index, i) = hit.index;
+				new_cache.integer(cache_instance, i) = hit.instance;
+				new_cache.integer(cache_age, i) = 0;
+
+				result(y, x) = tone_map(c);
+			});
+		}
+	}
+
+	// Drops the cache, for example after the scene changed. The next frame traces every pixel.
+	void reset()
+	{
+		cache_count[0] = cache_count[1] = 0;
+	}
+
+	// frames a colour is reused at most
+	void set_max_age(int frames)
+	{
+		max_age = std::max(frames, 0);
+	}
+
+	// degrees the view of a reflective or glossy hit may turn before it is shaded again
+	void set_max_view_angle(fp_t degrees)
+	{
+		max_view_angle = degrees;
+	}
+
+	const reprojection_stats& last_frame_stats() const
+	{
+		return stats;
+	}
+
+private:
+	// the buffers only grow, so that dynamic resolution does not reallocate them every frame
+	void resize(int generation, int pixels)
+	{
+		if (!values[generation] || static_cast<int>(integer_data[generation].size()) < pixels * cache_integer_count)
+		{
+			value_data[generation].resize(pixels * cache_value_count);
+			integer_data[generation].resize(pixels * cache_integer_count);
+			values[generation].reset(new Concurrency::array_view<fp_t, 1>(static_cast<int>(value_data[generation].size()), value_data[generation]));
+			integers[generation].reset(new Concurrency::array_view<int, 1>(static_cast<int>(integer_data[generation].size()), integer_data[generation]));
+		}
+		cache_count[generation] = pixels;
+	}
+
+	int current;
+	int max_age;
+	fp_t max_view_angle;
+	reprojection_stats stats;
+
+	// samples in the caches of the last and the current frame, which stay on the accelerator
+	int cache_count[2];
+	std::vector<fp_t> value_data[2];
+	std::vector<int> integer_data[2];
+	std::unique_ptr<Concurrency::array_view<fp_t, 1>> values[2];
+	std::unique_ptr<Concurrency::array_view<int, 1>> integers[2];
+
+	std::vector<unsigned int> depth_key_data;
+	std::vector<int> source_data;
+	std::vector<int> list_data;
+	std::vector<int> counter_data;
+};
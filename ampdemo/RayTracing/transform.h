@@ -0,0 +1,99 @@
+#pragma once
+
+#include "bvh.h"
+#include <cmath>
+
+// Affine transform p' = A p + t of instanced geometry, stored as the three columns of A
+// and the translation. Instances keep both directions, object to world for their bounds
+// and world to object for moving rays into the space of their shape.
+template <typename fp_t>
+class affine_transform
+{
+public:
+	vector3<fp_t> column_x;
+	vector3<fp_t> column_y;
+	vector3<fp_t> column_z;
+	vector3<fp_t> translation;
+
+	affine_transform() restrict(cpu, amp)
+		: column_x(1.0f, 0.0f, 0.0f), column_y(0.0f, 1.0f, 0.0f), column_z(0.0f, 0.0f, 1.0f) {}
+	explicit affine_transform(const vector3<fp_t>& column_x, const vector3<fp_t>& column_y, const vector3<fp_t>& column_z, const vector3<fp_t>& translation) restrict(cpu, amp)
+		: column_x(column_x), column_y(column_y), column_z(column_z), translation(translation) {}
+
+	static affine_transform translate(const vector3<fp_t>& offset) restrict(cpu)
+	{
+		affine_transform t;
+		t.translation = offset;
+		return t;
+	}
+
+	static affine_transform scale(fp_t factor) restrict(cpu)
+	{
+		return affine_transform(vector3<fp_t>(factor, 0.0f, 0.0f), vector3<fp_t>(0.0f, factor, 0.0f), vector3<fp_t>(0.0f, 0.0f, factor), vector3<fp_t>());
+	}
+
+	// rotation about the y axis, the up axis of the scenes
+	static affine_transform rotate_y(fp_t radians) restrict(cpu)
+	{
+		const fp_t c = std::cos(radians);
+		const fp_t s = std::sin(radians);
+
+		return affine_transform(vector3<fp_t>(c, 0.0f, -s), vector3<fp_t>(0.0f, 1.0f, 0.0f), vector3<fp_t>(s, 0.0f, c), vector3<fp_t>());
+	}
+
+	vector3<fp_t> point(const vector3<fp_t>& p) const restrict(cpu, amp)
+	{
+		return column_x * p.x + column_y * p.y + column_z * p.z + translation;
+	}
+
+	vector3<fp_t> direction(const vector3<fp_t>& v) const restrict(cpu, amp)
+	{
+		return column_x * v.x + column_y * v.y + column_z * v.z;
+	}
+
+	// Applies the transposed linear part. Called on the world to object transform it maps
+	// object space normals to world space, they transform with the inverse transpose.
+	vector3<fp_t> transpose_direction(const vector3<fp_t>& v) const restrict(cpu, amp)
+	{
+		return vector3<fp_t>(column_x.dot(v), column_y.dot(v), column_z.dot(v));
+	}
+
+	// the transform that applies other first and this one second
+	affine_transform operator*(const affine_transform& other) const restrict(cpu)
+	{
+		return affine_transform(direction(other.column_x), direction(other.column_y), direction(other.column_z), point(other.translation));
+	}
+
+	// The rows of the inverse linear part are the cross products of the columns divided
+	// by the determinant. The transform must not be singular.
+	affine_transform inverse() const restrict(cpu)
+	{
+		const fp_t inv_det = 1.0f / column_x.dot(column_y.cross(column_z));
+		const vector3<fp_t> row_x(column_y.cross(column_z) * inv_det);
+		const vector3<fp_t> row_y(column_z.cross(column_x) * inv_det);
+		const vector3<fp_t> row_z(column_x.cross(column_y) * inv_det);
+
+		affine_transform result(vector3<fp_t>(row_x.x, row_y.x, row_z.x), vector3<fp_t>(row_x.y, row_y.y, row_z.y), vector3<fp_t>(row_x.z, row_y.z, row_z.z), vector3<fp_t>());
+		result.translation = result.direction(translation).negate();
+		return result;
+	}
+
+	// box around the transformed corners of box
+	aabb<fp_t> bounds(const aabb<fp_t>& box) const restrict(cpu)
+	{
+		aabb<fp_t> result;
+
+		if (!box.is_empty())
+		{
+			for (int corner = 0; corner < 8; corner++)
+			{
+				result.grow(point(vector3<fp_t>(
+					(corner & 1) ? box.upper.x : box.lower.x,
+					(corner & 2) ? box.upper.y : box.lower.y,
+					(corner & 4) ? box.upper.z : box.lower.z)));
+			}
+		}
+
+		return result;
+	}
+};
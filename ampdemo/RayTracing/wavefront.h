@@ -0,0 +1,383 @@
+#pragma once
+
+#include "render.h"
+
+// Wavefront renderer for the reflection scene (Laine, Karras and Aila, "Megakernels
+// Considered Harmful: Wavefront Path Tracing on GPUs"). Instead of one kernel running
+// the whole bounce loop of reflection() per pixel, every bounce runs small kernels:
+//
+//   extend  - closest hit of every ray in the ray queue, hits are appended to the hit
+//             list and to the list of their material type
+//   shadow  - light sample for every hit, one light picked from the light tree and
+//             tested with an any-hit occlusion query
+//   shade   - one kernel per material type, adds the contribution to the pixel and
+//             appends the reflection ray to the ray queue of the next bounce
+//
+// Queues are compacted with atomic counters, so each kernel only runs live paths and
+// the shade kernels only see one material type. Paths are stored field-major (SoA) in
+// one buffer per element type, which also keeps every kernel under the UAV limit.
+
+enum wavefront_path_value
+{
+	path_origin_x, path_origin_y, path_origin_z,
+	path_direction_x, path_direction_y, path_direction_z,
+	path_reflectiveness,
+	path_last_position_x, path_last_position_y, path_last_position_z,
+	path_last_normal_x, path_last_normal_y, path_last_normal_z,
+	path_distance,
+	path_light_x, path_light_y, path_light_z,
+	path_energy_r, path_energy_g, path_energy_b,
+	path_value_count
+};
+
+enum wavefront_path_integer
+{
+	path_pixel,
+	path_last_material,
+	path_kind,
+	path_index,
+	path_instance,
+	path_integer_count
+};
+
+// Counters and lists: the hit list first, then one list per material type.
+enum wavefront_list
+{
+	wavefront_hit_list,
+	wavefront_material_list,
+	wavefront_next_count = wavefront_material_list + material<float>::material_type_count,
+	wavefront_counter_count
+};
+
+// Device view of a queue of paths.
+template <typename fp_t>
+class path_queue
+{
+public:
+	Concurrency::array_view<fp_t, 1> values;
+	Concurrency::array_view<int, 1> integers;
+	int capacity;
+
+	explicit path_queue(std::vector<fp_t>& value_data, std::vector<int>& integer_data, int capacity) restrict(cpu)
+		: values(static_cast<int>(value_data.size()), value_data), integers(static_cast<int>(integer_data.size()), integer_data), capacity(capacity)
+	{
+		values.discard_data();
+		integers.discard_data();
+	}
+
+	fp_t& value(int field, int i) const restrict(cpu, amp)
+	{
+		return values[field * capacity + i];
+	}
+
+	int& integer(int field, int i) const restrict(cpu, amp)
+	{
+		return integers[field * capacity + i];
+	}
+
+	vector3<fp_t> get_vector(int field, int i) const restrict(cpu, amp)
+	{
+		return vector3<fp_t>(value(field, i), value(field + 1, i), value(field + 2, i));
+	}
+
+	void set_vector(int field, int i, const vector3<fp_t>& v) const restrict(cpu, amp)
+	{
+		value(field, i) = v.x;
+		value(field + 1, i) = v.y;
+		value(field + 2, i) = v.z;
+	}
+
+	ray<fp_t> get_ray(int i) const restrict(cpu, amp)
+	{
+		return ray<fp_t>(get_vector(path_origin_x, i), get_vector(path_direction_x, i));
+	}
+
+	hit_record<fp_t> get_hit(int i) const restrict(cpu, amp)
+	{
+		hit_record<fp_t> hit(value(path_distance, i));
+		hit.kind = integer(path_kind, i);
+		hit.index = integer(path_index, i);
+		hit.instance = integer(path_instance, i);
+		return hit;
+	}
+};
+
+// Queue sizes and stage times of one bounce. Every hit traces one shadow ray, the rays
+// of the first bounce are the primary rays and those of the later ones reflection rays.
+struct wavefront_bounce_stats
+{
+	int rays;
+	int hits;
+	int material_hits[material<float>::material_type_count];
+	int reflected;
+	double extend_ms;
+	double shadow_ms;
+	double shade_ms;
+};
+
+template <typename fp_t>
+class wavefront_renderer
+{
+public:
+	void render(const Concurrency::array_view<unsigned int, 2>& result, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights, fp_t phi, fp_t theta, fp_t eyedist, fp_t aa_factor, int max_reflect = 3)
+	{
+		using namespace Concurrency;
+
+		const int width = result.extent[1];
+		const int height = result.extent[0];
+		const int capacity = width * height;
+
+		resize(capacity);
+
+		path_queue<fp_t> queue_a(path_values[0], path_integers[0], capacity);
+		path_queue<fp_t> queue_b(path_values[1], path_integers[1], capacity);
+
+		array_view<int, 1> lists(static_cast<int>(list_data.size()), list_data);
+		lists.discard_data();
+		array_view<int, 1> counters(static_cast<int>(counter_data.size()), counter_data);
+		array_view<fp_t, 1> accumulator(static_cast<int>(accumulator_data.size()), accumulator_data);
+		accumulator.discard_data();
+
+		perspective_camera<fp_t> camera(reflection_camera(phi, theta, eyedist));
+		material_storage<fp_t> materials;
+
+		const fp_t edge = 640 * aa_factor;
+		const int xshift = static_cast<int>((width - edge) / 2);
+		const int yshift = static_cast<int>((height - edge) / 2);
+
+		// generate: one primary ray per pixel, the queue slot is the pixel
+		parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+		{
+			const int x = idx[1];
+			const int y = idx[0];
+			const int i = y * width + x;
+
+			fp_t sy = 1.0f - static_cast<fp_t>(y - yshift) / edge;
+			fp_t sx = static_cast<fp_t>(x - xshift) / edge;
+
+			ray<fp_t> ray(camera.generate_ray(sx, sy));
+			queue_a.set_vector(path_origin_x, i, ray.origin);
+			queue_a.set_vector(path_direction_x, i, ray.direction);
+			queue_a.value(path_reflectiveness, i) = 1.0f;
+			queue_a.integer(path_pixel, i) = i;
+			queue_a.integer(path_last_material, i) = -1;
+
+			accumulator[i] = 0.0f;
+			accumulator[capacity + i] = 0.0f;
+			accumulator[2 * capacity + i] = 0.0f;
+		});
+
+		bounces.clear();
+		int ray_count = capacity;
+
+		for (int bounce = 0; bounce < max_reflect && ray_count > 0; bounce++)
+		{
+			const path_queue<fp_t>& current = bounce % 2 == 0 ? queue_a : queue_b;
+			const path_queue<fp_t>& next = bounce % 2 == 0 ? queue_b : queue_a;
+
+			for (int k = 0; k < wavefront_counter_count; k++)
+			{
+				counters[k] = 0;
+			}
+
+			// the stages wait for their kernels, so that the times add up to the frame time
+			auto stage_start = std::chrono::high_resolution_clock::now();
+
+			extend(ray_count, current, lists, counters, scene, materials);
+
+			wavefront_bounce_stats stats;
+			stats.rays = ray_count;
+			stats.hits = counters[wavefront_hit_list];
+			for (int type = 0; type < material<fp_t>::material_type_count; type++)
+			{
+				stats.material_hits[type] = counters[wavefront_material_list + type];
+			}
+
+			stats.extend_ms = elapsed_ms(stage_start);
+
+			if (stats.hits > 0)
+			{
+				shadow(stats.hits, bounce, current, lists, scene, lights);
+			}
+
+			accelerator().get_default_view().wait();
+			stats.shadow_ms = elapsed_ms(stage_start);
+
+			const bool reflect = bounce + 1 < max_reflect;
+
+			shade<checker<fp_t>>(material<fp_t>::material_checker, stats.material_hits[material<fp_t>::material_checker], reflect, current, next, lists, counters, accumulator, scene, materials);
+			shade<phong<fp_t>>(material<fp_t>::material_phong, stats.material_hits[material<fp_t>::material_phong], reflect, current, next, lists, counters, accumulator, scene, materials);
+
+			stats.reflected = reflect ? counters[wavefront_next_count] : 0;
+
+			accelerator().get_default_view().wait();
+			stats.shade_ms = elapsed_ms(stage_start);
+
+			bounces.push_back(stats);
+
+			ray_count = stats.reflected;
+		}
+
+		parallel_for_each(result.extent, [=](index<2> idx) restrict(amp)
+		{
+			const int i = idx[0] * width + idx[1];
+
+			unsigned int r = static_cast<unsigned int>(direct3d::saturate(accumulator[i]) * 255);
+			unsigned int g = static_cast<unsigned int>(direct3d::saturate(accumulator[capacity + i]) * 255);
+			unsigned int b = static_cast<unsigned int>(direct3d::saturate(accumulator[2 * capacity + i]) * 255);
+
+			result[idx] = 0xff000000 | (r << 16) | (g << 8) | b;
+		});
+	}
+
+	// queue sizes of every bounce of the last frame
+	const std::vector<wavefront_bounce_stats>& bounce_stats() const
+	{
+		return bounces;
+	}
+
+private:
+	// time since start, restarts start
+	static double elapsed_ms(std::chrono::high_resolution_clock::time_point& start)
+	{
+		auto now = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration<double, std::milli>(now - start).count();
+		start = now;
+		return ms;
+	}
+
+	void resize(int capacity)
+	{
+		for (int k = 0; k < 2; k++)
+		{
+			path_values[k].resize(capacity * path_value_count);
+			path_integers[k].resize(capacity * path_integer_count);
+		}
+
+		list_data.resize(capacity * wavefront_next_count);
+		counter_data.resize(wavefront_counter_count);
+		accumulator_data.resize(capacity * 3);
+	}
+
+	static void extend(int count, const path_queue<fp_t>& current, const Concurrency::array_view<int, 1>& lists, const Concurrency::array_view<int, 1>& counters, const scene_storage<fp_t>& scene, const material_storage<fp_t>& materials)
+	{
+		using namespace Concurrency;
+
+		const int capacity = current.capacity;
+
+		parallel_for_each(extent<1>(count), [=](index<1> idx) restrict(amp)
+		{
+			const int i = idx[0];
+
+			ray<fp_t> ray(current.get_ray(i));
+			hit_record<fp_t> hit(scene.closest_hit(ray));
+
+			current.value(path_distance, i) = hit.distance;
+			current.integer(path_kind, i) = hit.kind;
+			current.integer(path_index, i) = hit.index;
+			current.integer(path_instance, i) = hit.instance;
+
+			if (hit.kind != primitive_none)
+			{
+				const int type = materials.get_type(scene.result(ray, hit).material);
+				const int list = wavefront_material_list + type;
+
+				lists[wavefront_hit_list * capacity + atomic_fetch_inc(&counters[wavefront_hit_list])] = i;
+				lists[list * capacity + atomic_fetch_inc(&counters[list])] = i;
+			}
+		});
+	}
+
+	static void shadow(int count, int bounce, const path_queue<fp_t>& current, const Concurrency::array_view<int, 1>& lists, const scene_storage<fp_t>& scene, const light_storage<fp_t>& lights)
+	{
+		using namespace Concurrency;
+
+		parallel_for_each(extent<1>(count), [=](index<1> idx) restrict(amp)
+		{
+			const int i = lists[wavefront_hit_list * current.capacity + idx[0]];
+
+			ray<fp_t> ray(current.get_ray(i));
+			intersect_result<fp_t> r(scene.result(ray, current.get_hit(i)));
+			const sample_random random(static_cast<unsigned int>(current.integer(path_pixel, i)), 0);
+			light_sample<fp_t> ls(lights.sample(scene, r.position, random.uniform(dimension_light + bounce)));
+
+			current.set_vector(path_light_x, i, ls.light_vec);
+			current.value(path_energy_r, i) = ls.energy.r;
+			current.value(path_energy_g, i) = ls.energy.g;
+			current.value(path_energy_b, i) = ls.energy.b;
+		});
+	}
+
+	// One step of the bounce loop of shade_reflection for the hits on material_t.
+	template <typename material_t>
+	static void shade(int type, int count, bool reflect, const path_queue<fp_t>& current, const path_queue<fp_t>& next, const Concurrency::array_view<int, 1>& lists,
+		const Concurrency::array_view<int, 1>& counters, const Concurrency::array_view<fp_t, 1>& accumulator, const scene_storage<fp_t>& scene, const material_storage<fp_t>& materials)
+	{
+		using namespace Concurrency;
+
+		if (count == 0)
+		{
+			return;
+		}
+
+		const int list = wavefront_material_list + type;
+		const int capacity = current.capacity;
+
+		parallel_for_each(extent<1>(count), [=](index<1> idx) restrict(amp)
+		{
+			const int i = lists[list * capacity + idx[0]];
+
+			ray<fp_t> i_ray(current.get_ray(i));
+			intersect_result<fp_t> r(scene.result(i_ray, current.get_hit(i)));
+			light_sample<fp_t> ls(current.get_vector(path_light_x, i),
+				color<fp_t>(current.value(path_energy_r, i), current.value(path_energy_g, i), current.value(path_energy_b, i)));
+
+			fp_t reflectiveness = current.value(path_reflectiveness, i);
+			const int last_material = current.integer(path_last_material, i);
+			const int pixel = current.integer(path_pixel, i);
+
+			fp_t ref_c = materials.get_reflectiveness(r.material);
+			color<fp_t> color(materials.template sample_as<material_t>(r.material, i_ray, r.position, r.normal, ls));
+
+			light_sample<fp_t> ref_ls(i_ray.direction.negate(), color * (1.0f - ref_c));
+
+			if (last_material >= 0)
+			{
+				ray<fp_t> ref_ray(r.position, i_ray.direction.negate());
+				color = materials.sample(last_material, ref_ray, current.get_vector(path_last_position_x, i), current.get_vector(path_last_normal_x, i).negate(), ref_ls);
+			}
+			else
+			{
+				color = color * (1.0f - ref_c);
+			}
+
+			accumulator[pixel] += color.r * reflectiveness;
+			accumulator[capacity + pixel] += color.g * reflectiveness;
+			accumulator[2 * capacity + pixel] += color.b * reflectiveness;
+
+			reflectiveness = reflectiveness * ref_c;
+
+			if (reflect && reflectiveness > 0.0f)
+			{
+				const int j = atomic_fetch_inc(&counters[wavefront_next_count]);
+
+				vector3<fp_t> r1 = (r.normal * (-2.0f * r.normal.dot(i_ray.direction))) + i_ray.direction;
+
+				next.set_vector(path_origin_x, j, r.position);
+				next.set_vector(path_direction_x, j, r1);
+				next.value(path_reflectiveness, j) = reflectiveness;
+				next.set_vector(path_last_position_x, j, r.position);
+				next.set_vector(path_last_normal_x, j, r.normal);
+				next.integer(path_pixel, j) = pixel;
+				next.integer(path_last_material, j) = r.material;
+			}
+		});
+	}
+
+	std::vector<fp_t> path_values[2];
+	std::vector<int> path_integers[2];
+	std::vector<int> list_data;
+	std::vector<int> counter_data;
+	std::vector<fp_t> accumulator_data;
+	std::vector<wavefront_bounce_stats> bounces;
+};
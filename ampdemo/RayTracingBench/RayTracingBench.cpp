@@ -0,0 +1,1153 @@
+// Headless renderer and benchmark for the ray tracer. Renders named scenes from named
+// camera positions with every render mode, writes the images as PPM files and reports
+// frame latency percentiles, ray throughput split into primary, shadow and reflection
+// rays, and how both scale with the number of threads. With --replay it instead renders
+// a camera path recorded in the viewer frame by frame and compares the frame times with
+// a stored baseline.
+//
+// Built against the CPU stand-ins for amp.h and ppl.h in cpu_amp, it needs neither a
+// DirectX accelerator nor a window system.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "camera_path.h"
+#include "reprojection.h"
+#include "denoise.h"
+#include "wavefront.h"
+
+namespace
+{
+    enum render_mode
+    {
+        mode_depth,
+        mode_normal,
+        mode_material,
+        mode_reflection,
+        mode_wavefront,
+        mode_cpu_packets,
+        mode_reprojection,
+        mode_gbuffer,
+        mode_denoise,
+        render_mode_count
+    };
+
+    const char* const ModeNames[render_mode_count] = { "depth", "normal", "material", "reflection", "wavefront", "cpu-packets", "reprojection", "gbuffer", "denoise" };
+
+    // names of the pixel_order values
+    const char* const OrderNames[] = { "row", "morton" };
+    const int OrderCount = sizeof(OrderNames) / sizeof(OrderNames[0]);
+
+    const char* const BvhNames[bvh_build_method_count] = { "median", "sah", "lbvh" };
+
+    const char* const SceneNames[] = { "default", "spheres", "lights", "instances", "bouncing" };
+    const int SceneCount = sizeof(SceneNames) / sizeof(SceneNames[0]);
+
+    struct CameraPosition
+    {
+        const char* name;
+        float phi;
+        float theta;
+        float eyedist;
+    };
+
+    // orbit angles in degrees as used by reflection_camera, "front" is the viewer's start
+    const CameraPosition Cameras[] =
+    {
+        { "front", -270.0f, -85.0f, 60.0f },
+        { "high", -270.0f, -45.0f, 90.0f },
+        { "side", -200.0f, -75.0f, 70.0f }
+    };
+    const int CameraCount = sizeof(Cameras) / sizeof(Cameras[0]);
+
+    struct Options
+    {
+        std::vector<int> scenes;
+        std::vector<int> cameras;
+        std::vector<int> modes;
+        std::vector<int> threads;
+        std::vector<int> orders;
+        std::vector<int> bvhs;
+        int width;
+        int height;
+        int frames;
+        std::string outputDirectory;
+        bool writeImages;
+        bool modeGiven;
+        bool bvhGiven;
+
+        std::string replayPath;
+        std::string baselinePath;
+        std::string saveBaselinePath;
+        std::string orbitPath;
+        double tolerance;
+    };
+
+    // Rays of one frame of the reflection renderers, counted from the wavefront queues.
+    struct RayCounts
+    {
+        long long primary;
+        long long shadow;
+        long long reflection;
+
+        long long Total() const
+        {
+            return primary + shadow + reflection;
+        }
+    };
+
+    struct FrameTimes
+    {
+        std::vector<double> ms;
+
+        // nearest-rank percentile
+        double Percentile(double p) const
+        {
+            std::vector<double> sorted(ms);
+            std::sort(sorted.begin(), sorted.end());
+
+            int rank = static_cast<int>(std::ceil(p / 100.0 * sorted.size())) - 1;
+            return sorted[std::min(std::max(rank, 0), static_cast<int>(sorted.size()) - 1)];
+        }
+    };
+
+    void PrintUsage()
+    {
+        std::printf(
+            "usage: raytracing_bench [options]\n"
+            "  --scene NAMES     comma separated scenes or all (default all): default, spheres, lights,\n"
+            "                    instances, bouncing\n"
+            "  --camera NAMES    comma separated cameras or all (default front): front, high, side\n"
+            "  --mode NAMES      comma separated modes or all (default all): depth, normal, material,\n"
+            "                    reflection, wavefront, cpu-packets, reprojection, gbuffer, denoise;\n"
+            "                    depth and normal always render their own one-sphere scene,\n"
+            "                    reprojection starts every frame from an empty cache and denoise\n"
+            "                    without history except in --replay, gbuffer writes all outputs in\n"
+            "                    one pass and an image of each\n"
+            "  --order NAMES     comma separated pixel orders or all (default row): row, morton;\n"
+            "                    only depth, normal, material, reflection, gbuffer and denoise walk\n"
+            "                    their pixels in an order, the other modes run row only\n"
+            "  --bvh NAMES       comma separated hierarchy builders or all (default sah): median, sah,\n"
+            "                    lbvh; when given, each is built and traced with reflection at the\n"
+            "                    first camera, the mode tables and --replay use the first\n"
+            "  --size WxH        image size (default 640x640)\n"
+            "  --frames N        timed frames per mode and thread count (default 5)\n"
+            "  --threads LIST    comma separated thread counts (default 1, 2, 4, ... up to all)\n"
+            "  --out DIR         directory for the PPM images (default .)\n"
+            "  --no-images       do not write images\n"
+            "\n"
+            "camera path replay, renders the first scene with the first mode (default reflection):\n"
+            "  --replay FILE     render every view of a path recorded with R in the viewer; --frames\n"
+            "                    passes are made and a view's time is the median over the passes\n"
+            "  --baseline FILE   compare the frame times with a baseline, exit with 2 when the median\n"
+            "                    ratio is above 1 + tolerance\n"
+            "  --save-baseline FILE  write the frame times as a baseline\n"
+            "  --tolerance T     relative slowdown reported per frame and allowed overall (default 0.1)\n"
+            "  --write-orbit-path FILE  write a 120 view orbit and zoom path, for use without the viewer\n");
+    }
+
+    std::vector<std::string> SplitList(const std::string& list)
+    {
+        std::vector<std::string> items;
+        std::stringstream stream(list);
+        std::string item;
+
+        while (std::getline(stream, item, ','))
+        {
+            if (!item.empty())
+            {
+                items.push_back(item);
+            }
+        }
+        return items;
+    }
+
+    // Maps a list of names, or all, to indices into names. Returns false for unknown names.
+    bool ParseNames(const std::string& list, const char* const* names, int count, std::vector<int>& result)
+    {
+        result.clear();
+
+        if (list == "all")
+        {
+            for (int i = 0; i < count; i++)
+            {
+                result.push_back(i);
+            }
+            return true;
+        }
+
+        std::vector<std::string> items(SplitList(list));
+        for (size_t k = 0; k < items.size(); k++)
+        {
+            int found = -1;
+            for (int i = 0; i < count; i++)
+            {
+                if (items[k] == names[i])
+                {
+                    found = i;
+                }
+            }
+
+            if (found < 0)
+            {
+                std::fprintf(stderr, "unknown name '%s'\n", items[k].c_str());
+                return false;
+            }
+            result.push_back(found);
+        }
+        return !result.empty();
+    }
+
+    bool ParseOptions(int argc, char** argv, Options& options)
+    {
+        std::vector<const char*> cameraNames;
+        for (int i = 0; i < CameraCount; i++)
+        {
+            cameraNames.push_back(Cameras[i].name);
+        }
+
+        options.width = 640;
+        options.height = 640;
+        options.frames = 5;
+        options.outputDirectory = ".";
+        options.writeImages = true;
+        options.modeGiven = false;
+        options.bvhGiven = false;
+        options.tolerance = 0.1;
+        ParseNames("all", SceneNames, SceneCount, options.scenes);
+        ParseNames("front", cameraNames.data(), CameraCount, options.cameras);
+        ParseNames("all", ModeNames, render_mode_count, options.modes);
+        ParseNames("row", OrderNames, OrderCount, options.orders);
+        ParseNames("sah", BvhNames, bvh_build_method_count, options.bvhs);
+
+        const int hardwareThreads = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        for (int t = 1; t < hardwareThreads; t *= 2)
+        {
+            options.threads.push_back(t);
+        }
+        options.threads.push_back(hardwareThreads);
+
+        for (int i = 1; i < argc; i++)
+        {
+            std::string option(argv[i]);
+            const bool hasValue = i + 1 < argc;
+
+            if (option == "--no-images")
+            {
+                options.writeImages = false;
+            }
+            else if (option == "--help" || option == "-h" || !hasValue)
+            {
+                return false;
+            }
+            else if (option == "--scene")
+            {
+                if (!ParseNames(argv[++i], SceneNames, SceneCount, options.scenes)) return false;
+            }
+            else if (option == "--camera")
+            {
+                if (!ParseNames(argv[++i], cameraNames.data(), CameraCount, options.cameras)) return false;
+            }
+            else if (option == "--mode")
+            {
+                if (!ParseNames(argv[++i], ModeNames, render_mode_count, options.modes)) return false;
+                options.modeGiven = true;
+            }
+            else if (option == "--order")
+            {
+                if (!ParseNames(argv[++i], OrderNames, OrderCount, options.orders)) return false;
+            }
+            else if (option == "--bvh")
+            {
+                if (!ParseNames(argv[++i], BvhNames, bvh_build_method_count, options.bvhs)) return false;
+                options.bvhGiven = true;
+            }
+            else if (option == "--size")
+            {
+                if (std::sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 || options.width <= 0 || options.height <= 0) return false;
+            }
+            else if (option == "--frames")
+            {
+                options.frames = std::atoi(argv[++i]);
+                if (options.frames <= 0) return false;
+            }
+            else if (option == "--threads")
+            {
+                options.threads.clear();
+                std::vector<std::string> items(SplitList(argv[++i]));
+                for (size_t k = 0; k < items.size(); k++)
+                {
+                    int count = std::atoi(items[k].c_str());
+                    if (count <= 0) return false;
+                    options.threads.push_back(count);
+                }
+                if (options.threads.empty()) return false;
+            }
+            else if (option == "--out")
+            {
+                options.outputDirectory = argv[++i];
+            }
+            else if (option == "--replay")
+            {
+                options.replayPath = argv[++i];
+            }
+            else if (option == "--baseline")
+            {
+                options.baselinePath = argv[++i];
+            }
+            else if (option == "--save-baseline")
+            {
+                options.saveBaselinePath = argv[++i];
+            }
+            else if (option == "--tolerance")
+            {
+                options.tolerance = std::atof(argv[++i]);
+                if (options.tolerance <= 0.0) return false;
+            }
+            else if (option == "--write-orbit-path")
+            {
+                options.orbitPath = argv[++i];
+            }
+            else
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    // Torus around the y axis, rings segments around the axis and sides around the tube.
+    triangle_mesh TorusMesh(int rings, int sides, float tube)
+    {
+        triangle_mesh mesh;
+
+        for (int i = 0; i < rings; i++)
+        {
+            for (int j = 0; j < sides; j++)
+            {
+                const float u = i * 6.2831853f / rings;
+                const float v = j * 6.2831853f / sides;
+                mesh.x.push_back((1.0f + tube * std::cos(v)) * std::cos(u));
+                mesh.y.push_back(tube * std::sin(v));
+                mesh.z.push_back((1.0f + tube * std::cos(v)) * std::sin(u));
+            }
+        }
+
+        for (int i = 0; i < rings; i++)
+        {
+            for (int j = 0; j < sides; j++)
+            {
+                const int a = i * sides + j;
+                const int b = ((i + 1) % rings) * sides + j;
+                const int c = ((i + 1) % rings) * sides + (j + 1) % sides;
+                const int d = i * sides + (j + 1) % sides;
+                const int quad[6] = { a, c, b, a, d, c };
+                mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+            }
+        }
+
+        return mesh;
+    }
+
+    // Placement of instance i of the "instances" scene, turned by angle about its own axis.
+    affine_transform<float> InstancePlacement(int i, float angle)
+    {
+        const float x = (i % 24) * 7.0f - 80.0f;
+        const float z = (i / 24) * -7.0f + 10.0f;
+        const float scale = 0.7f + 0.3f * hash_to_unit(hash_uint(static_cast<unsigned int>(i) + 0x2545f491u));
+
+        return affine_transform<float>::translate(vector3<float>(x, 0.0f, z)) *
+            affine_transform<float>::rotate_y(angle + i * 0.9f) * affine_transform<float>::scale(scale);
+    }
+
+    // The "bouncing" scene: spheres with these ids bounce on the floor and off the walls
+    // of a box around the start scene.
+    const int BouncingFirst = 2;
+    const int BouncingCount = 4096;
+
+    // "default" is the viewer's start scene, "spheres" adds a field of small spheres on the
+    // floor, "lights" lights the start scene with 4096 scattered lights, "instances"
+    // places 384 copies of a torus mesh and of a sphere cluster around it and "bouncing"
+    // drops 4096 spheres that are animated before the scene is benchmarked.
+    void BuildScene(int sceneIndex, scene_data<float>& scene, light_data<float>& lights)
+    {
+        const std::string name(SceneNames[sceneIndex]);
+
+        if (name == "spheres")
+        {
+            for (int i = 0; i < 20000; i++)
+            {
+                unsigned int h = hash_uint(static_cast<unsigned int>(i) + 0x51ed270bu);
+                float x = hash_to_unit(h) * 160.0f - 80.0f;
+                h = hash_uint(h);
+                float z = hash_to_unit(h) * 120.0f - 100.0f;
+                h = hash_uint(h);
+                float radius = 0.3f + 1.2f * hash_to_unit(h);
+
+                scene.add_sphere(vector3<float>(x, radius, z), radius, i % 2);
+            }
+            scene.build();
+        }
+        else if (name == "lights")
+        {
+            lights.clear();
+            add_scattered_lights(lights, 4096, vector3<float>(-50.0f, 10.0f, -60.0f), vector3<float>(50.0f, 40.0f, 20.0f), 3000.0f);
+            lights.build();
+        }
+        else if (name == "instances")
+        {
+            const int torus = scene.add_shape(TorusMesh(96, 48, 0.35f), 1, 5.0f);
+
+            sphere_set cluster;
+            for (int i = 0; i < 64; i++)
+            {
+                unsigned int h = hash_uint(static_cast<unsigned int>(i) + 0x6a09e667u);
+                const float angle = hash_to_unit(h) * 6.2831853f;
+                h = hash_uint(h);
+                const float distance = 0.5f + 2.0f * hash_to_unit(h);
+                h = hash_uint(h);
+                const float radius = 0.2f + 0.4f * hash_to_unit(h);
+
+                cluster.add(distance * std::cos(angle), radius, distance * std::sin(angle), radius, i % 2);
+            }
+            const int spheres = scene.add_shape(cluster);
+
+            for (int i = 0; i < 384; i++)
+            {
+                scene.add_instance(i % 2 == 0 ? torus : spheres, InstancePlacement(i, 0.0f));
+            }
+            scene.build();
+        }
+        else if (name == "bouncing")
+        {
+            for (int i = 0; i < BouncingCount; i++)
+            {
+                unsigned int h = hash_uint(static_cast<unsigned int>(i) + 0x3c6ef372u);
+                float x = hash_to_unit(h) * 100.0f - 50.0f;
+                h = hash_uint(h);
+                float y = 2.0f + hash_to_unit(h) * 40.0f;
+                h = hash_uint(h);
+                float z = hash_to_unit(h) * 100.0f - 80.0f;
+                h = hash_uint(h);
+                float radius = 0.4f + 0.6f * hash_to_unit(h);
+
+                scene.add_sphere(vector3<float>(x, y, z), radius, i % 2);
+            }
+            scene.build();
+        }
+    }
+
+    // Runs steps of the bouncing animation from the built scene. Every step the spheres
+    // fall, bounce and drift, and the hierarchy is refitted or, once its SAH cost has
+    // grown past the threshold, rebuilt. Every tenth step a frame is traced on the CPU
+    // for the primary ray throughput of the refitted tree. The scene is rebuilt in its
+    // start state at the end, with the first --bvh builder.
+    void ReportAnimation(scene_data<float>& scene, const light_data<float>& lights, const Options& options)
+    {
+        const int steps = 120;
+        const float dt = 1.0f / 30.0f;
+        const double threshold = 2.0;
+        const int threads = *std::max_element(options.threads.begin(), options.threads.end());
+
+        Concurrency::set_cpu_thread_count(threads);
+
+        std::vector<vector3<float>> start(BouncingCount), velocity(BouncingCount);
+        for (int i = 0; i < BouncingCount; i++)
+        {
+            start[i] = scene.get_sphere_center(BouncingFirst + i);
+
+            unsigned int h = hash_uint(static_cast<unsigned int>(i) + 0xa54ff53au);
+            float vx = hash_to_unit(h) * 16.0f - 8.0f;
+            h = hash_uint(h);
+            float vz = hash_to_unit(h) * 16.0f - 8.0f;
+            velocity[i] = vector3<float>(vx, 0.0f, vz);
+        }
+
+        const double buildMs = scene.build_stats().build_ms;
+        std::vector<unsigned int> pixels(options.width * options.height);
+        const CameraPosition& camera = Cameras[1];
+
+        std::printf("\n%d bouncing spheres, %d steps of %.0f ms, rebuild when the SAH cost grows past %.1fx, %d threads\n",
+            BouncingCount, steps, dt * 1000.0f, threshold, threads);
+        std::printf("%6s %9s %9s %8s %9s\n", "step", "refit ms", "growth", "rebuilt", "Mrays/s");
+
+        FrameTimes refitTimes, rebuildTimes;
+        int rebuilds = 0;
+
+        for (int step = 1; step <= steps; step++)
+        {
+            for (int i = 0; i < BouncingCount; i++)
+            {
+                const int id = BouncingFirst + i;
+                vector3<float> p(scene.get_sphere_center(id) + velocity[i] * dt);
+                vector3<float>& v = velocity[i];
+                const float radius = scene.get_sphere_radius(id);
+
+                v.y -= 30.0f * dt;
+                if (p.y < radius && v.y < 0.0f)
+                {
+                    v.y = -0.9f * v.y;
+                }
+                if ((p.x < -80.0f && v.x < 0.0f) || (p.x > 80.0f && v.x > 0.0f))
+                {
+                    v.x = -v.x;
+                }
+                if ((p.z < -110.0f && v.z < 0.0f) || (p.z > 30.0f && v.z > 0.0f))
+                {
+                    v.z = -v.z;
+                }
+
+                scene.move_sphere(id, p);
+            }
+
+            const bvh_update_stats update = scene.update_dynamic(threshold);
+            refitTimes.ms.push_back(update.refit_ms);
+            if (update.rebuilds > 0)
+            {
+                rebuildTimes.ms.push_back(update.rebuild_ms);
+                rebuilds++;
+            }
+
+            if (step % 10 == 0 || update.rebuilds > 0)
+            {
+                std::printf("%6d %9.3f %8.2fx %8s", step, update.refit_ms, update.cost_growth, update.rebuilds > 0 ? "yes" : "");
+
+                if (step % 10 == 0)
+                {
+                    const cpu_render_stats stats = render_reflection_cpu<float>(pixels, options.width, options.height, scene.storage(), lights.storage(),
+                        camera.phi, camera.theta, camera.eyedist, 1.0f, 1);
+                    std::printf(" %9.3f", stats.rays_per_second() / 1e6);
+                }
+                std::printf("\n");
+            }
+        }
+
+        std::printf("refit p50 %.3f ms, max %.3f ms; full build %.3f ms; %d rebuilds in %d steps", refitTimes.Percentile(50.0), refitTimes.Percentile(100.0), buildMs, rebuilds, steps);
+        std::printf(rebuilds > 0 ? ", rebuild p50 %.3f ms\n" : "\n", rebuilds > 0 ? rebuildTimes.Percentile(50.0) : 0.0);
+
+        for (int i = 0; i < BouncingCount; i++)
+        {
+            scene.move_sphere(BouncingFirst + i, start[i]);
+        }
+        scene.build(options.bvhs[0]);
+    }
+
+    // Memory of an instanced scene and the time to move every instance, which only
+    // rebuilds the top level hierarchy.
+    void ReportInstances(scene_data<float>& scene, int frames)
+    {
+        std::printf("\n%d shapes in %d instances showing %lld primitives, %.1f KB of geometry\n", scene.shape_count(), scene.get_instance_count(),
+            scene.instanced_primitive_count(), scene.geometry_bytes() / 1024.0);
+
+        FrameTimes times;
+        for (int f = 0; f < frames; f++)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < scene.get_instance_count(); i++)
+            {
+                scene.set_instance_transform(i, InstancePlacement(i, 0.1f * (f + 1)));
+            }
+            scene.update_instances();
+            times.ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+        }
+
+        std::printf("moving every instance: p50 %.3f ms, max %.3f ms\n", times.Percentile(50.0), times.Percentile(100.0));
+
+        for (int i = 0; i < scene.get_instance_count(); i++)
+        {
+            scene.set_instance_transform(i, InstancePlacement(i, 0.0f));
+        }
+        scene.update_instances();
+    }
+
+    bool WritePpm(const std::string& path, const std::vector<unsigned int>& pixels, int width, int height)
+    {
+        std::ofstream file(path.c_str(), std::ios::binary);
+        file << "P6\n" << width << " " << height << "\n255\n";
+
+        std::vector<unsigned char> row(width * 3);
+        for (int y = 0; y < height; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                unsigned int pixel = pixels[y * width + x];
+                row[3 * x] = static_cast<unsigned char>(pixel >> 16);
+                row[3 * x + 1] = static_cast<unsigned char>(pixel >> 8);
+                row[3 * x + 2] = static_cast<unsigned char>(pixel);
+            }
+            file.write(reinterpret_cast<const char*>(row.data()), row.size());
+        }
+
+        return static_cast<bool>(file);
+    }
+
+    // Renderers that keep buffers or state from one frame to the next.
+    struct Renderers
+    {
+        wavefront_renderer<float> wavefront;
+        reprojection_renderer<float> reprojection;
+        gbuffer<float> surfaces;
+        atrous_denoiser<float> denoiser;
+    };
+
+    // Renders one frame of mode into pixels.
+    void RenderFrame(int mode, int order, const scene_data<float>& scene, const light_data<float>& lights, const CameraPosition& camera,
+        int width, int height, Renderers& renderers, std::vector<unsigned int>& pixels)
+    {
+        Concurrency::array_view<unsigned int, 2> view(height, width, pixels);
+        view.discard_data();
+
+        switch (mode)
+        {
+        case mode_depth:
+            render_depth<float>(view, order);
+            break;
+        case mode_normal:
+            render_normal<float>(view, order);
+            break;
+        case mode_material:
+            render_material<float>(view, scene.storage(), order);
+            break;
+        case mode_reflection:
+            render_reflection<float>(view, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f, order);
+            break;
+        case mode_wavefront:
+            renderers.wavefront.render(view, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f);
+            break;
+        case mode_cpu_packets:
+            render_reflection_cpu<float>(pixels, width, height, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f, 16);
+            break;
+        case mode_reprojection:
+            renderers.reprojection.render(view, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f);
+            break;
+        case mode_gbuffer:
+            renderers.surfaces.render<gbuffer_all>(width, height, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f, order);
+            renderers.surfaces.show(view, gbuffer_color, 0.0f, 0.0f, order);
+            break;
+        case mode_denoise:
+            renderers.surfaces.render<atrous_denoiser<float>::inputs>(width, height, scene.storage(), lights.storage(), camera.phi, camera.theta, camera.eyedist, 1.0f, order);
+            renderers.denoiser.denoise(renderers.surfaces, view, order);
+            break;
+        }
+
+        view.synchronize();
+    }
+
+    // Modes whose kernels walk the pixels in the order given to RenderFrame.
+    bool ModeTakesOrder(int mode)
+    {
+        switch (mode)
+        {
+        case mode_depth:
+        case mode_normal:
+        case mode_material:
+        case mode_reflection:
+        case mode_gbuffer:
+        case mode_denoise:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Rays per frame. The reflection renderers trace the same rays as the wavefront one,
+    // so does reprojection from an empty cache, the other modes one primary ray per pixel.
+    long long RaysPerFrame(int mode, const RayCounts& counts, int width, int height)
+    {
+        switch (mode)
+        {
+        case mode_reflection:
+        case mode_wavefront:
+        case mode_cpu_packets:
+        case mode_reprojection:
+        case mode_gbuffer:
+        case mode_denoise:
+            return counts.Total();
+        default:
+            return static_cast<long long>(width) * height;
+        }
+    }
+
+    RayCounts CountRays(const std::vector<wavefront_bounce_stats>& bounces)
+    {
+        RayCounts counts = {};
+
+        for (size_t i = 0; i < bounces.size(); i++)
+        {
+            (i == 0 ? counts.primary : counts.reflection) += bounces[i].rays;
+            counts.shadow += bounces[i].hits;
+        }
+        return counts;
+    }
+
+    // One image per output of the last G-buffer render, named prefix-output.ppm.
+    void WriteGbufferViews(const std::string& prefix, const gbuffer<float>& buffers, int width, int height, float eyedist)
+    {
+        const char* const names[] = { "depth", "normal", "material", "albedo", "color", "motion" };
+        std::vector<unsigned int> pixels(width * height);
+
+        for (int i = 0; i < 6; i++)
+        {
+            Concurrency::array_view<unsigned int, 2> view(height, width, pixels);
+            view.discard_data();
+            buffers.show(view, 1 << i, 2.0f * eyedist, 16.0f);
+            view.synchronize();
+
+            std::string path(prefix + "-" + names[i] + ".ppm");
+            if (!WritePpm(path, pixels, width, height))
+            {
+                std::fprintf(stderr, "could not write %s\n", path.c_str());
+            }
+        }
+    }
+
+    // Builds the scene with each of the requested builders and traces it with the reflection
+    // renderer at the first camera. Build time and SAH cost add the world trees and the top
+    // level over the instances, the shape trees are built once by add_shape. The scene is
+    // left built with the first builder.
+    void CompareBvhs(const Options& options, scene_data<float>& scene, const light_data<float>& lights)
+    {
+        const CameraPosition& camera = Cameras[options.cameras[0]];
+        const int width = options.width;
+        const int height = options.height;
+
+        Renderers renderers;
+        std::vector<unsigned int> pixels(width * height);
+        Concurrency::set_cpu_thread_count(options.threads[0]);
+
+        std::printf("\nhierarchies, camera %s, %dx%d, reflection with %d threads\n", camera.name, width, height, options.threads[0]);
+        std::printf("%-8s %9s %10s %8s %6s %9s %9s\n", "bvh", "build ms", "SAH cost", "nodes", "depth", "p50 ms", "Mrays/s");
+
+        for (size_t b = 0; b < options.bvhs.size(); b++)
+        {
+            scene.build(options.bvhs[b]);
+
+            bvh_build_stats stats = scene.build_stats();
+            const bvh_build_stats& top = scene.instance_build_stats();
+            stats.build_ms += top.build_ms;
+            stats.sah_cost += top.sah_cost;
+            stats.node_count += top.node_count;
+            stats.depth = std::max(stats.depth, top.depth);
+
+            // the rays traced differ slightly between the trees, count them for each
+            RenderFrame(mode_wavefront, pixel_order_row_major, scene, lights, camera, width, height, renderers, pixels);
+            const long long rays = CountRays(renderers.wavefront.bounce_stats()).Total();
+
+            FrameTimes times;
+            for (int f = 0; f < options.frames; f++)
+            {
+                auto start = std::chrono::high_resolution_clock::now();
+                RenderFrame(mode_reflection, pixel_order_row_major, scene, lights, camera, width, height, renderers, pixels);
+                times.ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+            }
+
+            const double median = times.Percentile(50.0);
+            std::printf("%-8s %9.2f %10.2f %8d %6d %9.2f %9.3f\n", BvhNames[options.bvhs[b]],
+                stats.build_ms, stats.sah_cost, stats.node_count, stats.depth, median, rays / (median * 1000.0));
+        }
+
+        scene.build(options.bvhs[0]);
+    }
+
+    void BenchmarkView(const Options& options, int sceneIndex, const CameraPosition& camera, const scene_data<float>& scene, const light_data<float>& lights)
+    {
+        const int width = options.width;
+        const int height = options.height;
+
+        Renderers renderers;
+        std::vector<unsigned int> pixels(width * height);
+
+        Concurrency::set_cpu_thread_count(0);
+        RenderFrame(mode_wavefront, pixel_order_row_major, scene, lights, camera, width, height, renderers, pixels);
+        const RayCounts counts = CountRays(renderers.wavefront.bounce_stats());
+
+        // primitives in world space, and those the instances show
+        char primitives[96];
+        std::snprintf(primitives, sizeof(primitives), "%d primitives", scene.primitive_count());
+        if (scene.get_instance_count() > 0)
+        {
+            std::snprintf(primitives, sizeof(primitives), "%d primitives and %d instances of %lld primitives",
+                scene.primitive_count(), scene.get_instance_count(), scene.instanced_primitive_count());
+        }
+
+        std::printf("\nscene %s, bvh %s, camera %s, %dx%d, %s, %d lights\n", SceneNames[sceneIndex], BvhNames[options.bvhs[0]], camera.name, width, height, primitives, lights.light_count());
+        std::printf("rays per frame: %lld primary, %lld shadow, %lld reflection\n", counts.primary, counts.shadow, counts.reflection);
+        std::printf("%-12s %-7s %7s %9s %9s %9s %9s %9s %8s\n", "mode", "order", "threads", "p50 ms", "p90 ms", "p99 ms", "max ms", "Mrays/s", "speedup");
+
+        // every mode in each of the requested pixel orders it can walk
+        std::vector<std::pair<int, int>> runs;
+        for (size_t m = 0; m < options.modes.size(); m++)
+        {
+            for (size_t o = 0; o < options.orders.size(); o++)
+            {
+                if (options.orders[o] == pixel_order_row_major || ModeTakesOrder(options.modes[m]))
+                {
+                    runs.push_back(std::make_pair(options.modes[m], options.orders[o]));
+                }
+            }
+        }
+
+        for (size_t r = 0; r < runs.size(); r++)
+        {
+            const int mode = runs[r].first;
+            const int order = runs[r].second;
+            const long long rays = RaysPerFrame(mode, counts, width, height);
+            double baseline = 0.0;
+
+            // primary, shadow and reflection time of the wavefront stages per thread count
+            std::vector<double> stageMs[3];
+            std::vector<double> denoiseMs;
+
+            for (size_t t = 0; t < options.threads.size(); t++)
+            {
+                Concurrency::set_cpu_thread_count(options.threads[t]);
+
+                // the first frame warms the caches and sizes the wavefront queues
+                RenderFrame(mode, order, scene, lights, camera, width, height, renderers, pixels);
+
+                FrameTimes times;
+                double primaryMs = 0.0, shadowMs = 0.0, reflectionMs = 0.0;
+                FrameTimes filterTimes;
+
+                for (int f = 0; f < options.frames; f++)
+                {
+                    // with the camera at rest every pixel would be reused
+                    renderers.reprojection.reset();
+                    renderers.surfaces.reset();
+                    renderers.denoiser.reset();
+
+                    auto start = std::chrono::high_resolution_clock::now();
+                    RenderFrame(mode, order, scene, lights, camera, width, height, renderers, pixels);
+                    times.ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+
+                    filterTimes.ms.push_back(renderers.denoiser.last_denoise_ms());
+
+                    if (mode == mode_wavefront)
+                    {
+                        const std::vector<wavefront_bounce_stats>& bounces = renderers.wavefront.bounce_stats();
+                        for (size_t i = 0; i < bounces.size(); i++)
+                        {
+                            (i == 0 ? primaryMs : reflectionMs) += bounces[i].extend_ms;
+                            shadowMs += bounces[i].shadow_ms;
+                        }
+                    }
+                }
+
+                const double median = times.Percentile(50.0);
+                if (t == 0)
+                {
+                    baseline = median;
+                }
+
+                std::printf("%-12s %-7s %7d %9.2f %9.2f %9.2f %9.2f %9.3f %7.2fx\n", ModeNames[mode], OrderNames[order], options.threads[t],
+                    median, times.Percentile(90.0), times.Percentile(99.0), times.Percentile(100.0),
+                    rays / (median * 1000.0), baseline / median);
+
+                denoiseMs.push_back(filterTimes.Percentile(50.0));
+
+                if (mode == mode_wavefront)
+                {
+                    stageMs[0].push_back(primaryMs / options.frames);
+                    stageMs[1].push_back(shadowMs / options.frames);
+                    stageMs[2].push_back(reflectionMs / options.frames);
+                }
+            }
+
+            if (mode == mode_wavefront)
+            {
+                std::printf("  wavefront stages  %7s %12s %12s %12s   (Mrays/s, stage time per frame)\n", "threads", "primary", "shadow", "reflection");
+                for (size_t t = 0; t < options.threads.size(); t++)
+                {
+                    std::printf("                    %7d %6.3f %5.1fms %6.3f %5.1fms %6.3f %5.1fms\n", options.threads[t],
+                        counts.primary / (stageMs[0][t] * 1000.0), stageMs[0][t],
+                        counts.shadow / (stageMs[1][t] * 1000.0), stageMs[1][t],
+                        counts.reflection / (std::max(stageMs[2][t], 1e-6) * 1000.0), stageMs[2][t]);
+                }
+            }
+
+            if (mode == mode_denoise)
+            {
+                std::printf("  denoise filter    %7s %9s   (%d iterations, part of the frame time)\n", "threads", "p50 ms", renderers.denoiser.get_iterations());
+                for (size_t t = 0; t < options.threads.size(); t++)
+                {
+                    std::printf("                    %7d %9.2f\n", options.threads[t], denoiseMs[t]);
+                }
+            }
+
+            if (options.writeImages)
+            {
+                std::string path(options.outputDirectory + "/" + SceneNames[sceneIndex] + "-" + camera.name + "-" + ModeNames[mode] +
+                    (order == pixel_order_row_major ? "" : std::string("-") + OrderNames[order]) + ".ppm");
+                if (!WritePpm(path, pixels, width, height))
+                {
+                    std::fprintf(stderr, "could not write %s\n", path.c_str());
+                }
+
+                if (mode == mode_gbuffer)
+                {
+                    WriteGbufferViews(path.substr(0, path.size() - 4), renderers.surfaces, width, height, camera.eyedist);
+                }
+            }
+        }
+    }
+
+    // One full orbit from the front camera that climbs and zooms in and back out, spaced
+    // as a 60 Hz recording.
+    camera_path OrbitPath()
+    {
+        const CameraPosition& front = Cameras[0];
+        camera_path path;
+
+        for (int i = 0; i < 120; i++)
+        {
+            const float t = i / 120.0f;
+            const float wave = std::sin(t * 6.2831853f);
+            path.add(i * 1000.0f / 60.0f, front.phi + 360.0f * t, front.theta + 30.0f * std::fabs(wave), front.eyedist * (1.0f - 0.4f * wave));
+        }
+        return path;
+    }
+
+    // Baselines are text, one frame time in ms per line, so that they diff well.
+    bool LoadBaseline(const std::string& path, std::vector<double>& ms)
+    {
+        std::ifstream file(path.c_str());
+        ms.clear();
+
+        double value;
+        while (file >> value)
+        {
+            ms.push_back(value);
+        }
+        return file.eof() && !ms.empty();
+    }
+
+    bool SaveBaseline(const std::string& path, const std::vector<double>& ms)
+    {
+        std::ofstream file(path.c_str());
+        file.precision(4);
+        file << std::fixed;
+
+        for (size_t i = 0; i < ms.size(); i++)
+        {
+            file << ms[i] << "\n";
+        }
+        return static_cast<bool>(file);
+    }
+
+    // Renders every view of the path and reports the frame times. Returns the exit code,
+    // 2 when the frames are slower than the baseline by more than the tolerance.
+    int ReplayPath(const Options& options)
+    {
+        camera_path path;
+        if (!path.load(options.replayPath) || path.size() == 0)
+        {
+            std::fprintf(stderr, "could not read the camera path %s\n", options.replayPath.c_str());
+            return 1;
+        }
+
+        const int sceneIndex = options.scenes[0];
+        const int mode = options.modeGiven ? options.modes[0] : static_cast<int>(mode_reflection);
+        const int order = options.orders[0];
+        const int threads = *std::max_element(options.threads.begin(), options.threads.end());
+        const int width = options.width;
+        const int height = options.height;
+
+        scene_data<float> scene;
+        light_data<float> lights;
+        BuildScene(sceneIndex, scene, lights);
+        if (options.bvhs[0] != bvh_build_sah)
+        {
+            scene.build(options.bvhs[0]);
+        }
+
+        Renderers renderers;
+        std::vector<unsigned int> pixels(width * height);
+        Concurrency::set_cpu_thread_count(threads);
+
+        std::printf("replay %s: %d views, scene %s, mode %s, order %s, %dx%d, %d threads, %d passes\n", options.replayPath.c_str(), path.size(),
+            SceneNames[sceneIndex], ModeNames[mode], OrderNames[order], width, height, threads, options.frames);
+
+        // the first view warms the caches and sizes the wavefront queues
+        const CameraPosition first = { "replay", path[0].phi, path[0].theta, path[0].eyedist };
+        RenderFrame(mode, order, scene, lights, first, width, height, renderers, pixels);
+
+        // pixels reprojection traced per view, the same in every pass
+        std::vector<reprojection_stats> reprojection(path.size());
+
+        std::vector<FrameTimes> passes(path.size());
+        for (int pass = 0; pass < options.frames; pass++)
+        {
+            renderers.reprojection.reset();
+            renderers.surfaces.reset();
+            renderers.denoiser.reset();
+
+            for (int i = 0; i < path.size(); i++)
+            {
+                const CameraPosition camera = { "replay", path[i].phi, path[i].theta, path[i].eyedist };
+
+                auto start = std::chrono::high_resolution_clock::now();
+                RenderFrame(mode, order, scene, lights, camera, width, height, renderers, pixels);
+                passes[i].ms.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+
+                reprojection[i] = renderers.reprojection.last_frame_stats();
+            }
+        }
+
+        FrameTimes times;
+        for (int i = 0; i < path.size(); i++)
+        {
+            times.ms.push_back(passes[i].Percentile(50.0));
+        }
+
+        std::vector<double> baseline;
+        const bool compare = !options.baselinePath.empty();
+        if (compare && (!LoadBaseline(options.baselinePath, baseline) || static_cast<int>(baseline.size()) != path.size()))
+        {
+            std::fprintf(stderr, "%s is not a baseline of the %d views of this path\n", options.baselinePath.c_str(), path.size());
+            return 1;
+        }
+
+        const bool reprojecting = mode == mode_reprojection;
+        long long traced = 0, disoccluded = 0, failed = 0, refreshed = 0, total = 0;
+
+        std::printf("%6s %10s %8s %8s %8s %9s", "frame", "time ms", "phi", "theta", "dist", "ms");
+        std::printf(reprojecting ? " %8s" : "", "traced");
+        std::printf(compare ? " %11s %7s\n" : "\n", "baseline ms", "ratio");
+
+        FrameTimes ratios;
+        for (int i = 0; i < path.size(); i++)
+        {
+            std::printf("%6d %10.1f %8.2f %8.2f %8.2f %9.2f", i, path[i].time_ms, path[i].phi, path[i].theta, path[i].eyedist, times.ms[i]);
+
+            if (reprojecting)
+            {
+                const reprojection_stats& stats = reprojection[i];
+                std::printf(" %7.1f%%", 100.0 * stats.traced / stats.pixels);
+
+                // the first view has nothing to reuse
+                if (i > 0)
+                {
+                    traced += stats.traced;
+                    disoccluded += stats.disoccluded;
+                    failed += stats.failed;
+                    refreshed += stats.refreshed;
+                    total += stats.pixels;
+                }
+            }
+
+            if (compare)
+            {
+                const double ratio = times.ms[i] / std::max(baseline[i], 1e-6);
+                ratios.ms.push_back(ratio);
+                std::printf(" %11.2f %7.3f%s", baseline[i], ratio, ratio > 1.0 + options.tolerance ? "  slower" : "");
+            }
+            std::printf("\n");
+        }
+
+        std::printf("frame ms: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f\n", times.Percentile(50.0), times.Percentile(90.0), times.Percentile(99.0), times.Percentile(100.0));
+
+        if (reprojecting && total > 0)
+        {
+            std::printf("after the first view %.1f%% of the pixels were traced: %.1f%% disoccluded, %.1f%% failed validation, %.1f%% refreshed\n",
+                100.0 * traced / total, 100.0 * disoccluded / total, 100.0 * failed / total, 100.0 * refreshed / total);
+        }
+
+        if (!options.saveBaselinePath.empty())
+        {
+            if (!SaveBaseline(options.saveBaselinePath, times.ms))
+            {
+                std::fprintf(stderr, "could not write %s\n", options.saveBaselinePath.c_str());
+                return 1;
+            }
+            std::printf("baseline saved to %s\n", options.saveBaselinePath.c_str());
+        }
+
+        if (compare)
+        {
+            int slower = 0;
+            for (size_t i = 0; i < ratios.ms.size(); i++)
+            {
+                slower += ratios.ms[i] > 1.0 + options.tolerance ? 1 : 0;
+            }
+
+            const double median = ratios.Percentile(50.0);
+            std::printf("against the baseline: median ratio %.3f, p90 %.3f, %d of %d frames over the %.0f%% tolerance\n",
+                median, ratios.Percentile(90.0), slower, path.size(), options.tolerance * 100.0);
+
+            if (median > 1.0 + options.tolerance)
+            {
+                std::printf("REGRESSION: the replay is slower than the baseline\n");
+                return 2;
+            }
+        }
+
+        return 0;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!ParseOptions(argc, argv, options))
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    if (!options.orbitPath.empty())
+    {
+        if (!OrbitPath().save(options.orbitPath))
+        {
+            std::fprintf(stderr, "could not write %s\n", options.orbitPath.c_str());
+            return 1;
+        }
+
+        if (options.replayPath.empty())
+        {
+            return 0;
+        }
+    }
+
+    if (!options.replayPath.empty())
+    {
+        return ReplayPath(options);
+    }
+
+    for (size_t s = 0; s < options.scenes.size(); s++)
+    {
+        scene_data<float> scene;
+        light_data<float> lights;
+        BuildScene(options.scenes[s], scene, lights);
+
+        if (scene.get_instance_count() > 0)
+        {
+            ReportInstances(scene, options.frames);
+        }
+
+        if (std::string(SceneNames[options.scenes[s]]) == "bouncing")
+        {
+            ReportAnimation(scene, lights, options);
+        }
+
+        if (options.bvhGiven)
+        {
+            CompareBvhs(options, scene, lights);
+        }
+
+        for (size_t c = 0; c < options.cameras.size(); c++)
+        {
+            BenchmarkView(options, options.scenes[s], Cameras[options.cameras[c]], scene, lights);
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+// CPU stand-in for the part of C++ AMP the ray tracer uses, so that the headers of
+// RayTracing build with compilers that have no C++ AMP and run where there is no
+// DirectX accelerator. restrict() specifiers are compiled away, array_view wraps host
+// memory, and parallel_for_each runs the kernel on a set of std::threads whose size
+// set_cpu_thread_count() controls. Kernels complete before parallel_for_each returns.
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#define restrict(...)
+
+// glibc declares ::index(const char*, int), which makes every unqualified index<N> in a
+// kernel with using namespace Concurrency ambiguous
+#include <strings.h>
+#define index amp_index
+
+namespace Concurrency
+{
+
+namespace details
+{
+    inline std::atomic<int>& cpu_thread_setting()
+    {
+        static std::atomic<int> setting(0);
+        return setting;
+    }
+
+    // Calls body(begin, end) on chunks of [0, count) from up to cpu_thread_count() threads.
+    template <typename body_t>
+    void run_chunked(int count, int chunk, const body_t& body)
+    {
+        int setting = cpu_thread_setting();
+        int threads = setting > 0 ? setting : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+        threads = std::min(threads, (count + chunk - 1) / chunk);
+
+        if (threads <= 1)
+        {
+            if (count > 0)
+            {
+                body(0, count);
+            }
+            return;
+        }
+
+        std::atomic<int> next(0);
+        auto worker = [&]()
+        {
+            for (int begin = next.fetch_add(chunk); begin < count; begin = next.fetch_add(chunk))
+            {
+                body(begin, std::min(begin + chunk, count));
+            }
+        };
+
+        std::vector<std::thread> pool;
+        for (int t = 1; t < threads; t++)
+        {
+            pool.emplace_back(worker);
+        }
+        worker();
+
+        for (size_t t = 0; t < pool.size(); t++)
+        {
+            pool[t].join();
+        }
+    }
+}
+
+// Threads used by parallel_for_each and the PPL stand-ins, 0 for one per hardware thread.
+inline void set_cpu_thread_count(int count)
+{
+    details::cpu_thread_setting() = count;
+}
+
+inline int get_cpu_thread_count()
+{
+    int setting = details::cpu_thread_setting();
+    return setting > 0 ? setting : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+}
+
+template <int rank>
+class index
+{
+public:
+    index() { std::fill(values, values + rank, 0); }
+    explicit index(int i0) { values[0] = i0; }
+    index(int i0, int i1) { values[0] = i0; values[1] = i1; }
+
+    int& operator[](int i) { return values[i]; }
+    int operator[](int i) const { return values[i]; }
+
+private:
+    int values[rank];
+};
+
+template <int rank>
+class extent
+{
+public:
+    extent() { std::fill(values, values + rank, 0); }
+    explicit extent(int e0) { values[0] = e0; }
+    extent(int e0, int e1) { values[0] = e0; values[1] = e1; }
+
+    int& operator[](int i) { return values[i]; }
+    int operator[](int i) const { return values[i]; }
+
+    int size() const
+    {
+        int s = 1;
+        for (int i = 0; i < rank; i++)
+        {
+            s *= values[i];
+        }
+        return s;
+    }
+
+    bool operator==(const extent& other) const { return std::equal(values, values + rank, other.values); }
+    bool operator!=(const extent& other) const { return !(*this == other); }
+
+private:
+    int values[rank];
+};
+
+// View of host memory. Copies share the memory, as amp views share their data source,
+// and views of T convert to views of const T.
+template <typename T, int rank = 1>
+class array_view
+{
+public:
+    Concurrency::extent<rank> extent;
+
+    template <typename container_t>
+    array_view(int e0, container_t& source) : extent(e0), data_pointer(source.data()) {}
+    array_view(int e0, T* source) : extent(e0), data_pointer(source) {}
+
+    template <typename container_t>
+    array_view(int e0, int e1, container_t& source) : extent(e0, e1), data_pointer(source.data()) {}
+    array_view(int e0, int e1, T* source) : extent(e0, e1), data_pointer(source) {}
+
+    template <typename container_t>
+    array_view(const Concurrency::extent<rank>& e, container_t& source) : extent(e), data_pointer(source.data()) {}
+
+    template <typename U>
+    array_view(const array_view<U, rank>& other) : extent(other.extent), data_pointer(other.data()) {}
+
+    T& operator[](const index<rank>& i) const { return data_pointer[linear(i)]; }
+    T& operator[](int i) const { return data_pointer[i]; }
+    T& operator()(int i0, int i1) const { return data_pointer[i0 * extent[1] + i1]; }
+
+    T* data() const { return data_pointer; }
+
+    // host memory is always current
+    void synchronize() const {}
+    void discard_data() const {}
+    void refresh() const {}
+
+private:
+    int linear(const index<rank>& i) const
+    {
+        return rank == 1 ? i[0] : i[0] * extent[rank - 1] + i[rank - 1];
+    }
+
+    T* data_pointer;
+};
+
+class accelerator_view
+{
+public:
+    // kernels run synchronously, there is never anything to wait for
+    void wait() const {}
+};
+
+class accelerator
+{
+public:
+    accelerator_view get_default_view() const { return accelerator_view(); }
+    bool get_supports_double_precision() const { return true; }
+    bool get_supports_limited_double_precision() const { return true; }
+};
+
+template <typename kernel_t>
+void parallel_for_each(const extent<1>& domain, const kernel_t& kernel)
+{
+    details::run_chunked(domain[0], 256, [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            kernel(index<1>(i));
+        }
+    });
+}
+
+// rows are handed out one at a time, they are long enough to amortize the scheduling
+template <typename kernel_t>
+void parallel_for_each(const extent<2>& domain, const kernel_t& kernel)
+{
+    const int width = domain[1];
+
+    details::run_chunked(domain[0], 1, [&](int begin, int end)
+    {
+        for (int y = begin; y < end; y++)
+        {
+            for (int x = 0; x < width; x++)
+            {
+                kernel(index<2>(y, x));
+            }
+        }
+    });
+}
+
+inline int atomic_fetch_inc(int* dest) { return __atomic_fetch_add(dest, 1, __ATOMIC_RELAXED); }
+inline unsigned int atomic_fetch_inc(unsigned int* dest) { return __atomic_fetch_add(dest, 1u, __ATOMIC_RELAXED); }
+inline int atomic_fetch_add(int* dest, int value) { return __atomic_fetch_add(dest, value, __ATOMIC_RELAXED); }
+inline unsigned int atomic_fetch_add(unsigned int* dest, unsigned int value) { return __atomic_fetch_add(dest, value, __ATOMIC_RELAXED); }
+
+inline unsigned int atomic_fetch_min(unsigned int* dest, unsigned int value)
+{
+    unsigned int old = __atomic_load_n(dest, __ATOMIC_RELAXED);
+    while (value < old && !__atomic_compare_exchange_n(dest, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    return old;
+}
+
+namespace direct3d
+{
+    inline int imin(int a, int b) { return a < b ? a : b; }
+    inline int imax(int a, int b) { return a > b ? a : b; }
+    inline float clamp(float x, float lower, float upper) { return std::min(std::max(x, lower), upper); }
+    inline float saturate(float x) { return clamp(x, 0.0f, 1.0f); }
+}
+
+}
+
+#include "amp_math.h"
@@ -0,0 +1,38 @@
+#pragma once
+
+// CPU stand-in for amp_math.h, see amp.h. fmin and fmax are written out so that they
+// inline into the slab tests and keep the NaN rules of the real functions.
+
+#include <cmath>
+
+namespace Concurrency
+{
+
+namespace fast_math
+{
+    inline float sqrt(float x) { return std::sqrt(x); }
+    inline float rsqrt(float x) { return 1.0f / std::sqrt(x); }
+    inline float tan(float x) { return std::tan(x); }
+    inline float fabs(float x) { return std::fabs(x); }
+    inline float floor(float x) { return std::floor(x); }
+    inline float pow(float x, float y) { return std::pow(x, y); }
+    inline float exp(float x) { return std::exp(x); }
+    inline float log2(float x) { return std::log2(x); }
+    inline float fmin(float x, float y) { return x != x ? y : (y != y ? x : (x < y ? x : y)); }
+    inline float fmax(float x, float y) { return x != x ? y : (y != y ? x : (x > y ? x : y)); }
+}
+
+namespace precise_math
+{
+    inline double sqrt(double x) { return std::sqrt(x); }
+    inline double rsqrt(double x) { return 1.0 / std::sqrt(x); }
+    inline double tan(double x) { return std::tan(x); }
+    inline double fabs(double x) { return std::fabs(x); }
+    inline double floor(double x) { return std::floor(x); }
+    inline double pow(double x, double y) { return std::pow(x, y); }
+    inline double exp(double x) { return std::exp(x); }
+    inline double fmin(double x, double y) { return x != x ? y : (y != y ? x : (x < y ? x : y)); }
+    inline double fmax(double x, double y) { return x != x ? y : (y != y ? x : (x > y ? x : y)); }
+}
+
+}
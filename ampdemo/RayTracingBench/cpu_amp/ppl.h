@@ -0,0 +1,75 @@
+#pragma once
+
+// CPU stand-in for the part of the Parallel Patterns Library the ray tracer uses, on
+// the threads of amp.h so that set_cpu_thread_count() also limits the BVH builders.
+
+#include "amp.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace Concurrency
+{
+
+template <typename index_t, typename body_t>
+void parallel_for(index_t first, index_t last, const body_t& body)
+{
+    const int count = static_cast<int>(last - first);
+
+    details::run_chunked(count, std::max(count / (8 * get_cpu_thread_count()), 1), [&](int begin, int end)
+    {
+        for (int i = begin; i < end; i++)
+        {
+            body(static_cast<index_t>(first + i));
+        }
+    });
+}
+
+template <typename iterator_t>
+void parallel_sort(iterator_t first, iterator_t last)
+{
+    std::sort(first, last);
+}
+
+template <typename iterator_t, typename compare_t>
+void parallel_sort(iterator_t first, iterator_t last, const compare_t& compare)
+{
+    std::sort(first, last, compare);
+}
+
+// Runs every task on a thread of its own, or inline when only one thread is allowed.
+class task_group
+{
+public:
+    ~task_group()
+    {
+        wait();
+    }
+
+    template <typename function_t>
+    void run(const function_t& function)
+    {
+        if (get_cpu_thread_count() > 1)
+        {
+            threads.emplace_back(function);
+        }
+        else
+        {
+            function();
+        }
+    }
+
+    void wait()
+    {
+        for (size_t i = 0; i < threads.size(); i++)
+        {
+            threads[i].join();
+        }
+        threads.clear();
+    }
+
+private:
+    std::vector<std::thread> threads;
+};
+
+}